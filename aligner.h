@@ -472,11 +472,7 @@ public:
 		bool ebwtFw = ra.ebwt->fw();
 		params_->setFw(ra.fw);
 		return params_->reportHit(
-				ra.fw ? (ebwtFw? bufa_->patFw    : bufa_->patFwRev) :
-				        (ebwtFw? bufa_->patRc    : bufa_->patRcRev),
-				ra.fw ? (ebwtFw? &bufa_->qual    : &bufa_->qualRev) :
-				        (ebwtFw? &bufa_->qualRev : &bufa_->qual),
-				&bufa_->name,
+				*bufa_,                   // read
 				ebwtFw,
 				ra.mms,                   // mismatch positions
 				ra.refcs,                 // reference characters for mms
@@ -877,11 +873,7 @@ protected:
 		params_->setFw(rL.fw);
 		// Print upstream mate first
 		ret = params_->reportHit(
-				rL.fw ? (ebwtFwL?  bufL->patFw  :  bufL->patFwRev) :
-					    (ebwtFwL?  bufL->patRc  :  bufL->patRcRev),
-				rL.fw ? (ebwtFwL? &bufL->qual    : &bufL->qualRev) :
-				        (ebwtFwL? &bufL->qualRev : &bufL->qual),
-				&bufL->name,
+				*bufL,                        // read
 				ebwtFwL,
 				rL.mms,                       // mismatch positions
 				rL.refcs,                     // reference characters for mms
@@ -904,11 +896,7 @@ protected:
 		}
 		params_->setFw(rR.fw);
 		ret = params_->reportHit(
-				rR.fw ? (ebwtFwR?  bufR->patFw  :  bufR->patFwRev) :
-					    (ebwtFwR?  bufR->patRc  :  bufR->patRcRev),
-				rR.fw ? (ebwtFwR? &bufR->qual    : &bufR->qualRev) :
-				        (ebwtFwR? &bufR->qualRev : &bufR->qual),
-				&bufR->name,
+				*bufR,                        // read
 				ebwtFwR,
 				rR.mms,                       // mismatch positions
 				rR.refcs,                     // reference characters for mms
@@ -1736,11 +1724,7 @@ protected:
 		params_->setFw(rL.fw);
 		// Print upstream mate first
 		ret = params_->reportHit(
-				rL.fw ? (ebwtFwL?  bufL->patFw  :  bufL->patFwRev) :
-				        (ebwtFwL?  bufL->patRc  :  bufL->patRcRev),
-				rL.fw ? (ebwtFwL? &bufL->qual    : &bufL->qualRev) :
-				        (ebwtFwL? &bufL->qualRev : &bufL->qual),
-				&bufL->name,
+				*bufL,                        // read
 				ebwtFwL,
 				rL.mms,                       // mismatch positions
 				rL.refcs,                     // reference characters for mms
@@ -1763,11 +1747,7 @@ protected:
 		}
 		params_->setFw(rR.fw);
 		ret = params_->reportHit(
-				rR.fw ? (ebwtFwR?  bufR->patFw  :  bufR->patFwRev) :
-				        (ebwtFwR?  bufR->patRc  :  bufR->patRcRev),
-				rR.fw ? (ebwtFwR? &bufR->qual    : &bufR->qualRev) :
-				        (ebwtFwR? &bufR->qualRev : &bufR->qual),
-				&bufR->name,
+				*bufR,                        // read
 				ebwtFwR,
 				rR.mms,                       // mismatch positions
 				rR.refcs,                     // reference characters for mms
@@ -1802,11 +1782,7 @@ protected:
 		uint32_t len = r.mate1 ? alen_ : blen_;
 		// Print upstream mate first
 		if(params->reportHit(
-			r.fw ? (ebwtFw?  buf->patFw   :  buf->patFwRev) :
-			       (ebwtFw?  buf->patRc   :  buf->patRcRev),
-			r.fw ? (ebwtFw? &buf->qual    : &buf->qualRev) :
-			       (ebwtFw? &buf->qualRev : &buf->qual),
-			&buf->name,
+			*buf,                    // read
 			ebwtFw,
 			r.mms,                   // mismatch positions
 			r.refcs,                 // reference characters for mms
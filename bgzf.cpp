@@ -0,0 +1,559 @@
+/*
+ * bgzf.cpp
+ */
+
+#if (__cplusplus >= 201103L)
+
+#include <iostream>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "bgzf.h"
+
+using namespace std;
+
+/// Length of a BGZF block header, extra field included
+static const size_t BGZF_HDR_LEN = 18;
+
+/// Length of the gzip trailer (CRC32 and ISIZE)
+static const size_t BGZF_TRAILER_LEN = 8;
+
+/// Inflated size of a BGZF block can't exceed this
+static const size_t BGZF_MAX_ISIZE = 64 * 1024;
+
+/// Bytes we put in a block before deflating it; leaves room for the
+/// header and trailer even if the data doesn't compress at all.  Same
+/// as htslib's BGZF_BLOCK_SIZE.
+static const size_t BGZF_WRITE_ISIZE = 0xff00;
+
+/// Deflated size of a BGZF block, header and trailer included, can't
+/// exceed this
+static const size_t BGZF_MAX_BLOCK = 64 * 1024;
+
+/// Empty block that ends a BGZF file
+static const unsigned char BGZF_EOF[28] = {
+	31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0,
+	27, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+static inline uint32_t unpackLE32(const unsigned char *p) {
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+	       ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void packLE32(unsigned char *p, uint32_t u) {
+	p[0] = (unsigned char)u;
+	p[1] = (unsigned char)(u >> 8);
+	p[2] = (unsigned char)(u >> 16);
+	p[3] = (unsigned char)(u >> 24);
+}
+
+/**
+ * Return true iff hdr is a gzip member header whose only extra
+ * subfield is BGZF's 'BC' block-size field.  This is the same test
+ * samtools/htslib apply.
+ */
+static inline bool isBgzfHeader(const unsigned char *hdr) {
+	return hdr[0] == 31 && hdr[1] == 139 && hdr[2] == 8 &&
+	       (hdr[3] & 4) != 0 &&                   // FEXTRA
+	       hdr[10] == 6 && hdr[11] == 0 &&        // XLEN
+	       hdr[12] == 'B' && hdr[13] == 'C' &&
+	       hdr[14] == 2 && hdr[15] == 0;          // SLEN
+}
+
+BgzfReader::BgzfReader() :
+	fp_(NULL),
+	zfp_(NULL),
+	bgzf_(false),
+	nthreads_(0),
+	nextSeq_(0),
+	consSeq_(0),
+	endSeq_(0),
+	eof_(false),
+	holding_(false),
+	stop_(false)
+{ }
+
+bool BgzfReader::isBgzf(const char *fn) {
+	// Only peek at regular files; anything else we'd consume
+	struct stat s;
+	if(stat(fn, &s) != 0 || !S_ISREG(s.st_mode)) {
+		return false;
+	}
+	FILE *f = fopen(fn, "rb");
+	if(f == NULL) {
+		return false;
+	}
+	unsigned char hdr[BGZF_HDR_LEN];
+	bool ret = fread(hdr, 1, BGZF_HDR_LEN, f) == BGZF_HDR_LEN &&
+	           isBgzfHeader(hdr);
+	fclose(f);
+	return ret;
+}
+
+bool BgzfReader::open(const char *fn, bool bgzf, int nthreads) {
+	close();
+	bgzf_ = bgzf;
+	if(bgzf) {
+		fp_ = fopen(fn, "rb");
+		if(fp_ == NULL) {
+			return false;
+		}
+	} else {
+		if(strcmp(fn, "-") == 0) {
+			zfp_ = gzdopen(dup(fileno(stdin)), "rb");
+		} else {
+			zfp_ = gzopen(fn, "rb");
+		}
+		if(zfp_ == NULL) {
+			return false;
+		}
+#if ZLIB_VERNUM >= 0x1235
+		gzbuffer(zfp_, 64*1024);
+#endif
+		// zlib has to inflate a plain gzip stream from front to back
+		nthreads = 1;
+	}
+	if(nthreads < 1) {
+		nthreads = 1;
+	}
+	nthreads_ = nthreads;
+	blocks_.resize(nthreads * BLOCKS_PER_THREAD);
+	for(size_t i = 0; i < blocks_.size(); i++) {
+		blocks_[i].len = 0;
+		blocks_[i].ready = false;
+	}
+	nextSeq_ = consSeq_ = endSeq_ = 0;
+	eof_ = holding_ = stop_ = false;
+	err_.clear();
+	return true;
+}
+
+void BgzfReader::close() {
+	if(!threads_.empty()) {
+		{
+			std::lock_guard<std::mutex> lk(mu_);
+			stop_ = true;
+		}
+		spaceCv_.notify_all();
+		for(size_t i = 0; i < threads_.size(); i++) {
+			threads_[i]->join();
+			delete threads_[i];
+		}
+		threads_.clear();
+	}
+	if(fp_ != NULL) {
+		fclose(fp_);
+		fp_ = NULL;
+	}
+	if(zfp_ != NULL) {
+		gzclose(zfp_);
+		zfp_ = NULL;
+	}
+}
+
+/**
+ * Read the next whole BGZF block into b.raw.  Returns false at the end
+ * of the file or on error, in which case err_ is set.  Must be called
+ * with mu_ held so that blocks are claimed in file order.
+ */
+bool BgzfReader::readBgzfBlock(Block& b) {
+	unsigned char hdr[BGZF_HDR_LEN];
+	size_t n = fread(hdr, 1, BGZF_HDR_LEN, fp_);
+	if(n == 0 && feof(fp_)) {
+		return false;
+	}
+	if(n < BGZF_HDR_LEN || !isBgzfHeader(hdr)) {
+		err_ = "reads file is not valid BGZF";
+		return false;
+	}
+	size_t blockLen = ((size_t)hdr[16] | ((size_t)hdr[17] << 8)) + 1;
+	if(blockLen < BGZF_HDR_LEN + BGZF_TRAILER_LEN) {
+		err_ = "reads file has a malformed BGZF block";
+		return false;
+	}
+	size_t rawLen = blockLen - BGZF_HDR_LEN;
+	b.raw.resize(rawLen);
+	if(fread(b.raw.ptr(), 1, rawLen, fp_) != rawLen) {
+		err_ = "reads file has a truncated BGZF block";
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Inflate the block in b.raw into b.out and check its CRC.  Returns
+ * false if the block is corrupt.
+ */
+bool BgzfReader::inflateBgzfBlock(z_stream& zs, Block& b) {
+	const unsigned char *raw = (const unsigned char *)b.raw.ptr();
+	const size_t cdataLen = b.raw.size() - BGZF_TRAILER_LEN;
+	uint32_t crc = unpackLE32(raw + cdataLen);
+	uint32_t isize = unpackLE32(raw + cdataLen + 4);
+	if(isize > BGZF_MAX_ISIZE) {
+		return false;
+	}
+	b.out.resize(isize);
+	b.len = isize;
+	if(isize == 0) {
+		return true; // e.g. the end-of-file marker block
+	}
+	if(inflateReset(&zs) != Z_OK) {
+		return false;
+	}
+	zs.next_in = (Bytef *)raw;
+	zs.avail_in = (uInt)cdataLen;
+	zs.next_out = (Bytef *)b.out.ptr();
+	zs.avail_out = (uInt)isize;
+	if(inflate(&zs, Z_FINISH) != Z_STREAM_END || zs.total_out != isize) {
+		return false;
+	}
+	return crc32(crc32(0L, Z_NULL, 0), (const Bytef *)b.out.ptr(), isize) == crc;
+}
+
+/**
+ * Body of an inflating thread.  Claims the next block in the file,
+ * inflates it into its slot in the ring, and repeats until the input
+ * runs out or close() is called.
+ */
+void BgzfReader::workerLoop() {
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	bool zsOk = !bgzf_ || inflateInit2(&zs, -15) == Z_OK; // raw deflate
+	std::unique_lock<std::mutex> lk(mu_);
+	if(!zsOk && err_.empty()) {
+		err_ = "could not initialize zlib";
+		eof_ = true;
+		endSeq_ = nextSeq_;
+		readyCv_.notify_one();
+	}
+	while(zsOk) {
+		while(!stop_ && !eof_ && nextSeq_ - consSeq_ >= blocks_.size()) {
+			spaceCv_.wait(lk);
+		}
+		if(stop_ || eof_) {
+			break;
+		}
+		size_t seq = nextSeq_++;
+		Block& b = blocks_[seq % blocks_.size()];
+		assert(!b.ready);
+		bool more = true, ok = true;
+		if(bgzf_) {
+			more = readBgzfBlock(b);
+			if(more) {
+				lk.unlock();
+				ok = inflateBgzfBlock(zs, b);
+				lk.lock();
+			}
+		} else {
+			// Only one thread reads a non-BGZF file, so no need to
+			// hold the lock
+			lk.unlock();
+			b.out.resize(GZ_BLOCK_SZ);
+			int n = gzread(zfp_, b.out.ptr(), (unsigned)GZ_BLOCK_SZ);
+			lk.lock();
+			if(n < 0) {
+				int errnum = 0;
+				err_ = gzerror(zfp_, &errnum);
+				more = false;
+			} else {
+				b.len = (size_t)n;
+				more = n > 0;
+			}
+		}
+		if(!ok && err_.empty()) {
+			err_ = "reads file has a corrupt BGZF block";
+		}
+		if(!more || !ok) {
+			eof_ = true;
+			endSeq_ = seq;
+			readyCv_.notify_one();
+			spaceCv_.notify_all();
+			break;
+		}
+		b.ready = true;
+		if(seq == consSeq_) {
+			readyCv_.notify_one();
+		}
+	}
+	lk.unlock();
+	if(bgzf_ && zsOk) {
+		inflateEnd(&zs);
+	}
+}
+
+bool BgzfReader::nextBlock(const char*& beg, const char*& end) {
+	if(threads_.empty()) {
+		// Nothing is read until the first block is asked for, so
+		// that a source can be opened and reopened without consuming
+		// stdin
+		assert(fp_ != NULL || zfp_ != NULL);
+		for(int i = 0; i < nthreads_; i++) {
+			threads_.push_back(new std::thread(&BgzfReader::workerLoop, this));
+		}
+	}
+	std::unique_lock<std::mutex> lk(mu_);
+	while(true) {
+		if(holding_) {
+			blocks_[consSeq_ % blocks_.size()].ready = false;
+			consSeq_++;
+			holding_ = false;
+			spaceCv_.notify_one();
+		}
+		Block& b = blocks_[consSeq_ % blocks_.size()];
+		while(!b.ready && err_.empty() && !(eof_ && consSeq_ >= endSeq_)) {
+			readyCv_.wait(lk);
+		}
+		if(!err_.empty()) {
+			cerr << "Error: " << err_ << endl;
+			throw 1;
+		}
+		if(!b.ready) {
+			return false;
+		}
+		holding_ = true;
+		if(b.len > 0) {
+			beg = b.out.ptr();
+			end = beg + b.len;
+			return true;
+		}
+	}
+}
+
+BgzfWriter::BgzfWriter(OutFileBuf& out, int nthreads, int level) :
+	out_(out),
+	level_(level),
+	fillSeq_(0),
+	defSeq_(0),
+	writeSeq_(0),
+	writing_(false),
+	stop_(false),
+	finished_(false),
+	zsOk_(false)
+{
+	if(nthreads < 0) {
+		nthreads = 0;
+	}
+	blocks_.resize(max(nthreads, 1) * BLOCKS_PER_THREAD);
+	for(size_t i = 0; i < blocks_.size(); i++) {
+		blocks_[i].in.resize(BGZF_WRITE_ISIZE);
+		blocks_[i].out.resize(BGZF_MAX_BLOCK);
+		blocks_[i].inLen = blocks_[i].outLen = 0;
+		blocks_[i].cut = blocks_[i].deflated = false;
+	}
+	memset(&zs_, 0, sizeof(zs_));
+	if(nthreads == 0) {
+		zsOk_ = deflateInit2(&zs_, level_, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+		if(!zsOk_) {
+			err_ = "could not initialize zlib";
+		}
+	}
+	for(int i = 0; i < nthreads; i++) {
+		threads_.push_back(new std::thread(&BgzfWriter::workerLoop, this));
+	}
+}
+
+BgzfWriter::~BgzfWriter() {
+	// finish() wasn't called, or failed; just stop the threads
+	{
+		std::lock_guard<std::mutex> lk(mu_);
+		stop_ = true;
+	}
+	cutCv_.notify_all();
+	for(size_t i = 0; i < threads_.size(); i++) {
+		threads_[i]->join();
+		delete threads_[i];
+	}
+	if(zsOk_) {
+		deflateEnd(&zs_);
+	}
+}
+
+/**
+ * Print the first error encountered, if any, and throw.
+ */
+void BgzfWriter::checkErr() {
+	if(!err_.empty()) {
+		cerr << "Error: " << err_ << endl;
+		throw 1;
+	}
+}
+
+void BgzfWriter::write(const char *buf, size_t len) {
+	assert(!finished_);
+	while(len > 0) {
+		Block& b = blocks_[fillSeq_ % blocks_.size()];
+		assert(!b.cut);
+		size_t n = min(len, BGZF_WRITE_ISIZE - b.inLen);
+		memcpy(b.in.ptr() + b.inLen, buf, n);
+		b.inLen += n;
+		buf += n;
+		len -= n;
+		if(b.inLen == BGZF_WRITE_ISIZE) {
+			cut();
+		}
+	}
+}
+
+/**
+ * Hand the block being filled over to be deflated and start filling
+ * the next one, waiting for it to be written out first if the ring is
+ * full.
+ */
+void BgzfWriter::cut() {
+	Block& b = blocks_[fillSeq_ % blocks_.size()];
+	if(threads_.empty()) {
+		checkErr();
+		if(!deflateBlock(zs_, b)) {
+			err_ = "could not deflate a BGZF block";
+			checkErr();
+		}
+		out_.writeChars(b.out.ptr(), b.outLen);
+		b.inLen = b.outLen = 0;
+		writeSeq_ = defSeq_ = ++fillSeq_;
+		return;
+	}
+	std::unique_lock<std::mutex> lk(mu_);
+	b.cut = true;
+	fillSeq_++;
+	cutCv_.notify_one();
+	while(err_.empty() && fillSeq_ - writeSeq_ >= blocks_.size()) {
+		spaceCv_.wait(lk);
+	}
+	checkErr();
+}
+
+void BgzfWriter::finish() {
+	if(finished_) {
+		return;
+	}
+	finished_ = true;
+	if(blocks_[fillSeq_ % blocks_.size()].inLen > 0) {
+		cut();
+	}
+	if(!threads_.empty()) {
+		{
+			std::unique_lock<std::mutex> lk(mu_);
+			while(err_.empty() && writeSeq_ < fillSeq_) {
+				spaceCv_.wait(lk);
+			}
+			stop_ = true;
+		}
+		cutCv_.notify_all();
+		for(size_t i = 0; i < threads_.size(); i++) {
+			threads_[i]->join();
+			delete threads_[i];
+		}
+		threads_.clear();
+	}
+	checkErr();
+	out_.writeChars((const char *)BGZF_EOF, sizeof(BGZF_EOF));
+}
+
+/**
+ * Deflate b.in into a whole BGZF block in b.out: header, raw deflate
+ * stream, CRC32 and inflated length.  Returns false if zlib fails.
+ */
+bool BgzfWriter::deflateBlock(z_stream& zs, Block& b) {
+	unsigned char *out = (unsigned char *)b.out.ptr();
+	if(deflateReset(&zs) != Z_OK) {
+		return false;
+	}
+	zs.next_in = (Bytef *)b.in.ptr();
+	zs.avail_in = (uInt)b.inLen;
+	zs.next_out = (Bytef *)(out + BGZF_HDR_LEN);
+	zs.avail_out = (uInt)(BGZF_MAX_BLOCK - BGZF_HDR_LEN - BGZF_TRAILER_LEN);
+	if(deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+		return false;
+	}
+	b.outLen = BGZF_HDR_LEN + zs.total_out + BGZF_TRAILER_LEN;
+	assert_leq(b.outLen, BGZF_MAX_BLOCK);
+	// Same header as BGZF_EOF, with this block's size
+	memcpy(out, BGZF_EOF, 16);
+	out[16] = (unsigned char)(b.outLen - 1);
+	out[17] = (unsigned char)((b.outLen - 1) >> 8);
+	unsigned char *trailer = out + b.outLen - BGZF_TRAILER_LEN;
+	packLE32(trailer, (uint32_t)crc32(crc32(0L, Z_NULL, 0), (const Bytef *)b.in.ptr(), (uInt)b.inLen));
+	packLE32(trailer + 4, (uint32_t)b.inLen);
+	assert(isBgzfHeader(out));
+	return true;
+}
+
+/**
+ * Write out deflated blocks for as long as the next one in sequence
+ * is ready.  Called with lk held by at most one thread at a time; the
+ * lock is dropped while writing.
+ */
+void BgzfWriter::writeReady(std::unique_lock<std::mutex>& lk) {
+	assert(!writing_);
+	writing_ = true;
+	while(err_.empty() && writeSeq_ < fillSeq_) {
+		Block& b = blocks_[writeSeq_ % blocks_.size()];
+		if(!b.deflated) {
+			break;
+		}
+		lk.unlock();
+		bool ok = true;
+		try {
+			out_.writeChars(b.out.ptr(), b.outLen);
+		} catch(int) {
+			ok = false;
+		}
+		lk.lock();
+		if(!ok) {
+			err_ = "could not write BAM output";
+		}
+		b.inLen = b.outLen = 0;
+		b.cut = b.deflated = false;
+		writeSeq_++;
+		spaceCv_.notify_all();
+	}
+	writing_ = false;
+}
+
+/**
+ * Body of a deflating thread.  Claims the oldest block that has been
+ * cut, deflates it, and, unless another thread is already at it,
+ * writes out whatever blocks are ready in sequence.
+ */
+void BgzfWriter::workerLoop() {
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	bool zsOk = deflateInit2(&zs, level_, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+	std::unique_lock<std::mutex> lk(mu_);
+	if(!zsOk && err_.empty()) {
+		err_ = "could not initialize zlib";
+		spaceCv_.notify_all();
+	}
+	while(zsOk) {
+		while(!stop_ && err_.empty() && defSeq_ == fillSeq_) {
+			cutCv_.wait(lk);
+		}
+		if(stop_ || !err_.empty()) {
+			break;
+		}
+		size_t seq = defSeq_++;
+		Block& b = blocks_[seq % blocks_.size()];
+		assert(b.cut);
+		lk.unlock();
+		bool ok = deflateBlock(zs, b);
+		lk.lock();
+		if(!ok) {
+			if(err_.empty()) {
+				err_ = "could not deflate a BGZF block";
+			}
+			spaceCv_.notify_all();
+			break;
+		}
+		b.deflated = true;
+		if(!writing_) {
+			writeReady(lk);
+		}
+	}
+	lk.unlock();
+	if(zsOk) {
+		deflateEnd(&zs);
+	}
+}
+
+#endif /* __cplusplus >= 201103L */
@@ -0,0 +1,170 @@
+/*
+ * bgzf.h
+ *
+ * Read-ahead decompression of gzipped read files.  BGZF files (gzip
+ * files made up of independent blocks of at most 64K, as written by
+ * bgzip and samtools) are inflated block-by-block by a small pool of
+ * threads.  Other gzip files can't be split without inflating them, so
+ * they get a single thread that inflates ahead of the parser.  Either
+ * way the parser is handed the inflated blocks themselves.
+ *
+ * BgzfWriter goes the other way for BAM output: it cuts the stream
+ * into BGZF blocks, has a pool of threads deflate them, and writes the
+ * deflated blocks out in the order they were cut.
+ */
+
+#ifndef BGZF_H_
+#define BGZF_H_
+
+#if (__cplusplus >= 201103L)
+
+#include <stdio.h>
+#include <stdint.h>
+#include <zlib.h>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "assert_helpers.h"
+#include "ds.h"
+#include "filebuf.h"
+
+class BgzfReader {
+
+public:
+
+	BgzfReader();
+
+	~BgzfReader() { close(); }
+
+	/**
+	 * Return true iff the named file starts with a BGZF block header.
+	 */
+	static bool isBgzf(const char *fn);
+
+	/**
+	 * Open the named file.  Inflating starts with the first call to
+	 * nextBlock().  If bgzf is true, the file is inflated by nthreads
+	 * threads; otherwise it's handed to zlib and inflated by one
+	 * thread.  Returns false if the file can't be opened.
+	 */
+	bool open(const char *fn, bool bgzf, int nthreads);
+
+	/**
+	 * Stop the inflating threads and close the file.
+	 */
+	void close();
+
+	/**
+	 * Release the block handed out by the previous call, if any, and
+	 * set [beg, end) to the next one, waiting for it to be inflated if
+	 * necessary.  Returns false if there are no more blocks.
+	 */
+	bool nextBlock(const char*& beg, const char*& end);
+
+protected:
+
+	/// Blocks that can be in flight at once, per thread
+	static const size_t BLOCKS_PER_THREAD = 4;
+
+	/// Bytes requested per block when inflating a non-BGZF file
+	static const size_t GZ_BLOCK_SZ = 256 * 1024;
+
+	struct Block {
+		EList<char> raw;  // compressed BGZF block
+		EList<char> out;  // inflated data
+		size_t len;       // # valid chars in out
+		bool ready;       // out holds inflated data
+	};
+
+	void workerLoop();
+	bool readBgzfBlock(Block& b);
+	bool inflateBgzfBlock(z_stream& zs, Block& b);
+
+	FILE *fp_;              // BGZF file
+	gzFile zfp_;            // non-BGZF file
+	bool bgzf_;
+	int nthreads_;          // # inflating threads to launch
+	EList<Block> blocks_;   // ring of blocks, indexed by sequence #
+	size_t nextSeq_;        // sequence # of next block to read
+	size_t consSeq_;        // sequence # of block being consumed
+	size_t endSeq_;         // sequence # at which input ends
+	bool eof_;              // endSeq_ is valid
+	bool holding_;          // consumer is reading from block consSeq_
+	bool stop_;
+	std::string err_;       // first error encountered, if any
+	std::mutex mu_;
+	std::condition_variable spaceCv_; // a block slot was freed
+	std::condition_variable readyCv_; // a block was inflated
+	EList<std::thread*> threads_;
+};
+
+class BgzfWriter {
+
+public:
+
+	/**
+	 * Write BGZF to out, deflating with nthreads threads at the given
+	 * zlib compression level.  With nthreads 0, blocks are deflated
+	 * and written by the thread calling write().
+	 */
+	BgzfWriter(OutFileBuf& out, int nthreads, int level = Z_DEFAULT_COMPRESSION);
+
+	~BgzfWriter();
+
+	/**
+	 * Append len bytes to the stream.  Not safe to call from several
+	 * threads at once; callers have to take turns.  May wait for the
+	 * deflating threads to catch up.  Throws if a block couldn't be
+	 * deflated or written.
+	 */
+	void write(const char *buf, size_t len);
+
+	/**
+	 * Cut the last, partial block, wait for every block to be
+	 * written, then write the end-of-file marker block and stop the
+	 * threads.  Throws if anything failed.
+	 */
+	void finish();
+
+protected:
+
+	/// Blocks that can be in flight at once, per thread
+	static const size_t BLOCKS_PER_THREAD = 4;
+
+	struct Block {
+		EList<char> in;   // data to be deflated
+		size_t inLen;     // # valid chars in in
+		EList<char> out;  // the whole BGZF block, once deflated
+		size_t outLen;    // # valid chars in out
+		bool cut;         // in is ready to be deflated
+		bool deflated;    // out is ready to be written
+	};
+
+	void cut();
+	void workerLoop();
+	void writeReady(std::unique_lock<std::mutex>& lk);
+	bool deflateBlock(z_stream& zs, Block& b);
+	void checkErr();
+
+	OutFileBuf& out_;
+	int level_;
+	EList<Block> blocks_;   // ring of blocks, indexed by sequence #
+	size_t fillSeq_;        // sequence # of block being filled
+	size_t defSeq_;         // sequence # of next block to deflate
+	size_t writeSeq_;       // sequence # of next block to write
+	bool writing_;          // a thread is writing blocks out
+	bool stop_;
+	bool finished_;
+	std::string err_;       // first error encountered, if any
+	z_stream zs_;           // for deflating inline, with no threads
+	bool zsOk_;
+	std::mutex mu_;
+	std::condition_variable spaceCv_; // a block was written
+	std::condition_variable cutCv_;   // a block was cut
+	EList<std::thread*> threads_;
+};
+
+#endif /* __cplusplus >= 201103L */
+
+#endif /* BGZF_H_ */
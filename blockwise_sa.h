@@ -14,10 +14,13 @@
 #include "alphabet.h"
 #include "assert_helpers.h"
 #include "binary_sa_search.h"
+#include "build_profile.h"
 #include "diff_sample.h"
 #include "ds.h"
 #include "multikey_qsort.h"
 #include "random_source.h"
+#include "sa_checkpoint.h"
+#include "sais.h"
 #include "threading.h"
 #include "timer.h"
 #include "util.h"
@@ -175,6 +178,127 @@ public:
 		{ }
 };
 
+/// Suffix-array builders bowtie-build can use (--sa-engine)
+enum {
+	SA_ENGINE_BLOCKWISE = 1, // KarkkainenBlockwiseSA, memory-fitted
+	SA_ENGINE_SAIS           // SaisBlockwiseSA, whole SA in memory
+};
+
+/**
+ * Build the whole suffix array at once by induced sorting (see
+ * sais.h) and dole it out in order.  There's no difference-cover
+ * sample and no per-block sorting, but len+1 suffix-array elements
+ * have to fit in memory alongside the text.
+ */
+template<typename TStr>
+class SaisBlockwiseSA : public InorderBlockwiseSA<TStr> {
+public:
+	SaisBlockwiseSA(const TStr& __text,
+			int __nthreads,
+			bool __sanityCheck = false,
+			bool __passMemExc = false,
+			bool __verbose = false,
+			ostream& __logger = cout) :
+		InorderBlockwiseSA<TStr>(__text, (TIndexOffU)__text.length()+1, __sanityCheck, __passMemExc, __verbose, __logger),
+		_nthreads(__nthreads), _sa(NULL), _cur(0)
+		{ reset(); }
+
+	~SaisBlockwiseSA()
+#if __cplusplus > 199711L
+	noexcept(false)
+#endif
+		{
+			if(_sa != NULL) delete[] _sa;
+		}
+
+	/**
+	 * Return the number of bytes held at the peak while building the
+	 * suffix array of a text of length len.
+	 */
+	static size_t footprint(size_t len) {
+		len++;
+		// The suffix array, the L/S type bits, and the bucket array
+		// of the first level of recursion, which can't have more than
+		// len/2 names
+		return len * OFF_SIZE + len / 8 + (len / 2) * OFF_SIZE;
+	}
+
+	/**
+	 * Get the next suffix.  The SA-IS order is the reverse of
+	 * bowtie's (see SaisDnaText), so suffixes come off the end.
+	 */
+	virtual TIndexOffU nextSuffix() {
+		if(this->_itrPushedBackSuffix != OFF_MASK) {
+			TIndexOffU tmp = this->_itrPushedBackSuffix;
+			this->_itrPushedBackSuffix = OFF_MASK;
+			return tmp;
+		}
+		if(_cur == 0) {
+			throw out_of_range("No more suffixes");
+		}
+		return _sa[--_cur];
+	}
+
+	/// The suffix array is built in one piece by reset()
+	virtual void nextBlock(int cur_block, int tid = 0) { }
+
+	/// Return true iff more suffixes are available
+	virtual bool hasMoreBlocks() const {
+		return _cur > 0;
+	}
+
+protected:
+
+	/**
+	 * Build the suffix array if it hasn't been built yet, then point
+	 * the cursor at its first element.
+	 */
+	virtual void reset() {
+		if(_sa == NULL) {
+			build();
+		}
+		_cur = (TIndexOffU)this->text().length() + 1;
+	}
+
+	/// Return true iff we're about to dole out the first suffix
+	virtual bool isReset() {
+		return _cur == (TIndexOffU)this->text().length() + 1;
+	}
+
+private:
+
+	void build() {
+		const TIndexOffU n = (TIndexOffU)this->text().length() + 1;
+		try {
+			_sa = new TIndexOffU[n];
+			ProfilePhase phase("sais");
+			Timer timer(cout, "  Induced-sorting suffix array time: ", this->verbose());
+			VMSG_NL("Building suffix array of length " << n << " by induced sorting");
+			SaisBuilder<TIndexOffU>::build(
+				SaisDnaText<TStr, TIndexOffU>(this->text()),
+				_sa, n, 5, _nthreads);
+		} catch(bad_alloc &e) {
+			if(_sa != NULL) {
+				delete[] _sa;
+				_sa = NULL;
+			}
+			if(this->_passMemExc) {
+				throw e; // rethrow immediately
+			} else {
+				cerr << "Could not allocate a suffix array of " << ((size_t)n * OFF_SIZE)
+				     << " bytes for induced sorting" << endl
+				     << "Please try --sa-engine blockwise" << endl;
+				throw 1;
+			}
+		}
+		assert_eq(n-1, _sa[0]); // '$' comes last in bowtie's order
+	}
+
+	int         _nthreads; /// # of threads
+	TIndexOffU* _sa;       /// the whole suffix array, in SA-IS order
+	TIndexOffU  _cur;      /// # of suffixes not yet doled out
+};
+
 /**
  * Build the SA a block at a time according to the scheme outlined in
  * Karkkainen's "Fast BWT" paper.
@@ -193,10 +317,13 @@ public:
 			      bool __passMemExc = false,
 			      bool __verbose = false,
 			      string base_fname = "",
+			      bool __streamBlocks = false,
+			      const string& ckptBase = "",
 			      ostream& __logger = cout) :
 		InorderBlockwiseSA<TStr>(__text, __bucketSz, __sanityCheck, __passMemExc, __verbose, __logger),
-		_sampleSuffs(), _nthreads(__nthreads), _itrBucketIdx(0), _cur(0), _dcV(__dcV), _dc(NULL), _built(false), _base_fname(base_fname), _bigEndian(currentlyBigEndian()), _done(NULL)
-		{ _randomSrc.init(__seed); reset(); }
+		_sampleSuffs(), _nthreads(__nthreads), _itrBucketIdx(0), _cur(0), _dcV(__dcV), _dc(NULL), _built(false), _base_fname(base_fname), _bigEndian(currentlyBigEndian()), _done(NULL),
+		_streamBlocks(__streamBlocks), _blockLeft(0), _seed(__seed), _profParent(PROFILE_TOP)
+		{ _ckpt.init(ckptBase); _randomSrc.init(__seed); reset(); }
 
 	~KarkkainenBlockwiseSA()
 #if __cplusplus > 199711L
@@ -214,6 +341,10 @@ public:
 					delete _threads[tid];
 				}
 			}
+			if(_blockIn.is_open()) {
+				_blockIn.close();
+				if(!_ckpt.enabled()) std::remove(_blockFname.c_str());
+			}
 		}
 
 	/**
@@ -245,26 +376,72 @@ public:
 				if(cur > sa->_sampleSuffs.size()) break;
 				sa->_cur++;
 			}
-			sa->nextBlock((int)cur, tid);
-			// Write suffixes into a file
-			std::ostringstream number; number << cur;
-			const string fname = sa->_base_fname + "." + number.str() + ".sa";
-			ofstream sa_file(fname.c_str(), ios::binary);
-			if(!sa_file.good()) {
-				cerr << "Could not open file for writing a reference graph: \"" << fname << "\"" << endl;
-				throw 1;
-			}
-			const EList<TIndexOffU>& bucket = sa->_itrBuckets[tid];
-			writeU<TIndexOffU>(sa_file, (TIndexOffU)bucket.size(), sa->_bigEndian);
-			for(size_t i = 0; i < bucket.size(); i++) {
-				writeU<TIndexOffU>(sa_file, bucket[i], sa->_bigEndian);
+			if(!sa->_ckpt.saved(cur)) {
+				sa->nextBlock((int)cur, tid);
+				// Write suffixes into a file
+				sa->writeBlock(cur, sa->_itrBuckets[tid]);
+				sa->_itrBuckets[tid].clear();
 			}
-			sa_file.close();
-			sa->_itrBuckets[tid].clear();
 			sa->_done[cur] = true;
 		}
 	}
 
+	/**
+	 * Write the sorted block 'cur' to its file, where nextSuffix() will
+	 * pick it up.  If checkpointing, record it in the manifest too.
+	 */
+	void writeBlock(size_t cur, const EList<TIndexOffU>& bucket) {
+		const string fname = _ckpt.enabled() ? _ckpt.blockFname(cur) + ".tmp" : blockFname(cur);
+		ofstream sa_file(fname.c_str(), ios::binary);
+		if(!sa_file.good()) {
+			cerr << "Could not open file for writing a reference graph: \"" << fname << "\"" << endl;
+			throw 1;
+		}
+		writeU<TIndexOffU>(sa_file, (TIndexOffU)bucket.size(), _bigEndian);
+		for(size_t i = 0; i < bucket.size(); i++) {
+			writeU<TIndexOffU>(sa_file, bucket[i], _bigEndian);
+		}
+		sa_file.close();
+		if(sa_file.fail()) {
+			cerr << "Could not write \"" << fname << "\"; please check if the disk is full." << endl;
+			throw 1;
+		}
+		if(_ckpt.enabled()) {
+			_ckpt.commitBlock(cur);
+		}
+	}
+
+	/**
+	 * Read the sorted block 'cur' from its file into 'bucket'.  The
+	 * file is deleted unless it's a checkpoint.
+	 */
+	void readBlock(size_t cur, EList<TIndexOffU>& bucket) {
+		const string fname = blockFname(cur);
+		ifstream sa_file(fname.c_str(), ios::binary);
+		if(!sa_file.good()) {
+			cerr << "Could not open file for reading a reference graph: \"" << fname << "\"" << endl;
+			throw 1;
+		}
+		size_t numSAs = readU<TIndexOffU>(sa_file, false /* don't endian swap */);
+		bucket.resize(numSAs);
+		for(size_t i = 0; i < numSAs; i++) {
+			bucket[i] = readU<TIndexOffU>(sa_file, false);
+		}
+		sa_file.close();
+		if(!_ckpt.enabled()) {
+			std::remove(fname.c_str());
+		}
+	}
+
+	/// Name of the file that holds sorted block 'cur'
+	string blockFname(size_t cur) const {
+		if(_ckpt.enabled()) {
+			return _ckpt.blockFname(cur);
+		}
+		std::ostringstream number; number << cur;
+		return _base_fname + "." + number.str() + ".sa";
+	}
+
 
 	/**
 	 * Get the next suffix; compute the next bucket if necessary.
@@ -296,6 +473,9 @@ public:
 			this->_itrPushedBackSuffix = OFF_MASK;
 			return tmp;
 		}
+		if(_streamBlocks && this->_nthreads > 1) {
+			return nextStreamedSuffix();
+		}
 		while(this->_itrBucketPos >= this->_itrBucket.size() ||
 		      this->_itrBucket.size() == 0)
 		{
@@ -303,27 +483,21 @@ public:
 				throw out_of_range("No more suffixes");
 			}
 			if(this->_nthreads == 1) {
-				nextBlock((int)_cur);
+				if(_ckpt.saved(_cur)) {
+					readBlock(_cur, this->_itrBucket);
+				} else {
+					nextBlock((int)_cur);
+					if(_ckpt.enabled()) {
+						writeBlock(_cur, this->_itrBucket);
+					}
+				}
 				_cur++;
 			} else {
 				while(!_done[this->_itrBucketIdx]) {
 					SLEEP(1);
 				}
 				// Read suffixes from a file
-				std::ostringstream number; number << this->_itrBucketIdx;
-				const string fname = _base_fname + "." + number.str() + ".sa";
-				ifstream sa_file(fname.c_str(), ios::binary);
-				if(!sa_file.good()) {
-					cerr << "Could not open file for reading a reference graph: \"" << fname << "\"" << endl;
-					throw 1;
-				}
-				size_t numSAs = readU<TIndexOffU>(sa_file, false /* don't endian swap */);
-				this->_itrBucket.resize(numSAs);
-				for(size_t i = 0; i < numSAs; i++) {
-					this->_itrBucket[i] = readU<TIndexOffU>(sa_file, false);
-				}
-				sa_file.close();
-				std::remove(fname.c_str());
+				readBlock(this->_itrBucketIdx, this->_itrBucket);
 			}
 			this->_itrBucketIdx++;
 			this->_itrBucketPos = 0;
@@ -331,6 +505,39 @@ public:
 		return this->_itrBucket[this->_itrBucketPos++];
 	}
 
+	/**
+	 * Get the next suffix from the sorted blocks the worker threads
+	 * spilled to disk, reading each block through a small buffer
+	 * rather than loading it whole.  The blocks come out of the
+	 * workers in suffix order, so merging them is just a matter of
+	 * reading one file after another.
+	 */
+	TIndexOffU nextStreamedSuffix() {
+		while(_blockLeft == 0) {
+			if(_blockIn.is_open()) {
+				_blockIn.close();
+				if(!_ckpt.enabled()) std::remove(_blockFname.c_str());
+			}
+			if(!hasMoreBlocks()) {
+				throw out_of_range("No more suffixes");
+			}
+			while(!_done[this->_itrBucketIdx]) {
+				SLEEP(1);
+			}
+			_blockFname = blockFname(this->_itrBucketIdx);
+			_blockIn.clear();
+			_blockIn.open(_blockFname.c_str(), ios::binary);
+			if(!_blockIn.good()) {
+				cerr << "Could not open file for reading a reference graph: \"" << _blockFname << "\"" << endl;
+				throw 1;
+			}
+			_blockLeft = readU<TIndexOffU>(_blockIn, false /* don't endian swap */);
+			this->_itrBucketIdx++;
+		}
+		_blockLeft--;
+		return readU<TIndexOffU>(_blockIn, false);
+	}
+
 	/// Defined in blockwise_sa.cpp
 	virtual void nextBlock(int cur_block, int tid = 0);
 
@@ -372,14 +579,21 @@ private:
 	 * Calculate the difference-cover sample and sample suffixes.
 	 */
 	void build() {
+		_profParent = currentProfilePhase();
+		if(_ckpt.enabled() && resumeCheckpoint()) {
+			_built = true;
+			return;
+		}
 		// Calculate difference-cover sample
 		assert(_dc == NULL);
 		if(_dcV != 0) {
+			ProfilePhase phase("dc_sample");
 			_dc = new TDC(this->text(), _dcV, this->verbose(), this->sanityCheck());
 			_dc->build(this->_nthreads);
 		}
 		// Calculate sample suffixes
 		if(this->bucketSz() <= this->text().length()) {
+			ProfilePhase phase("sample_suffixes");
 			VMSG_NL("Building samples");
 			buildSamples();
 		} else {
@@ -387,9 +601,94 @@ private:
 				this->text().length() << " is less than bucket size: " <<
 				this->bucketSz());
 		}
+		if(_ckpt.enabled()) {
+			saveSamples();
+		}
 		_built = true;
 	}
 
+	/**
+	 * Parameters that must match for a checkpoint to be picked up: the
+	 * text, as its length and a hash, and everything that decides the
+	 * blocks.
+	 */
+	string checkpointParams() const {
+		const TStr& t = this->text();
+		size_t len = t.length();
+		uint64_t h = 14695981039346656037ull; // FNV-1a
+		for(size_t i = 0; i < len; i++) {
+			h = (h ^ (uint64_t)t[i]) * 1099511628211ull;
+		}
+		std::ostringstream os;
+		os << "len " << len << " hash " << h
+		   << " bmax " << this->bucketSz() << " dcv " << _dcV
+		   << " seed " << _seed << " offsize " << OFF_SIZE
+		   << " bigendian " << (_bigEndian ? 1 : 0);
+		return os.str();
+	}
+
+	/**
+	 * If the checkpoint has samples from an earlier build of the same
+	 * text with the same parameters, load them and return true.
+	 */
+	bool resumeCheckpoint() {
+		if(!_ckpt.resume(checkpointParams())) {
+			return false;
+		}
+		ifstream in(_ckpt.samplesFname().c_str(), ios::binary);
+		bool ok = in.good();
+		if(ok && _dcV != 0) {
+			_dc = new TDC(this->text(), _dcV, this->verbose(), this->sanityCheck());
+			ok = _dc->readBuilt(in);
+		}
+		if(ok) {
+			uint64_t nsamp = readU<uint64_t>(in, false);
+			ok = in.good() && nsamp + 1 == _ckpt.nblocks();
+			if(ok) {
+				_sampleSuffs.resizeExact((size_t)nsamp);
+				in.read((char*)_sampleSuffs.ptr(), nsamp * sizeof(TIndexOffU));
+				ok = in.good();
+			}
+		}
+		if(!ok) {
+			VMSG_NL("Checkpoint samples unreadable; starting over");
+			if(_dc != NULL) {
+				delete _dc;
+				_dc = NULL;
+			}
+			_sampleSuffs.clear();
+			_ckpt.restart();
+			return false;
+		}
+		VMSG_NL("Resuming from checkpoint: " << _ckpt.nsaved() << " of "
+		        << _ckpt.nblocks() << " blocks already sorted");
+		return true;
+	}
+
+	/**
+	 * Save the difference-cover sample and the sample suffixes to the
+	 * checkpoint.
+	 */
+	void saveSamples() {
+		const string fname = _ckpt.samplesFname() + ".tmp";
+		ofstream out(fname.c_str(), ios::binary);
+		if(!out.good()) {
+			cerr << "Could not open checkpoint file for writing: \"" << fname << "\"" << endl;
+			throw 1;
+		}
+		if(_dc != NULL) {
+			_dc->writeBuilt(out);
+		}
+		writeU<uint64_t>(out, _sampleSuffs.size());
+		out.write((const char*)_sampleSuffs.ptr(), _sampleSuffs.size() * sizeof(TIndexOffU));
+		out.close();
+		if(out.fail()) {
+			cerr << "Could not write \"" << fname << "\"; please check if the disk is full." << endl;
+			throw 1;
+		}
+		_ckpt.commitSamples(_sampleSuffs.size() + 1);
+	}
+
 	/**
 	 * Calculate the lcp between two suffixes using the difference
 	 * cover as a tie-breaker.  If the tie-breaker is employed, then
@@ -433,6 +732,13 @@ private:
 	EList<pair<KarkkainenBlockwiseSA*, int> > _tparams;
 	EList<EList<TIndexOffU> >     _itrBuckets;  /// buckets
 	volatile bool* _done;        /// is a block processed?
+	bool           _streamBlocks; /// read spilled blocks incrementally
+	ifstream       _blockIn;      /// spilled block being read
+	string         _blockFname;   /// name of that block's file
+	TIndexOffU     _blockLeft;    /// suffixes left to read from it
+	uint32_t       _seed;         /// seed for the sample suffixes
+	SACheckpoint   _ckpt;         /// saved samples and blocks, if any
+	size_t         _profParent;   /// profile phase that block phases go in
 };
 
 /**
@@ -981,6 +1287,8 @@ void KarkkainenBlockwiseSA<TStr>::nextBlock(int cur_block, int tid) {
 			}
 		}
 	} else {
+		// Block phases may run on several threads at once
+		ProfilePhase phase("block_bucketing", _profParent);
 		try {
 			{
 				ThreadSafe ts(&_mutex);
@@ -1110,6 +1418,7 @@ void KarkkainenBlockwiseSA<TStr>::nextBlock(int cur_block, int tid) {
 	} // end else clause of if(_sampleSuffs.size() == 0)
 	// Sort the bucket
 	if(bucket.size() > 0) {
+		ProfilePhase phase("block_sorting", _profParent);
 		Timer timer(cout, "  Sorting block time: ", this->verbose());
 		{
 			ThreadSafe ts(&_mutex);
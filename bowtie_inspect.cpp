@@ -388,6 +388,7 @@ void print_index_summary(
 	}
 	cout << "SA-Sample" << "\t1 in " << (1 << ebwt.eh().offRate()) << endl;
 	cout << "FTab-Chars" << '\t' << ebwt.eh().ftabChars() << endl;
+	cout << "Layout" << '\t' << (ebwt.eh().isBt2Index() ? "interleaved" : "paired") << endl;
 	for(size_t i = 0; i < ebwt.nPat(); i++) {
 		cout << "Sequence-" << (i+1)
 		     << '\t' << p_refnames[refs.expandIdx((uint32_t)i)]
@@ -0,0 +1,230 @@
+/*
+ * build_profile.cpp
+ */
+
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include "build_profile.h"
+#include "assert_helpers.h"
+#include "ds.h"
+#include "threading.h"
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
+#endif
+
+using namespace std;
+
+bool gBuildProfile = false;
+
+/// A phase's totals over every time it was entered
+struct PhaseTotals {
+	string   path;
+	size_t   parent;  // index of enclosing phase, or PROFILE_TOP
+	uint64_t calls;
+	double   wall;
+	double   cpu;
+	uint64_t rd;
+	uint64_t wr;
+	uint64_t peakRss; // KB
+};
+
+static EList<PhaseTotals> phaseTotals;
+static ProfileSnapshot    profStart;
+static MUTEX_T            profMutex;
+
+#if (__cplusplus >= 201103L)
+#define PROFILE_TLS thread_local
+#else
+#define PROFILE_TLS __thread
+#endif
+
+/// Phases open on this thread, innermost last
+static const size_t MAX_PHASE_DEPTH = 32;
+static PROFILE_TLS size_t openPhases[MAX_PHASE_DEPTH];
+static PROFILE_TLS size_t nopen = 0;
+
+/**
+ * Process's peak resident set size so far, in KB.
+ */
+static uint64_t peakRssKb() {
+#ifdef _WIN32
+	return 0;
+#else
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+	return (uint64_t)ru.ru_maxrss / 1024; // bytes
+#else
+	return (uint64_t)ru.ru_maxrss;
+#endif
+#endif
+}
+
+/**
+ * Read the rchar and wchar counts from a Linux /proc/.../io file.
+ */
+static void readIoCounts(const char *fname, uint64_t& rd, uint64_t& wr) {
+	rd = wr = 0;
+	FILE *f = fopen(fname, "r");
+	if(f == NULL) {
+		return;
+	}
+	char key[32];
+	unsigned long long n;
+	while(fscanf(f, "%31s %llu", key, &n) == 2) {
+		if(strcmp(key, "rchar:") == 0) rd = n;
+		else if(strcmp(key, "wchar:") == 0) wr = n;
+	}
+	fclose(f);
+}
+
+void ProfileSnapshot::take(bool thread) {
+	wall = cpu = 0.0;
+	rd = wr = 0;
+#ifndef _WIN32
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	wall = tv.tv_sec + tv.tv_usec / 1e6;
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	if(thread) {
+		struct timespec ts;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+		cpu = ts.tv_sec + ts.tv_nsec / 1e9;
+	} else
+#endif
+	{
+		struct rusage ru;
+		getrusage(RUSAGE_SELF, &ru);
+		cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		      ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+	}
+#endif
+#ifdef __linux__
+	readIoCounts(thread ? "/proc/thread-self/io" : "/proc/self/io", rd, wr);
+#endif
+}
+
+void enableBuildProfile() {
+	profStart.take(false);
+	gBuildProfile = true;
+}
+
+size_t currentProfilePhase() {
+	return nopen == 0 ? PROFILE_TOP : openPhases[nopen-1];
+}
+
+void ProfilePhase::begin(size_t parent) {
+	{
+		ThreadSafe ts(&profMutex);
+		string path = (parent == PROFILE_TOP) ? string() : phaseTotals[parent].path + "/";
+		path += _name;
+		for(_idx = 0; _idx < phaseTotals.size(); _idx++) {
+			if(phaseTotals[_idx].path == path) break;
+		}
+		if(_idx == phaseTotals.size()) {
+			phaseTotals.expand();
+			PhaseTotals& p = phaseTotals.back();
+			p.path = path;
+			p.parent = parent;
+			p.calls = 0;
+			p.wall = p.cpu = 0.0;
+			p.rd = p.wr = p.peakRss = 0;
+		}
+	}
+	assert_lt(nopen, MAX_PHASE_DEPTH);
+	openPhases[nopen++] = _idx;
+	_start.take(_thread);
+}
+
+void ProfilePhase::end() {
+	ProfileSnapshot fin;
+	fin.take(_thread);
+	uint64_t rss = peakRssKb();
+	assert(nopen > 0 && openPhases[nopen-1] == _idx);
+	nopen--;
+	ThreadSafe ts(&profMutex);
+	PhaseTotals& p = phaseTotals[_idx];
+	p.calls++;
+	p.wall += fin.wall - _start.wall;
+	p.cpu  += fin.cpu  - _start.cpu;
+	p.rd   += fin.rd   - _start.rd;
+	p.wr   += fin.wr   - _start.wr;
+	p.peakRss = max(p.peakRss, rss);
+}
+
+/**
+ * Write s as a JSON string.
+ */
+static void writeJsonString(ostream& out, const string& s) {
+	out << '"';
+	for(size_t i = 0; i < s.length(); i++) {
+		char c = s[i];
+		if(c == '"' || c == '\\') {
+			out << '\\' << c;
+		} else if((unsigned char)c < 0x20) {
+			out << "\\u" << hex << setw(4) << setfill('0') << (int)c << dec << setfill(' ');
+		} else {
+			out << c;
+		}
+	}
+	out << '"';
+}
+
+static void writeCounts(ostream& out, double wall, double cpu, uint64_t rss, uint64_t rd, uint64_t wr) {
+	out << "\"wall_sec\": " << wall << ", \"cpu_sec\": " << cpu
+	    << ", \"peak_rss_kb\": " << rss
+	    << ", \"bytes_read\": " << rd << ", \"bytes_written\": " << wr;
+}
+
+/**
+ * Write the phases nested directly in 'parent', each followed by the
+ * phases nested in it, in the order they were first entered.
+ */
+static void writePhases(ostream& out, size_t parent, bool& first) {
+	for(size_t i = 0; i < phaseTotals.size(); i++) {
+		const PhaseTotals& p = phaseTotals[i];
+		if(p.parent != parent) {
+			continue;
+		}
+		out << (first ? "" : ",") << endl << "    {\"name\": ";
+		first = false;
+		writeJsonString(out, p.path);
+		out << ", \"calls\": " << p.calls << ", ";
+		writeCounts(out, p.wall, p.cpu, p.peakRss, p.rd, p.wr);
+		out << "}";
+		writePhases(out, i, first);
+	}
+}
+
+bool writeBuildProfile(const string& fname, const string& cmd) {
+	ProfileSnapshot fin;
+	fin.take(false);
+	ofstream out(fname.c_str());
+	if(!out.good()) {
+		cerr << "Could not open profile file \"" << fname << "\" for writing" << endl;
+		return false;
+	}
+	ThreadSafe ts(&profMutex);
+	out << fixed << setprecision(3);
+	out << "{" << endl << "  \"command\": ";
+	writeJsonString(out, cmd);
+	out << "," << endl << "  \"total\": {";
+	writeCounts(out, fin.wall - profStart.wall, fin.cpu - profStart.cpu, peakRssKb(),
+	            fin.rd - profStart.rd, fin.wr - profStart.wr);
+	out << "}," << endl << "  \"phases\": [";
+	bool first = true;
+	writePhases(out, PROFILE_TOP, first);
+	out << endl << "  ]" << endl << "}" << endl;
+	out.close();
+	if(out.fail()) {
+		cerr << "Could not write profile file \"" << fname << "\"" << endl;
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,96 @@
+/*
+ * build_profile.h
+ *
+ * Per-phase resource accounting for bowtie-build --profile-json.  Each
+ * phase of the build (reading the reference, building the
+ * difference-cover sample, sorting blocks, writing the index, ...) is
+ * bracketed by a ProfilePhase, which records the wall-clock and CPU
+ * time it took, the process's peak resident set size when it ended,
+ * and the bytes read and written meanwhile.  Phases opened while
+ * another is open are named after it, e.g. "forward/build_to_disk", and
+ * a phase entered more than once (one per block, say) is summed.
+ * Nothing is recorded unless profiling was enabled, so phases cost a
+ * branch otherwise.
+ */
+
+#ifndef BUILD_PROFILE_H_
+#define BUILD_PROFILE_H_
+
+#include <stdint.h>
+#include <string>
+
+/**
+ * Start recording phases.  Called once, before any phase is entered.
+ */
+extern void enableBuildProfile();
+
+/// True iff enableBuildProfile() was called
+extern bool gBuildProfile;
+
+/**
+ * Write everything recorded so far as JSON to 'fname', along with the
+ * totals since enableBuildProfile().  'cmd' is the command line that
+ * ran the build.  Returns false if the file can't be written.
+ */
+extern bool writeBuildProfile(const std::string& fname, const std::string& cmd);
+
+/**
+ * Resources used so far, by the process or by the calling thread.
+ * Bytes read and written are 0 where the OS doesn't count them.
+ */
+struct ProfileSnapshot {
+	void take(bool thread);
+
+	double   wall;  // seconds
+	double   cpu;   // seconds of user + system time
+	uint64_t rd;    // bytes read
+	uint64_t wr;    // bytes written
+};
+
+/// Parent of a phase that isn't nested in any other
+static const size_t PROFILE_TOP = (size_t)-1;
+
+/**
+ * The innermost phase open on the calling thread, or PROFILE_TOP.
+ * Code that starts threads passes this to the phases they run.
+ */
+extern size_t currentProfilePhase();
+
+/**
+ * Records the phase 'name' from construction to destruction.  A phase
+ * is nested in the innermost phase open on its thread, and counts the
+ * whole process's CPU time and I/O.  A phase that runs on a thread of
+ * its own, alongside others, names its parent explicitly and counts
+ * only that thread's CPU time and I/O; its wall time can add up to
+ * more than its parent's.  Phases it encloses on its thread nest in
+ * it as usual.
+ */
+class ProfilePhase {
+public:
+	explicit ProfilePhase(const char *name) :
+		_name(name), _thread(false)
+	{
+		if(gBuildProfile) begin(currentProfilePhase());
+	}
+
+	ProfilePhase(const char *name, size_t parent) :
+		_name(name), _thread(true)
+	{
+		if(gBuildProfile) begin(parent);
+	}
+
+	~ProfilePhase() {
+		if(gBuildProfile) end();
+	}
+
+private:
+	void begin(size_t parent);
+	void end();
+
+	const char     *_name;
+	bool            _thread;
+	size_t          _idx;   // which recorded phase this adds to
+	ProfileSnapshot _start;
+};
+
+#endif /* BUILD_PROFILE_H_ */
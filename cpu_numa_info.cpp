@@ -1,9 +1,170 @@
 #include "cpu_numa_info.h"
 
+#ifdef __linux__
+#include <sched.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "ds.h"
+#endif
+
 /// Based on http://stackoverflow.com/questions/16862620/numa-get-current-node-core
 void get_cpu_and_node_(int& cpu, int& node) {
+#if defined(__x86_64__) || defined(__i386__)
 	unsigned long a,d,c;
 	__asm__ volatile("rdtscp" : "=a" (a), "=d" (d), "=c" (c));
 	node = (c & 0xFFF000)>>12;
 	cpu = c & 0xFFF;
+#else
+	cpu = node = 0;
+#endif
+}
+
+#ifdef __linux__
+
+/**
+ * The nodes with CPUs we may run on, from /sys, and the CPUs we may
+ * run on in each.
+ */
+struct NumaTopology {
+	NumaTopology() {
+		sched_getaffinity(0, sizeof(allowed), &allowed);
+		FILE *f = fopen("/sys/devices/system/node/online", "r");
+		if(f == NULL) {
+			return;
+		}
+		// A list of ranges, e.g. "0-1,4"
+		int lo, hi;
+		while(fscanf(f, "%d", &lo) == 1) {
+			hi = lo;
+			int c = fgetc(f);
+			if(c == '-') {
+				if(fscanf(f, "%d", &hi) != 1) break;
+				c = fgetc(f);
+			}
+			for(int n = lo; n <= hi; n++) {
+				addNode(n);
+			}
+			if(c != ',') break;
+		}
+		fclose(f);
+		if(nodes.size() < 2) {
+			nodes.clear();
+			cpus.clear();
+		}
+	}
+
+	void addNode(int n) {
+		char fn[64];
+		snprintf(fn, sizeof(fn), "/sys/devices/system/node/node%d/cpulist", n);
+		FILE *f = fopen(fn, "r");
+		if(f == NULL) {
+			return;
+		}
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		int lo, hi;
+		while(fscanf(f, "%d", &lo) == 1) {
+			hi = lo;
+			int c = fgetc(f);
+			if(c == '-') {
+				if(fscanf(f, "%d", &hi) != 1) break;
+				c = fgetc(f);
+			}
+			for(int i = lo; i <= hi && i < CPU_SETSIZE; i++) {
+				if(CPU_ISSET(i, &allowed)) CPU_SET(i, &set);
+			}
+			if(c != ',') break;
+		}
+		fclose(f);
+		if(CPU_COUNT(&set) > 0) {
+			nodes.push_back(n);
+			cpus.push_back(set);
+		}
+	}
+
+	cpu_set_t allowed;
+	EList<int> nodes;
+	EList<cpu_set_t> cpus;
+};
+
+static NumaTopology& topology() {
+	static NumaTopology topo;
+	return topo;
+}
+
+int numa_node_count() {
+	return topology().nodes.empty() ? 1 : (int)topology().nodes.size();
+}
+
+bool pin_thread_to_node(int i) {
+	NumaTopology& t = topology();
+	if(t.nodes.empty()) {
+		return false;
+	}
+	return sched_setaffinity(0, sizeof(cpu_set_t), &t.cpus[i % t.cpus.size()]) == 0;
+}
+
+void unpin_thread() {
+	sched_setaffinity(0, sizeof(cpu_set_t), &topology().allowed);
+}
+
+void interleave_pages(void *p, size_t len) {
+#ifdef SYS_mbind
+	NumaTopology& t = topology();
+	if(t.nodes.empty()) {
+		return;
+	}
+	const int MPOL_INTERLEAVE_ = 3;
+	const unsigned MPOL_MF_MOVE_ = 1 << 1;
+	const size_t WORD = 8 * sizeof(unsigned long);
+	unsigned long mask[1024 / WORD] = { 0 };
+	unsigned long maxnode = 0;
+	for(size_t i = 0; i < t.nodes.size(); i++) {
+		size_t n = (size_t)t.nodes[i];
+		if(n >= 1024) continue;
+		mask[n / WORD] |= 1ul << (n % WORD);
+		if(n + 2 > maxnode) maxnode = n + 2;
+	}
+	// mbind wants whole pages
+	const uintptr_t pg = (uintptr_t)sysconf(_SC_PAGESIZE);
+	uintptr_t beg = ((uintptr_t)p + pg - 1) & ~(pg - 1);
+	uintptr_t end = ((uintptr_t)p + len) & ~(pg - 1);
+	if(end > beg) {
+		syscall(SYS_mbind, beg, end - beg, MPOL_INTERLEAVE_, mask, maxnode, MPOL_MF_MOVE_);
+	}
+#endif
 }
+
+int numa_node_of(const void *p) {
+#ifdef SYS_move_pages
+	NumaTopology& t = topology();
+	if(t.nodes.empty()) {
+		return -1;
+	}
+	// With no target nodes, move_pages just reports where each page is
+	const uintptr_t pg = (uintptr_t)sysconf(_SC_PAGESIZE);
+	void *page = (void*)((uintptr_t)p & ~(pg - 1));
+	int status = -1;
+	if(syscall(SYS_move_pages, 0, 1ul, &page, NULL, &status, 0) != 0 || status < 0) {
+		return -1;
+	}
+	for(size_t i = 0; i < t.nodes.size(); i++) {
+		if(t.nodes[i] == status) {
+			return (int)i;
+		}
+	}
+#endif
+	return -1;
+}
+
+#else
+
+int numa_node_count() { return 1; }
+bool pin_thread_to_node(int i) { return false; }
+void unpin_thread() { }
+void interleave_pages(void *p, size_t len) { }
+int numa_node_of(const void *p) { return -1; }
+
+#endif
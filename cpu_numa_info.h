@@ -1,6 +1,40 @@
 #ifndef CPU_AND_NODE_H_
 #define CPU_AND_NODE_H_
 
+#include <stddef.h>
+
 extern void get_cpu_and_node_(int& cpu, int& node);
 
+/**
+ * Return the number of NUMA nodes with CPUs this process may run on.
+ * Returns 1 if the topology can't be determined.
+ */
+extern int numa_node_count();
+
+/**
+ * Restrict the calling thread to the CPUs of the i'th node counted by
+ * numa_node_count(), wrapping around.  Returns false if it can't.
+ */
+extern bool pin_thread_to_node(int i);
+
+/**
+ * Let the calling thread run on any CPU the process could when it
+ * started.
+ */
+extern void unpin_thread();
+
+/**
+ * Ask the kernel to spread the pages of [p, p+len) round-robin across
+ * all nodes, moving those already placed.  Best effort; does nothing
+ * where that isn't supported.
+ */
+extern void interleave_pages(void *p, size_t len);
+
+/**
+ * Return the index, as counted by numa_node_count(), of the node
+ * holding the page at p, or -1 if that can't be told (e.g. the page
+ * hasn't been touched yet).
+ */
+extern int numa_node_of(const void *p);
+
 #endif
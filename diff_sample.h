@@ -14,6 +14,7 @@
 #include "multikey_qsort.h"
 #include "timer.h"
 #include "threading.h"
+#include "word_io.h"
 
 using namespace std;
 
@@ -581,6 +582,8 @@ public:
 	ostream& log() const                 { return _logger; }
 
 	void     build(int nthreads);
+	void     writeBuilt(ostream& out) const;
+	bool     readBuilt(istream& in);
 	uint32_t tieBreakOff(TIndexOffU i, TIndexOffU j) const;
 	int64_t  breakTie(TIndexOffU i, TIndexOffU j) const;
 	bool     isCovered(TIndexOffU i) const;
@@ -820,6 +823,32 @@ static void VSorting_worker(void *vp)
 	}
 }
 
+template<typename TStr>
+struct VRankingParam {
+        const TStr*                  host;
+        const TIndexOffU*            sPrimeArr;
+        uint32_t                     v;
+        size_t                       begin;
+        size_t                       end;
+        uint8_t*                     newRank;
+};
+
+/**
+ * Mark each v-sorted sample suffix in [begin, end) that differs from
+ * the next one within v characters, i.e. that ends its rank.
+ */
+template<typename TStr>
+static void VRanking_worker(void *vp)
+{
+	VRankingParam<TStr>* param = (VRankingParam<TStr>*)vp;
+	for(size_t i = param->begin; i < param->end; i++) {
+		param->newRank[i] = !suffixSameUpTo(*param->host,
+		                                    param->sPrimeArr[i],
+		                                    param->sPrimeArr[i+1],
+		                                    param->v);
+	}
+}
+
 /**
  * Calculates a ranking of all suffixes in the sample and stores them,
  * packed according to the mu mapping, in _isaPrime.
@@ -944,12 +973,48 @@ void DifferenceCoverSample<TStr>::build(int nthreads) {
 		{
 			Timer timer(cout, "  Ranking v-sort output time: ", this->verbose());
 			VMSG_NL("  Ranking v-sort output");
-			for(size_t i = 0; i < sPrimeSz-1; i++) {
-				// Place the appropriate ranking
-				_isaPrime[sPrimeOrder[i]] = nextRank;
-				// If sPrime[i] and sPrime[i+1] are identical up to v, then we
-				// should give the next suffix the same rank
-				if(!suffixSameUpTo(t, sPrime[i], sPrime[i+1], v)) nextRank++;
+			if(nthreads == 1) {
+				for(size_t i = 0; i < sPrimeSz-1; i++) {
+					// Place the appropriate ranking
+					_isaPrime[sPrimeOrder[i]] = nextRank;
+					// If sPrime[i] and sPrime[i+1] are identical up to v, then we
+					// should give the next suffix the same rank
+					if(!suffixSameUpTo(t, sPrime[i], sPrime[i+1], v)) nextRank++;
+				}
+			} else {
+				// Comparing neighbors up to v characters is the bulk of
+				// the work; do that in parallel, then hand out ranks
+				EList<uint8_t> newRank;
+				newRank.resizeExact(sPrimeSz);
+#if (__cplusplus >= 201103L)
+				AutoArray<std::thread*> threads(nthreads);
+#else
+				AutoArray<tthread::thread*> threads(nthreads);
+#endif
+				EList<VRankingParam<TStr> > tparams;
+				tparams.resize(nthreads);
+				size_t per = (sPrimeSz - 1 + nthreads - 1) / nthreads;
+				for(int tid = 0; tid < nthreads; tid++) {
+					tparams[tid].host = &t;
+					tparams[tid].sPrimeArr = sPrime.ptr();
+					tparams[tid].v = v;
+					tparams[tid].begin = min(per * tid, sPrimeSz - 1);
+					tparams[tid].end = min(per * (tid + 1), sPrimeSz - 1);
+					tparams[tid].newRank = newRank.ptr();
+#if (__cplusplus >= 201103L)
+					threads[tid] = new std::thread(VRanking_worker<TStr>, (void*)&tparams[tid]);
+#else
+					threads[tid] = new tthread::thread(VRanking_worker<TStr>, (void*)&tparams[tid]);
+#endif
+				}
+				for(int tid = 0; tid < nthreads; tid++) {
+					threads[tid]->join();
+					delete threads[tid];
+				}
+				for(size_t i = 0; i < sPrimeSz-1; i++) {
+					_isaPrime[sPrimeOrder[i]] = nextRank;
+					nextRank += newRank[i];
+				}
 			}
 			_isaPrime[sPrimeOrder[sPrimeSz-1]] = nextRank; // finish off
 		}
@@ -975,7 +1040,8 @@ void DifferenceCoverSample<TStr>::build(int nthreads) {
 			(TIndexOff*)&sPrime[0],
 			(TIndexOff)sPrimeSz,
 			(TIndexOff)sPrime.size(),
-			0);
+			0,
+			nthreads);
 	}
 	// sPrime now contains the suffix array (which we ignore)
 	assert_eq(_isaPrime.size(), sPrime.size());
@@ -994,6 +1060,52 @@ void DifferenceCoverSample<TStr>::build(int nthreads) {
 	if(this->sanityCheck()) doBuiltSanityCheck();
 }
 
+/**
+ * Write what build() computed to 'out', in this machine's byte order,
+ * so that a later build of the same text can restore it with
+ * readBuilt() instead of building it again.
+ */
+template <typename TStr>
+void DifferenceCoverSample<TStr>::writeBuilt(ostream& out) const {
+	assert(built());
+	writeU<uint32_t>(out, _v);
+	writeU<uint64_t>(out, _doffs.size());
+	out.write((const char*)_doffs.ptr(), _doffs.size() * sizeof(TIndexOffU));
+	writeU<uint64_t>(out, _isaPrime.size());
+	out.write((const char*)_isaPrime.ptr(), _isaPrime.size() * sizeof(TIndexOffU));
+}
+
+/**
+ * Restore a sample written by writeBuilt() for the same text and
+ * period.  Return false, leaving the sample unbuilt, if 'in' doesn't
+ * hold one.
+ */
+template <typename TStr>
+bool DifferenceCoverSample<TStr>::readBuilt(istream& in) {
+	assert(!built());
+	uint32_t v = readU<uint32_t>(in, false);
+	uint64_t ndoffs = readU<uint64_t>(in, false);
+	if(!in.good() || v != _v || ndoffs != (uint64_t)_d + 1) {
+		return false;
+	}
+	_doffs.resizeExact((size_t)ndoffs);
+	in.read((char*)_doffs.ptr(), ndoffs * sizeof(TIndexOffU));
+	uint64_t nisa = readU<uint64_t>(in, false);
+	if(!in.good() || nisa != _doffs[_d] || nisa == 0) {
+		_doffs.clear();
+		return false;
+	}
+	_isaPrime.resizeExact((size_t)nisa);
+	in.read((char*)_isaPrime.ptr(), nisa * sizeof(TIndexOffU));
+	if(!in.good()) {
+		_doffs.clear();
+		_isaPrime.clear();
+		return false;
+	}
+	if(this->sanityCheck()) doBuiltSanityCheck();
+	return true;
+}
+
 /**
  * Return true iff index i within the text is covered by the difference
  * cover sample.  Allow i to be off the end of the text; simplifies
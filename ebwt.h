@@ -23,13 +23,16 @@
 #include "bitpack.h"
 #include "bitset.h"
 #include "blockwise_sa.h"
+#include "build_profile.h"
 #include "ds.h"
 #include "endian_swap.h"
 #include "hit.h"
 #include "mm.h"
+#include "occ_simd.h"
 #include "random_source.h"
 #include "ref_read.h"
 #include "reference.h"
+#include "hugepage.h"
 #include "shmem.h"
 #include "sstring.h"
 #include "str_util.h"
@@ -48,6 +51,11 @@ using namespace std;
 #define PREFETCH_LOCALITY 2
 #endif
 
+/// Rows of the BWT matrix rowsToDisk() hands to a thread at a time
+#ifndef ROWS_CHUNK_LEN
+#define ROWS_CHUNK_LEN (64 * 1024)
+#endif
+
 // From ccnt_lut.cpp, automatically generated by gen_lookup_tables.pl
 extern uint8_t cCntLUT_4[4][4][256];
 
@@ -81,11 +89,26 @@ if(this->verbose()) { \
  */
 enum EBWT_FLAGS {
 	EBWT_COLOR = 2,     // true -> Ebwt is colorspace
-	EBWT_ENTIRE_REV = 4 // true -> reverse Ebwt is the whole
-	                    // concatenated string reversed, rather than
-	                    // each stretch reversed
+	EBWT_ENTIRE_REV = 4, // true -> reverse Ebwt is the whole
+	                     // concatenated string reversed, rather than
+	                     // each stretch reversed
+	EBWT_INTERLEAVED = 8 // true -> each side is one line holding its
+	                     // own A/C/G/T occ checkpoint plus BWT chars,
+	                     // as in Bowtie 2 indexes
 };
 
+/// Every flag bit this version of Bowtie knows how to read
+static const int32_t EBWT_KNOWN_FLAGS = 1 | EBWT_COLOR | EBWT_ENTIRE_REV | EBWT_INTERLEAVED;
+
+/**
+ * Word an index with the EBWT_INTERLEAVED flag has right after the
+ * flags, where older versions of Bowtie expect the number of
+ * references.  They ignore flags they don't know about, so without it
+ * they would take an interleaved BWT for a paired one and crash; with
+ * it, they fail trying to read that many reference lengths.
+ */
+static const TIndexOffU EBWT_INTERLEAVED_MARK = OFF_MASK;
+
 extern string gLastIOErrMsg;
 
 inline bool is_read_err(int fdesc, ssize_t ret, size_t count){
@@ -283,7 +306,8 @@ public:
 		    << "    numLines: "     << _numLines << endl
 		    << "    ebwtTotLen: "   << _ebwtTotLen << endl
 		    << "    ebwtTotSz: "    << _ebwtTotSz << endl
-		    << "    reverse: "      << _entireReverse << endl;
+		    << "    reverse: "      << _entireReverse << endl
+		    << "    interleaved: "  << _isBt2Index << endl;
 	}
 
 	TIndexOffU _len;
@@ -316,7 +340,7 @@ public:
 	TIndexOffU _ebwtTotLen;
 	TIndexOffU _ebwtTotSz;
 	bool     _entireReverse;
-	bool     _isBt2Index;
+	bool     _isBt2Index; // one-line sides w/ in-side occ counts
 };
 
 /**
@@ -344,6 +368,73 @@ static inline int64_t fileSize(const char* name) {
 // Forward declarations for Ebwt class
 struct SideLocus;
 class EbwtSearchParams;
+template<typename TStr> class AppendRows;
+
+/**
+ * A stretch of consecutive rows of the BWT matrix, a whole number of
+ * sides long, on its way to disk in Ebwt::rowsToDisk().  The rows
+ * object fills it in order, then it's assembled into finished sides,
+ * possibly on another thread, and finally written out in order.  The
+ * buffers are allocated once and reused for chunk after chunk.
+ */
+struct RowChunk {
+	TIndexOffU first;   /// first row
+	TIndexOffU nrows;   /// rows, including padding past the last SA row
+	TIndexOffU nsa;     /// rows that are in the suffix array
+	bool allOffs;       /// every row's offset is needed, not just sampled ones
+	EList<TIndexOffU> offs;    /// text offset of each row, or OFF_MASK
+	EList<TIndexOffU> sufInts; /// ftab index of each row, or OFF_MASK
+	EList<int8_t> bwt;         /// BWT char of each row, or -1 for the '$'
+	EList<uint8_t> sides;      /// assembled sides; counts start at 0
+	TIndexOffU cnt[4];  /// chars in the sides, padding included
+	TIndexOffU fchr[4]; /// chars in the sides, padding not included
+	TIndexOffU zOff;    /// row with the '$', or OFF_MASK if elsewhere
+
+	/**
+	 * Size buffers for up to 'rows' rows of sides 'sideSz' bytes long
+	 * holding 'sideBwtLen' characters each.
+	 */
+	void init(TIndexOffU rows, TIndexOffU sideBwtLen, TIndexOffU sideSz) {
+		offs.resizeExact(rows);
+		sufInts.resizeExact(rows);
+		bwt.resizeExact(rows);
+		sides.resizeExact((rows / sideBwtLen) * sideSz);
+	}
+};
+
+/**
+ * What Ebwt::rowsToDisk() accumulates as chunks are written: the
+ * character counts so far, the ftab under construction and the ISA
+ * sample, if any.
+ */
+struct RowsToDiskState {
+	TIndexOffU occ[4];  /// chars written so far, padding included
+	TIndexOffU fchr[4]; /// chars written so far, padding not included
+	TIndexOffU zOff;
+	TIndexOffU* ftab;
+	uint8_t* absorbFtab;
+	uint8_t absorbCnt;
+	uint32_t* isaSample;
+	TIndexOffU lastSufInt;
+};
+
+#if (__cplusplus >= 201103L)
+/**
+ * Coordinates the threads of Ebwt::rowsToDisk().  Chunk k lives in
+ * slot k % nslots; the thread filling chunks waits for the writer to
+ * be done with a slot before reusing it.
+ */
+struct RowsPipeline {
+	std::mutex mu;
+	std::condition_variable cv;
+	size_t nchunks;
+	size_t filled;   /// chunks filled so far
+	size_t claimed;  /// chunks a worker has taken so far
+	size_t written;  /// chunks written so far
+	EList<bool> ready; /// per slot: assembled, waiting to be written
+	bool err;        /// the filling thread failed; wind down
+};
+#endif
 
 /**
  * Extended Burrows-Wheeler transform data.
@@ -382,6 +473,8 @@ public:
 	    _ebwt(NULL), \
 	    _useMm(false), \
 	    useShmem_(false), \
+	    _replica(false), \
+	    _hugePages(false), \
 	    _refnames(), \
 	    mmFile1_(NULL), \
 	    mmFile2_(NULL)
@@ -411,15 +504,18 @@ public:
 	     bool startVerbose = false,
 	     bool passMemExc = false,
 	     bool sanityCheck = false,
-	     bool isBt2Index = false) :
+	     bool isBt2Index = false,
+	     bool hugePages = false) :
 	     Ebwt_INITS
 	     Ebwt_STAT_INITS
 	{
 		assert(!useMm || !useShmem);
+		_hugePages = hugePages && !useMm && !useShmem;
 #ifdef POPCNT_CAPABILITY
         ProcessorSupport ps;
         _usePOPCNTinstruction = ps.POPCNTenabled();
 #endif
+		_occSimd = occSimdLevel();
 		_packed = false;
 		_useMm = useMm;
 		useShmem_ = useShmem;
@@ -477,7 +573,10 @@ public:
 	     bool verbose = false,
 	     bool passMemExc = false,
 	     bool sanityCheck = false,
-	     bool isBt2Index = false) :
+	     bool isBt2Index = false,
+	     int saEngine = SA_ENGINE_BLOCKWISE,
+	     size_t memLimit = 0,
+	     const string& ckptBase = "") :
 	     Ebwt_INITS
 	     Ebwt_STAT_INITS,
 	     _eh(joinedLen(szs),
@@ -494,6 +593,7 @@ public:
         ProcessorSupport ps;
         _usePOPCNTinstruction = ps.POPCNTenabled();
 #endif
+		_occSimd = occSimdLevel();
 		_in1Str = file + ".1." + gEbwt_ext;
 		_in2Str = file + ".2." + gEbwt_ext;
 		// Open output files
@@ -527,7 +627,10 @@ public:
 			bmaxSqrtMult,
 			bmaxDivN,
 			dcv,
-			seed);
+			seed,
+			saEngine,
+			memLimit,
+			ckptBase);
 		// Close output files
 		fout1.flush();
 		int64_t tellpSz1 = (int64_t)fout1.tellp();
@@ -571,6 +674,95 @@ public:
 		VMSG_NL("Returning from Ebwt constructor");
 	}
 
+	/// Construct an Ebwt over the text of the in-memory Ebwt 'old'
+	/// with more text appended; s is the joined text of both, and
+	/// szs, plens and refnames describe the sequences of both.  The
+	/// parameters are old's.  The suffixes of old's text aren't sorted
+	/// again; see AppendRows.
+	template<typename TStr>
+	Ebwt(Ebwt& old,
+	     const TStr& s,
+	     const EList<RefRecord>& szs,
+	     const EList<uint32_t>& plens,
+	     const EList<string>& refnames,
+	     const string& file,   // base filename for EBWT files
+	     bool __fw,
+	     int nthreads,
+	     int32_t __overrideOffRate = -1,
+	     int32_t __overrideIsaRate = -1,
+	     bool verbose = false,
+	     bool passMemExc = false,
+	     bool sanityCheck = false,
+	     bool isBt2Index = false) :
+	     Ebwt_INITS
+	     Ebwt_STAT_INITS,
+	     _eh((TIndexOffU)s.length(),
+	         old.eh()._lineRate,
+	         old.eh()._linesPerSide,
+	         old.eh()._offRate,
+	         -1,
+	         old.eh()._ftabChars,
+	         false,
+	         old.eh()._isBt2Index)
+	{
+		assert(old.isInMemory());
+		assert(!old.eh()._entireReverse);
+		_packed = false;
+#ifdef POPCNT_CAPABILITY
+		ProcessorSupport ps;
+		_usePOPCNTinstruction = ps.POPCNTenabled();
+#endif
+		_occSimd = occSimdLevel();
+		_isBt2Index = _eh._isBt2Index;
+		_in1Str = file + ".1." + gEbwt_ext;
+		_in2Str = file + ".2." + gEbwt_ext;
+		ofstream fout1(_in1Str.c_str(), ios::binary);
+		if(!fout1.good()) {
+			cerr << "Could not open index file for writing: \"" << _in1Str << "\"" << endl
+			     << "Please make sure the directory exists and that permissions allow writing by" << endl
+			     << "Bowtie." << endl;
+			throw 1;
+		}
+		ofstream fout2(_in2Str.c_str(), ios::binary);
+		if(!fout2.good()) {
+			cerr << "Could not open index file for writing: \"" << _in2Str << "\"" << endl
+			     << "Please make sure the directory exists and that permissions allow writing by" << endl
+			     << "Bowtie." << endl;
+			throw 1;
+		}
+		VMSG_NL("Writing header");
+		writeFromMemory(true, fout1, fout2);
+		plensToDisk(szs, plens, fout1);
+		szsToDisk(szs, fout1, REF_READ_FORWARD);
+		{
+			AppendRows<TStr> rows(old, s, nthreads, _verbose);
+			ProfilePhase phase("append_write");
+			Timer timer(cout, "  Time writing the merged index: ", _verbose);
+			rowsToDisk(rows, fout1, fout2, nthreads);
+		}
+		_refnames = refnames;
+		assert_eq(this->_refnames.size(), this->_nPat);
+		for(TIndexOffU i = 0; i < this->_refnames.size(); i++) {
+			fout1 << this->_refnames[i] << endl;
+		}
+		fout1 << '\0';
+		fout1.flush(); fout2.flush();
+		if(fout1.fail() || fout2.fail()) {
+			cerr << "An error occurred writing the index to disk.  Please check if the disk is full." << endl;
+			throw 1;
+		}
+		VMSG_NL("Wrote " << fout1.tellp() << " bytes to primary EBWT file: " << _in1Str);
+		VMSG_NL("Wrote " << fout2.tellp() << " bytes to secondary EBWT file: " << _in2Str);
+		fout1.close();
+		fout2.close();
+		if(_sanity) {
+			VMSG_NL("Sanity-checking Ebwt");
+			readIntoMemory(__fw ? -1 : 0, false, NULL, false, true, false);
+			sanityCheckAll(REF_READ_FORWARD);
+			evictFromMemory();
+		}
+	}
+
 	bool isPacked() {
 		return _packed;
 	};
@@ -635,7 +827,10 @@ public:
 		TIndexOffU bmaxSqrtMult,
 		TIndexOffU bmaxDivN,
 		int dcv,
-		uint32_t seed)
+		uint32_t seed,
+		int saEngine = SA_ENGINE_BLOCKWISE,
+		size_t memLimit = 0,
+		const string& ckptBase = "")
 	{
 		// Compose text strings into single string
 		VMSG_NL("Calculating joined length");
@@ -645,15 +840,22 @@ public:
 		assert_geq(jlen, sztot);
 		VMSG_NL("Writing header");
 		writeFromMemory(true, out1, out2);
+		// Bytes the joined string takes up
+		size_t joinedSz = isPacked() ? (jlen + 3) / 4 : jlen;
 		try {
 			VMSG_NL("Reserving space for joined string");
+			if(memLimit > 0 && joinedSz > memLimit) {
+				throw bad_alloc();
+			}
 			s.resize(jlen);
 			VMSG_NL("Joining reference sequences");
 			if(refparams.reverse == REF_READ_REVERSE) {
 				{
+					ProfilePhase phase("join_reference");
 					Timer timer(cout, "  Time to join reference sequences: ", _verbose);
 					joinToDisk(is, szs, plens, sztot, refparams, s, out1, out2, seed);
 				} {
+					ProfilePhase phase("reverse_reference");
 					Timer timer(cout, "  Time to reverse reference sequence: ", _verbose);
 					EList<RefRecord> tmp;
 					s.reverse();
@@ -661,6 +863,7 @@ public:
 					szsToDisk(tmp, out1, refparams.reverse);
 				}
 			} else {
+				ProfilePhase phase("join_reference");
 				Timer timer(cout, "  Time to join reference sequences: ", _verbose);
 				joinToDisk(is, szs, plens, sztot, refparams, s, out1, out2, seed);
 				szsToDisk(szs, out1, refparams.reverse);
@@ -712,10 +915,46 @@ public:
 			bmax = (TIndexOffU)sqrt(s.length());
 			VMSG_NL("bmax defaulted to: " << bmax);
 		}
+		bool built = false;
+		if(saEngine == SA_ENGINE_SAIS && memLimit > 0 &&
+		   joinedSz + saisFootprint(jlen, nthreads, _eh._ftabChars) > memBudget(memLimit))
+		{
+			VMSG_NL("Suffix array won't fit in the memory limit; using the blockwise suffix-array builder.");
+			saEngine = SA_ENGINE_BLOCKWISE;
+		}
+		if(saEngine == SA_ENGINE_SAIS) {
+			// Try building the whole suffix array at once; if it
+			// doesn't fit, rewind the output and fall through to the
+			// blockwise builder
+			streampos pos1 = out1.tellp(), pos2 = out2.tellp();
+			try {
+				VMSG_NL("Constructing suffix array by induced sorting");
+				SaisBlockwiseSA<TStr> sa(s, nthreads, _sanity, _passMemExc, _verbose);
+				assert(sa.suffixItrIsReset());
+				assert_eq(sa.size(), s.length()+1);
+				VMSG_NL("Converting suffix-array elements to index image");
+				buildToDisk(sa, s, out1, out2, nthreads);
+				out1.flush(); out2.flush();
+				if(out1.fail() || out2.fail()) {
+					cerr << "An error occurred writing the index to disk.  Please check if the disk is full." << endl;
+					throw 1;
+				}
+				built = true;
+			} catch(bad_alloc& e) {
+				if(!_passMemExc) {
+					cerr << "Out of memory while constructing suffix array.  Please try using" << endl
+					     << "--sa-engine blockwise" << endl;
+					throw 1;
+				}
+				VMSG_NL("  Ran out of memory; falling back to the blockwise suffix-array builder.");
+				out1.seekp(pos1);
+				out2.seekp(pos2);
+			}
+		}
 		int iter = 0;
 		bool first = true;
 		// Look for bmax/dcv parameters that work.
-		while(true) {
+		while(!built) {
 			if(!first && bmax < 40 && _passMemExc) {
 				cerr << "Could not find approrpiate bmax/dcv settings for building this index." << endl;
 				if(!isPacked()) {
@@ -746,7 +985,21 @@ public:
 			}
 			iter++;
 			try {
-				{
+				if(memLimit > 0) {
+					// Plan against the budget instead of probing; an
+					// allocation that would break a container's limit
+					// gets the process killed rather than throwing
+					size_t need = joinedSz + blockwiseFootprint(jlen, bmax, dcv, nthreads, _eh._ftabChars);
+					size_t budget = memBudget(memLimit);
+					if(need > budget) {
+						VMSG_NL("  Needs about " << need << " bytes, over the " << budget
+						        << " the memory limit of " << memLimit << " leaves");
+						throw bad_alloc();
+					}
+					VMSG_NL("  Needs about " << need << " bytes, within the " << budget
+					        << " the memory limit of " << memLimit << " leaves"
+					        << "; constructing with --bmax " << bmax << " --dcv " << dcv);
+				} else {
 					VMSG_NL("  Doing ahead-of-time memory usage test");
 					// Make a quick-and-dirty attempt to force a bad_alloc iff
 					// we would have thrown one eventually as part of
@@ -774,11 +1027,11 @@ public:
 					VMSG_NL("");
 				}
 				VMSG_NL("Constructing suffix-array element generator");
-				KarkkainenBlockwiseSA<TStr> bsa(s, bmax, nthreads, dcv, seed, _sanity, _passMemExc, _verbose, outfile);
+				KarkkainenBlockwiseSA<TStr> bsa(s, bmax, nthreads, dcv, seed, _sanity, _passMemExc, _verbose, outfile, memLimit > 0, ckptBase);
 				assert(bsa.suffixItrIsReset());
 				assert_eq(bsa.size(), s.length()+1);
 				VMSG_NL("Converting suffix-array elements to index image");
-				buildToDisk(bsa, s, out1, out2);
+				buildToDisk(bsa, s, out1, out2, nthreads);
 				out1.flush(); out2.flush();
 				if(out1.fail() || out2.fail()) {
 					cerr << "An error occurred writing the index to disk.  Please check if the disk is full." << endl;
@@ -829,22 +1082,156 @@ public:
 		return ret;
 	}
 
+	/**
+	 * Return roughly how many bytes, not counting the joined string,
+	 * building an index over jlen characters takes at the peak with the
+	 * blockwise suffix-array builder and the given bmax and dcv.  Each
+	 * thread holds one bucket and the sorted buckets are streamed back
+	 * from disk; the difference-cover sample and ftab stay resident
+	 * throughout.  Nothing is allocated.
+	 */
+	static size_t blockwiseFootprint(TIndexOffU jlen, TIndexOffU bmax,
+	                                 int dcv, int nthreads, int ftabChars)
+	{
+		size_t sz = 0;
+		if(dcv != 0) {
+			// sPrime, sPrimeOrder and _isaPrime, plus the original
+			// sPrime when sanity checking
+			EList<uint32_t> ds = getDiffCover<uint32_t>(dcv, false, false);
+			sz += (size_t)(jlen / dcv) * ds.size() * 4 * OFF_SIZE;
+		}
+		// One bucket per thread, and the sample suffixes
+		sz += (size_t)max(nthreads, 1) * ((size_t)bmax + 100) * OFF_SIZE;
+		// Radix-sort keys and scratch for each thread's bucket
+		sz += (size_t)max(nthreads, 1) * min<size_t>(bmax, BUCKET_SORT_CUTOFF) *
+		      (2 * sizeof(uint64_t) + OFF_SIZE);
+		sz += (size_t)(jlen / max<TIndexOffU>(bmax - 1, 1) + 1) * OFF_SIZE;
+		return sz + buildToDiskFootprint(nthreads, ftabChars);
+	}
+
+	/**
+	 * Like blockwiseFootprint(), for the induced-sorting builder.
+	 */
+	static size_t saisFootprint(TIndexOffU jlen, int nthreads, int ftabChars) {
+		return SaisBlockwiseSA<BTRefString>::footprint(jlen) +
+		       buildToDiskFootprint(nthreads, ftabChars);
+	}
+
+	/**
+	 * Bytes buildToDisk() allocates for ftab, absorbFtab and the row
+	 * chunks in flight.
+	 */
+	static size_t buildToDiskFootprint(int nthreads, int ftabChars) {
+		size_t ftabLen = ((size_t)1 << (ftabChars * 2)) + 1;
+		size_t chunks = (nthreads > 1) ? (size_t)nthreads + 2 : 1;
+		size_t chunkSz = (size_t)ROWS_CHUNK_LEN * (2 * OFF_SIZE + 2);
+		return ftabLen * (OFF_SIZE + 1) + chunks * chunkSz;
+	}
+
+	/**
+	 * Return how much of a --memory-limit of memLimit bytes the
+	 * footprint estimates above may add up to; the rest is left for
+	 * allocator overhead and the small structures they don't count.
+	 */
+	static size_t memBudget(size_t memLimit) {
+		return memLimit - memLimit / 8;
+	}
+
+	/**
+	 * Construct a replica of in-memory Ebwt 'master' with its own
+	 * copies of the arrays consulted on every step of a search: the
+	 * BWT itself, fchr, ftab and eftab.  Everything else, including
+	 * offs, is shared with master, which must outlive the replica.
+	 * The copies are written by the calling thread, so on a NUMA
+	 * machine they end up in the memory of the node it runs on.
+	 */
+	Ebwt(const Ebwt& master, bool replica) :
+	    _toBigEndian(master._toBigEndian),
+	    _overrideOffRate(master._overrideOffRate),
+	    _overrideIsaRate(master._overrideIsaRate),
+	    _verbose(master._verbose),
+	    _passMemExc(master._passMemExc),
+	    _sanity(master._sanity),
+	    _isBt2Index(master._isBt2Index),
+	    _fw(master._fw),
+	    _in1(NULL),
+	    _in2(NULL),
+	    _in1Str(master._in1Str),
+	    _in2Str(master._in2Str),
+	    _zOff(master._zOff),
+	    _zEbwtByteOff(master._zEbwtByteOff),
+	    _zEbwtBpOff(master._zEbwtBpOff),
+	    _nPat(master._nPat),
+	    _nFrag(master._nFrag),
+	    _plen(master._plen),
+	    _rstarts(master._rstarts),
+	    _fchr(NULL),
+	    _ftab(NULL),
+	    _eftab(NULL),
+	    _offs(master._offs),
+	    _isa(master._isa),
+	    _ebwt(NULL),
+	    _useMm(false),
+	    useShmem_(false),
+	    _replica(true),
+	    _hugePages(master._hugePages),
+	    _refnames(master._refnames),
+	    mmFile1_(NULL),
+	    mmFile2_(NULL),
+	    _eh(master._eh),
+	    _packed(master._packed)
+	    Ebwt_STAT_INITS
+	{
+		assert(replica);
+		assert(master.isInMemory());
+#ifdef POPCNT_CAPABILITY
+		_usePOPCNTinstruction = master._usePOPCNTinstruction;
+#endif
+		_occSimd = master._occSimd;
+		_fchr = new TIndexOffU[5];
+		memcpy(_fchr, master._fchr, 5 * OFF_SIZE);
+		_ftab = _hugePages ? ALLOC_HUGE_U(_eh._ftabLen, "ftab[] replica") :
+		                     new TIndexOffU[_eh._ftabLen];
+		memcpy(_ftab, master._ftab, _eh._ftabLen * OFF_SIZE);
+		_eftab = new TIndexOffU[_eh._eftabLen];
+		memcpy(_eftab, master._eftab, _eh._eftabLen * OFF_SIZE);
+		_ebwt = _hugePages ? ALLOC_HUGE_U8(_eh._ebwtTotLen, "ebwt[] replica") :
+		                     new uint8_t[_eh._ebwtTotLen];
+		memcpy(_ebwt, master._ebwt, _eh._ebwtTotLen);
+		assert(repOk());
+	}
+
 	/// Destruct an Ebwt
 	~Ebwt() {
+		if(_replica) {
+			// The rest belongs to the master
+			delete[] _fchr;
+			if(_hugePages) FREE_HUGE(_ftab); else delete[] _ftab;
+			delete[] _eftab;
+			if(_hugePages) FREE_HUGE(_ebwt); else delete[] _ebwt;
+			return;
+		}
 		// Only free buffers if we're *not* using memory-mapped files
 		if(!_useMm) {
 			// Delete everything that was allocated in read(false, ...)
 			if(_fchr    != NULL) delete[] _fchr;
-			if(_ftab    != NULL) delete[] _ftab;
+			if(_ftab != NULL && _hugePages)
+				FREE_HUGE(_ftab);
+			else if(_ftab != NULL)
+				delete[] _ftab;
 			if(_eftab   != NULL) delete[] _eftab;
-			if(_offs != NULL && !useShmem_)
+			if(_offs != NULL && _hugePages)
+				FREE_HUGE(_offs);
+			else if(_offs != NULL && !useShmem_)
 				delete[] _offs;
 			else if(_offs != NULL && useShmem_)
 				FREE_SHARED(_offs);
 			if(_isa     != NULL) delete[] _isa;
 			if(_plen    != NULL) delete[] _plen;
 			if(_rstarts != NULL) delete[] _rstarts;
-			if(_ebwt != NULL && !useShmem_)
+			if(_ebwt != NULL && _hugePages)
+				FREE_HUGE(_ebwt);
+			else if(_ebwt != NULL && !useShmem_)
 				delete[] _ebwt;
 			else if(_ebwt != NULL && useShmem_)
 				FREE_SHARED(_ebwt);
@@ -884,6 +1271,7 @@ public:
 #ifdef POPCNT_CAPABILITY
     bool _usePOPCNTinstruction;
 #endif
+	int _occSimd; // OCC_SIMD_* kernel used by countUpTo/countUpToEx
 
 	/// Return true iff the Ebwt is currently in memory
 	bool isInMemory() const {
@@ -938,17 +1326,18 @@ public:
 	 */
 	void evictFromMemory() {
 		assert(isInMemory());
+		assert(!_replica);
 		if(!_useMm) {
 			delete[] _fchr;
-			delete[] _ftab;
+			if(_hugePages) FREE_HUGE(_ftab); else delete[] _ftab;
 			delete[] _eftab;
-			if(!useShmem_) delete[] _offs;
+			if(_hugePages) FREE_HUGE(_offs); else if(!useShmem_) delete[] _offs;
 			delete[] _isa;
 			// Keep plen; it's small and the client may want to query it
 			// even when the others are evicted.
 			//delete[] _plen;
 			delete[] _rstarts;
-			if(!useShmem_) delete[] _ebwt;
+			if(_hugePages) FREE_HUGE(_ebwt); else if(!useShmem_) delete[] _ebwt;
 		}
 		_fchr  = NULL;
 		_ftab  = NULL;
@@ -1122,8 +1511,16 @@ public:
 	// Building
 	template <typename TStr> static TStr join(EList<TStr>& l, uint32_t seed);
 	template <typename TStr> static TStr join(EList<FileBuf*>& l, EList<RefRecord>& szs, TIndexOffU sztot, const RefReadInParams& refparams, uint32_t seed);
+	void plensToDisk(const EList<RefRecord>& szs, const EList<uint32_t>& plens, ostream& out1);
 	template <typename TStr> void joinToDisk(EList<FileBuf*>& l, EList<RefRecord>& szs, EList<uint32_t>& plens, TIndexOffU sztot, const RefReadInParams& refparams, TStr& ret, ostream& out1, ostream& out2, uint32_t seed = 0);
-	template <typename TStr> void buildToDisk(InorderBlockwiseSA<TStr>& sa, const TStr& s, ostream& out1, ostream& out2);
+	template <typename TStr> void buildToDisk(InorderBlockwiseSA<TStr>& sa, const TStr& s, ostream& out1, ostream& out2, int nthreads);
+	template <typename TRows> void rowsToDisk(TRows& rows, ostream& out1, ostream& out2, int nthreads);
+	void assembleSides(RowChunk& c) const;
+	void rowsChunkToDisk(RowChunk& c, RowsToDiskState& st, ostream& out1, ostream& out2);
+#if (__cplusplus >= 201103L)
+	template <typename TRows> void rowsWorker(TRows* rows, EList<RowChunk>* slots, RowsPipeline* p) const;
+	void rowsWriter(EList<RowChunk>* slots, RowsPipeline* p, RowsToDiskState* st, ostream* out1, ostream* out2);
+#endif
 
 	// I/O
 	void readIntoMemory(int needEntireReverse, bool justHeader, EbwtParams *params, bool mmSweep, bool loadNames, bool startVerbose);
@@ -1140,17 +1537,24 @@ public:
 
 	// Searching and reporting
 	void joinedToTextOff(TIndexOffU qlen, TIndexOffU off, TIndexOffU& tidx, TIndexOffU& textoff, TIndexOffU& tlen) const;
-	inline bool report(const BTDnaString& query, BTString* quals, BTString* name, const EList<TIndexOffU>& mmui32, const EList<uint8_t>& refcs, size_t numMms, TIndexOffU off, TIndexOffU top, TIndexOffU bot, uint32_t qlen, int stratum, uint16_t cost, uint32_t patid, uint32_t seed, const EbwtSearchParams& params) const;
-	inline bool reportChaseOne(const BTDnaString& query, BTString* quals, BTString* name, const EList<TIndexOffU>& mmui32, const EList<uint8_t>& refcs, size_t numMms, TIndexOffU i, TIndexOffU top, TIndexOffU bot, uint32_t qlen, int stratum, uint16_t cost, uint32_t patid, uint32_t seed, const EbwtSearchParams& params, SideLocus *l = NULL) const;
+	inline bool report(const Read& rd, const EList<TIndexOffU>& mmui32, const EList<uint8_t>& refcs, size_t numMms, TIndexOffU off, TIndexOffU top, TIndexOffU bot, uint32_t qlen, int stratum, uint16_t cost, uint32_t patid, uint32_t seed, const EbwtSearchParams& params) const;
+	inline bool reportChaseOne(const Read& rd, const EList<TIndexOffU>& mmui32, const EList<uint8_t>& refcs, size_t numMms, TIndexOffU i, TIndexOffU top, TIndexOffU bot, uint32_t qlen, int stratum, uint16_t cost, uint32_t patid, uint32_t seed, const EbwtSearchParams& params, SideLocus *l = NULL) const;
 	inline int rowL(const SideLocus& l) const;
 	inline TIndexOffU countUpTo(const SideLocus& l, int c) const;
 	inline void countUpToEx(const SideLocus& l, TIndexOffU* pairs) const;
+	inline void countUpToEx2(const SideLocus& l1, const SideLocus& l2, TIndexOffU* pairs1, TIndexOffU* pairs2) const;
+#ifdef OCC_SIMD
+	inline void occCountEx(const uint8_t *side, int nbytes, TIndexOffU* pairs) const;
+#endif
 	inline TIndexOffU countFwSide(const SideLocus& l, int c) const;
 	inline void countFwSideEx(const SideLocus& l, TIndexOffU *pairs) const;
+	inline void finishFwSideEx(const SideLocus& l, TIndexOffU *pairs) const;
 	inline TIndexOffU countBwSide(const SideLocus& l, int c) const;
 	inline void countBwSideEx(const SideLocus& l, TIndexOffU *pairs) const;
+	inline void finishBwSideEx(const SideLocus& l, TIndexOffU *pairs) const;
 	inline TIndexOffU countBt2Side(const SideLocus& l, int c) const;
 	inline void countBt2SideEx(const SideLocus& l, TIndexOffU *pairs) const;
+	inline void finishBt2SideEx(const SideLocus& l, TIndexOffU *pairs) const;
 	inline TIndexOffU mapLF(const SideLocus& l ASSERT_ONLY(, bool overrideSanity = false)) const;
 	inline void mapLFEx(const SideLocus& l, TIndexOffU *pairs ASSERT_ONLY(, bool overrideSanity = false)) const;
 	inline void mapLFEx(const SideLocus& ltop, const SideLocus& lbot, TIndexOffU *tops, TIndexOffU *bots ASSERT_ONLY(, bool overrideSanity = false)) const;
@@ -1227,6 +1631,8 @@ public:
 	uint8_t*   _ebwt;
 	bool       _useMm;        /// use memory-mapped files to hold the index
 	bool       useShmem_;     /// use shared memory to hold large parts of the index
+	bool       _replica;      /// only _ebwt, _fchr, _ftab and _eftab are ours
+	bool       _hugePages;    /// _ebwt, _ftab and _offs are in huge pages
 	EList<string> _refnames; /// names of the reference sequences
 	char *mmFile1_;
 	char *mmFile2_;
@@ -1284,9 +1690,7 @@ public:
 	/**
 	 * Report a hit.  Returns true iff caller can call off the search.
 	 */
-	bool reportHit(const BTDnaString& query, // read sequence
-	               BTString* quals, // read quality values
-	               BTString* name,  // read name
+	bool reportHit(const Read& rd,      // read that aligned
 	               bool ebwtFw,         // whether index is forward (true) or mirror (false)
 	               const EList<TIndexOffU>& mmui32, // mismatch list
 	               const EList<uint8_t>& refcs,  // reference characters
@@ -1313,53 +1717,42 @@ public:
 			}
 		}
 #endif
-		// If ebwtFw is true, then 'query' and 'quals' are reversed
-		// If _fw is false, then 'query' and 'quals' are reverse complemented
-		assert(quals != NULL);
-		assert(name != NULL);
 		assert_eq(mmui32.size(), refcs.size());
 		assert_leq(numMms, mmui32.size());
 		assert_gt(qlen, 0);
+		assert_eq(qlen, rd.length());
 		Hit hit;
+		hit.rd = &rd;
+		hit.fw = _fw;
 		hit.stratum = stratum;
 		hit.cost = cost;
-		hit.patSeq = query;
-		hit.quals = *quals;
-		if(!ebwtFw) {
-			// Re-reverse the pattern and the quals back to how they
-			// appeared in the read file
-			hit.patSeq.reverse();
-			hit.quals.reverse();
-		}
-		// Turn the mmui32 and refcs arrays into the mm FixedBitset and
-		// the refc vector
-		hit.refcs.resize(qlen);
-		hit.refcs.fillZero();
+		// Turn the mmui32 and refcs arrays into edits, with offsets
+		// from the 5' end
+		Edit *eds = hit.allocEdits(numMms, sink().editPool());
 		for(size_t i = 0; i < numMms; i++) {
-			if (ebwtFw != _fw) {
-				// The 3' end is on the left but the mm vector encodes
-				// mismatches w/r/t the 5' end, so we flip
-				uint32_t off = qlen - mmui32[i] - 1;
-				hit.mms.set(off);
-				hit.refcs[off] = refcs[i];
-			} else {
-				hit.mms.set(mmui32[i]);
-				hit.refcs[mmui32[i]] = refcs[i];
-			}
+			// If ebwtFw != _fw, the 3' end is on the left but the mm
+			// vector encodes mismatches w/r/t the 5' end, so we flip
+			uint32_t off = (ebwtFw != _fw) ? (uint32_t)(qlen - mmui32[i] - 1) : (uint32_t)mmui32[i];
+			eds[i] = Edit(off, refcs[i]);
 		}
+		hit.sortEdits();
 		// Check the hit against the original text, if it's available
 		if(_texts.size() > 0) {
 			assert_lt(h.first, _texts.size());
-			FixedBitset<1024> diffs;
+			FixedBitset<1024> diffs, mms;
+			for(size_t i = 0; i < hit.numEdits(); i++) {
+				mms.set(hit.edit(i).pos);
+			}
 			// This type of check assumes that only mismatches are
 			// possible.  If indels are possible, then we either need
 			// the caller to provide information about indel locations,
 			// or we need to extend this to a more complicated check.
 			assert_leq(h.second + qlen, _texts[h.first].length());
+			const BTDnaString& seq = hit.seq();
 			for(size_t i = 0; i < qlen; i++) {
 				assert_neq(4, (int)_texts[h.first][h.second + i]);
 				// Forward pattern appears at h
-				if((int)hit.patSeq[i] != (int)_texts[h.first][h.second + i]) {
+				if((int)seq[i] != (int)_texts[h.first][h.second + i]) {
 					uint32_t qoff = (uint32_t)i;
 					// if ebwtFw != _fw the 3' end is on on the
 					// left end of the pattern, but the diff vector
@@ -1369,11 +1762,11 @@ public:
 					else     diffs.set(qlen - qoff - 1);
 				}
 			}
-			if(diffs != hit.mms) {
+			if(diffs != mms) {
 				// Oops, mismatches were not where we expected them;
 				// print a diagnostic message before asserting
-				cerr << "Expected " << hit.mms.str() << " mismatches, got " << diffs.str() << endl;
-				cerr << "  Pat:  " << hit.patSeq << endl;
+				cerr << "Expected " << mms.str() << " mismatches, got " << diffs.str() << endl;
+				cerr << "  Pat:  " << seq << endl;
 				cerr << "  Tseg: ";
 				for(size_t i = 0; i < qlen; i++) {
 					cerr << _texts[h.first][h.second + i];
@@ -1387,13 +1780,11 @@ public:
 				cerr << "  FW: " << _fw << endl;
 				cerr << "  Ebwt FW: " << ebwtFw << endl;
 			}
-			if(diffs != hit.mms) assert(false);
+			if(diffs != mms) assert(false);
 		}
 		hit.h = h;
 		hit.patId = ((patid == 0xffffffff) ? _patid : patid);
-		hit.patName = *name;
 		hit.mh = mh;
-		hit.fw = _fw;
 		hit.mfw = mfw;
 		hit.mlen = mlen;
 		hit.oms = oms;
@@ -1582,10 +1973,10 @@ void Ebwt::printRangeBw(uint32_t begin, uint32_t end) const {
 void Ebwt::sanityCheckUpToSide(TIndexOff upToSide) const {
 	assert(isInMemory());
 	TIndexOffU occ[] = {0, 0, 0, 0};
-	ASSERT_ONLY(TIndexOffU occ_save[] = {0, 0});
+	ASSERT_ONLY(TIndexOffU occ_save[] = {0, 0, 0, 0});
 	TIndexOffU cur = 0; // byte pointer
 	const EbwtParams& eh = this->_eh;
-	bool fw = false;
+	bool fw = eh._isBt2Index;
 	while(cur < (TIndexOffU)(upToSide * eh._sideSz)) {
 		assert_leq(cur + eh._sideSz, eh._ebwtTotLen);
 		for(uint32_t i = 0; i < eh._sideBwtSz; i++) {
@@ -1599,7 +1990,17 @@ void Ebwt::sanityCheckUpToSide(TIndexOff upToSide) const {
 			assert_eq(0, (occ[0] + occ[1] + occ[2] + occ[3]) % 4);
 		}
 		assert_eq(0, (occ[0] + occ[1] + occ[2] + occ[3]) % eh._sideBwtLen);
-		if(fw) {
+		if(eh._isBt2Index) {
+			// Interleaved side; the four counts cover everything up to
+			// the start of the side, so check them against the counts
+			// saved from the previous iteration
+			ASSERT_ONLY(TIndexOffU *u32ebwt = reinterpret_cast<TIndexOffU*>(&this->_ebwt[cur + eh._sideBwtSz]));
+			assert(u32ebwt[0] == occ_save[0] || u32ebwt[0] == occ_save[0]-1);
+			assert_eq(u32ebwt[1], occ_save[1]);
+			assert_eq(u32ebwt[2], occ_save[2]);
+			assert_eq(u32ebwt[3], occ_save[3]);
+			ASSERT_ONLY(for(int i = 0; i < 4; i++) occ_save[i] = occ[i]);
+		} else if(fw) {
 			// Finished forward bucket; check saved [G] and [T]
 			// against the two uint32_ts encoded here
 			ASSERT_ONLY(TIndexOffU *u32ebwt = reinterpret_cast<TIndexOffU*>(&this->_ebwt[cur + eh._sideBwtSz]));
@@ -1900,6 +2301,14 @@ inline TIndexOffU Ebwt::countUpTo(const SideLocus& l, int c) const {
 	TIndexOffU cCnt = 0;
 	const uint8_t *side = l.side(this->_ebwt);
 	int i = 0;
+#ifdef OCC_SIMD
+	if(_occSimd != OCC_SIMD_NONE) {
+		TIndexOffU arrs[4] = {0, 0, 0, 0};
+		occCountEx(side, l._by, arrs);
+		cCnt = arrs[c];
+		i = l._by;
+	}
+#endif
 #if 1
     #ifdef POPCNT_CAPABILITY
     if ( _usePOPCNTinstruction) {
@@ -1970,6 +2379,12 @@ inline void Ebwt::countUpToEx(const SideLocus& l, TIndexOffU* arrs) const {
 	// vectorized/SSE-ized in case that helps.
 	const uint8_t *side = l.side(this->_ebwt);
 
+#ifdef OCC_SIMD
+	if(_occSimd != OCC_SIMD_NONE) {
+		occCountEx(side, l._by, arrs);
+		i = l._by;
+	}
+#endif
 #ifdef POPCNT_CAPABILITY
     if (_usePOPCNTinstruction) {
         for(; i+7 < l._by; i += 8) {
@@ -2025,6 +2440,58 @@ inline void Ebwt::countUpToEx(const SideLocus& l, TIndexOffU* arrs) const {
 #endif
 }
 
+#ifdef OCC_SIMD
+/**
+ * Add counts of all four chars in the first nbytes bytes of the side to
+ * arrs, using whichever vector kernel was selected at construction.
+ */
+inline void Ebwt::occCountEx(const uint8_t *side, int nbytes, TIndexOffU* arrs) const {
+	if(_occSimd == OCC_SIMD_AVX512) {
+		occCountAvx512(side, nbytes, arrs);
+	} else {
+		assert_eq(OCC_SIMD_AVX2, _occSimd);
+		occCountAvx2(side, nbytes, arrs);
+	}
+}
+#endif
+
+/**
+ * Like countUpToEx, but for two loci in the same side.  With a vector
+ * kernel available, the side is scanned once for both; otherwise this
+ * is just two calls to countUpToEx.
+ */
+inline void Ebwt::countUpToEx2(const SideLocus& l1,
+                               const SideLocus& l2,
+                               TIndexOffU* arrs1,
+                               TIndexOffU* arrs2) const
+{
+	assert_eq(l1._sideByteOff, l2._sideByteOff);
+#ifdef OCC_SIMD
+	if(_occSimd != OCC_SIMD_NONE) {
+		const uint8_t *side = l1.side(this->_ebwt);
+		if(_occSimd == OCC_SIMD_AVX512) {
+			occCountAvx512Ex(side, l1._by, arrs1, l2._by, arrs2);
+		} else {
+			occCountAvx2Ex(side, l1._by, arrs1, l2._by, arrs2);
+		}
+		// Count occurences in the rest of each byte
+		if(l1._bp > 0) {
+			for(int c = 0; c < 4; c++) {
+				arrs1[c] += cCntLUT_4[(int)l1._bp][c][side[l1._by]];
+			}
+		}
+		if(l2._bp > 0) {
+			for(int c = 0; c < 4; c++) {
+				arrs2[c] += cCntLUT_4[(int)l2._bp][c][side[l2._by]];
+			}
+		}
+		return;
+	}
+#endif
+	countUpToEx(l1, arrs1);
+	countUpToEx(l2, arrs2);
+}
+
 /**
  * Count all occurrences of character c from the beginning of the
  * forward side to <by,bp> and add in the occ[] count up to the side
@@ -2084,6 +2551,15 @@ inline void Ebwt::countFwSideEx(const SideLocus& l, TIndexOffU* arrs) const
 	assert_lt(l._bp, 4);
 	assert_geq(l._bp, 0);
 	countUpToEx(l, arrs);
+	finishFwSideEx(l, arrs);
+}
+
+/**
+ * Given counts from countUpToEx for a locus in a forward side, discount
+ * the '$' and add in the occ[] counts up to the side break.
+ */
+inline void Ebwt::finishFwSideEx(const SideLocus& l, TIndexOffU* arrs) const
+{
 #ifndef NDEBUG
 	assert_leq(arrs[0], this->_fchr[1]); // can't have jumped into next char's section
 	assert_leq(arrs[1], this->_fchr[2]); // can't have jumped into next char's section
@@ -2185,8 +2661,17 @@ inline void Ebwt::countBwSideEx(const SideLocus& l, TIndexOffU* arrs) const {
 	assert_geq(l._by, 0);
 	assert_lt(l._bp, 4);
 	assert_geq(l._bp, 0);
-	const uint8_t *side = l.side(this->_ebwt);
 	countUpToEx(l, arrs);
+	finishBwSideEx(l, arrs);
+}
+
+/**
+ * Given counts from countUpToEx for a locus in a backward side, count
+ * the char at the locus itself, discount the '$' and subtract from the
+ * occ[] counts up to the side break.
+ */
+inline void Ebwt::finishBwSideEx(const SideLocus& l, TIndexOffU* arrs) const {
+	const uint8_t *side = l.side(this->_ebwt);
 	arrs[rowL(l)]++;
 	assert_leq(arrs[0], this->_eh._sideBwtLen);
 	assert_leq(arrs[1], this->_eh._sideBwtLen);
@@ -2296,6 +2781,14 @@ inline void Ebwt::countBt2SideEx(const SideLocus& l, TIndexOffU* arrs) const {
 	assert_range(0, (int)this->_eh._sideBwtSz-1, (int)l._by);
 	assert_range(0, 3, (int)l._bp);
 	countUpToEx(l, arrs);
+	finishBt2SideEx(l, arrs);
+}
+
+/**
+ * Given counts from countUpToEx for a locus in a Bowtie 2 side,
+ * discount the '$' and add in the occ[] counts stored in the side.
+ */
+inline void Ebwt::finishBt2SideEx(const SideLocus& l, TIndexOffU* arrs) const {
 	if(l._sideByteOff <= _zEbwtByteOff && l._sideByteOff + l._by >= _zEbwtByteOff) {
 		// Adjust for the fact that we represented $ with an 'A', but
 		// shouldn't count it as an 'A' here
@@ -2337,8 +2830,6 @@ inline void Ebwt::mapLFEx(const SideLocus& ltop,
                                 ASSERT_ONLY(, bool overrideSanity)
                                 ) const
 {
-	// TODO: Where there's overlap, reuse the count for the overlapping
-	// portion
 #ifdef EBWT_STATS
 	const_cast<Ebwt*>(this)->mapLFExs_++;
 #endif
@@ -2346,20 +2837,36 @@ inline void Ebwt::mapLFEx(const SideLocus& ltop,
 	assert_eq(0, tops[1]); assert_eq(0, bots[1]);
 	assert_eq(0, tops[2]); assert_eq(0, bots[2]);
 	assert_eq(0, tops[3]); assert_eq(0, bots[3]);
-	if(ltop._fw) {
-		 // Forward side
-		!_eh._isBt2Index ? countFwSideEx(ltop, tops)
-		                 : countBt2SideEx(ltop, tops);
-	} else {
-		countBwSideEx(ltop, tops); // Backward side
-	}
-
-	if(lbot._fw) {
-		// Forward side
-		!_eh._isBt2Index ? countFwSideEx(lbot, bots)
-		                 : countBt2SideEx(lbot, bots);
+	if(_occSimd != OCC_SIMD_NONE && ltop._sideByteOff == lbot._sideByteOff) {
+		// Both loci are in the same side; scan it once for both
+		countUpToEx2(ltop, lbot, tops, bots);
+		if(ltop._fw) {
+			if(!_eh._isBt2Index) {
+				finishFwSideEx(ltop, tops);
+				finishFwSideEx(lbot, bots);
+			} else {
+				finishBt2SideEx(ltop, tops);
+				finishBt2SideEx(lbot, bots);
+			}
+		} else {
+			finishBwSideEx(ltop, tops);
+			finishBwSideEx(lbot, bots);
+		}
 	} else {
-		countBwSideEx(lbot, bots); // Backward side
+		if(ltop._fw) {
+			// Forward side
+			!_eh._isBt2Index ? countFwSideEx(ltop, tops)
+			                 : countBt2SideEx(ltop, tops);
+		} else {
+			countBwSideEx(ltop, tops); // Backward side
+		}
+		if(lbot._fw) {
+			// Forward side
+			!_eh._isBt2Index ? countFwSideEx(lbot, bots)
+			                 : countBt2SideEx(lbot, bots);
+		} else {
+			countBwSideEx(lbot, bots); // Backward side
+		}
 	}
 #ifndef NDEBUG
 	if(_sanity && !overrideSanity) {
@@ -2631,9 +3138,7 @@ void Ebwt::joinedToTextOff(TIndexOffU qlen, TIndexOffU off,
  * Report a potential match at offset 'off' with pattern length
  * 'qlen'.  Filter out spurious matches that span texts.
  */
-inline bool Ebwt::report(const BTDnaString& query,
-			 BTString* quals,
-			 BTString* name,
+inline bool Ebwt::report(const Read& rd,
 			 const EList<TIndexOffU>& mmui32,
 			 const EList<uint8_t>& refcs,
 			 size_t numMms,
@@ -2658,9 +3163,7 @@ inline bool Ebwt::report(const BTDnaString& query,
 		return false;
 	}
 	return params.reportHit(
-			query,                    // read sequence
-			quals,                    // read quality values
-			name,                     // read name
+			rd,                       // read
 			_fw,                      // true = index is forward; false = mirror
 			mmui32,                   // mismatch positions
 			refcs,                    // reference characters for mms
@@ -2681,6 +3184,7 @@ inline bool Ebwt::report(const BTDnaString& query,
 }
 
 #include "row_chaser.h"
+#include "ebwt_append.h"
 
 /**
  * Report a result.  Involves walking backwards along the original
@@ -2689,9 +3193,7 @@ inline bool Ebwt::report(const BTDnaString& query,
  * into the original string can be read directly from the this->_offs[]
  * array.
  */
-inline bool Ebwt::reportChaseOne(const BTDnaString& query,
-                                       BTString* quals,
-                                       BTString* name,
+inline bool Ebwt::reportChaseOne(const Read& rd,
                                        const EList<TIndexOffU>& mmui32,
                                        const EList<uint8_t>& refcs,
                                        size_t numMms,
@@ -2749,7 +3251,7 @@ inline bool Ebwt::reportChaseOne(const BTDnaString& query,
 		assert_eq(rcoff, off);
 	}
 #endif
-	return report(query, quals, name, mmui32, refcs, numMms, off, top, bot,
+	return report(rd, mmui32, refcs, numMms, off, top, bot,
 	              qlen, stratum, cost, patid, seed, params);
 }
 
@@ -2970,17 +3472,32 @@ void Ebwt::readIntoMemory(
 			throw 1;
 		}
 	} else entireRev = true;
+	if(flags < 0 && ((-flags) & ~EBWT_KNOWN_FLAGS) != 0) {
+		cerr << "Error: Index file " << _in1Str << " uses features this version of bowtie" << endl
+		     << "doesn't support.  Please upgrade bowtie, or rebuild the index with this" << endl
+		     << "version of bowtie-build." << endl;
+		throw 1;
+	}
+	bool interleaved = _isBt2Index || (flags < 0 && (((-flags) & EBWT_INTERLEAVED) != 0));
 	bytesRead += 4;
+	if(flags < 0 && (((-flags) & EBWT_INTERLEAVED) != 0)) {
+		if(readU<TIndexOffU>(_in1, switchEndian) != EBWT_INTERLEAVED_MARK) {
+			cerr << "Error: Index file " << _in1Str << " has the interleaved flag set but not" << endl
+			     << "the word that goes with it; the file may be corrupt.  Please re-build the index." << endl;
+			throw 1;
+		}
+		bytesRead += OFF_SIZE;
+	}
 
 	// Create a new EbwtParams from the entries read from primary stream
 	EbwtParams *eh;
 	bool deleteEh = false;
 	if(params != NULL) {
-		params->init(len, lineRate, linesPerSide, offRate, isaRate, ftabChars, entireRev, _isBt2Index);
+		params->init(len, lineRate, linesPerSide, offRate, isaRate, ftabChars, entireRev, interleaved);
 		if(_verbose || startVerbose) params->print(cerr);
 		eh = params;
 	} else {
-		eh = new EbwtParams(len, lineRate, linesPerSide, offRate, isaRate, ftabChars, entireRev, _isBt2Index);
+		eh = new EbwtParams(len, lineRate, linesPerSide, offRate, isaRate, ftabChars, entireRev, interleaved);
 		deleteEh = true;
 	}
 
@@ -3124,7 +3641,11 @@ void Ebwt::readIntoMemory(
 			}
 		} else {
 			try {
-				this->_ebwt = new uint8_t[eh->_ebwtTotLen];
+				if(_hugePages) {
+					this->_ebwt = ALLOC_HUGE_U8(eh->_ebwtTotLen, "ebwt[]");
+				} else {
+					this->_ebwt = new uint8_t[eh->_ebwtTotLen];
+				}
 			} catch(bad_alloc& e) {
 				cerr << "Out of memory allocating the ebwt[] array for the Bowtie index.  Please try" << endl
 				     << "again on a computer with more memory." << endl;
@@ -3152,10 +3673,12 @@ void Ebwt::readIntoMemory(
 			}
 			if(switchEndian) {
 				uint8_t *side = this->_ebwt;
+				const int ncums = eh->_isBt2Index ? 4 : 2;
 				for(size_t i = 0; i < eh->_numSides; i++) {
-					TIndexOffU *cums = reinterpret_cast<TIndexOffU*>(side + eh->_sideSz - 2*OFF_SIZE);
-					cums[0] = endianSwapU(cums[0]);
-					cums[1] = endianSwapU(cums[1]);
+					TIndexOffU *cums = reinterpret_cast<TIndexOffU*>(side + eh->_sideSz - ncums*OFF_SIZE);
+					for(int j = 0; j < ncums; j++) {
+						cums[j] = endianSwapU(cums[j]);
+					}
 					side += this->_eh._sideSz;
 				}
 			}
@@ -3202,7 +3725,11 @@ void Ebwt::readIntoMemory(
 			fseeko(_in1, eh->_ftabLen*OFF_SIZE, SEEK_CUR);
 #endif
 		} else {
-			this->_ftab = new TIndexOffU[eh->_ftabLen];
+			if(_hugePages) {
+				this->_ftab = ALLOC_HUGE_U(eh->_ftabLen, "ftab[]");
+			} else {
+				this->_ftab = new TIndexOffU[eh->_ftabLen];
+			}
 			if(switchEndian) {
 				for(TIndexOffU i = 0; i < eh->_ftabLen; i++)
 					this->_ftab[i] = readU<TIndexOffU>(_in1, switchEndian);
@@ -3281,7 +3808,11 @@ void Ebwt::readIntoMemory(
 		if(!useShmem_) {
 			// Allocate offs_
 			try {
-				this->_offs = new TIndexOffU[offsLenSampled];
+				if(_hugePages) {
+					this->_offs = ALLOC_HUGE_U(offsLenSampled, "offs[]");
+				} else {
+					this->_offs = new TIndexOffU[offsLenSampled];
+				}
 			} catch(bad_alloc& e) {
 				cerr << "Out of memory allocating the offs[] array  for the Bowtie index." << endl
 					 << "Please try again on a computer with more memory." << endl;
@@ -3472,12 +4003,16 @@ readEbwtRefnames(FILE* fin, EList<string>& refnames) {
 	// BTL: chunkRate is now deprecated
 	int32_t flags = readI<int32_t>(fin, switchEndian);
 	bool entireReverse = false;
+	bool isBt2Index = false;
 	if(flags < 0) {
 		entireReverse = (((-flags) & EBWT_ENTIRE_REV) != 0);
+		isBt2Index = (((-flags) & EBWT_INTERLEAVED) != 0);
+	}
+	if(isBt2Index) {
+		readU<TIndexOffU>(fin, switchEndian); // EBWT_INTERLEAVED_MARK
 	}
 
 	// Create a new EbwtParams from the entries read from primary stream
-	bool isBt2Index = false;
 	if (gEbwt_ext == "bt2" || gEbwt_ext == "bt2") {
 		isBt2Index = true;
 	}
@@ -3620,7 +4155,11 @@ void Ebwt::writeFromMemory(bool justHeader,
 	writeI<int32_t>(out1, eh._ftabChars,    be); // number of 2-bit chars used to address ftab
 	int32_t flags = 1;
 	if(eh._entireReverse) flags |= EBWT_ENTIRE_REV;
+	if(eh._isBt2Index) flags |= EBWT_INTERLEAVED;
 	writeI<int32_t>(out1, -flags, be); // BTL: chunkRate is now deprecated
+	if(eh._isBt2Index) {
+		writeU<TIndexOffU>(out1, EBWT_INTERLEAVED_MARK, be); // turns away older readers
+	}
 
 	if(!justHeader) {
 		assert(isInMemory());
@@ -3807,37 +4346,14 @@ TStr Ebwt::join(EList<FileBuf*>& l,
 }
 
 /**
- * Join several text strings together according to the text-chunking
- * scheme specified in the EbwtParams.  Ebwt fields calculated in this
- * function are written directly to disk.
- *
- * It is assumed, but not required, that the header values have already
- * been written to 'out1' before this function is called.
- *
- * The static member Ebwt::join just returns a joined version of a
- * list of strings without building any of the auxiliary arrays.
- * Because the pseudo-random number generator is the same, we expect
- * this function and the static function to give the same result given
- * the same seed.
+ * Count the sequences and fragments described by szs and write their
+ * number, the length of each sequence (from plens) and the number of
+ * fragments to out1.  plen[] is kept for szsToDisk().
  */
-template<typename TStr>
-void Ebwt::joinToDisk(
-	EList<FileBuf*>& l,
-	EList<RefRecord>& szs,
-	EList<uint32_t>& plens,
-	TIndexOffU sztot,
-	const RefReadInParams& refparams,
-	TStr& ret,
-	ostream& out1,
-	ostream& out2,
-	uint32_t seed)
+void Ebwt::plensToDisk(const EList<RefRecord>& szs,
+                       const EList<uint32_t>& plens,
+                       ostream& out1)
 {
-	RandomSource rand; // reproducible given same seed
-	rand.init(seed);
-	RefReadInParams rpcp = refparams;
-	assert_gt(szs.size(), 0);
-	assert_gt(l.size(), 0);
-	assert_gt(sztot, 0);
 	// Not every fragment represents a distinct sequence - many
 	// fragments may correspond to a single sequence.  Count the
 	// number of sequences here by counting the number of "first"
@@ -3867,7 +4383,7 @@ void Ebwt::joinToDisk(
 	try {
 		this->_plen = new TIndexOffU[this->_nPat];
 	} catch(bad_alloc& e) {
-		cerr << "Out of memory allocating plen[] in Ebwt::join()"
+		cerr << "Out of memory allocating plen[] in Ebwt::plensToDisk()"
 		     << " at " << __FILE__ << ":" << __LINE__ << endl;
 		throw e;
 	}
@@ -3878,6 +4394,41 @@ void Ebwt::joinToDisk(
 	}
 	// Write the number of fragments
 	writeU<TIndexOffU>(out1, this->_nFrag, this->toBe());
+}
+
+/**
+ * Join several text strings together according to the text-chunking
+ * scheme specified in the EbwtParams.  Ebwt fields calculated in this
+ * function are written directly to disk.
+ *
+ * It is assumed, but not required, that the header values have already
+ * been written to 'out1' before this function is called.
+ *
+ * The static member Ebwt::join just returns a joined version of a
+ * list of strings without building any of the auxiliary arrays.
+ * Because the pseudo-random number generator is the same, we expect
+ * this function and the static function to give the same result given
+ * the same seed.
+ */
+template<typename TStr>
+void Ebwt::joinToDisk(
+	EList<FileBuf*>& l,
+	EList<RefRecord>& szs,
+	EList<uint32_t>& plens,
+	TIndexOffU sztot,
+	const RefReadInParams& refparams,
+	TStr& ret,
+	ostream& out1,
+	ostream& out2,
+	uint32_t seed)
+{
+	RandomSource rand; // reproducible given same seed
+	rand.init(seed);
+	RefReadInParams rpcp = refparams;
+	assert_gt(szs.size(), 0);
+	assert_gt(l.size(), 0);
+	assert_gt(sztot, 0);
+	plensToDisk(szs, plens, out1);
 	TIndexOffU seqsRead = 0;
 	ASSERT_ONLY(TIndexOffU szsi = 0);
 	ASSERT_ONLY(TIndexOffU entsWritten = 0);
@@ -3957,6 +4508,66 @@ void Ebwt::joinToDisk(
 }
 
 
+/**
+ * Presents the suffix array of a string, as it's produced by an
+ * InorderBlockwiseSA, as a sequence of rows of the BWT matrix for
+ * Ebwt::rowsToDisk().  Only fetching suffix-array elements is done in
+ * order; looking up the BWT character and ftab index of each is left
+ * to resolve(), which can run on any thread.
+ */
+template<typename TStr>
+class SuffixArrayRows {
+public:
+	SuffixArrayRows(InorderBlockwiseSA<TStr>& sa, const TStr& s, int ftabChars) :
+		sa_(sa), s_(s), len_((TIndexOffU)s.length()), ftabChars_(ftabChars) { }
+
+	/**
+	 * Take the suffix-array elements of the next c.nsa rows.
+	 */
+	void fill(RowChunk& c) {
+		for(TIndexOffU i = 0; i < c.nsa; i++) {
+			c.offs[i] = sa_.nextSuffix();
+			// (that might have triggered sa to calc next suf block)
+		}
+	}
+
+	/**
+	 * Set the BWT character of each row of c, or -1 if its suffix is
+	 * the whole text (the BWT character is the '$'), and its ftab
+	 * index: the first ftabChars characters of its suffix packed 2
+	 * bits apiece, or OFF_MASK if the suffix is shorter than that.
+	 */
+	void resolve(RowChunk& c) const {
+		for(TIndexOffU i = 0; i < c.nsa; i++) {
+			TIndexOffU saElt = c.offs[i];
+			TIndexOffU sufInt = OFF_MASK;
+			if((len_-saElt) >= (TIndexOffU)ftabChars_) {
+				// Turn the first ftabChars characters of the
+				// suffix into an integer index into ftab
+				sufInt = 0;
+				for(int j = 0; j < ftabChars_; j++) {
+					sufInt <<= 2;
+					assert_lt((TIndexOffU)j, len_-saElt);
+					sufInt |= (unsigned char)(s_[saElt+j]);
+				}
+			}
+			c.sufInts[i] = sufInt;
+			if(saElt == 0) {
+				c.bwt[i] = -1;
+			} else {
+				c.bwt[i] = (int8_t)s_[saElt-1];
+				assert_lt(c.bwt[i], 4);
+			}
+		}
+	}
+
+private:
+	InorderBlockwiseSA<TStr>& sa_;
+	const TStr& s_;
+	TIndexOffU len_;
+	int ftabChars_;
+};
+
 /**
  * Build an Ebwt from a string 's' and its suffix array 'sa' (which
  * might actually be a suffix array *builder* that builds blocks of the
@@ -3985,313 +4596,420 @@ template<typename TStr>
 void Ebwt::buildToDisk(InorderBlockwiseSA<TStr>& sa,
 		       const TStr& s,
 		       ostream& out1,
-		       ostream& out2)
+		       ostream& out2,
+		       int nthreads)
+{
+	assert_eq(s.length()+1, sa.size());
+	assert_eq(s.length(), this->_eh._len);
+	assert(sa.suffixItrIsReset());
+	ProfilePhase phase("build_to_disk");
+	SuffixArrayRows<TStr> rows(sa, s, this->_eh._ftabChars);
+	rowsToDisk(rows, out1, out2, nthreads);
+}
+
+/**
+ * Fill in the sides of chunk c from the BWT characters of its rows.
+ * The occurrence counts stored in the sides count from the start of
+ * the chunk; rowsChunkToDisk() adds the counts before it.  Only reads
+ * the Ebwt, so chunks can be assembled on several threads at once.
+ */
+inline void Ebwt::assembleSides(RowChunk& c) const {
+	const EbwtParams& eh = this->_eh;
+	const TIndexOffU sideSz = eh._sideSz;
+	const TIndexOffU sideBwtLen = eh._sideBwtLen;
+	const TIndexOffU nsides = c.nrows / sideBwtLen;
+	const TIndexOffU nwords = sideSz / OFF_SIZE;
+	assert_eq(0, c.nrows % sideBwtLen);
+	memset(c.sides.ptr(), 0, nsides * sideSz);
+	for(int i = 0; i < 4; i++) {
+		c.cnt[i] = c.fchr[i] = 0;
+	}
+	c.zOff = OFF_MASK;
+	TIndexOffU i = 0;
+	for(TIndexOffU sd = 0; sd < nsides; sd++) {
+		uint8_t *side = c.sides.ptr() + sd * sideSz;
+		TIndexOffU *u32side = reinterpret_cast<TIndexOffU*>(side);
+		// Sides alternate backward and forward, starting with a
+		// backward one, except in the interleaved layout where every
+		// side is a forward side
+		bool fw = eh._isBt2Index || (((c.first / sideBwtLen) + sd) & 1) == 1;
+		if(eh._isBt2Index) {
+			// A/C/G/T counts up to the start of the side
+			for(int k = 0; k < 4; k++) {
+				u32side[nwords-4+k] = c.cnt[k];
+			}
+		} else if(fw) {
+			// 'G' and 'T' counts between backward and forward side
+			u32side[nwords-2] = c.cnt[2];
+			u32side[nwords-1] = c.cnt[3];
+		}
+		for(TIndexOffU j = 0; j < sideBwtLen; j++, i++) {
+			int bwtChar = 0;
+			if(i < c.nsa) {
+				bwtChar = c.bwt[i];
+				if(bwtChar < 0) {
+					// Don't add the '$' in the last column to the BWT
+					// transform; we can't encode a $ (only A C T or G)
+					// and counting it as, say, an A, will mess up the
+					// LR mapping
+					bwtChar = 0;
+					c.zOff = c.first + i;
+				} else {
+					assert_lt(bwtChar, 4);
+					c.fchr[bwtChar]++;
+					c.cnt[bwtChar]++;
+				}
+			} else {
+				// Padding out the last side; 'A' used for padding;
+				// important that padding be counted in the occ[] array
+				c.cnt[0]++;
+			}
+#ifdef SIXTY4_FORMAT
+			uint64_t *words = reinterpret_cast<uint64_t*>(side);
+			if(fw) {
+				// Forward side: fill from least to most
+				words[j >> 5] |= ((uint64_t)bwtChar << ((j & 31) << 1));
+			} else {
+				// Backward side: fill from most to least
+				words[(eh._sideBwtSz >> 3) - 1 - (j >> 5)] |=
+					((uint64_t)bwtChar << ((31 - (j & 31)) << 1));
+			}
+#else
+			if(fw) {
+				pack_2b_in_8b(bwtChar, side[j >> 2], j & 3);
+			} else {
+				pack_2b_in_8b(bwtChar, side[eh._sideBwtSz - 1 - (j >> 2)], 3 - (j & 3));
+			}
+#endif
+		}
+		if(!eh._isBt2Index && !fw) {
+			// 'A' and 'C' counts up to the end of the side
+			u32side[nwords-2] = c.cnt[0];
+			u32side[nwords-1] = c.cnt[1];
+		}
+	}
+}
+
+/**
+ * Write chunk c, whose sides have been assembled, and fold its rows
+ * into the ftab, offs and ISA sample.  Chunks must come in order.
+ */
+inline void Ebwt::rowsChunkToDisk(RowChunk& c,
+                                  RowsToDiskState& st,
+                                  ostream& out1,
+                                  ostream& out2)
+{
+	const EbwtParams& eh = this->_eh;
+	for(TIndexOffU i = 0; i < c.nsa; i++) {
+		TIndexOffU sufInt = c.sufInts[i];
+		if(sufInt != OFF_MASK) {
+			// Assert that this prefix-of-suffix is greater
+			// than or equal to the last one (true b/c the
+			// suffix array is sorted)
+			#ifndef NDEBUG
+			if(st.lastSufInt > 0) assert_geq(sufInt, st.lastSufInt);
+			st.lastSufInt = sufInt;
+			#endif
+			// Update ftab
+			assert_lt(sufInt+1, eh._ftabLen);
+			st.ftab[sufInt+1]++;
+			if(st.absorbCnt > 0) {
+				// Absorb all short suffixes since the last
+				// transition into this transition
+				st.absorbFtab[sufInt] = st.absorbCnt;
+				st.absorbCnt = 0;
+			}
+		} else {
+			// Otherwise if suffix is fewer than ftabChars
+			// characters long, then add it to the 'absorbCnt';
+			// it will be absorbed into the next transition
+			assert_lt(st.absorbCnt, 255);
+			st.absorbCnt++;
+		}
+	}
+	// Suffix array offset boundaries - write offsets directly to the
+	// secondary output stream, thereby avoiding keeping them in memory
+	const TIndexOffU end = c.first + c.nsa;
+	TIndexOffU si = ((c.first + (1 << eh._offRate) - 1) >> eh._offRate) << eh._offRate;
+	for(; si < end; si += (1 << eh._offRate)) {
+		assert_lt((si >> eh._offRate), eh._offsLen);
+		assert_neq(OFF_MASK, c.offs[si - c.first]);
+		writeU<TIndexOffU>(out2, c.offs[si - c.first], this->toBe());
+	}
+	if(st.isaSample != NULL) {
+		for(TIndexOffU i = 0; i < c.nsa; i++) {
+			TIndexOffU saElt = c.offs[i];
+			if((saElt & eh._isaMask) == saElt) {
+				// This element belongs in the ISA sample.  Add
+				// an entry mapping the text offset to the offset
+				// into the suffix array that holds the suffix
+				// beginning with the character at that text offset
+				assert_lt((saElt >> eh._isaRate), eh._isaLen);
+				st.isaSample[saElt >> eh._isaRate] = c.first + i;
+			}
+		}
+	}
+	if(c.zOff != OFF_MASK) {
+		assert_eq(OFF_MASK, st.zOff);
+		st.zOff = c.zOff;
+	}
+	// Offset the sides' counts by those before the chunk
+	const TIndexOffU sideSz = eh._sideSz;
+	const TIndexOffU nsides = c.nrows / eh._sideBwtLen;
+	const TIndexOffU nwords = sideSz / OFF_SIZE;
+	for(TIndexOffU sd = 0; sd < nsides; sd++) {
+		TIndexOffU *u32side = reinterpret_cast<TIndexOffU*>(c.sides.ptr() + sd * sideSz);
+		if(eh._isBt2Index) {
+			for(int k = 0; k < 4; k++) {
+				u32side[nwords-4+k] = endianizeU<TIndexOffU>(u32side[nwords-4+k] + st.occ[k], this->toBe());
+			}
+		} else {
+			int k = ((((c.first / eh._sideBwtLen) + sd) & 1) == 1) ? 2 : 0;
+			u32side[nwords-2] = endianizeU<TIndexOffU>(u32side[nwords-2] + st.occ[k], this->toBe());
+			u32side[nwords-1] = endianizeU<TIndexOffU>(u32side[nwords-1] + st.occ[k+1], this->toBe());
+		}
+	}
+	out1.write((const char *)c.sides.ptr(), nsides * sideSz);
+	for(int k = 0; k < 4; k++) {
+		st.occ[k] += c.cnt[k];
+		st.fchr[k] += c.fchr[k];
+	}
+}
+
+#if (__cplusplus >= 201103L)
+/**
+ * Body of a worker thread of rowsToDisk(): take filled chunks in order
+ * of arrival and turn them into finished sides.
+ */
+template<typename TRows>
+void Ebwt::rowsWorker(TRows* rows, EList<RowChunk>* slots, RowsPipeline* p) const {
+	std::unique_lock<std::mutex> lk(p->mu);
+	while(true) {
+		while(!p->err && p->claimed == p->filled && p->claimed < p->nchunks) {
+			p->cv.wait(lk);
+		}
+		if(p->err || p->claimed == p->nchunks) {
+			break;
+		}
+		size_t slot = (p->claimed++) % slots->size();
+		lk.unlock();
+		RowChunk& c = (*slots)[slot];
+		rows->resolve(c);
+		assembleSides(c);
+		lk.lock();
+		p->ready[slot] = true;
+		p->cv.notify_all();
+	}
+}
+
+/**
+ * Body of the writer thread of rowsToDisk(): write assembled chunks
+ * out in order and hand their slots back.
+ */
+inline void Ebwt::rowsWriter(EList<RowChunk>* slots,
+                             RowsPipeline* p,
+                             RowsToDiskState* st,
+                             ostream* out1,
+                             ostream* out2)
+{
+	std::unique_lock<std::mutex> lk(p->mu);
+	for(size_t k = 0; k < p->nchunks; k++) {
+		size_t slot = k % slots->size();
+		while(!p->err && !p->ready[slot]) {
+			p->cv.wait(lk);
+		}
+		if(p->err) {
+			break;
+		}
+		lk.unlock();
+		rowsChunkToDisk((*slots)[slot], *st, *out1, *out2);
+		lk.lock();
+		p->ready[slot] = false;
+		p->written = k + 1;
+		p->cv.notify_all();
+	}
+}
+#endif
+
+/**
+ * Write the ebwt, zOff, fchr, ftab and eftab to the primary file and
+ * offs (and the ISA sample, if any) to the secondary file, given the
+ * rows of the BWT matrix in order.  'rows' has the interface of
+ * SuffixArrayRows: fill() takes the next rows in order, and resolve()
+ * finishes them given only the chunk; it must be safe to call on
+ * several chunks at once.  Offsets need only be given for rows that
+ * are sampled, unless the chunk asks for all of them.
+ *
+ * The rows are handled a chunk at a time.  With more than one thread,
+ * this thread fills chunks while nthreads-1 workers resolve them and
+ * assemble their sides, and a writer thread writes them out in order.
+ */
+template<typename TRows>
+void Ebwt::rowsToDisk(TRows& rows,
+		      ostream& out1,
+		      ostream& out2,
+		      int nthreads)
 {
 	const EbwtParams& eh = this->_eh;
 
 	assert(eh.repOk());
-	assert_eq(s.length()+1, sa.size());
-	assert_eq(s.length(), eh._len);
 	assert_gt(eh._lineRate, 3);
-	assert(sa.suffixItrIsReset());
 	// assert_leq((int)ValueSize<Dna>::VALUE, 4);
 
 	TIndexOffU  len = eh._len;
 	TIndexOffU  ftabLen = eh._ftabLen;
 	TIndexOffU  sideSz = eh._sideSz;
-	TIndexOffU  ebwtTotSz = eh._ebwtTotSz;
-	TIndexOffU  fchr[] = {0, 0, 0, 0, 0};
-	TIndexOffU* ftab = NULL;
-	TIndexOffU  zOff = OFF_MASK;
+	TIndexOffU  sideBwtLen = eh._sideBwtLen;
 
-	// Save # of occurrences of each character as we walk along the bwt
-	TIndexOffU occ[4] = {0, 0, 0, 0};
-	// Save 'G' and 'T' occurrences between backward and forward buckets
-	TIndexOffU occSave[2] = {0, 0};
+	RowsToDiskState st;
+	memset(&st, 0, sizeof(st));
+	st.zOff = OFF_MASK;
+	st.ftab = NULL;
+	st.absorbFtab = NULL;
+	st.isaSample = NULL;
 
 	// Record rows that should "absorb" adjacent rows in the ftab.
 	// The absorbed rows represent suffixes shorter than the ftabChars
 	// cutoff.
-	uint8_t absorbCnt = 0;
-	uint8_t *absorbFtab;
 	try {
 		VMSG_NL("Allocating ftab, absorbFtab");
-		ftab = new TIndexOffU[ftabLen];
-		memset(ftab, 0, OFF_SIZE * ftabLen);
-		absorbFtab = new uint8_t[ftabLen];
-		memset(absorbFtab, 0, ftabLen);
+		st.ftab = new TIndexOffU[ftabLen];
+		memset(st.ftab, 0, OFF_SIZE * ftabLen);
+		st.absorbFtab = new uint8_t[ftabLen];
+		memset(st.absorbFtab, 0, ftabLen);
 	} catch(bad_alloc &e) {
 		cerr << "Out of memory allocating ftab[] or absorbFtab[] "
-		     << "in Ebwt::buildToDisk() at " << __FILE__ << ":"
+		     << "in Ebwt::rowsToDisk() at " << __FILE__ << ":"
 		     << __LINE__ << endl;
 		throw e;
 	}
+	TIndexOffU *ftab = st.ftab;
+	uint8_t *absorbFtab = st.absorbFtab;
 	assert(ftab != NULL);
 	assert(absorbFtab != NULL);
 
-	// Allocate the side buffer; holds a single side as its being
-	// constructed and then written to disk.  Reused across all sides.
-#ifdef SIXTY4_FORMAT
-	uint64_t *ebwtSide = NULL;
-#else
-	uint8_t *ebwtSide = NULL;
-#endif
-	try {
-#ifdef SIXTY4_FORMAT
-		ebwtSide = new uint64_t[sideSz >> 3];
-#else
-		ebwtSide = new uint8_t[sideSz];
-#endif
-	} catch(bad_alloc &e) {
-		cerr << "Out of memory allocating ebwtSide[] in "
-		     << "Ebwt::buildToDisk() at " << __FILE__ << ":"
-		     << __LINE__ << endl;
-		throw e;
-	}
-	assert(ebwtSide != NULL);
-
 	// Allocate a buffer to hold the ISA sample, which we accumulate in
 	// the loop and then output at the end.  We can't write output the
 	// ISA right away because the order in which we calculate its
 	// elements is based on the suffix array, which we only see bit by
 	// bit
-	uint32_t *isaSample = NULL;
 	if(eh._isaRate >= 0) {
 		try {
-			isaSample = new uint32_t[eh._isaLen];
+			st.isaSample = new uint32_t[eh._isaLen];
 		} catch(bad_alloc &e) {
 			cerr << "Out of memory allocating isaSample[] in "
-			     << "Ebwt::buildToDisk() at " << __FILE__ << ":"
+			     << "Ebwt::rowsToDisk() at " << __FILE__ << ":"
 			     << __LINE__ << endl;
 			throw e;
 		}
-		assert(isaSample != NULL);
+		assert(st.isaSample != NULL);
 	}
 
-	// Points to the base offset within ebwt for the side currently
-	// being written
-	TIndexOffU side = 0;
-	// Points to a byte offset from 'side' within ebwt[] where next
-	// char should be written
-#ifdef SIXTY4_FORMAT
-	TIndexOff sideCur = (eh._sideBwtSz >> 3) - 1;
-#else
-	TIndexOff sideCur = eh._sideBwtSz - 1;
+	// Chunks are a whole number of side pairs, so that each starts with
+	// a backward side and its G/T counts stay within the chunk
+	TIndexOffU chunkSides = ((ROWS_CHUNK_LEN / sideBwtLen) + 2) & ~(TIndexOffU)1;
+	TIndexOffU chunkRows = chunkSides * sideBwtLen;
+	TIndexOffU totRows = (eh._ebwtTotSz / sideSz) * sideBwtLen;
+	size_t nchunks = (totRows + chunkRows - 1) / chunkRows;
+	int nworkers = 0;
+#if (__cplusplus >= 201103L)
+	if(nthreads > 1 && nchunks > 1) {
+		nworkers = nthreads - 1;
+	}
 #endif
+	EList<RowChunk> slots;
+	try {
+		slots.resize(nworkers > 0 ? (size_t)nworkers + 3 : 1);
+		for(size_t i = 0; i < slots.size(); i++) {
+			slots[i].init(chunkRows, sideBwtLen, sideSz);
+		}
+	} catch(bad_alloc &e) {
+		cerr << "Out of memory allocating row chunks in "
+		     << "Ebwt::rowsToDisk() at " << __FILE__ << ":"
+		     << __LINE__ << endl;
+		throw e;
+	}
 
-	// Whether we're assembling a forward or a reverse bucket
-	bool fw = false;
-
-	// Did we just finish writing a forward bucket?  (Must be true when
-	// we exit the loop.)
-	ASSERT_ONLY(bool wroteFwBucket = false);
-
-	// Have we skipped the '$' in the last column yet?
-	ASSERT_ONLY(bool dollarSkipped = false);
-
-	TIndexOffU si = 0;   // string offset (chars)
-	ASSERT_ONLY(TIndexOffU lastSufInt = 0);
-	ASSERT_ONLY(bool inSA = true); // true iff saI still points inside suffix
-	                               // array (as opposed to the padding at the
-	                               // end)
-	// Iterate over packed bwt bytes
 	VMSG_NL("Entering Ebwt loop");
 	ASSERT_ONLY(TIndexOffU beforeEbwtOff = (uint32_t)out1.tellp());
-	while(side < ebwtTotSz) {
-		ASSERT_ONLY(wroteFwBucket = false);
-		// Sanity-check our cursor into the side buffer
-		assert_geq(sideCur, 0);
-		assert_lt(sideCur, (int)eh._sideBwtSz);
-		assert_eq(0, side % sideSz); // 'side' must be on side boundary
-		ebwtSide[sideCur] = 0; // clear
-		assert_lt(side + sideCur, ebwtTotSz);
-		// Iterate over bit-pairs in the si'th character of the BWT
-#ifdef SIXTY4_FORMAT
-		for(int bpi = 0; bpi < 32; bpi++, si++)
-#else
-		for(int bpi = 0; bpi < 4; bpi++, si++)
-#endif
-		{
-			int bwtChar;
-			bool count = true;
-			if(si <= len) {
-				// Still in the SA; extract the bwtChar
-				TIndexOffU saElt = sa.nextSuffix();
-				// (that might have triggered sa to calc next suf block)
-				if(isaSample != NULL && (saElt & eh._isaMask) == saElt) {
-					// This element belongs in the ISA sample.  Add
-					// an entry mapping the text offset to the offset
-					// into the suffix array that holds the suffix
-					// beginning with the character at that text offset
-					assert_lt((saElt >> eh._isaRate), eh._isaLen);
-					isaSample[saElt >> eh._isaRate] = si;
-				}
-				if(saElt == 0) {
-					// Don't add the '$' in the last column to the BWT
-					// transform; we can't encode a $ (only A C T or G)
-					// and counting it as, say, an A, will mess up the
-					// LR mapping
-					bwtChar = 0; count = false;
-					ASSERT_ONLY(dollarSkipped = true);
-					zOff = si; // remember the SA row that
-					           // corresponds to the 0th suffix
-				} else {
-					bwtChar = (int)(s[saElt-1]);
-					assert_lt(bwtChar, 4);
-					// Update the fchr
-					fchr[bwtChar]++;
-				}
-				// Update ftab
-				if((len-saElt) >= (TIndexOffU)eh._ftabChars) {
-					// Turn the first ftabChars characters of the
-					// suffix into an integer index into ftab
-					TIndexOffU sufInt = 0;
-					for(int i = 0; i < eh._ftabChars; i++) {
-						sufInt <<= 2;
-						assert_lt((TIndexOffU)i, len-saElt);
-						sufInt |= (unsigned char)(s[saElt+i]);
-					}
-					// Assert that this prefix-of-suffix is greater
-					// than or equal to the last one (true b/c the
-					// suffix array is sorted)
-					#ifndef NDEBUG
-					if(lastSufInt > 0) assert_geq(sufInt, lastSufInt);
-					lastSufInt = sufInt;
-					#endif
-					// Update ftab
-					assert_lt(sufInt+1, ftabLen);
-					ftab[sufInt+1]++;
-					if(absorbCnt > 0) {
-						// Absorb all short suffixes since the last
-						// transition into this transition
-						absorbFtab[sufInt] = absorbCnt;
-						absorbCnt = 0;
+	if(nworkers == 0) {
+		RowChunk& c = slots[0];
+		for(size_t k = 0; k < nchunks; k++) {
+			c.first = (TIndexOffU)(k * chunkRows);
+			c.nrows = min(chunkRows, totRows - c.first);
+			c.nsa = (c.first > len) ? 0 : min(c.nrows, len + 1 - c.first);
+			c.allOffs = (st.isaSample != NULL);
+			rows.fill(c);
+			rows.resolve(c);
+			assembleSides(c);
+			rowsChunkToDisk(c, st, out1, out2);
+		}
+	}
+#if (__cplusplus >= 201103L)
+	if(nworkers > 0) {
+		RowsPipeline p;
+		p.nchunks = nchunks;
+		p.filled = p.claimed = p.written = 0;
+		p.ready.resize(slots.size());
+		p.ready.fill(false);
+		p.err = false;
+		AutoArray<std::thread*> threads(nworkers + 1);
+		for(int i = 0; i < nworkers; i++) {
+			threads[i] = new std::thread(&Ebwt::rowsWorker<TRows>, this, &rows, &slots, &p);
+		}
+		threads[nworkers] = new std::thread(&Ebwt::rowsWriter, this, &slots, &p, &st, &out1, &out2);
+		try {
+			for(size_t k = 0; k < nchunks; k++) {
+				{
+					std::unique_lock<std::mutex> lk(p.mu);
+					while(k - p.written >= slots.size()) {
+						p.cv.wait(lk);
 					}
-				} else {
-					// Otherwise if suffix is fewer than ftabChars
-					// characters long, then add it to the 'absorbCnt';
-					// it will be absorbed into the next transition
-					assert_lt(absorbCnt, 255);
-					absorbCnt++;
-				}
-				// Suffix array offset boundary? - update offset array
-				if((si & eh._offMask) == si) {
-					assert_lt((si >> eh._offRate), eh._offsLen);
-					// Write offsets directly to the secondary output
-					// stream, thereby avoiding keeping them in memory
-					writeU<TIndexOffU>(out2, saElt, this->toBe());
-				}
-			} else {
-				// Strayed off the end of the SA, now we're just
-				// padding out a bucket
-				#ifndef NDEBUG
-				if(inSA) {
-					// Assert that we wrote all the characters in the
-					// string before now
-					assert_eq(si, len+1);
-					inSA = false;
 				}
-				#endif
-				// 'A' used for padding; important that padding be
-				// counted in the occ[] array
-				bwtChar = 0;
+				RowChunk& c = slots[k % slots.size()];
+				c.first = (TIndexOffU)(k * chunkRows);
+				c.nrows = min(chunkRows, totRows - c.first);
+				c.nsa = (c.first > len) ? 0 : min(c.nrows, len + 1 - c.first);
+				c.allOffs = (st.isaSample != NULL);
+				rows.fill(c);
+				std::lock_guard<std::mutex> lk(p.mu);
+				p.filled = k + 1;
+				p.cv.notify_all();
 			}
-			if(count) occ[bwtChar]++;
-			// Append BWT char to bwt section of current side
-			if(fw) {
-				// Forward bucket: fill from least to most
-#ifdef SIXTY4_FORMAT
-				ebwtSide[sideCur] |= ((uint64_t)bwtChar << (bpi << 1));
-				if(bwtChar > 0) assert_gt(ebwtSide[sideCur], 0);
-#else
-				pack_2b_in_8b(bwtChar, ebwtSide[sideCur], bpi);
-				assert_eq((ebwtSide[sideCur] >> (bpi*2)) & 3, bwtChar);
-#endif
-			} else {
-				// Backward bucket: fill from most to least
-#ifdef SIXTY4_FORMAT
-				ebwtSide[sideCur] |= ((uint64_t)bwtChar << ((31 - bpi) << 1));
-				if(bwtChar > 0) assert_gt(ebwtSide[sideCur], 0);
-#else
-				pack_2b_in_8b(bwtChar, ebwtSide[sideCur], 3-bpi);
-				assert_eq((ebwtSide[sideCur] >> ((3-bpi)*2)) & 3, bwtChar);
-#endif
+		} catch(...) {
+			// Typically bad_alloc from the suffix-array builder; stop
+			// the other threads before passing it on
+			{
+				std::lock_guard<std::mutex> lk(p.mu);
+				p.err = true;
+				p.cv.notify_all();
 			}
-		} // end loop over bit-pairs
-		assert_eq(dollarSkipped ? 3 : 0, (occ[0] + occ[1] + occ[2] + occ[3]) & 3);
-#ifdef SIXTY4_FORMAT
-		assert_eq(0, si & 31);
-#else
-		assert_eq(0, si & 3);
-#endif
-		if(fw) sideCur++;
-		else   sideCur--;
-#ifdef SIXTY4_FORMAT
-		if(sideCur == (int)eh._sideBwtSz >> 3)
-#else
-		if(sideCur == (int)eh._sideBwtSz)
-#endif
-		{
-			// Forward side boundary
-			assert_eq(0, si % eh._sideBwtLen);
-#ifdef SIXTY4_FORMAT
-			sideCur = (eh._sideBwtSz >> 3) - 1;
-#else
-			sideCur = eh._sideBwtSz - 1;
-#endif
-			assert(fw); fw = false;
-			ASSERT_ONLY(wroteFwBucket = true);
-			// Write 'G' and 'T'
-			assert_leq(occSave[0], occ[2]);
-			assert_leq(occSave[1], occ[3]);
-			TIndexOffU *u32side = reinterpret_cast<TIndexOffU*>(ebwtSide);
-			side += sideSz;
-			assert_leq(side, eh._ebwtTotSz);
-#ifdef BOWTIE_64BIT_INDEX
-			u32side[(sideSz >> 3)-2] = endianizeU<TIndexOffU>(occSave[0], this->toBe());
-			u32side[(sideSz >> 3)-1] = endianizeU<TIndexOffU>(occSave[1], this->toBe());
-#else
-			u32side[(sideSz >> 2)-2] = endianizeU<TIndexOffU>(occSave[0], this->toBe());
-			u32side[(sideSz >> 2)-1] = endianizeU<TIndexOffU>(occSave[1], this->toBe());
-#endif
-			// Write forward side to primary file
-			out1.write((const char *)ebwtSide, sideSz);
-		} else if (sideCur == -1) {
-			// Backward side boundary
-			assert_eq(0, si % eh._sideBwtLen);
-			sideCur = 0;
-			assert(!fw); fw = true;
-			// Write 'A' and 'C'
-			TIndexOffU *u32side = reinterpret_cast<TIndexOffU*>(ebwtSide);
-			side += sideSz;
-			assert_leq(side, eh._ebwtTotSz);
-#ifdef BOWTIE_64BIT_INDEX
-			u32side[(sideSz >> 3)-2] = endianizeU<TIndexOffU>(occ[0], this->toBe());
-			u32side[(sideSz >> 3)-1] = endianizeU<TIndexOffU>(occ[1], this->toBe());
-#else
-			u32side[(sideSz >> 2)-2] = endianizeU<TIndexOffU>(occ[0], this->toBe());
-			u32side[(sideSz >> 2)-1] = endianizeU<TIndexOffU>(occ[1], this->toBe());
-#endif
-			occSave[0] = occ[2]; // save 'G' count
-			occSave[1] = occ[3]; // save 'T' count
-			// Write backward side to primary file
-			out1.write((const char *)ebwtSide, sideSz);
+			for(int i = 0; i <= nworkers; i++) {
+				threads[i]->join();
+				delete threads[i];
+			}
+			delete[] st.isaSample;
+			delete[] ftab;
+			delete[] absorbFtab;
+			throw;
+		}
+		for(int i = 0; i <= nworkers; i++) {
+			threads[i]->join();
+			delete threads[i];
 		}
 	}
+#endif
 	VMSG_NL("Exited Ebwt loop");
-	assert(ftab != NULL);
+	TIndexOffU zOff = st.zOff;
 	assert_neq(zOff, OFF_MASK);
-	if(absorbCnt > 0) {
+	if(st.absorbCnt > 0) {
 		// Absorb any trailing, as-yet-unabsorbed short suffixes into
 		// the last element of ftab
-		absorbFtab[ftabLen-1] = absorbCnt;
+		absorbFtab[ftabLen-1] = st.absorbCnt;
 	}
-	// Assert that our loop counter got incremented right to the end
-	assert_eq(side, eh._ebwtTotSz);
 	// Assert that we wrote the expected amount to out1
 	assert_eq(((TIndexOffU)out1.tellp() - beforeEbwtOff), eh._ebwtTotSz);
-	// assert that the last thing we did was write a forward bucket
-	assert(wroteFwBucket);
+	assert_eq(0, (st.occ[0] + st.occ[1] + st.occ[2] + st.occ[3] + 1) % sideBwtLen);
 
 	//
 	// Write zOff to primary stream
@@ -4301,6 +5019,7 @@ void Ebwt::buildToDisk(InorderBlockwiseSA<TStr>& sa,
 	//
 	// Finish building fchr
 	//
+	TIndexOffU fchr[] = {st.fchr[0], st.fchr[1], st.fchr[2], st.fchr[3], 0};
 	// Exclusive prefix sum on fchr
 	for(int i = 1; i < 4; i++) {
 		fchr[i] += fchr[i-1];
@@ -4337,7 +5056,7 @@ void Ebwt::buildToDisk(InorderBlockwiseSA<TStr>& sa,
 		memset(eftab, 0, OFF_SIZE * eftabLen);
 	} catch(bad_alloc &e) {
 		cerr << "Out of memory allocating eftab[] "
-		     << "in Ebwt::buildToDisk() at " << __FILE__ << ":"
+		     << "in Ebwt::rowsToDisk() at " << __FILE__ << ":"
 		     << __LINE__ << endl;
 		throw e;
 	}
@@ -4368,6 +5087,7 @@ void Ebwt::buildToDisk(InorderBlockwiseSA<TStr>& sa,
 		writeU<TIndexOffU>(out1, eftab[i], this->toBe());
 	}
 	// Write isa to primary file
+	uint32_t *isaSample = st.isaSample;
 	if(isaSample != NULL) {
 		ASSERT_ONLY(Bitset sawISA(eh._len+1));
 		for(TIndexOffU i = 0; i < eh._isaLen; i++) {
@@ -4386,7 +5106,7 @@ void Ebwt::buildToDisk(InorderBlockwiseSA<TStr>& sa,
 	// Note: if you'd like to sanity-check the Ebwt, you'll have to
 	// read it back into memory first!
 	assert(!isInMemory());
-	VMSG_NL("Exiting Ebwt::buildToDisk()");
+	VMSG_NL("Exiting Ebwt::rowsToDisk()");
 }
 
 /**
@@ -0,0 +1,417 @@
+/*
+ * ebwt_append.h
+ *
+ * Rows of the BWT matrix of an existing index's text with more text
+ * appended, worked out from the existing index instead of by sorting
+ * all of the suffixes again.
+ *
+ * Say the existing text is T, of length n, and the appended text is
+ * S.  Let L be the length of the longest suffix of T that occurs
+ * somewhere else in T too.  For i, j < n-L, comparing T[i..]S with
+ * T[j..]S is settled before either runs off the end of T, so the
+ * existing index already has those suffixes (call their text A =
+ * T[0..n-L)) in the right order.  Only the suffixes of W =
+ * T[n-L..n)S need sorting, and W is hardly longer than S.  What's
+ * left is where each suffix of A goes among the suffixes of W, and
+ * that is a backward search of A through the BWT of W, one step per
+ * character of A.  The sampled suffix-array offsets of A's rows are
+ * recovered by walking left through the existing index, on several
+ * threads.
+ */
+
+#ifndef EBWT_APPEND_H_
+#define EBWT_APPEND_H_
+
+#if (__cplusplus >= 201103L)
+#include <thread>
+#endif
+
+#include <algorithm>
+#include "ebwt.h"
+#include "sais.h"
+#include "timer.h"
+
+template<typename TStr>
+class AppendRows;
+
+/**
+ * What one thread needs to resolve a range of sampled rows of the
+ * existing index into text offsets.
+ */
+template<typename TStr>
+struct AppendOffsParam {
+	const AppendRows<TStr>* rows;
+	TIndexOffU* offs; // rows on the way in, offsets on the way out
+	size_t begin;
+	size_t end;
+};
+
+template<typename TStr>
+static void AppendOffs_worker(void *vp) {
+	AppendOffsParam<TStr>* param = (AppendOffsParam<TStr>*)vp;
+	for(size_t i = param->begin; i < param->end; i++) {
+		param->offs[i] = param->rows->oldOffset(param->offs[i]);
+	}
+}
+
+/**
+ * Presents the rows of the BWT matrix of s, whose first old.eh()._len
+ * characters are the text of the in-memory index old, to
+ * Ebwt::rowsToDisk() in the same way SuffixArrayRows does.  The merge
+ * is inherently in order, so fill() does all the work.
+ */
+template<typename TStr>
+class AppendRows {
+
+	/// BWT characters and occurrence counts for 64 rows of W's BWT
+	struct OccBlock {
+		TIndexOffU cnt[4];  // occurrences before the block
+		uint64_t   bits[4]; // bit i set iff row i has that character
+	};
+
+public:
+
+	AppendRows(const Ebwt& old,
+	           const TStr& s,
+	           int nthreads,
+	           bool verbose) :
+		old_(old),
+		s_(s),
+		n_(old.eh()._len),
+		ftabChars_(old.eh()._ftabChars),
+		verbose_(verbose)
+	{
+		assert(old.isInMemory());
+		assert_gt(s.length(), n_);
+		TIndexOffU tail = repeatedSuffixLen();
+		// A's suffixes need at least ftabChars characters inside T so
+		// that their ftab entries can be had from the existing ftab
+		tail = std::max<TIndexOffU>(tail, (TIndexOffU)ftabChars_);
+		tail = std::min<TIndexOffU>(tail, n_);
+		wOff_ = n_ - tail;
+		wLen_ = (TIndexOffU)s.length() - wOff_;
+		if(verbose_) {
+			cout << "Re-sorting the last " << tail << " suffixes of the existing text "
+			     << "with the " << (wLen_ - tail) << " new ones" << endl;
+		}
+		// The existing rows that go: those of T's last 'tail' suffixes
+		// and of its empty suffix, the last row
+		oldDrop_.reserveExact(tail + 1);
+		{
+			TIndexOffU row = n_;
+			oldDrop_.push_back(row);
+			for(TIndexOffU i = 0; i < tail; i++) {
+				SideLocus l(row, old_.eh(), old_.ebwt());
+				row = old_.mapLF(l);
+				oldDrop_.push_back(row);
+			}
+			oldDrop_.sort();
+		}
+		{
+			ProfilePhase phase("append_sort");
+			Timer timer(cout, "  Time sorting the appended suffixes: ", verbose_);
+			sortW(nthreads);
+		}
+		{
+			ProfilePhase phase("append_rank");
+			Timer timer(cout, "  Time ranking the existing suffixes: ", verbose_);
+			rankA();
+		}
+		{
+			ProfilePhase phase("append_offsets");
+			Timer timer(cout, "  Time resolving sampled offsets: ", verbose_);
+			resolveOffs(nthreads);
+		}
+		wRow_ = 0;
+		aLeft_ = aCnt_[0];
+		oldRow_ = 0;
+		dropi_ = 0;
+		ftabi_ = 0;
+		isOld_ = false;
+		cur_ = 0;
+		row_ = 0;
+		aSampi_ = 0;
+	}
+
+	/**
+	 * Take the next c.nsa rows; see SuffixArrayRows::resolve().
+	 */
+	void fill(RowChunk& c) {
+		for(TIndexOffU i = 0; i < c.nsa; i++) {
+			const TIndexOffU si = c.first + i;
+			c.bwt[i] = (int8_t)next(c.sufInts[i]);
+			c.offs[i] = OFF_MASK;
+			if(c.allOffs || (si & offMask_) == si) {
+				c.offs[i] = offset();
+			}
+		}
+	}
+
+	/// Nothing left to do once the rows are filled
+	void resolve(RowChunk& c) const { }
+
+	/**
+	 * Move on to the next row and return its BWT character, or -1 for
+	 * the '$', setting sufInt to its ftab index or OFF_MASK.  Rows of A
+	 * are taken from the existing index in its order, aCnt_[r] of them
+	 * just ahead of W's row r.
+	 */
+	int next(TIndexOffU& sufInt) {
+		const TIndexOffU row = row_++;
+		if(aLeft_ > 0) {
+			aLeft_--;
+			isOld_ = true;
+			cur_ = nextOldRow();
+			curOff_ = OFF_MASK;
+			if((row & offMask_) == row) {
+				curOff_ = aSampOffs_[aSampi_++];
+			}
+			// Find the ftab bucket the row is in; rows of A are never
+			// among the short ones absorbed between buckets
+			while(old_.ftabLo(ftabi_+1) <= cur_) {
+				ftabi_++;
+			}
+			assert_geq(cur_, old_.ftabHi(ftabi_));
+			sufInt = ftabi_;
+			if(cur_ == old_.zOff()) {
+				return -1;
+			}
+			SideLocus l(cur_, old_.eh(), old_.ebwt());
+			return old_.rowL(l);
+		}
+		assert_leq(wRow_, wLen_);
+		isOld_ = false;
+		cur_ = wOff_ + wSa_[wRow_++];
+		if(wRow_ <= wLen_) {
+			aLeft_ = aCnt_[wRow_];
+		}
+		sufInt = OFF_MASK;
+		if((TIndexOffU)s_.length() - cur_ >= (TIndexOffU)ftabChars_) {
+			sufInt = 0;
+			for(int i = 0; i < ftabChars_; i++) {
+				sufInt <<= 2;
+				sufInt |= (unsigned char)(s_[cur_+i]);
+			}
+		}
+		if(cur_ == 0) {
+			return -1;
+		}
+		return (int)s_[cur_-1];
+	}
+
+	/**
+	 * Text offset of the current row's suffix.  Those of the existing
+	 * index's rows that are sampled in the new one were resolved up
+	 * front.
+	 */
+	TIndexOffU offset() const {
+		if(!isOld_) {
+			return cur_;
+		}
+		return curOff_ != OFF_MASK ? curOff_ : oldOffset(cur_);
+	}
+
+	/**
+	 * Text offset of the suffix of the existing index's row 'row';
+	 * walk left to a row that index sampled.
+	 */
+	TIndexOffU oldOffset(TIndexOffU row) const {
+		const EbwtParams& eh = old_.eh();
+		TIndexOffU jumps = 0;
+		while((row & eh._offMask) != row && row != old_.zOff()) {
+			SideLocus l(row, eh, old_.ebwt());
+			row = old_.mapLF(l);
+			jumps++;
+		}
+		if(row == old_.zOff()) {
+			return jumps;
+		}
+		return old_.offs()[row >> eh._offRate] + jumps;
+	}
+
+private:
+
+	/// Next row of the existing index that isn't dropped
+	TIndexOffU nextOldRow() {
+		while(dropi_ < oldDrop_.size() && oldDrop_[dropi_] == oldRow_) {
+			dropi_++;
+			oldRow_++;
+		}
+		assert_lt(oldRow_, n_);
+		return oldRow_++;
+	}
+
+	/**
+	 * Find the rows of A that are sampled in the new index by going
+	 * through the merge without looking at any characters, then walk
+	 * each of them back to a row the existing index sampled.  The
+	 * walks are independent, so they're split among the threads.
+	 */
+	void resolveOffs(int nthreads) {
+		offMask_ = old_.eh()._offMask;
+		oldRow_ = 0;
+		dropi_ = 0;
+		TIndexOffU row = 0;
+		for(TIndexOffU wr = 0; wr <= wLen_; wr++) {
+			for(TIndexOffU i = 0; i < aCnt_[wr]; i++, row++) {
+				TIndexOffU orow = nextOldRow();
+				if((row & offMask_) == row) {
+					aSampOffs_.push_back(orow);
+				}
+			}
+			row++; // W's row wr
+		}
+		const size_t nsamp = aSampOffs_.size();
+		if(nthreads <= 1 || nsamp < 1024) {
+			for(size_t i = 0; i < nsamp; i++) {
+				aSampOffs_[i] = oldOffset(aSampOffs_[i]);
+			}
+			return;
+		}
+#if (__cplusplus >= 201103L)
+		AutoArray<std::thread*> threads(nthreads);
+#else
+		AutoArray<tthread::thread*> threads(nthreads);
+#endif
+		EList<AppendOffsParam<TStr> > tparams;
+		tparams.resize(nthreads);
+		size_t per = (nsamp + nthreads - 1) / nthreads;
+		for(int tid = 0; tid < nthreads; tid++) {
+			tparams[tid].rows = this;
+			tparams[tid].offs = aSampOffs_.ptr();
+			tparams[tid].begin = std::min(per * tid, nsamp);
+			tparams[tid].end = std::min(per * (tid + 1), nsamp);
+#if (__cplusplus >= 201103L)
+			threads[tid] = new std::thread(AppendOffs_worker<TStr>, (void*)&tparams[tid]);
+#else
+			threads[tid] = new tthread::thread(AppendOffs_worker<TStr>, (void*)&tparams[tid]);
+#endif
+		}
+		for(int tid = 0; tid < nthreads; tid++) {
+			threads[tid]->join();
+			delete threads[tid];
+		}
+	}
+
+	/**
+	 * Return the length of the longest suffix of T that occurs at
+	 * least twice in T, by backward search of ever longer suffixes
+	 * through the existing index.
+	 */
+	TIndexOffU repeatedSuffixLen() const {
+		const TIndexOffU *fchr = old_.fchr();
+		int c = (int)s_[n_-1];
+		TIndexOffU top = fchr[c], bot = fchr[c+1];
+		TIndexOffU len = 0;
+		while(bot - top > 1) {
+			len++;
+			if(len == n_) break;
+			c = (int)s_[n_-len-1];
+			SideLocus ltop(top, old_.eh(), old_.ebwt());
+			SideLocus lbot(bot, old_.eh(), old_.ebwt());
+			top = old_.mapLF(ltop, c);
+			bot = old_.mapLF(lbot, c);
+		}
+		return len;
+	}
+
+	/**
+	 * Build W's suffix array (in bowtie's order, '$' last) and the
+	 * occurrence blocks over its BWT.
+	 */
+	void sortW(int nthreads) {
+		BTRefString w;
+		w.resize(wLen_);
+		for(TIndexOffU i = 0; i < wLen_; i++) {
+			w.set(s_[wOff_ + i], i);
+		}
+		const TIndexOffU n = wLen_ + 1;
+		{
+			AutoArray<TIndexOffU> sa(n);
+			SaisBuilder<TIndexOffU>::build(
+				SaisDnaText<BTRefString, TIndexOffU>(w),
+				&sa[0], n, 5, nthreads);
+			wSa_.resizeExact(n);
+			for(TIndexOffU i = 0; i < n; i++) {
+				wSa_[i] = sa[n - i - 1];
+			}
+		}
+		assert_eq(wLen_, wSa_[wLen_]);
+		occ_.resizeExact(n / 64 + 1);
+		TIndexOffU cnt[4] = {0, 0, 0, 0};
+		for(TIndexOffU r = 0; r < n; r++) {
+			OccBlock& b = occ_[r >> 6];
+			if((r & 63) == 0) {
+				for(int c = 0; c < 4; c++) {
+					b.cnt[c] = cnt[c];
+					b.bits[c] = 0;
+				}
+			}
+			if(wSa_[r] == 0) {
+				wZ_ = r; // '$' isn't counted
+				continue;
+			}
+			int c = (int)w[wSa_[r] - 1];
+			b.bits[c] |= (1llu << (r & 63));
+			cnt[c]++;
+		}
+		wC_[0] = 0;
+		for(int c = 1; c < 4; c++) {
+			wC_[c] = wC_[c-1] + cnt[c-1];
+		}
+	}
+
+	/// Occurrences of c in W's BWT above row r
+	TIndexOffU wOcc(int c, TIndexOffU r) const {
+		const OccBlock& b = occ_[r >> 6];
+		return b.cnt[c] + (TIndexOffU)__builtin_popcountll(b.bits[c] & ((1llu << (r & 63)) - 1));
+	}
+
+	/**
+	 * For each suffix of A, count how many suffixes of W are smaller.
+	 * Extending the suffix left by c maps that count as the LF
+	 * mapping does; W itself (the empty suffix of A) comes just after
+	 * the wZ_ suffixes of W smaller than it.  Only the histogram is
+	 * kept: the suffixes of A are already in order, so it's enough to
+	 * know how many go ahead of each row of W.
+	 */
+	void rankA() {
+		aCnt_.resizeExact(wLen_ + 1);
+		aCnt_.fillZero();
+		TIndexOffU h = wZ_;
+		for(TIndexOffU i = wOff_; i > 0; i--) {
+			int c = (int)s_[i-1];
+			h = wC_[c] + wOcc(c, h);
+			assert_leq(h, wLen_);
+			aCnt_[h]++;
+		}
+	}
+
+	const Ebwt& old_;
+	const TStr& s_;
+	TIndexOffU n_;           /// length of the existing text, T
+	int ftabChars_;
+	bool verbose_;
+	TIndexOffU wOff_;        /// offset of W into s
+	TIndexOffU wLen_;        /// length of W
+	EList<TIndexOffU> wSa_;  /// suffix array of W, '$' last
+	EList<OccBlock> occ_;    /// occurrences over the BWT of W
+	TIndexOffU wC_[4];       /// # characters of W less than each
+	TIndexOffU wZ_;          /// row of W's whole-text suffix
+	EList<TIndexOffU> aCnt_; /// # suffixes of A just ahead of each W row
+	EList<TIndexOffU> oldDrop_; /// existing rows not in A, sorted
+	TIndexOffU wRow_;        /// next row of W
+	TIndexOffU aLeft_;       /// suffixes of A to go before row wRow_
+	TIndexOffU oldRow_;      /// next row of the existing index
+	size_t dropi_;           /// next element of oldDrop_
+	TIndexOffU ftabi_;       /// ftab bucket of the last row of A
+	bool isOld_;             /// current row is from the existing index
+	TIndexOffU cur_;         /// row in old, or text offset into s
+	TIndexOffU curOff_;      /// resolved offset of cur_ in old, if sampled
+	TIndexOffU row_;         /// next row of the new index
+	TIndexOffU offMask_;     /// the new index's (and old's) offMask
+	EList<TIndexOffU> aSampOffs_; /// offsets of A's sampled rows, in order
+	size_t aSampi_;          /// next element of aSampOffs_
+};
+
+#endif /* EBWT_APPEND_H_ */
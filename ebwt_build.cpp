@@ -2,9 +2,16 @@
 #include <fstream>
 #include <string>
 #include <cassert>
+#include <cerrno>
+#if (__cplusplus >= 201103L)
+#include <thread>
+#endif
 #include <getopt.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "assert_helpers.h"
+#include "build_profile.h"
 #include "ds.h"
 #include "endian_swap.h"
 #include "ebwt.h"
@@ -37,6 +44,7 @@ static bool doubleEbwt;
 //   Ebwt parameters
 static int32_t lineRate;
 static int32_t linesPerSide;
+static bool interleaved;
 static int32_t offRate;
 static int32_t ftabChars;
 static int  bigEndian;
@@ -47,6 +55,13 @@ static bool writeRef;
 static bool justRef;
 static int reverseType;
 static int nthreads;
+static bool concurrentMirror;
+static int saEngine;
+static size_t memoryLimit;
+static string appendBase;
+static EList<string> appendConflicts; // options given that --append can't honor
+static string checkpointDir;
+static string profileJson;
 static string wrapper;
 
 
@@ -66,6 +81,7 @@ static void resetOptions() {
 	//   Ebwt parameters
 	lineRate     = Ebwt::default_lineRate;  // a "line" is 64 bytes
 	linesPerSide = 1;  // 1 64-byte line on a side
+	interleaved  = false; // put occ checkpoints in every line
 	offRate      = 5;  // sample 1 out of 32 SA elts
 	ftabChars    = 10; // 10 chars in initial lookup table
 	bigEndian    = 0;  // little endian
@@ -76,6 +92,13 @@ static void resetOptions() {
 	justRef      = false; // *just* write compact reference, don't index
 	reverseType  = REF_READ_REVERSE_EACH;
 	nthreads     = 1;
+	concurrentMirror = false; // build forward and mirror indexes at once
+	saEngine     = SA_ENGINE_BLOCKWISE; // suffix-array builder
+	memoryLimit  = 0;     // bytes to plan the build within; 0 = probe
+	appendBase.clear();   // index to extend with the input sequences
+	appendConflicts.clear();
+	checkpointDir.clear(); // where to keep state for resuming a killed build
+	profileJson.clear();   // where to write per-phase time and memory use
 	wrapper.clear();
 }
 
@@ -91,7 +114,14 @@ enum {
 	ARG_USAGE,
 	ARG_NEW_REVERSE,
 	ARG_THREADS,
-	ARG_WRAPPER
+	ARG_WRAPPER,
+	ARG_INTERLEAVED,
+	ARG_CONCURRENT_MIRROR,
+	ARG_SA_ENGINE,
+	ARG_MEMORY_LIMIT,
+	ARG_APPEND,
+	ARG_CHECKPOINT_DIR,
+	ARG_PROFILE_JSON
 };
 
 /**
@@ -118,17 +148,24 @@ static void printUsage(ostream& out) {
 		    << "                            has fewer than 4 billion nucleotides" << endl;
 	}
 	out << "    -a/--noauto             disable automatic -p/--bmax/--dcv memory-fitting" << endl
+	    << "    --memory-limit <int>    fit -p/--bmax/--dcv to this many bytes (K/M/G suffix ok)" << endl
 	    << "    -p/--packed             use packed strings internally; slower, uses less mem" << endl
 	    << "    --bmax <int>            max bucket sz for blockwise suffix-array builder" << endl
 	    //<< "    --bmaxmultsqrt <int>    max bucket sz as multiple of sqrt(ref len)" << endl
 	    << "    --bmaxdivn <int>        max bucket sz as divisor of ref len (default: 4)" << endl
 	    << "    --dcv <int>             diff-cover period for blockwise (default: 1024)" << endl
 	    << "    --nodc                  disable diff-cover (algorithm becomes quadratic)" << endl
+	    << "    --sa-engine <name>      suffix-array builder: blockwise (default) or sais" << endl
 	    << "    -r/--noref              don't build .3/.4.ebwt (packed reference) portion" << endl
 	    << "    -3/--justref            just build .3/.4.ebwt (packed reference) portion" << endl
 	    << "    -o/--offrate <int>      SA is sampled every 2^offRate BWT chars (default: 5)" << endl
 	    << "    -t/--ftabchars <int>    # of chars consumed in initial lookup (default: 10)" << endl
+	    << "    --interleaved           store occ counts in every BWT line" << endl
 	    << "    --threads <int>         # of threads" << endl
+	    << "    --concurrent-mirror     build forward and mirror indexes at the same time" << endl
+	    << "    --append <ebwt_base>    index <ebwt_base>'s sequences followed by reference_in" << endl
+	    << "    --checkpoint-dir <dir>  save progress in <dir>; rerun to resume a killed build" << endl
+	    << "    --profile-json <file>   write time, memory and I/O of each build phase to <file>" << endl
 	    << "    --ntoa                  convert Ns in reference to As" << endl
 	    //<< "    --big --little          endianness (default: little, this host: "
 	    //<< (currentlyBigEndian()? "big":"little") << ")" << endl
@@ -177,6 +214,13 @@ static struct option long_options[] = {
 	{(char*)"usage",        no_argument,       0,            ARG_USAGE},
 	{(char*)"wrapper",      required_argument, 0,            ARG_WRAPPER},
 	{(char*)"new-reverse",  no_argument,       0,            ARG_NEW_REVERSE},
+	{(char*)"interleaved",  no_argument,       0,            ARG_INTERLEAVED},
+	{(char*)"concurrent-mirror", no_argument,  0,            ARG_CONCURRENT_MIRROR},
+	{(char*)"sa-engine",    required_argument, 0,            ARG_SA_ENGINE},
+	{(char*)"memory-limit", required_argument, 0,            ARG_MEMORY_LIMIT},
+	{(char*)"append",       required_argument, 0,            ARG_APPEND},
+	{(char*)"checkpoint-dir", required_argument, 0,          ARG_CHECKPOINT_DIR},
+	{(char*)"profile-json", required_argument, 0,            ARG_PROFILE_JSON},
 	{(char*)0, 0, 0, 0} // terminator
 };
 
@@ -203,6 +247,67 @@ static int parseNumber(T lower, const char *errmsg) {
 	return -1;
 }
 
+/**
+ * Parse a byte count with an optional K, M or G suffix (powers of
+ * 1024) out of optarg.  Exits with an error and a usage message if
+ * it's malformed or zero.
+ */
+static size_t parseByteCount(const char *errmsg) {
+	char *end = NULL;
+	errno = 0;
+	double n = strtod(optarg, &end);
+	size_t mult = 1;
+	if(end != optarg && *end != '\0' && end[1] == '\0') {
+		switch(toupper(*end)) {
+			case 'K': mult = 1024; end++; break;
+			case 'M': mult = 1024 * 1024; end++; break;
+			case 'G': mult = 1024 * 1024 * 1024; end++; break;
+			default: break;
+		}
+	}
+	if(end == optarg || *end != '\0' || errno != 0 || n * mult < 1.0) {
+		cerr << errmsg << endl;
+		printUsage(cerr);
+		throw 1;
+	}
+	return (size_t)(n * mult);
+}
+
+/**
+ * If option 'opt' (or the flag-setting long option at 'optIndex' when
+ * 'opt' is 0) sets something --append takes from the index it extends
+ * or doesn't support, remember it so that main() can refuse the
+ * combination once all options are parsed.
+ */
+static void noteAppendConflict(int opt, int optIndex) {
+	const char *name = NULL;
+	switch(opt) {
+		case 'l': name = "-l/--linerate"; break;
+		case 'i': name = "-i/--linesperside"; break;
+		case 'o': name = "-o/--offrate"; break;
+		case 't': name = "-t/--ftabchars"; break;
+		case 'p': name = "-p/--packed"; break;
+		case '3': name = "-3/--justref"; break;
+		case ARG_BMAX: name = "--bmax"; break;
+		case ARG_BMAX_MULT: name = "--bmaxmultsqrt"; break;
+		case ARG_BMAX_DIV: name = "--bmaxdivn"; break;
+		case ARG_DCV: name = "--dcv"; break;
+		case ARG_NEW_REVERSE: name = "--new-reverse"; break;
+		case ARG_INTERLEAVED: name = "--interleaved"; break;
+		case ARG_CONCURRENT_MIRROR: name = "--concurrent-mirror"; break;
+		case ARG_SA_ENGINE: name = "--sa-engine"; break;
+		case ARG_MEMORY_LIMIT: name = "--memory-limit"; break;
+		case ARG_CHECKPOINT_DIR: name = "--checkpoint-dir"; break;
+		case 0:
+			if(long_options[optIndex].flag == &noDc) name = "--nodc";
+			break;
+		default: break;
+	}
+	if(name != NULL) {
+		appendConflicts.push_back(name);
+	}
+}
+
 /**
  * Read command-line arguments
  */
@@ -214,6 +319,7 @@ static void parseOptions(int argc, const char **argv) {
 		next_option = getopt_long(
 			argc, const_cast<char**>(argv),
 			short_options, long_options, &option_index);
+		noteAppendConflict(next_option, option_index);
 		switch (next_option) {
 			case ARG_WRAPPER: wrapper = optarg;	break;
 			case 'f': format = FASTA; break;
@@ -270,6 +376,27 @@ static void parseOptions(int argc, const char **argv) {
 			        nthreads = parseNumber<int>(0, "--threads arg must be at least 1");
 		                break;
 			case ARG_NEW_REVERSE: reverseType = REF_READ_REVERSE; break;
+			case ARG_INTERLEAVED: interleaved = true; break;
+			case ARG_CONCURRENT_MIRROR: concurrentMirror = true; break;
+			case ARG_MEMORY_LIMIT:
+				memoryLimit = parseByteCount("--memory-limit arg must be a positive number of bytes");
+				break;
+			case ARG_APPEND: appendBase = optarg; break;
+			case ARG_CHECKPOINT_DIR: checkpointDir = optarg; break;
+			case ARG_PROFILE_JSON: profileJson = optarg; break;
+			case ARG_SA_ENGINE: {
+				string engine = optarg;
+				if(engine == "blockwise") {
+					saEngine = SA_ENGINE_BLOCKWISE;
+				} else if(engine == "sais") {
+					saEngine = SA_ENGINE_SAIS;
+				} else {
+					cerr << "Error: --sa-engine arg must be blockwise or sais" << endl;
+					printUsage(cerr);
+					throw 1;
+				}
+				break;
+			}
 			case 'a': autoMem = false; break;
 			case 'q': verbose = false; break;
 			case 's': sanityCheck = true; break;
@@ -293,27 +420,29 @@ static void parseOptions(int argc, const char **argv) {
 	if (!bmaxDivNSet) {
 		bmaxDivN *= nthreads;
 	}
+#if (__cplusplus < 201103L)
+	if (concurrentMirror) {
+		cerr << "Warning: --concurrent-mirror needs a C++11 build; building the mirror index afterwards" << endl;
+		concurrentMirror = false;
+	}
+#endif
 }
 
 /**
- * Drive the Ebwt construction process and optionally sanity-check the
- * result.
+ * Open the reference sequences named in infiles (or given on the
+ * command line) as a list of FileBufs.  Sequences given on the command
+ * line are named by their index, counting from firstName.
  */
-template<typename TStr>
-static void driver(const string& infile,
-                   EList<string>& infiles,
-                   const string& outfile,
-                   bool reverse = false)
+static void openRefStreams(const EList<string>& infiles,
+                           EList<FileBuf*>& is,
+                           size_t firstName = 0)
 {
-	EList<FileBuf*> is;
-	bool bisulfite = false;
-	RefReadInParams refparams(reverse ? reverseType : REF_READ_FORWARD, nsToAs, bisulfite);
 	assert_gt(infiles.size(), 0);
 	if(format == CMDLINE) {
 		// Adapt sequence strings to stringstreams open for input
 		stringstream *ss = new stringstream();
 		for(size_t i = 0; i < infiles.size(); i++) {
-			(*ss) << ">" << i << endl << infiles[i] << endl;
+			(*ss) << ">" << (firstName + i) << endl << infiles[i] << endl;
 		}
 		FileBuf *fb = new FileBuf(ss);
 		assert(fb != NULL);
@@ -349,6 +478,295 @@ static void driver(const string& infile,
 			is.push_back(fb);
 		}
 	}
+}
+
+/**
+ * Return the prefix of the checkpoint files for the index with
+ * basename 'outfile', or "" if there's no --checkpoint-dir.
+ */
+static string checkpointBase(const string& outfile) {
+	if(checkpointDir.empty()) {
+		return "";
+	}
+	size_t slash = outfile.find_last_of('/');
+	return checkpointDir + "/" + (slash == string::npos ? outfile : outfile.substr(slash + 1));
+}
+
+/**
+ * Describe the index the build writes to 'outfile' well enough that a
+ * rerun only skips an index a killed run finished if it's the same.
+ * Input files are described by size and modification time too, so
+ * that editing a reference between runs doesn't leave a forward index
+ * of the old text next to a mirror index of the new one.
+ */
+static string checkpointDesc(const EList<string>& infiles, const string& outfile) {
+	ostringstream os;
+	os << outfile << " <-";
+	for(size_t i = 0; i < infiles.size(); i++) {
+		os << " " << infiles[i];
+		struct stat st;
+		if(format != CMDLINE && stat(infiles[i].c_str(), &st) == 0) {
+			os << " (" << st.st_size << " bytes, mtime " << st.st_mtime << ")";
+		}
+	}
+	os << " format " << format << " linerate " << lineRate
+	   << " linesperside " << linesPerSide << " offrate " << offRate
+	   << " ftabchars " << ftabChars << " interleaved " << interleaved
+	   << " ntoa " << nsToAs << " reverse " << reverseType
+	   << " bigendian " << bigEndian;
+	return os.str();
+}
+
+/**
+ * True iff a run killed earlier already wrote the index 'outfile'.
+ */
+static bool checkpointDone(const EList<string>& infiles, const string& outfile) {
+	if(checkpointDir.empty()) {
+		return false;
+	}
+	ifstream in1((outfile + ".1." + gEbwt_ext).c_str());
+	ifstream in2((outfile + ".2." + gEbwt_ext).c_str());
+	return in1.good() && in2.good() &&
+	       SACheckpoint::isDone(checkpointBase(outfile), checkpointDesc(infiles, outfile));
+}
+
+/**
+ * Construct the forward or mirror Ebwt from the reference streams and
+ * the size records read from them, and optionally sanity-check the
+ * result.
+ */
+template<typename TStr>
+static void buildEbwt(EList<FileBuf*>& is,
+                      EList<RefRecord>& szs,
+                      EList<uint32_t>& plens,
+                      std::pair<size_t, size_t> sztot,
+                      const RefReadInParams& refparams,
+                      const string& outfile,
+                      bool reverse,
+                      int nthr,
+                      size_t memLimit)
+{
+	// Construct Ebwt from input strings and parameters
+	Ebwt ebwt(TStr(),
+		  packed,
+		  lineRate,
+		  linesPerSide,
+		  offRate,      // suffix-array sampling rate
+		  -1,           // ISA sampling rate
+		  ftabChars,    // number of chars in initial arrow-pair calc
+		  nthr,
+		  outfile,      // basename for .?.ebwt files
+		  !reverse,     // fw
+		  !entireSA,    // useBlockwise
+		  bmax,         // block size for blockwise SA builder
+		  bmaxMultSqrt, // block size as multiplier of sqrt(len)
+		  bmaxDivN,     // block size as divisor of len
+		  noDc? 0 : dcv,// difference-cover period
+		  is,           // list of input streams
+		  szs,          // list of reference sizes
+		  plens,        // list of not-all-gap reference sequence lengths
+		  (TIndexOffU)sztot.first,  // total size of all unambiguous ref chars
+		  refparams,    // reference read-in parameters
+		  seed,         // pseudo-random number generator seed
+		  -1,           // override offRate
+		  -1,           // override isaRate
+		  verbose,      // be talkative
+		  autoMem,      // pass exceptions up to the toplevel so that we can adjust memory settings automatically
+		  sanityCheck,  // verify results and internal consistency
+		  interleaved,  // one-line sides with in-line occ counts?
+		  saEngine,     // suffix-array builder
+		  memLimit,     // bytes to fit the build in, or 0
+		  checkpointBase(outfile)); // prefix of checkpoint files, if any
+	// Note that the Ebwt is *not* resident in memory at this time.  To
+	// load it into memory, call ebwt.loadIntoMemory()
+	if(verbose) {
+		// Print Ebwt's vital stats
+		ebwt.eh().print(cout);
+	}
+	if(sanityCheck) {
+		// Try restoring the original string (if there were
+		// multiple texts, what we'll get back is the joined,
+		// padded string, not a list)
+		ebwt.loadIntoMemory(
+			-1,
+			false,
+			false);
+		BTRefString s2; ebwt.restore(s2);
+		ebwt.evictFromMemory();
+		{
+			BTRefString joinedss = Ebwt::join<BTRefString >(
+				is,          // list of input streams
+				szs,         // list of reference sizes
+				(TIndexOffU)sztot.first, // total size of all unambiguous ref chars
+				refparams,   // reference read-in parameters
+				seed);       // pseudo-random number generator seed
+			if(refparams.reverse == REF_READ_REVERSE) {
+				joinedss.reverse();
+			}
+			assert_eq(joinedss.length(), s2.length());
+			assert(sstr_eq(joinedss, s2));
+		}
+		if(verbose) {
+			if(s2.length() < 1000) {
+				cout << "Passed restore check: " << s2.toZBuf() << endl;
+			} else {
+				cout << "Passed restore check: (" << s2.length() << " chars)" << endl;
+			}
+		}
+	}
+}
+
+#if (__cplusplus >= 201103L)
+/**
+ * Estimate the peak memory footprint, in bytes, of one
+ * Ebwt::initFromVector build using nthr threads over a joined
+ * reference of jlen characters, with the parameters it tries first.
+ */
+static size_t buildFootprint(TIndexOffU jlen, int nthr) {
+	// Joined reference string
+	size_t sz = packed ? (jlen + 3) / 4 : jlen;
+	if(saEngine == SA_ENGINE_SAIS) {
+		return sz + Ebwt::saisFootprint(jlen, nthr, ftabChars);
+	}
+	TIndexOffU bm = bmax;
+	if(bm == OFF_MASK) {
+		if(bmaxMultSqrt != OFF_MASK) {
+			bm = (TIndexOffU)sqrt((double)jlen) * bmaxMultSqrt;
+		} else if(bmaxDivN != 0xffffffff) {
+			bm = max<TIndexOffU>(jlen / bmaxDivN, 1);
+		} else {
+			bm = (TIndexOffU)sqrt((double)jlen);
+		}
+		bm -= (bm >> 2);
+	}
+	return sz + Ebwt::blockwiseFootprint(jlen, bm, noDc ? 0 : dcv, nthr, ftabChars);
+}
+
+/**
+ * Return the number of bytes of physical memory available to us, or
+ * 0 if that can't be determined.
+ */
+static size_t availableMemory() {
+	ifstream meminfo("/proc/meminfo");
+	string key;
+	size_t kb;
+	while(meminfo >> key >> kb) {
+		if(key == "MemAvailable:") {
+			return kb * 1024;
+		}
+		meminfo.ignore(256, '\n');
+	}
+	long pages = sysconf(_SC_PHYS_PAGES);
+	long pagesz = sysconf(_SC_PAGESIZE);
+	if(pages <= 0 || pagesz <= 0) {
+		return 0;
+	}
+	return (size_t)pages * (size_t)pagesz;
+}
+
+/**
+ * Return true iff a forward build with fwThreads threads and a mirror
+ * build with rvThreads threads should both fit in memory at once.
+ * Unless there's a --memory-limit to go by, this also makes a
+ * quick-and-dirty attempt to allocate the combined footprint, like
+ * initFromVector's own test.
+ */
+static bool mirrorFits(TIndexOffU jlen, int fwThreads, int rvThreads) {
+	size_t need = buildFootprint(jlen, fwThreads) +
+	              buildFootprint(jlen, rvThreads);
+	size_t avail = memoryLimit > 0 ? Ebwt::memBudget(memoryLimit) : availableMemory();
+	if(verbose) {
+		cout << "Estimated memory for concurrent forward and mirror builds: "
+		     << need << " bytes (" << avail << " available)" << endl;
+	}
+	if(avail > 0 && need > avail) {
+		return false;
+	}
+	if(memoryLimit > 0) {
+		return true;
+	}
+	try {
+		AutoArray<uint8_t> tmp(need);
+	} catch(bad_alloc& e) {
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Build the forward index and the mirror index on two threads at
+ * once, splitting the --threads budget between them.  Each build reads
+ * the reference through its own streams and works on its own copy of
+ * the size records, so the caller's are left as they were.  An
+ * exception thrown by either build is rethrown here once both have
+ * finished.
+ */
+template<typename TStr>
+static void buildBothEbwts(const EList<string>& infiles,
+                           const EList<RefRecord>& szs,
+                           const EList<uint32_t>& plens,
+                           std::pair<size_t, size_t> sztot,
+                           const string& outfile,
+                           int fwThreads,
+                           int rvThreads)
+{
+	bool bisulfite = false;
+	RefReadInParams fwparams(REF_READ_FORWARD, nsToAs, bisulfite);
+	RefReadInParams rvparams(reverseType, nsToAs, bisulfite);
+	EList<FileBuf*> fwis, rvis;
+	openRefStreams(infiles, fwis);
+	openRefStreams(infiles, rvis);
+	EList<RefRecord> fwszs(szs), rvszs(szs);
+	EList<uint32_t> fwplens(plens), rvplens(plens);
+	int rvErr = 0;
+	bool rvBadAlloc = false;
+	std::thread rvThread([&]() {
+		ProfilePhase phase("mirror", PROFILE_TOP);
+		try {
+			buildEbwt<TStr>(rvis, rvszs, rvplens, sztot, rvparams,
+			                outfile + ".rev", true, rvThreads, memoryLimit / 2);
+		} catch(bad_alloc& e) {
+			rvBadAlloc = true;
+		} catch(int e) {
+			rvErr = (e == 0 ? 1 : e);
+		} catch(std::exception& e) {
+			cerr << "Error: " << e.what() << endl;
+			rvErr = 1;
+		}
+	});
+	try {
+		buildEbwt<TStr>(fwis, fwszs, fwplens, sztot, fwparams, outfile, false,
+		                fwThreads, memoryLimit / 2);
+	} catch(...) {
+		rvThread.join();
+		throw;
+	}
+	rvThread.join();
+	if(rvBadAlloc) {
+		throw bad_alloc();
+	}
+	if(rvErr != 0) {
+		throw rvErr;
+	}
+}
+#endif
+
+/**
+ * Drive the Ebwt construction process and optionally sanity-check the
+ * result.  If mirror is true, try to build the mirror index at the
+ * same time as the forward one; return true iff that happened.
+ */
+template<typename TStr>
+static bool driver(const string& infile,
+                   EList<string>& infiles,
+                   const string& outfile,
+                   bool reverse = false,
+                   bool mirror = false)
+{
+	EList<FileBuf*> is;
+	bool bisulfite = false;
+	RefReadInParams refparams(reverse ? reverseType : REF_READ_FORWARD, nsToAs, bisulfite);
+	openRefStreams(infiles, is);
 	// Vector for the ordered list of "records" comprising the input
 	// sequences.  A record represents a stretch of unambiguous
 	// characters in one of the input sequences.
@@ -357,6 +775,7 @@ static void driver(const string& infile,
 	std::pair<size_t, size_t> sztot;
 	{
 		if(verbose) cout << "Reading reference sizes" << endl;
+		ProfilePhase phase("reference_scan");
 		Timer _t(cout, "  Time reading reference sizes: ", verbose);
 		if(!reverse && (writeRef || justRef)) {
 			// For forward reference, dump it to .3.ebwt and .4.ebwt
@@ -378,7 +797,8 @@ static void driver(const string& infile,
 			// streams are reset once it's done.
 			writeU<int32_t>(fout3, 1, bigEndian); // endianness sentinel
 			TIndexOff numSeqs = 0;
-			sztot = fastaRefReadSizes(is, szs, plens, refparams, &bpout, numSeqs);
+			sztot = fastaRefReadSizes(is, szs, plens, refparams, &bpout, numSeqs,
+			                          format == CMDLINE ? NULL : &infiles, nthreads);
 			writeU<TIndexOffU>(fout3, (TIndexOffU)szs.size(), bigEndian); // write # records
 			for(size_t i = 0; i < szs.size(); i++) szs[i].write(fout3, bigEndian);
 			if(sztot.first == 0) {
@@ -409,82 +829,231 @@ static void driver(const string& infile,
 			// Read in the sizes of all the unambiguous stretches of the
 			// genome into a vector of RefRecords
 			TIndexOff numSeqs = 0;
-			sztot = fastaRefReadSizes(is, szs, plens, refparams, NULL, numSeqs);
+			sztot = fastaRefReadSizes(is, szs, plens, refparams, NULL, numSeqs,
+			                          format == CMDLINE ? NULL : &infiles, nthreads);
 		}
 	}
-	if(justRef) return;
+	if(justRef) return false;
 	assert_gt(sztot.first, 0);
 	assert_gt(sztot.second, 0);
 	assert_gt(szs.size(), 0);
-	// Construct Ebwt from input strings and parameters
-	Ebwt ebwt(TStr(),
-		  packed,
-		  lineRate,
-		  linesPerSide,
-		  offRate,      // suffix-array sampling rate
-		  -1,           // ISA sampling rate
-		  ftabChars,    // number of chars in initial arrow-pair calc
-		  nthreads,
-		  outfile,      // basename for .?.ebwt files
-		  !reverse,     // fw
-		  !entireSA,    // useBlockwise
-		  bmax,         // block size for blockwise SA builder
-		  bmaxMultSqrt, // block size as multiplier of sqrt(len)
-		  bmaxDivN,     // block size as divisor of len
-		  noDc? 0 : dcv,// difference-cover period
-		  is,           // list of input streams
-		  szs,          // list of reference sizes
-		  plens,        // list of not-all-gap reference sequence lengths
-		  (TIndexOffU)sztot.first,  // total size of all unambiguous ref chars
-		  refparams,    // reference read-in parameters
-		  seed,         // pseudo-random number generator seed
-		  -1,           // override offRate
-		  -1,           // override isaRate
-		  verbose,      // be talkative
-		  autoMem,      // pass exceptions up to the toplevel so that we can adjust memory settings automatically
-		  sanityCheck,  // verify results and internal consistency
-		  false);       // are we building a bt2 index?
-	// Note that the Ebwt is *not* resident in memory at this time.  To
-	// load it into memory, call ebwt.loadIntoMemory()
-	if(verbose) {
-		// Print Ebwt's vital stats
-		ebwt.eh().print(cout);
-	}
-	if(sanityCheck) {
-		// Try restoring the original string (if there were
-		// multiple texts, what we'll get back is the joined,
-		// padded string, not a list)
-		ebwt.loadIntoMemory(
-			-1,
-			false,
-			false);
-		BTRefString s2; ebwt.restore(s2);
-		ebwt.evictFromMemory();
-		{
-			BTRefString joinedss = Ebwt::join<BTRefString >(
-				is,          // list of input streams
-				szs,         // list of reference sizes
-				(TIndexOffU)sztot.first, // total size of all unambiguous ref chars
-				refparams,   // reference read-in parameters
-				seed);       // pseudo-random number generator seed
-			if(refparams.reverse == REF_READ_REVERSE) {
-				joinedss.reverse();
+#if (__cplusplus >= 201103L)
+	if(mirror) {
+		assert(!reverse);
+		int fwThreads = (nthreads + 1) / 2;
+		int rvThreads = max(nthreads / 2, 1);
+		TIndexOffU jlen = 0;
+		for(size_t i = 0; i < szs.size(); i++) {
+			jlen += szs[i].len;
+		}
+		if(!mirrorFits(jlen, fwThreads, rvThreads)) {
+			if(verbose) {
+				cout << "Not enough memory to build the mirror index concurrently; "
+				     << "building it afterwards" << endl;
+			}
+		} else {
+			try {
+				buildBothEbwts<TStr>(infiles, szs, plens, sztot, outfile,
+				                     fwThreads, rvThreads);
+				return true;
+			} catch(bad_alloc& e) {
+				// The estimate was too optimistic; one build at a time
+				// may still fit
+				cerr << "Ran out of memory building the forward and mirror indexes "
+				     << "concurrently; building them one at a time." << endl;
 			}
-			assert_eq(joinedss.length(), s2.length());
-			assert(sstr_eq(joinedss, s2));
 		}
-		if(verbose) {
-			if(s2.length() < 1000) {
-				cout << "Passed restore check: " << s2.toZBuf() << endl;
-			} else {
-				cout << "Passed restore check: (" << s2.length() << " chars)" << endl;
+	}
+#endif
+	buildEbwt<TStr>(is, szs, plens, sztot, refparams, outfile, reverse, nthreads, memoryLimit);
+	return false;
+}
+
+/**
+ * Build the forward and mirror indexes of the sequences in the index
+ * appendBase followed by the sequences in infiles.  The existing
+ * sequences are taken from appendBase's .3 and .4 files rather than
+ * read again, and the existing indexes supply the order of their
+ * suffixes (see AppendRows), so only the new suffixes and the few
+ * existing ones they could reorder get sorted.  The existing indexes'
+ * parameters are kept.
+ */
+static void appendDriver(EList<string>& infiles, const string& outfile) {
+	bool bisulfite = false;
+	RefReadInParams refparams(REF_READ_FORWARD, nsToAs, bisulfite);
+	// Size records and packed reference of the existing sequences
+	EList<RefRecord> szs;
+	EList<uint8_t> oldBits;
+	TIndexOffU oldLen = 0;
+	{
+		string file3 = appendBase + ".3." + gEbwt_ext;
+		string file4 = appendBase + ".4." + gEbwt_ext;
+		FILE *f3 = fopen(file3.c_str(), "rb");
+		FILE *f4 = fopen(file4.c_str(), "rb");
+		if(f3 == NULL || f4 == NULL) {
+			cerr << "Could not open index files " << file3 << " and " << file4 << endl
+			     << "--append needs the packed reference of the index it extends; it can't" << endl
+			     << "extend an index built with -r/--noref." << endl;
+			throw 1;
+		}
+		bool swap = (readU<int32_t>(f3, false) != 1);
+		TIndexOffU nrecs = readU<TIndexOffU>(f3, swap);
+		for(TIndexOffU i = 0; i < nrecs; i++) {
+			szs.push_back(RefRecord(f3, swap));
+			oldLen += szs.back().len;
+		}
+		fclose(f3);
+		oldBits.resizeExact((oldLen + 3) / 4);
+		if(fread(oldBits.ptr(), 1, oldBits.size(), f4) != oldBits.size()) {
+			cerr << "Error reading " << file4 << endl;
+			throw 1;
+		}
+		fclose(f4);
+	}
+	Ebwt old(appendBase,
+	         -1,      // not the mirror index
+	         true,    // fw
+	         -1,      // don't override offRate
+	         -1,      // don't override isaRate
+	         false,   // use memory-mapped files
+	         false,   // use shared memory
+	         false,   // sweep memory-mapped files
+	         true,    // load names
+	         false,   // verbose
+	         false);  // startVerbose
+	if(old.eh()._len != oldLen || old.eh()._entireReverse) {
+		cerr << "Error: the .3/.4 files of " << appendBase << " don't match its index" << endl;
+		throw 1;
+	}
+	old.loadIntoMemory(-1, true, false);
+	// Size records of the new sequences
+	EList<FileBuf*> is;
+	openRefStreams(infiles, is, old.nPat());
+	EList<RefRecord> newSzs;
+	EList<uint32_t> plens;
+	for(TIndexOffU i = 0; i < old.nPat(); i++) {
+		plens.push_back((uint32_t)old.plen()[i]);
+	}
+	TIndexOff numSeqs = 0;
+	std::pair<size_t, size_t> sztot;
+	{
+		ProfilePhase phase("reference_scan");
+		sztot = fastaRefReadSizes(is, newSzs, plens, refparams, NULL, numSeqs,
+		                          format == CMDLINE ? NULL : &infiles, nthreads);
+	}
+	if(sztot.first == 0) {
+		cerr << "Error: No unambiguous stretches of characters in the input.  Aborting..." << endl;
+		throw 1;
+	}
+	for(size_t i = 0; i < newSzs.size(); i++) {
+		szs.push_back(newSzs[i]);
+	}
+	// Joined text: the existing reference, then the new sequences,
+	// whose names are added to the existing ones
+	S2bDnaString s(oldLen + sztot.first);
+	for(TIndexOffU i = 0; i < oldLen; i++) {
+		s.set((oldBits[i >> 2] >> ((i & 3) << 1)) & 3, i);
+	}
+	EList<string> names;
+	for(TIndexOffU i = 0; i < old.nPat(); i++) {
+		names.push_back(old.refnames()[i]);
+	}
+	{
+		TIndexOffU dstoff = oldLen;
+		for(size_t i = 0; i < is.size(); i++) {
+			bool first = true;
+			while(!is[i]->eof()) {
+				names.push_back("");
+				RefRecord rec = fastaRefReadAppend(*is[i], first, s, dstoff, refparams, &names.back());
+#ifndef ACCOUNT_FOR_ALL_GAP_REFS
+				if(rec.first && rec.len == 0) rec.first = false;
+#endif
+				first = false;
+				if(!rec.first) {
+					names.pop_back();
+				} else if(names.back().empty()) {
+					// If name was empty, replace with an index
+					ostringstream stm;
+					stm << (names.size()-1);
+					names.back() = stm.str();
+				}
 			}
+			is[i]->reset();
 		}
+		assert_eq(s.length(), dstoff);
 	}
+	if(writeRef) {
+		string file3 = outfile + ".3." + gEbwt_ext;
+		string file4 = outfile + ".4." + gEbwt_ext;
+		ofstream fout3(file3.c_str(), ios::binary);
+		if(!fout3.good()) {
+			cerr << "Could not open index file for writing: \"" << file3 << "\"" << endl
+				 << "Please make sure the directory exists and that permissions allow writing by" << endl
+				 << "Bowtie." << endl;
+			throw 1;
+		}
+		writeU<int32_t>(fout3, 1, bigEndian); // endianness sentinel
+		writeU<TIndexOffU>(fout3, (TIndexOffU)szs.size(), bigEndian);
+		for(size_t i = 0; i < szs.size(); i++) szs[i].write(fout3, bigEndian);
+		fout3.close();
+		BitpairOutFileBuf bpout(file4.c_str());
+		bpout.writePacked(oldBits.ptr(), oldLen);
+		for(TIndexOffU i = oldLen; i < s.length(); i++) {
+			bpout.write(s[i]);
+		}
+		bpout.close();
+	}
+	oldBits.clear();
+	{
+		ProfilePhase phase("forward");
+		Timer timer(cout, "Total time for forward index: ", verbose);
+		Ebwt ebwt(old, s, szs, plens, names, outfile, true, nthreads,
+		          -1, -1, verbose, false, sanityCheck);
+	}
+	old.evictFromMemory();
+	if(!doubleEbwt) {
+		return;
+	}
+	// The mirror index's text has each stretch reversed
+	{
+		TIndexOffU off = 0;
+		for(size_t i = 0; i < szs.size(); i++) {
+			if(szs[i].len == 0) continue;
+			s.reverseWindow(off, szs[i].len);
+			off += szs[i].len;
+		}
+	}
+	Ebwt oldRev(appendBase + ".rev", 0, false, -1, -1,
+	            false, false, false, true, false, false);
+	if(oldRev.eh()._len != oldLen || oldRev.eh()._entireReverse) {
+		cerr << "Error: the mirror index of " << appendBase << " doesn't match its forward index" << endl;
+		throw 1;
+	}
+	oldRev.loadIntoMemory(0, true, false);
+	ProfilePhase phase("mirror");
+	Timer timer(cout, "Total time for mirror index: ", verbose);
+	Ebwt ebwt(oldRev, s, szs, plens, names, outfile + ".rev", false, nthreads,
+	          -1, -1, verbose, false, sanityCheck);
 }
 
 static const char *argv0 = NULL;
 
+/**
+ * If --profile-json was given, write the phases recorded to it.
+ * Returns the exit status for a build that otherwise succeeded.
+ */
+static int writeProfile(int argc, const char **argv) {
+	if(!gBuildProfile) {
+		return 0;
+	}
+	string cmd;
+	for(int i = 0; i < argc; i++) {
+		if(i > 0) cmd += " ";
+		cmd += argv[i];
+	}
+	return writeBuildProfile(profileJson, cmd) ? 0 : 1;
+}
+
 extern "C" {
 /**
  * main function.  Parses command-line arguments.
@@ -551,6 +1120,7 @@ extern "C" {
 				 << "  Output files: \"" << outfile << ".*." + gEbwt_ext + "\"" << endl
 				 << "  Line rate: " << lineRate << " (line is " << (1<<lineRate) << " bytes)" << endl
 				 << "  Lines per side: " << linesPerSide << " (side is " << ((1<<lineRate)*linesPerSide) << " bytes)" << endl
+				 << "  Layout: " << (interleaved ? "interleaved" : "paired") << endl
 				 << "  Offset rate: " << offRate << " (one in " << (1<<offRate) << ")" << endl
 				 << "  FTable chars: " << ftabChars << endl
 				 << "  Strings: " << (packed? "packed" : "unpacked") << endl
@@ -571,6 +1141,21 @@ extern "C" {
 				cout << "  Max bucket size, len divisor: " << bmaxDivN << endl;
 			}
 			cout << "  Difference-cover sample period: " << dcv << endl;
+			if(!appendBase.empty()) {
+				cout << "  Appending to: \"" << appendBase << ".*." + gEbwt_ext + "\"" << endl;
+			}
+			if(!checkpointDir.empty()) {
+				cout << "  Checkpoint directory: " << checkpointDir << endl;
+			}
+			if(!profileJson.empty()) {
+				cout << "  Profile output: " << profileJson << endl;
+			}
+			cout << "  Suffix-array engine: " << (saEngine == SA_ENGINE_SAIS ? "sais" : "blockwise") << endl;
+			if(memoryLimit > 0) {
+				cout << "  Memory limit: " << memoryLimit << " bytes" << endl;
+			} else {
+				cout << "  Memory limit: none" << endl;
+			}
 			cout << "  Endianness: " << (bigEndian? "big":"little") << endl
 				 << "  Actual local endianness: " << (currentlyBigEndian()? "big":"little") << endl
 				 << "  Sanity checking: " << (sanityCheck? "enabled":"disabled") << endl;
@@ -586,13 +1171,45 @@ extern "C" {
 				cout << "  " << infiles[i] << endl;
 			}
 		}
+		if(!profileJson.empty()) {
+			enableBuildProfile();
+		}
 		// Seed random number generator
 		srand(seed);
-		{
+		if(!appendBase.empty()) {
+			if(!appendConflicts.empty()) {
+				cerr << "Error: --append can't be combined with ";
+				for(size_t i = 0; i < appendConflicts.size(); i++) {
+					cerr << (i > 0 ? ", " : "") << appendConflicts[i];
+				}
+				cerr << endl << "The new index takes its parameters from " << appendBase << "." << endl;
+				return 1;
+			}
+			appendDriver(infiles, outfile);
+			return writeProfile(argc, argv);
+		}
+		bool mirror = doubleEbwt && concurrentMirror;
+		bool mirrorBuilt = false;
+		if(!checkpointDir.empty()) {
+			struct stat st;
+			if(stat(checkpointDir.c_str(), &st) != 0 &&
+			   mkdir(checkpointDir.c_str(), 0755) != 0)
+			{
+				cerr << "Could not create checkpoint directory \"" << checkpointDir << "\"" << endl;
+				return 1;
+			}
+		}
+		const string outfileRev = outfile + ".rev";
+		bool fwDone = checkpointDone(infiles, outfile);
+		bool rvDone = doubleEbwt && checkpointDone(infiles, outfileRev);
+		if(fwDone) {
+			if(verbose) cout << "Forward index was already built; resuming after it" << endl;
+		} else {
+			ProfilePhase phase("forward");
 			Timer timer(cout, "Total time for call to driver() for forward index: ", verbose);
 			if(!packed) {
 				try {
-					driver<BTRefString >(infile, infiles, outfile);
+					mirrorBuilt = driver<BTRefString >(infile, infiles, outfile, false, mirror);
 				} catch(bad_alloc& e) {
 					if(autoMem) {
 						cerr << "Switching to a packed string representation." << endl;
@@ -603,15 +1220,22 @@ extern "C" {
 				}
 			}
 			if(packed) {
-				driver<S2bDnaString>(infile, infiles, outfile);
+				mirrorBuilt = driver<S2bDnaString>(infile, infiles, outfile, false, mirror);
+			}
+			if(!checkpointDir.empty()) {
+				SACheckpoint::markDone(checkpointBase(outfile), checkpointDesc(infiles, outfile));
+				if(mirrorBuilt) {
+					SACheckpoint::markDone(checkpointBase(outfileRev), checkpointDesc(infiles, outfileRev));
+				}
 			}
 		}
-		if(doubleEbwt) {
+		if(doubleEbwt && !mirrorBuilt && !rvDone) {
 			srand(seed);
+			ProfilePhase phase("mirror");
 			Timer timer(cout, "Total time for backward call to driver() for mirror index: ", verbose);
 			if(!packed) {
 				try {
-					driver<BTRefString >(infile, infiles, outfile + ".rev", true);
+					driver<BTRefString >(infile, infiles, outfileRev, true);
 				} catch(bad_alloc& e) {
 					if(autoMem) {
 						cerr << "Switching to a packed string representation." << endl;
@@ -622,10 +1246,17 @@ extern "C" {
 				}
 			}
 			if(packed) {
-				driver<S2bDnaString>(infile, infiles, outfile + ".rev", true);
+				driver<S2bDnaString>(infile, infiles, outfileRev, true);
+			}
+			if(!checkpointDir.empty()) {
+				SACheckpoint::markDone(checkpointBase(outfileRev), checkpointDesc(infiles, outfileRev));
 			}
 		}
-		return 0;
+		if(!checkpointDir.empty()) {
+			SACheckpoint::clearDone(checkpointBase(outfile));
+			SACheckpoint::clearDone(checkpointBase(outfileRev));
+		}
+		return writeProfile(argc, argv);
 	} catch(std::exception& e) {
 		cerr << "Command: ";
 		for(int i = 0; i < argc; i++) cerr << argv[i] << " ";
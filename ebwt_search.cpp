@@ -23,10 +23,12 @@
 #include "alphabet.h"
 #include "assert_helpers.h"
 #include "bitset.h"
+#include "cpu_numa_info.h"
 #include "ds.h"
 #include "ebwt.h"
 #include "ebwt_search.h"
 #include "endian_swap.h"
+#include "exact_batch.h"
 #include "formats.h"
 #include "hit.h"
 #include "pat.h"
@@ -41,6 +43,8 @@
 
 static int FNAME_SIZE;
 #if (__cplusplus >= 201103L)
+#include <condition_variable>
+#include <mutex>
 #include <thread>
 static std::atomic<int> thread_counter;
 #else
@@ -106,6 +110,7 @@ static bool useMm;			// use memory-mapped files to hold the index
 static bool mmSweep;			// sweep through memory-mapped files immediately after mapping
 static bool stateful;			// use stateful aligners
 static uint32_t prefetchWidth;		// number of reads to process in parallel w/ --stateful
+static uint32_t lfBatch;		// number of reads to advance in lockstep in 0-mismatch mode
 static uint32_t minInsert;		// minimum insert size (Maq = 0, SOAP = 400)
 static uint32_t maxInsert;		// maximum insert size (Maq = 250, SOAP = 600)
 static bool mate1fw;			// -1 mate aligns in fw orientation on fw strand
@@ -115,7 +120,7 @@ static uint32_t mixedThresh;		// threshold for when to switch to paired-end mixe
 static uint32_t mixedAttemptLim;	// number of attempts to make in "mixed mode" before giving up on orientation
 static bool dontReconcileMates;		// suppress pairwise all-versus-all way of resolving mates
 static uint32_t cacheLimit;		// ranges w/ size > limit will be cached
-static uint32_t cacheSize;		// # words per range cache
+static uint32_t cacheSize;		// # bytes per range cache
 static int offBase;			// offsets are 0-based by default, but configurable
 static bool tryHard;			// set very high maxBts, mixedAttemptLim
 static uint32_t skipReads;		// # reads/read pairs to skip
@@ -147,6 +152,11 @@ static EList<string> qualities2;
 static string wrapper;			// Type of wrapper script
 bool gAllowMateContainment;
 bool noUnal;				// don't print unaligned reads
+int inflateThreads;			// # threads inflating gzipped reads; 0 = inflate inline
+static int outQueueMb;			// MB of output queued for the writer thread; 0 = no writer thread
+static int bamThreads;			// # threads compressing BAM output; 0 = compress inline
+static bool numa;			// pin threads to NUMA nodes, each with a copy of the index
+static bool hugePages;			// load index and reference into huge pages
 string ebwtFile;			// read serialized Ebwt from this file
 MUTEX_T gLock;
 
@@ -209,6 +219,12 @@ static void resetOptions() {
 	mmSweep			= false;	// sweep through memory-mapped files immediately after mapping
 	stateful		= false;	// use stateful aligners
 	prefetchWidth		= 1;		// number of reads to process in parallel w/ --stateful
+	lfBatch			= 0;		// number of reads to advance in lockstep in 0-mismatch mode
+	inflateThreads		= -1;		// # threads inflating gzipped reads; -1 = pick based on -p
+	outQueueMb		= 0;		// write output from the alignment threads
+	bamThreads		= -1;		// # threads compressing BAM output; -1 = pick based on -p
+	numa			= false;	// let threads float; one copy of the index
+	hugePages		= false;	// load index and reference into normal pages
 	minInsert		= 0;		// minimum insert size (Maq = 0, SOAP = 400)
 	maxInsert		= 250;		// maximum insert size (Maq = 250, SOAP = 600)
 	mate1fw			= true;		// -1 mate aligns in fw orientation on fw strand
@@ -218,7 +234,7 @@ static void resetOptions() {
 	mixedAttemptLim		= 100;		// number of attempts to make in "mixed mode" before giving up on orientation
 	dontReconcileMates	= true;		// suppress pairwise all-versus-all way of resolving mates
 	cacheLimit		= 5;		// ranges w/ size > limit will be cached
-	cacheSize		= 0;		// # words per range cache
+	cacheSize		= 0;		// # bytes per range cache
 	offBase			= 0;		// offsets are 0-based by default, but configurable
 	tryHard			= false;	// set very high maxBts, mixedAttemptLim
 	skipReads		= 0;		// # reads/read pairs to skip
@@ -327,6 +343,13 @@ enum {
 	ARG_THREAD_CEILING,
 	ARG_THREAD_PIDDIR,
 	ARG_REORDER_SAM,
+	ARG_LF_BATCH,
+	ARG_INFLATE_THREADS,
+	ARG_OUT_QUEUE_MB,
+	ARG_BAM,
+	ARG_BAM_THREADS,
+	ARG_NUMA,
+	ARG_HUGEPAGES,
 };
 
 static struct option long_options[] = {
@@ -424,6 +447,13 @@ static struct option long_options[] = {
 {(char*)"thread-ceiling",required_argument,  0,                  ARG_THREAD_CEILING},
 {(char*)"thread-piddir",                     required_argument,  0,                    ARG_THREAD_PIDDIR},
 {(char*)"reorder",                           no_argument,        0,                    ARG_REORDER_SAM},
+{(char*)"lf-batch",                          required_argument,  0,                    ARG_LF_BATCH},
+{(char*)"inflate-threads",                   required_argument,  0,                    ARG_INFLATE_THREADS},
+{(char*)"out-queue-mb",                      required_argument,  0,                    ARG_OUT_QUEUE_MB},
+{(char*)"bam",                               no_argument,        0,                    ARG_BAM},
+{(char*)"bam-threads",                       required_argument,  0,                    ARG_BAM_THREADS},
+{(char*)"numa",                              no_argument,        0,                    ARG_NUMA},
+{(char*)"hugepages",                         no_argument,        0,                    ARG_HUGEPAGES},
 {(char*)0,                                   0,                  0,                    0} //  terminator
 };
 
@@ -512,6 +542,7 @@ static void printUsage(ostream& out) {
 	    << "  --fullref          write entire ref name (default: only up to 1st space)" << endl
 	    << "SAM:" << endl
 	    << "  -S/--sam           write hits in SAM format" << endl
+	    << "  --bam              write hits in BAM format (SAM options apply)" << endl
 	    << "  --mapq <int>       default mapping quality (MAPQ) to print for SAM alignments" << endl
 	    << "  --sam-nohead       supppress header lines (starting with @) for SAM output" << endl
 	    << "  --sam-nosq         supppress @SQ header lines for SAM output" << endl
@@ -519,6 +550,14 @@ static void printUsage(ostream& out) {
 	    << "Performance:" << endl
 	    << "  -o/--offrate <int> override offrate of index; must be >= index's offrate" << endl
 	    << "  -p/--threads <int> number of alignment threads to launch (default: 1)" << endl
+	    << "  --lf-batch <int>   # reads to search in lockstep w/ -v 0 (default: 0 = off)" << endl
+	    << "  --inflate-threads <int>" << endl
+	    << "                     # threads inflating gzipped reads (default: -p/4)" << endl
+	    << "  --out-queue-mb <int>" << endl
+	    << "                     write output from its own thread, queueing <= <int> MB" << endl
+	    << "  --bam-threads <int> # threads compressing --bam output (default: -p/2)" << endl
+	    << "  --numa             spread threads over NUMA nodes; copy index to each node" << endl
+	    << "  --hugepages        load index and reference into huge pages" << endl
 #ifdef BOWTIE_MM
 	    << "  --mm               use memory-mapped I/O for index; many 'bowtie's can share" << endl
 #endif
@@ -652,7 +691,7 @@ static void parseOptions(int argc, const char **argv) {
 			case ARG_RF: mate1fw = false; mate2fw = true;  mateFwSet = true; break;
 			case ARG_FR: mate1fw = true;  mate2fw = false; mateFwSet = true; break;
 			case ARG_RANGE: rangeMode = true; break;
-			case 'S': outType = OUTPUT_SAM; break;
+			case 'S': if(outType != OUTPUT_BAM) outType = OUTPUT_SAM; break;
 			case ARG_SHMEM: useShmem = true; break;
 			case ARG_SHOWSEED: showSeed = true; break;
 			case ARG_ALLOW_CONTAIN: gAllowMateContainment = true; break;
@@ -694,6 +733,21 @@ static void parseOptions(int argc, const char **argv) {
 			case ARG_PREFETCH_WIDTH:
 				prefetchWidth = parseInt(1, "--prewidth must be at least 1");
 				break;
+			case ARG_LF_BATCH:
+				lfBatch = parseInt(0, "--lf-batch must be at least 0");
+				break;
+			case ARG_INFLATE_THREADS:
+				inflateThreads = parseInt(0, "--inflate-threads must be at least 0");
+				break;
+			case ARG_OUT_QUEUE_MB:
+				outQueueMb = parseInt(0, "--out-queue-mb must be at least 0");
+				break;
+			case ARG_BAM: outType = OUTPUT_BAM; break;
+			case ARG_BAM_THREADS:
+				bamThreads = parseInt(0, "--bam-threads must be at least 0");
+				break;
+			case ARG_NUMA: numa = true; break;
+			case ARG_HUGEPAGES: hugePages = true; break;
 			case 'B':
 				offBase = parseInt(-999999, "-B/--offbase cannot be a large negative number");
 				break;
@@ -835,9 +889,41 @@ static void parseOptions(int argc, const char **argv) {
 	if (nthreads == 1 && !thread_stealing) {
 		reorder = false;
 	}
-	if (reorder == true && outType != OUTPUT_SAM) {
-		cerr << "Bowtie will reorder its output only when outputting SAM." << endl
-		     << "Please specify the `-S` parameter if you intend on using this option." << endl;
+	if (inflateThreads < 0) {
+		// One inflating thread per 4 search threads keeps up with
+		// -v 0 on BGZF input; with -p 1, just inflate inline
+		inflateThreads = (nthreads == 1) ? 0 : min(max(nthreads / 4, 1), 16);
+	}
+	if (bamThreads < 0) {
+		// Deflating costs a fraction of what aligning does, but -a
+		// and -k output can be large
+		bamThreads = min(max(nthreads / 2, 1), 16);
+	}
+#if (__cplusplus < 201103L)
+	if (outQueueMb > 0) {
+		cerr << "Warning: --out-queue-mb needs a C++11 build; writing output from the alignment threads" << endl;
+		outQueueMb = 0;
+	}
+	if (numa) {
+		cerr << "Warning: --numa needs a C++11 build; ignoring" << endl;
+		numa = false;
+	}
+	if (cacheSize > 0) {
+		cerr << "Warning: --cachesz needs a C++11 build; ignoring" << endl;
+		cacheSize = 0;
+	}
+	if (outType == OUTPUT_BAM) {
+		cerr << "Error: --bam needs a C++11 build" << endl;
+		throw 1;
+	}
+#endif
+	if (hugePages && (useMm || useShmem)) {
+		cerr << "Warning: --hugepages has no effect with --mm or --shmem" << endl;
+		hugePages = false;
+	}
+	if (reorder == true && outType != OUTPUT_SAM && outType != OUTPUT_BAM) {
+		cerr << "Bowtie will reorder its output only when outputting SAM or BAM." << endl
+		     << "Please specify the `-S` or `--bam` parameter if you intend on using this option." << endl;
 		throw 1;
 	}
 	//bool paired = mates1.size() > 0 || mates2.size() > 0 || mates12.size() > 0;
@@ -980,7 +1066,7 @@ static const char *argv0 = NULL;
 static PatternSourcePerThreadFactory*
 createPatsrcFactory(PatternComposer& _patsrc, int tid, uint32_t max_buf) {
 	PatternSourcePerThreadFactory *patsrcFact;
-	patsrcFact = new PatternSourcePerThreadFactory(_patsrc, max_buf, skipReads, seed);
+	patsrcFact = new PatternSourcePerThreadFactory(_patsrc, max_buf, skipReads, seed, tid);
 	assert(patsrcFact != NULL);
 	return patsrcFact;
 }
@@ -1116,6 +1202,136 @@ static bool steal_thread(int pid, int orig_nthreads) {
 }
 #endif
 
+#if (__cplusplus >= 201103L)
+/**
+ * With --numa, each search thread is pinned to a NUMA node, round-
+ * robin, and searches a replica of the index made on that node.  The
+ * node the index was loaded on searches the original.  Replicas share
+ * offs with the original, which is instead spread evenly over all the
+ * nodes.
+ */
+struct NumaReplica {
+	const Ebwt *master;
+	int node;
+	Ebwt *copy;  // NULL while the claiming thread is still copying
+	bool own;    // copy is a replica we must delete, not master itself
+};
+static EList<NumaReplica> numaReplicas;
+static std::mutex numaMutex;
+static std::condition_variable numaCopied;
+
+/**
+ * Pin search thread tid to its node, if --numa is on.
+ */
+static void numaPinWorker(int tid) {
+	if(numa) {
+		pin_thread_to_node(tid);
+	}
+}
+
+/**
+ * Return the replica of ebwt for search thread tid's node.  The first
+ * thread on a node to ask claims that node's slot and makes the copy
+ * without holding numaMutex, so nodes copy in parallel; later threads
+ * on the same node wait for it.  Returns ebwt itself if --numa is
+ * off, there's only one node, or tid's node is where ebwt lives.
+ */
+static Ebwt& numaLocalEbwt(Ebwt& ebwt, int tid) {
+	if(!numa || numa_node_count() < 2) {
+		return ebwt;
+	}
+	const int node = tid % numa_node_count();
+	std::unique_lock<std::mutex> lk(numaMutex);
+	bool first = true;
+	for(size_t i = 0; i < numaReplicas.size(); i++) {
+		if(numaReplicas[i].master == &ebwt) {
+			if(numaReplicas[i].node == node) {
+				// Entries may move as others are added; wait by index
+				numaCopied.wait(lk, [i] { return numaReplicas[i].copy != NULL; });
+				return *numaReplicas[i].copy;
+			}
+			first = false;
+		}
+	}
+	NumaReplica r;
+	r.master = &ebwt;
+	if(first) {
+		if(!useMm && !useShmem) {
+			interleave_pages(ebwt.offs(), (size_t)ebwt.eh().offsSz());
+		}
+		// Leave the original to the node it was loaded on
+		int home = numa_node_of(ebwt.ebwt() + ebwt.eh().ebwtTotLen() / 2);
+		if(home >= 0) {
+			r.node = home;
+			r.copy = &ebwt;
+			r.own = false;
+			numaReplicas.push_back(r);
+			if(home == node) {
+				return ebwt;
+			}
+		}
+	}
+	r.node = node;
+	r.copy = NULL;
+	r.own = true;
+	const size_t slot = numaReplicas.size();
+	numaReplicas.push_back(r);
+	lk.unlock();
+	Ebwt *copy = new Ebwt(ebwt, true);
+	lk.lock();
+	numaReplicas[slot].copy = copy;
+	lk.unlock();
+	numaCopied.notify_all();
+	return *copy;
+}
+
+/**
+ * Free the replicas once the search threads are done, and let the
+ * calling thread, which did some of the searching, run anywhere again.
+ */
+static void numaDropReplicas() {
+	if(!numa) {
+		return;
+	}
+	for(size_t i = 0; i < numaReplicas.size(); i++) {
+		if(numaReplicas[i].own) {
+			delete numaReplicas[i].copy;
+		}
+	}
+	numaReplicas.clear();
+	unpin_thread();
+}
+#else
+static void numaPinWorker(int tid) { }
+static Ebwt& numaLocalEbwt(Ebwt& ebwt, int tid) { return ebwt; }
+static void numaDropReplicas() { }
+#endif
+
+/**
+ * Range caches for the forward and mirror indexes, shared by all the
+ * search threads so that a big range resolved by one is reused by the
+ * rest.  NULL unless the aligners are stateful and --cachesz is set,
+ * which needs a C++11 build.
+ */
+static RangeCache* cacheFw = NULL;
+static RangeCache* cacheBw = NULL;
+
+static void createRangeCaches(Ebwt* ebwtFw, Ebwt* ebwtBw) {
+	if(!stateful || cacheSize == 0) {
+		return;
+	}
+	cacheFw = new RangeCache(cacheSize, ebwtFw, sanityCheck);
+	if(ebwtBw != NULL) {
+		cacheBw = new RangeCache(cacheSize, ebwtBw, sanityCheck);
+	}
+}
+
+static void deleteRangeCaches() {
+	delete cacheFw;
+	delete cacheBw;
+	cacheFw = cacheBw = NULL;
+}
+
 /**
  * Search through a single (forward) Ebwt index for exact end-to-end
  * hits.  Assumes that index is already loaded into memory.
@@ -1139,7 +1355,8 @@ static void exactSearchWorker(void *vp) {
 	}
 	PatternComposer&	_patsrc = *exactSearch_patsrc;
 	HitSink&		_sink   = *exactSearch_sink;
-	Ebwt&			ebwt    = *exactSearch_ebwt;
+	numaPinWorker(tid);
+	Ebwt&			ebwt    = numaLocalEbwt(*exactSearch_ebwt, tid);
 	EList<BTRefString >&	os	= *exactSearch_os;
 
 	// Per-thread initialization
@@ -1166,6 +1383,12 @@ static void exactSearchWorker(void *vp) {
 	        false);         // considerQuals
 	pair<bool, bool> get_read_ret = make_pair(false, false);
 	bool skipped = false;
+	// With --lf-batch, exact-match ranges are calculated for several
+	// reads at once and then reported one read at a time
+	ExactBatch batch;
+	TReadId batchFirst = 0;  // rdid of first read covered by batch
+	size_t batchSz = 0;      // # reads covered by batch
+	const size_t batchStride = (nofw ? 0 : 1) + (norc ? 0 : 1);
 #ifdef PER_THREAD_TIMING
 	uint64_t ncpu_changeovers = 0;
 	uint64_t nnuma_changeovers = 0;
@@ -1195,6 +1418,38 @@ static void exactSearchWorker(void *vp) {
 #endif
 			FINISH_READ(patsrc);
 			GET_READ(patsrc);
+			if(lfBatch > 1) {
+				TReadId rdid = patsrc->rdid();
+				if(rdid < batchFirst || rdid >= batchFirst + batchSz) {
+					// Match this read and the ones after it in lockstep
+					batchSz = patsrc->lookahead(lfBatch);
+					batchFirst = rdid;
+					batch.reset(&ebwt);
+					for(size_t i = 0; i < batchSz; i++) {
+						if(!nofw) batch.add(patsrc->bufa(i).patFw);
+						if(!norc) batch.add(patsrc->bufa(i).patRc);
+					}
+					batch.run();
+				}
+				size_t bi = (size_t)(rdid - batchFirst) * batchStride;
+				uint32_t plen = (uint32_t)patFw.length();
+				if(!nofw) {
+					params.setFw(true);
+					bt.setQuery(patsrc->bufa());
+					bt.setOffs(0, 0, plen, plen, plen, plen);
+					if(bt.reportExact(batch.top(bi), batch.bot(bi))) {
+						continue;
+					}
+					bi++;
+				}
+				if(!norc) {
+					params.setFw(false);
+					bt.setQuery(patsrc->bufa());
+					bt.setOffs(0, 0, plen, plen, plen, plen);
+					bt.reportExact(batch.top(bi), batch.bot(bi));
+				}
+				continue;
+			}
 			#include "search_exact.c"
 		}
 		FINISH_READ(patsrc);
@@ -1232,7 +1487,8 @@ static void exactSearchWorkerStateful(void *vp) {
 	}
 	PatternComposer&	_patsrc = *exactSearch_patsrc;
 	HitSink&		_sink   = *exactSearch_sink;
-	Ebwt&			ebwt    = *exactSearch_ebwt;
+	numaPinWorker(tid);
+	Ebwt&			ebwt    = numaLocalEbwt(*exactSearch_ebwt, tid);
 	EList<BTRefString >&	os	= *exactSearch_os;
 	BitPairReference*	refs    = exactSearch_refs;
 
@@ -1247,8 +1503,8 @@ static void exactSearchWorkerStateful(void *vp) {
 			!norc,
 			_sink,
 			*sinkFact,
-			NULL, //&cacheFw,
-			NULL, //&cacheBw,
+			cacheFw,
+			cacheBw,
 			cacheLimit,
 			pool,
 			refs,
@@ -1275,8 +1531,8 @@ static void exactSearchWorkerStateful(void *vp) {
 			mhits,       // for symCeiling
 			mixedThresh,
 			mixedAttemptLim,
-			NULL, //&cacheFw,
-			NULL, //&cacheBw,
+			cacheFw,
+			cacheBw,
 			cacheLimit,
 			pool,
 			refs, os,
@@ -1352,10 +1608,11 @@ static void exactSearch(PatternComposer& _patsrc,
 	bool pair = mates1.size() > 0 || mates12.size() > 0;
 	if((pair && mixedThresh < 0xffffffff)) {
 		Timer _t(cerr, "Time loading reference: ", timing);
-		refs = new BitPairReference(adjustedEbwtFileBase, sanityCheck, NULL, &os, false, true, useMm, useShmem, mmSweep, verbose, startVerbose);
+		refs = new BitPairReference(adjustedEbwtFileBase, sanityCheck, NULL, &os, false, true, useMm, useShmem, mmSweep, verbose, startVerbose, hugePages);
 		if(!refs->loaded()) throw 1;
 	}
 	exactSearch_refs   = refs;
+	createRangeCaches(&ebwt, NULL);
 	int tids[max(nthreads, thread_ceiling)];
 #if (__cplusplus >= 201103L)
 	EList<std::thread*> threads;
@@ -1474,6 +1731,8 @@ static void exactSearch(PatternComposer& _patsrc,
 		}
 #endif
 	}
+	numaDropReplicas();
+	deleteRangeCaches();
 	if(refs != NULL) delete refs;
 
 	for (int i = 0; i < nthreads - 1; i++) {
@@ -1518,8 +1777,9 @@ static void mismatchSearchWorkerFullStateful(void *vp) {
 	}
 	PatternComposer&	_patsrc = *mismatchSearch_patsrc;
 	HitSink&		_sink   = *mismatchSearch_sink;
-	Ebwt&			ebwtFw  = *mismatchSearch_ebwtFw;
-	Ebwt&			ebwtBw  = *mismatchSearch_ebwtBw;
+	numaPinWorker(tid);
+	Ebwt&			ebwtFw  = numaLocalEbwt(*mismatchSearch_ebwtFw, tid);
+	Ebwt&			ebwtBw  = numaLocalEbwt(*mismatchSearch_ebwtBw, tid);
 	EList<BTRefString >& os      = *mismatchSearch_os;
 	BitPairReference*	refs    = mismatchSearch_refs;
 
@@ -1535,8 +1795,8 @@ static void mismatchSearchWorkerFullStateful(void *vp) {
 			!norc,
 			_sink,
 			*sinkFact,
-			NULL, //&cacheFw,
-			NULL, //&cacheBw,
+			cacheFw,
+			cacheBw,
 			cacheLimit,
 			pool,
 			refs,
@@ -1564,8 +1824,8 @@ static void mismatchSearchWorkerFullStateful(void *vp) {
 			mhits,     // for symCeiling
 			mixedThresh,
 			mixedAttemptLim,
-			NULL, //&cacheFw,
-			NULL, //&cacheBw,
+			cacheFw,
+			cacheBw,
 			cacheLimit,
 			pool,
 			refs, os,
@@ -1615,8 +1875,9 @@ static void mismatchSearchWorkerFull(void *vp){
 	}
 	PatternComposer&	_patsrc = *mismatchSearch_patsrc;
 	HitSink&		_sink   = *mismatchSearch_sink;
-	Ebwt&			ebwtFw  = *mismatchSearch_ebwtFw;
-	Ebwt&			ebwtBw  = *mismatchSearch_ebwtBw;
+	numaPinWorker(tid);
+	Ebwt&			ebwtFw  = numaLocalEbwt(*mismatchSearch_ebwtFw, tid);
+	Ebwt&			ebwtBw  = numaLocalEbwt(*mismatchSearch_ebwtBw, tid);
 	EList<BTRefString >& os      = *mismatchSearch_os;
 
 	// Per-thread initialization
@@ -1731,10 +1992,11 @@ static void mismatchSearchFull(PatternComposer& _patsrc,
 	bool pair = mates1.size() > 0 || mates12.size() > 0;
 	if(pair && mixedThresh < 0xffffffff) {
 		Timer _t(cerr, "Time loading reference: ", timing);
-		refs = new BitPairReference(adjustedEbwtFileBase, sanityCheck, NULL, &os, false, true, useMm, useShmem, mmSweep, verbose, startVerbose);
+		refs = new BitPairReference(adjustedEbwtFileBase, sanityCheck, NULL, &os, false, true, useMm, useShmem, mmSweep, verbose, startVerbose, hugePages);
 		if(!refs->loaded()) throw 1;
 	}
 	mismatchSearch_refs = refs;
+	createRangeCaches(&ebwtFw, &ebwtBw);
 
 	int tids[max(nthreads, thread_ceiling)];
 #if (__cplusplus >= 201103L)
@@ -1855,6 +2117,8 @@ static void mismatchSearchFull(PatternComposer& _patsrc,
 		}
 #endif
 	}
+	numaDropReplicas();
+	deleteRangeCaches();
 	if(refs != NULL) delete refs;
 
 	for (int i = 0; i < nthreads - 1; i++) {
@@ -1964,8 +2228,9 @@ static void twoOrThreeMismatchSearchWorkerStateful(void *vp) {
 	}
 	PatternComposer&	_patsrc = *twoOrThreeMismatchSearch_patsrc;
 	HitSink&		_sink   = *twoOrThreeMismatchSearch_sink;
-	Ebwt&			ebwtFw  = *twoOrThreeMismatchSearch_ebwtFw;
-	Ebwt&			ebwtBw  = *twoOrThreeMismatchSearch_ebwtBw;
+	numaPinWorker(tid);
+	Ebwt&			ebwtFw  = numaLocalEbwt(*twoOrThreeMismatchSearch_ebwtFw, tid);
+	Ebwt&			ebwtBw  = numaLocalEbwt(*twoOrThreeMismatchSearch_ebwtBw, tid);
 	EList<BTRefString >& os      = *twoOrThreeMismatchSearch_os;
 	BitPairReference*	refs    = twoOrThreeMismatchSearch_refs;
 	static bool		two     = twoOrThreeMismatchSearch_two;
@@ -1983,8 +2248,8 @@ static void twoOrThreeMismatchSearchWorkerStateful(void *vp) {
 			!norc,
 			_sink,
 			*sinkFact,
-			NULL, //&cacheFw,
-			NULL, //&cacheBw,
+			cacheFw,
+			cacheBw,
 			cacheLimit,
 			pool,
 			refs,
@@ -2013,8 +2278,8 @@ static void twoOrThreeMismatchSearchWorkerStateful(void *vp) {
 			mhits,       // for symCeiling
 			mixedThresh,
 			mixedAttemptLim,
-			NULL, //&cacheFw,
-			NULL, //&cacheBw,
+			cacheFw,
+			cacheBw,
 			cacheLimit,
 			pool,
 			refs, os,
@@ -2077,8 +2342,9 @@ static void twoOrThreeMismatchSearchWorkerFull(void *vp) {
 	        os,          /* reference sequences */
 	        true,        /* read is forward */
 	        true);       /* index is forward */
-	Ebwt& ebwtFw = *twoOrThreeMismatchSearch_ebwtFw;
-	Ebwt& ebwtBw = *twoOrThreeMismatchSearch_ebwtBw;
+	numaPinWorker(tid);
+	Ebwt& ebwtFw = numaLocalEbwt(*twoOrThreeMismatchSearch_ebwtFw, tid);
+	Ebwt& ebwtBw = numaLocalEbwt(*twoOrThreeMismatchSearch_ebwtBw, tid);
 	GreedyDFSRangeSource btr1(
 	        &ebwtFw, params,
 	        0xffffffff,     // qualThresh
@@ -2219,10 +2485,11 @@ static void twoOrThreeMismatchSearchFull(
 	bool pair = mates1.size() > 0 || mates12.size() > 0;
 	if(pair && mixedThresh < 0xffffffff) {
 		Timer _t(cerr, "Time loading reference: ", timing);
-		refs = new BitPairReference(adjustedEbwtFileBase, sanityCheck, NULL, &os, false, true, useMm, useShmem, mmSweep, verbose, startVerbose);
+		refs = new BitPairReference(adjustedEbwtFileBase, sanityCheck, NULL, &os, false, true, useMm, useShmem, mmSweep, verbose, startVerbose, hugePages);
 		if(!refs->loaded()) throw 1;
 	}
 	twoOrThreeMismatchSearch_refs     = refs;
+	createRangeCaches(&ebwtFw, &ebwtBw);
 	twoOrThreeMismatchSearch_patsrc   = &_patsrc;
 	twoOrThreeMismatchSearch_sink     = &_sink;
 	twoOrThreeMismatchSearch_ebwtFw   = &ebwtFw;
@@ -2351,6 +2618,8 @@ static void twoOrThreeMismatchSearchFull(
 		}
 #endif
 	}
+	numaDropReplicas();
+	deleteRangeCaches();
 	if(refs != NULL) delete refs;
 
 	for (int i = 0; i < nthreads - 1; i++) {
@@ -2399,8 +2668,9 @@ static void seededQualSearchWorkerFull(void *vp) {
 	        os,          /* reference sequences */
 	        true,        /* read is forward */
 	        true);       /* index is forward */
-	Ebwt& ebwtFw = *seededQualSearch_ebwtFw;
-	Ebwt& ebwtBw = *seededQualSearch_ebwtBw;
+	numaPinWorker(tid);
+	Ebwt& ebwtFw = numaLocalEbwt(*seededQualSearch_ebwtFw, tid);
+	Ebwt& ebwtBw = numaLocalEbwt(*seededQualSearch_ebwtBw, tid);
 	PartialAlignmentManager * pamRc = NULL;
 	PartialAlignmentManager * pamFw = NULL;
 	if(seedMms > 0) {
@@ -2618,8 +2888,9 @@ static void seededQualSearchWorkerFullStateful(void *vp) {
 	}
 	PatternComposer&	_patsrc    = *seededQualSearch_patsrc;
 	HitSink&                _sink      = *seededQualSearch_sink;
-	Ebwt&			ebwtFw     = *seededQualSearch_ebwtFw;
-	Ebwt&			ebwtBw     = *seededQualSearch_ebwtBw;
+	numaPinWorker(tid);
+	Ebwt&			ebwtFw     = numaLocalEbwt(*seededQualSearch_ebwtFw, tid);
+	Ebwt&			ebwtBw     = numaLocalEbwt(*seededQualSearch_ebwtBw, tid);
 	EList<BTRefString >& os         = *seededQualSearch_os;
 	int                     qualCutoff = seededQualSearch_qualCutoff;
 	BitPairReference*       refs       = seededQualSearch_refs;
@@ -2644,8 +2915,8 @@ static void seededQualSearchWorkerFullStateful(void *vp) {
 			maxBts,
 			_sink,
 			*sinkFact,
-			NULL, //&cacheFw,
-			NULL, //&cacheBw,
+			cacheFw,
+			cacheBw,
 			cacheLimit,
 			pool,
 			refs,
@@ -2678,8 +2949,8 @@ static void seededQualSearchWorkerFullStateful(void *vp) {
 			mhits,       // for symCeiling
 			mixedThresh,
 			mixedAttemptLim,
-			NULL, //&cacheFw,
-			NULL, //&cacheBw,
+			cacheFw,
+			cacheBw,
 			cacheLimit,
 			pool,
 			refs,
@@ -2765,10 +3036,11 @@ static void seededQualCutoffSearchFull(
 	bool pair = mates1.size() > 0 || mates12.size() > 0;
 	if(pair && mixedThresh < 0xffffffff) {
 		Timer _t(cerr, "Time loading reference: ", timing);
-		refs = new BitPairReference(adjustedEbwtFileBase, sanityCheck, NULL, &os, false, true, useMm, useShmem, mmSweep, verbose, startVerbose);
+		refs = new BitPairReference(adjustedEbwtFileBase, sanityCheck, NULL, &os, false, true, useMm, useShmem, mmSweep, verbose, startVerbose, hugePages);
 		if(!refs->loaded()) throw 1;
 	}
 	seededQualSearch_refs = refs;
+	createRangeCaches(&ebwtFw, &ebwtBw);
 
 	int tids[max(nthreads, thread_ceiling)];
 #if (__cplusplus >= 201103L)
@@ -2897,6 +3169,8 @@ static void seededQualCutoffSearchFull(
 		}
 #endif
 	}
+	numaDropReplicas();
+	deleteRangeCaches();
 
 	if(refs != NULL) {
 		delete refs;
@@ -3102,6 +3376,14 @@ static void driver(const char * type,
 	} else {
 		patsrc = new DualPatternComposer(patsrcs_a, patsrcs_b);
 	}
+#if (__cplusplus >= 201103L)
+	// With more than one search thread, hand reading off to a dedicated
+	// thread that deals batches out to the workers
+	PatternComposer *patsrcBase = patsrc;
+	if(nthreads > 1) {
+		patsrc = new StealingPatternComposer(*patsrcBase, readsPerBatch, nthreads);
+	}
+#endif
 
 	// Open hit output file
 	if(verbose || startVerbose) {
@@ -3109,7 +3391,7 @@ static void driver(const char * type,
 	}
 	OutFileBuf *fout;
 	if(!outfile.empty()) {
-		fout = new OutFileBuf(outfile.c_str(), false);
+		fout = new OutFileBuf(outfile.c_str(), outType == OUTPUT_BAM);
 	} else {
 		fout = new OutFileBuf();
 	}
@@ -3130,7 +3412,8 @@ static void driver(const char * type,
 	                startVerbose, // talkative during initialization
 	                false /*passMemExc*/,
 	                sanityCheck,
-	                isBt2Index);
+	                isBt2Index,
+	                hugePages); // load into huge pages
 	Ebwt* ebwtBw = NULL;
 	// We need the mirror index if mismatches are allowed
 	if(mismatches > 0 || maqLike) {
@@ -3151,7 +3434,8 @@ static void driver(const char * type,
 			startVerbose, // talkative during initialization
 			false /*passMemExc*/,
 			sanityCheck,
-	        isBt2Index);
+	        isBt2Index,
+			hugePages); // load into huge pages
 	}
 	if(!os.empty()) {
 		for(size_t i = 0; i < os.size(); i++) {
@@ -3204,9 +3488,28 @@ static void driver(const char * type,
 					dumpMaxBase,
 					format == TAB_MATE, sampleMax,
 					refnames, nthreads,
-					outBatchSz, partitionSz);
-		} else if(outType == OUTPUT_SAM) {
-			SAMHitSink *sam = new SAMHitSink(
+					outBatchSz, (size_t)outQueueMb << 20,
+					partitionSz);
+		} else if(outType == OUTPUT_SAM || outType == OUTPUT_BAM) {
+			SAMHitSink *sam;
+#if (__cplusplus >= 201103L)
+			if(outType == OUTPUT_BAM) {
+				sam = new BAMHitSink(
+					*fout,
+					fullRef, samNoQnameTrunc,
+					dumpAlBase,
+					dumpUnalBase,
+					dumpMaxBase,
+					format == TAB_MATE,
+					sampleMax,
+					refnames,
+					nthreads,
+					outBatchSz,
+					reorder,
+					bamThreads);
+			} else
+#endif
+			sam = new SAMHitSink(
 				*fout,
 				fullRef, samNoQnameTrunc,
 				dumpAlBase,
@@ -3217,16 +3520,18 @@ static void driver(const char * type,
 				refnames,
 				nthreads,
 				outBatchSz,
-				reorder);
-			if(!samNoHead) {
+				reorder,
+				(size_t)outQueueMb << 20);
+			// BAM always has a header, if only to list the references
+			if(!samNoHead || outType == OUTPUT_BAM) {
 				EList<string> refnames;
-				if(!samNoSQ) {
+				if(!samNoSQ || outType == OUTPUT_BAM) {
 					readEbwtRefnames(adjustedEbwtFileBase, refnames);
 				}
 				sam->appendHeaders(
 					sam->out(),
 					ebwt.nPat(),
-					refnames, samNoSQ,
+					refnames, samNoHead, samNoSQ,
 					ebwt.plen(), fullRef,
 					samNoQnameTrunc,
 					argstr.c_str(),
@@ -3274,6 +3579,12 @@ static void driver(const char * type,
 			delete ebwtBw;
 		}
 		sink->finish(hadoopOut); // end the hits section of the hit file
+		// Composers go first; they may still have a reader thread using
+		// the sources
+		delete patsrc;
+#if (__cplusplus >= 201103L)
+		if(patsrcBase != patsrc) delete patsrcBase;
+#endif
 		for(size_t i = 0; i < patsrcs_a.size(); i++) {
 			assert(patsrcs_a[i] != NULL);
 			delete patsrcs_a[i];
@@ -3288,7 +3599,6 @@ static void driver(const char * type,
 				delete patsrcs_ab[i];
 			}
 		}
-		delete patsrc;
 		delete sink;
 		if(fout != NULL) delete fout;
 	}
@@ -43,7 +43,7 @@ public:
 		_qry(NULL),
 		_qlen(0),
 		_qual(NULL),
-		_name(NULL),
+		_rd(NULL),
 		_ebwt(ebwt),
 		_params(params),
 		_unrevOff(0),
@@ -97,7 +97,7 @@ public:
 			_qry  = fw ? &r.patFwRev : &r.patRcRev;
 			_qual = fw ? &r.qualRev  : &r.qual;
 		}
-		_name = &r.name;
+		_rd = &r;
 		// Reset _qlen
 		if(_qry->length() > _qlen) {
 			try {
@@ -296,6 +296,26 @@ public:
 		return ret;
 	}
 
+	/**
+	 * Report the end-to-end exact-match range [top, bot) for the
+	 * current query, as calculated ahead of time by ExactBatch.  This
+	 * stands in for backtrack() when no mismatches are allowed; the
+	 * hits reported are the same.
+	 *
+	 * Return true iff the HitSink has indicated that we're done with
+	 * this read.
+	 */
+	bool reportExact(TIndexOffU top, TIndexOffU bot) {
+		assert_gt(_qry->length(), 0);
+		assert_eq(0, _reportPartials);
+		bool ret = false;
+		if(bot > top) {
+			ret = reportAlignment(0, top, bot, 0);
+		}
+		if(finalize()) ret = true;
+		return ret;
+	}
+
 	/**
 	 * If there are any buffered results that have yet to be committed,
 	 * commit them.  This happens when looking for partial alignments.
@@ -381,7 +401,7 @@ public:
 		assert_geq(_qual->length(), _qry->length());
 		assert(_qry != NULL);
 		assert(_qual != NULL);
-		assert(_name != NULL);
+		assert(_rd != NULL);
 		assert(_qlen != 0);
 		assert_leq(ham, _qualThresh);
 		assert_lt(depth, _qlen); // can't have run off the end of qry
@@ -1543,7 +1563,7 @@ protected:
 			// their indices into the query string; not in terms
 			// of their offset from the 3' or 5' end.
 			assert_geq(cost, (uint32_t)(stratum << 14));
-			if(_ebwt->reportChaseOne((*_qry), _qual, _name,
+			if(_ebwt->reportChaseOne(*_rd,
 			                         _mms, _refcs,
 			                         stackDepth, ri, top, bot,
 			                         (uint32_t)_qlen, stratum, cost, _patid,
@@ -1698,7 +1718,7 @@ protected:
 	BTDnaString*        _qry;    // query (read) sequence
 	size_t              _qlen;   // length of _qry
 	BTString*           _qual;   // quality values for _qry
-	BTString*           _name;   // name of _qry
+	const Read*         _rd;     // read _qry and _qual come from
 	const Ebwt* _ebwt;   // Ebwt to search in
 	const EbwtSearchParams& _params;   // Ebwt to search in
 	uint32_t            _unrevOff; // unrevisitable chunk
@@ -0,0 +1,211 @@
+/*
+ * exact_batch.h
+ */
+
+#ifndef EXACT_BATCH_H_
+#define EXACT_BATCH_H_
+
+#include <stdint.h>
+#include "ds.h"
+#include "ebwt.h"
+#include "sstring.h"
+
+/**
+ * Finds the BW ranges of exact end-to-end matches for a batch of
+ * queries at once.  Rather than walking one query to completion before
+ * starting the next, as GreedyDFSRangeSource::backtrack() does, every
+ * active query is advanced by one LF step per round.  The side loci
+ * for a query's next step are computed (and the corresponding cache
+ * lines prefetched) as soon as its current step is done, so by the
+ * time the round comes back around to it the memory latency has been
+ * hidden behind the work done on all the other queries.
+ *
+ * The ranges computed are identical to those that the exact-matching
+ * mode of GreedyDFSRangeSource would arrive at, so hits can be
+ * reported from them with GreedyDFSRangeSource::reportExact().
+ */
+class ExactBatch {
+
+	/**
+	 * State for one query being matched.
+	 */
+	struct Job {
+		const BTDnaString* qry; // query, matched from right to left
+		uint32_t depth;         // # chars matched so far
+		TIndexOffU top;         // top of current range
+		TIndexOffU bot;         // bottom of current range
+		SideLocus ltop;         // side locus for top
+		SideLocus lbot;         // side locus for bot
+	};
+
+public:
+
+	ExactBatch() : ebwt_(NULL) { }
+
+	/**
+	 * Forget all queries and prepare to match against the given index.
+	 */
+	void reset(const Ebwt* ebwt) {
+		assert(ebwt != NULL);
+		ebwt_ = ebwt;
+		jobs_.clear();
+		active_.clear();
+	}
+
+	/**
+	 * Add a query to the batch and return its index.  The query must
+	 * remain valid until the range has been retrieved with top() and
+	 * bot().
+	 */
+	size_t add(const BTDnaString& qry) {
+		jobs_.expand();
+		Job& j = jobs_.back();
+		j.qry = &qry;
+		j.depth = 0;
+		j.top = j.bot = 0;
+		start(jobs_.size()-1);
+		return jobs_.size()-1;
+	}
+
+	/**
+	 * Advance all queries in lockstep until every one of them has
+	 * either been matched end to end or fallen off the index.
+	 */
+	void run() {
+		while(!active_.empty()) {
+			size_t nleft = 0;
+			for(size_t i = 0; i < active_.size(); i++) {
+				size_t ji = active_[i];
+				if(step(jobs_[ji])) {
+					active_[nleft++] = ji;
+				}
+			}
+			active_.resize(nleft);
+		}
+	}
+
+	/// Return the number of queries in the batch
+	size_t size() const { return jobs_.size(); }
+
+	/// Return top of the exact-match range for query i; after run()
+	TIndexOffU top(size_t i) const { return jobs_[i].top; }
+
+	/// Return bottom of the exact-match range for query i; after run()
+	TIndexOffU bot(size_t i) const { return jobs_[i].bot; }
+
+protected:
+
+	/**
+	 * Calculate the initial range for job i, either from the ftab or,
+	 * if the query is shorter than the ftab, from fchr.  Queries with
+	 * Ns can't match exactly and are given an empty range right away.
+	 */
+	void start(size_t i) {
+		Job& j = jobs_[i];
+		const Ebwt& ebwt = *ebwt_;
+		const BTDnaString& qry = *j.qry;
+		const uint32_t qlen = (uint32_t)qry.length();
+		for(uint32_t k = 0; k < qlen; k++) {
+			if((int)qry[k] == 4) {
+				return; // leave range empty
+			}
+		}
+		const uint32_t ftabChars = (uint32_t)ebwt._eh._ftabChars;
+		if(qlen == 0) {
+			return;
+		} else if(qlen >= ftabChars) {
+			uint32_t ftabOff = qry[qlen - ftabChars];
+			for(uint32_t k = ftabChars - 1; k > 0; k--) {
+				ftabOff <<= 2;
+				ftabOff |= (uint32_t)qry[qlen - k];
+			}
+			assert_lt(ftabOff, ebwt._eh._ftabLen-1);
+			j.top = ebwt.ftabHi(ftabOff);
+			j.bot = ebwt.ftabLo(ftabOff+1);
+			j.depth = ftabChars;
+		} else {
+			int c = (int)qry[qlen-1];
+			j.top = ebwt._fchr[c];
+			j.bot = ebwt._fchr[c+1];
+			j.depth = 1;
+		}
+		if(j.bot <= j.top) {
+			j.top = j.bot = 0;
+			return;
+		}
+		if(j.depth < qlen) {
+			prep(j);
+			active_.push_back(i);
+		}
+	}
+
+	/**
+	 * Compute the side loci for the job's current range and issue
+	 * prefetches for every cache line the next LF step will read.
+	 */
+	void prep(Job& j) {
+		const Ebwt& ebwt = *ebwt_;
+		const EbwtParams& eh = ebwt._eh;
+		SideLocus::initFromTopBot(j.top, j.bot, eh, ebwt._ebwt, j.ltop, j.lbot);
+		prefetch(j.ltop);
+		if(j.lbot._sideByteOff != j.ltop._sideByteOff) {
+			prefetch(j.lbot);
+		}
+	}
+
+	/**
+	 * Prefetch the lines of the side holding locus l along with the
+	 * line holding the occ[] counts that countFwSide/countBwSide will
+	 * add in, which for Bowtie 1 indexes may live in a neighboring
+	 * side.  SideLocus::initFromRow has already fetched the first line.
+	 */
+	void prefetch(const SideLocus& l) {
+#ifndef NO_PREFETCH
+		const EbwtParams& eh = ebwt_->_eh;
+		const uint8_t *side = l.side(ebwt_->_ebwt);
+		for(uint32_t off = eh._lineSz; off < eh._sideSz; off += eh._lineSz) {
+			__builtin_prefetch((const void *)(side + off), 0, PREFETCH_LOCALITY);
+		}
+		if(!eh._isBt2Index) {
+			const uint8_t *cnts = l._fw ? (side - 2*OFF_SIZE) :
+			                              (side + (2*eh._sideSz) - 2*OFF_SIZE);
+			__builtin_prefetch((const void *)cnts, 0, PREFETCH_LOCALITY);
+		}
+#endif
+	}
+
+	/**
+	 * Advance the job by one LF step.  Return true iff it needs more.
+	 */
+	bool step(Job& j) {
+		const Ebwt& ebwt = *ebwt_;
+		const BTDnaString& qry = *j.qry;
+		const uint32_t qlen = (uint32_t)qry.length();
+		assert_lt(j.depth, qlen);
+		int c = (int)qry[qlen - j.depth - 1];
+		assert_lt(c, 4);
+		if(j.top + 1 == j.bot) {
+			j.bot = j.top = ebwt.mapLF1(j.top, j.ltop, c);
+			if(j.bot != OFF_MASK) j.bot++;
+		} else {
+			j.top = ebwt.mapLF(j.ltop, c);
+			j.bot = ebwt.mapLF(j.lbot, c);
+		}
+		j.depth++;
+		if(j.top >= j.bot) {
+			j.top = j.bot = 0;
+			return false;
+		}
+		if(j.depth == qlen) {
+			return false;
+		}
+		prep(j);
+		return true;
+	}
+
+	const Ebwt* ebwt_;     // index being searched
+	EList<Job> jobs_;      // one per query
+	EList<size_t> active_; // indexes of jobs still being extended
+};
+
+#endif /* EXACT_BATCH_H_ */
@@ -32,6 +32,9 @@
 #include <string>
 #include <unistd.h>
 #include <zlib.h>
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
 
 #include "alphabet.h"
 #include "assert_helpers.h"
@@ -190,6 +193,16 @@ public:
 		_done = false;
 	}
 
+	/**
+	 * Read at most n more bytes from the C-style file, as though the
+	 * file ended there.  Lets one piece of a file that has been split
+	 * be read through its own FileBuf.
+	 */
+	void limitTo(uint64_t n) {
+		assert(_in != NULL);
+		_limit = n;
+	}
+
 	/**
 	 * Restore state as though we just started reading the input
 	 * stream.
@@ -238,7 +251,10 @@ public:
 				} else {
 					assert(_in != NULL);
 					// TODO: consider an _unlocked function
-					_buf_sz = fread(_buf, 1, BUF_SZ, _in);
+					size_t want = BUF_SZ;
+					if(_limit < (uint64_t)want) want = (size_t)_limit;
+					_buf_sz = fread(_buf, 1, want, _in);
+					_limit -= _buf_sz;
 				}
 				_cur = 0;
 				if(_buf_sz == 0) {
@@ -510,6 +526,7 @@ private:
 		_cur = _buf_sz = BUF_SZ;
 		_done = false;
 		_lastn_cur = 0;
+		_limit = (uint64_t)-1;
 		// no need to clear _buf[]
 	}
 
@@ -523,6 +540,7 @@ private:
 	bool      _done;
 	uint8_t   _buf[BUF_SZ]; // (large) input buffer
 	size_t    _lastn_cur;
+	uint64_t  _limit;       // bytes left to fread from _in
 	char      _lastn_buf[LASTN_BUF_SZ]; // buffer of the last N chars dispensed
 };
 
@@ -571,6 +589,32 @@ public:
 		}
 	}
 
+	/**
+	 * Write n bitpairs packed four to a byte, lowest bits first (the
+	 * layout this class writes), from bps.
+	 */
+	void writePacked(const uint8_t *bps, size_t n) {
+		size_t nbytes = n >> 2;
+		const int shift = bpPtr_;
+		for(size_t i = 0; i < nbytes; i++) {
+			// The low bits of bps[i] complete the current octet and
+			// the rest start the next one
+			buf_[cur_] |= (char)(bps[i] << shift);
+			cur_++;
+			if(cur_ == BUF_SZ) {
+				if(!fwrite((const void *)buf_, BUF_SZ, 1, out_)) {
+					std::cerr << "Error writing to the reference index file (.4.ebwt)" << std::endl;
+					throw 1;
+				}
+				cur_ = 0;
+			}
+			buf_[cur_] = (shift == 0) ? 0 : (char)(bps[i] >> (8 - shift));
+		}
+		for(size_t i = nbytes << 2; i < n; i++) {
+			write((bps[i >> 2] >> ((i & 3) << 1)) & 3);
+		}
+	}
+
 	/**
 	 * Write any remaining bitpairs and then close the input
 	 */
@@ -747,6 +791,58 @@ public:
 		writeChars(s, strlen(s));
 	}
 
+	/**
+	 * Write n strings to the output stream, in order.  Whatever is
+	 * buffered goes first; the strings themselves are handed to the
+	 * OS with writev() rather than copied into the buffer.
+	 */
+	template<typename T>
+	void writeStrings(T* const* strs, size_t n) {
+		assert(!closed_);
+#ifdef _WIN32
+		for(size_t i = 0; i < n; i++) {
+			writeString(*strs[i]);
+		}
+#else
+		if(cur_ > 0) flush();
+		if(fflush(out_) != 0) {
+			writeError();
+		}
+		const int fd = fileno(out_);
+		struct iovec iov[IOV_BATCH];
+		size_t i = 0;
+		while(i < n) {
+			int niov = 0;
+			for(; i < n && niov < (int)IOV_BATCH; i++) {
+				if(strs[i]->length() == 0) continue;
+				iov[niov].iov_base = (void *)strs[i]->toZBuf();
+				iov[niov].iov_len = strs[i]->length();
+				niov++;
+			}
+			struct iovec *cur = iov;
+			while(niov > 0) {
+				ssize_t ret = writev(fd, cur, niov);
+				if(ret < 0) {
+					if(errno == EINTR) continue;
+					writeError();
+				}
+				// Skip past whatever made it out; a short write can
+				// stop in the middle of a string
+				size_t done = (size_t)ret;
+				while(niov > 0 && done >= cur->iov_len) {
+					done -= cur->iov_len;
+					cur++;
+					niov--;
+				}
+				if(niov > 0) {
+					cur->iov_base = (char *)cur->iov_base + done;
+					cur->iov_len -= done;
+				}
+			}
+		}
+#endif
+	}
+
 	/**
 	 * Write any remaining bitpairs and then close the input
 	 */
@@ -769,11 +865,7 @@ public:
 
 	void flush() {
 		if(cur_ != fwrite((const void *)buf_, 1, cur_, out_)) {
-			if (errno == EPIPE) {
-				exit(EXIT_SUCCESS);
-			}
-			std::cerr << "Error while flushing and closing output" << std::endl;
-			throw 1;
+			writeError();
 		}
 		cur_ = 0;
 	}
@@ -794,7 +886,16 @@ public:
 
 private:
 
+	void writeError() {
+		if (errno == EPIPE) {
+			exit(EXIT_SUCCESS);
+		}
+		std::cerr << "Error while flushing and closing output" << std::endl;
+		throw 1;
+	}
+
 	static const size_t BUF_SZ = 16 * 1024;
+	static const size_t IOV_BATCH = 64; // strings per writev() call
 
 	const char *name_;
 	FILE       *out_;
@@ -1,6 +1,7 @@
 #include "ds.h"
 #include "hit.h"
 #include "hit_set.h"
+#include "record_writer.h"
 #include "search_globals.h"
 
 using namespace std;
@@ -80,11 +81,22 @@ void VerboseHitSink::append(
 	bool cost,
 	const Bitset& suppress)
 {
+	const BTString& name = h.name();
+	const string* refname = NULL;
+	if(refnames != NULL && h.h.first < refnames->size()) {
+		refname = &(*refnames)[h.h.first];
+	}
+	// Name (twice if it's used as a label), reference name, sequence,
+	// qualities, mismatches and the fixed fields
+	const size_t maxlen = 2 * name.length() + (refname != NULL ? refname->length() : 0) +
+	                      2 * h.length() + h.numEdits() * (RECORD_MAX_INT_CHARS + 5) +
+	                      12 * RECORD_MAX_INT_CHARS + 64;
 	bool spill = false;
 	int spillAmt = 0;
 	uint32_t pdiv = 0xffffffff;
 	uint32_t pmod = 0xffffffff;
 	do {
+		RecordWriter w(o, maxlen);
 		bool dospill = false;
 		if(spill) {
 			// The read spilled over a partition boundary and so
@@ -100,13 +112,13 @@ void VerboseHitSink::append(
 			int pospart = abs(partition);
 			if(!suppress.test((uint32_t)field++)) {
 				if(firstfield) firstfield = false;
-				else o << '\t';
+				else w.put('\t');
 				// Output a partitioning key
 				// First component of the key is the reference index
-				if(refnames != NULL && h.h.first < refnames->size()) {
-					printUptoWs(o, (*refnames)[h.h.first], !fullRef);
+				if(refname != NULL) {
+					w.putUptoWs(*refname, !fullRef);
 				} else {
-					o << h.h.first;
+					w.putInt(h.h.first);
 				}
 			}
 			// Next component of the key is the partition id
@@ -127,140 +139,121 @@ void VerboseHitSink::append(
 				if(firstfield) {
 					firstfield = false;
 				} else {
-					o << '\t';
+					w.put('\t');
 				}
 				// Print partition id with leading 0s so that Hadoop
 				// can do lexicographical sort (modern Hadoop versions
-				// seen to support numeric)
-				int padding = 10;
+				// seen to support numeric).  0 gets an extra 0.
 				uint32_t part = (pdiv + (dospill ? spillAmt : 0));
-				uint32_t parttmp = part;
-				while(parttmp > 0) {
-					padding--;
-					parttmp /= 10;
-				}
-				assert_geq(padding, 0);
-				for(int i = 0; i < padding; i++) {
-					o << '0';
-				}
-				o << part;
+				w.putUint(part, part == 0 ? 11 : 10);
 			}
 			if(!suppress.test((uint32_t)field++)) {
 				if(firstfield) {
 					firstfield = false;
 				} else {
-					o << '\t';
+					w.put('\t');
 				}
 				// Print offset with leading 0s
-				int padding = 9;
 				uint32_t off = h.h.second + offBase;
-				uint32_t offtmp = off;
-				while(offtmp > 0) {
-					padding--;
-					offtmp /= 10;
-				}
-				assert_geq(padding, 0);
-				for(int i = 0; i < padding; i++) {
-					o << '0';
-				}
-				o << off;
+				w.putUint(off, off == 0 ? 10 : 9);
 			}
 			if(!suppress.test((uint32_t)field++)) {
 				if(firstfield) firstfield = false;
-				else o << '\t';
-				o << (h.fw? "+":"-");
+				else w.put('\t');
+				w.put(h.fw? '+':'-');
 			}
 			// end if(partition != 0)
 		} else {
 			assert(!dospill);
 			if(!suppress.test((uint32_t)field++)) {
 				if(firstfield) firstfield = false;
-				else o << '\t';
-				for (size_t i = 0; i < h.patName.length(); i++)
-					o << h.patName[i];
+				else w.put('\t');
+				w.put(name);
 			}
 			if(!suppress.test((uint32_t)field++)) {
 				if(firstfield) firstfield = false;
-				else o << '\t';
-				o << (h.fw? '+' : '-');
+				else w.put('\t');
+				w.put(h.fw? '+' : '-');
 			}
 			if(!suppress.test((uint32_t)field++)) {
 				if(firstfield) firstfield = false;
-				else o << '\t';
+				else w.put('\t');
 				// .first is text id, .second is offset
-				if(refnames != NULL && h.h.first < refnames->size()) {
-					printUptoWs(o, (*refnames)[h.h.first], !fullRef);
+				if(refname != NULL) {
+					w.putUptoWs(*refname, !fullRef);
 				} else {
-					o << h.h.first;
+					w.putInt(h.h.first);
 				}
 			}
 			if(!suppress.test((uint32_t)field++)) {
 				if(firstfield) firstfield = false;
-				else o << '\t';
-				o << (h.h.second + offBase);
+				else w.put('\t');
+				w.putInt(h.h.second + offBase);
 			}
 			// end else clause of if(partition != 0)
 		}
 		if(!suppress.test((uint32_t)field++)) {
 			if(firstfield) firstfield = false;
-			else o << '\t';
-			o << h.patSeq.toZBuf();
+			else w.put('\t');
+			w.putDna(h.seq());
 		}
 		if(!suppress.test((uint32_t)field++)) {
 			if(firstfield) firstfield = false;
-			else o << '\t';
-			o << h.quals.toZBuf();
+			else w.put('\t');
+			w.put(h.qual());
 		}
 		if(!suppress.test((uint32_t)field++)) {
 			if(firstfield) firstfield = false;
-			else o << '\t';
-			o << h.oms;
+			else w.put('\t');
+			w.putInt(h.oms);
 		}
 		if(!suppress.test((uint32_t)field++)) {
 			if(firstfield) firstfield = false;
-			else o << '\t';
+			else w.put('\t');
 			// Output mismatch column
 			bool firstmm = true;
-			for (unsigned int i = 0; i < h.patSeq.length(); ++ i) {
-				if(h.mms.test(i)) {
-					// There's a mismatch at this position
-					if (!firstmm) {
-						o << ",";
-					}
-					o << i; // position
-					assert_gt(h.refcs.size(), i);
-					char refChar = toupper(h.refcs[i]);
-					char qryChar = (h.fw ? h.patSeq.toChar(i) : h.patSeq.toChar(h.patSeq.length()-i-1));
-					assert_neq(refChar, qryChar);
-					o << ":" << refChar << ">" << qryChar;
-					firstmm = false;
+			const BTDnaString& seq = h.seq();
+			for (size_t i = 0; i < h.numEdits(); ++ i) {
+				const Edit& e = h.edit(i);
+				const uint32_t pos = e.pos;
+				if (!firstmm) {
+					w.put(',');
 				}
+				w.putInt(pos); // position
+				char refChar = toupper(e.chr);
+				char qryChar = (h.fw ? seq.toChar(pos) : seq.toChar(seq.length()-pos-1));
+				assert_neq(refChar, qryChar);
+				w.put(':');
+				w.put(refChar);
+				w.put('>');
+				w.put(qryChar);
+				firstmm = false;
 			}
-			if(partition != 0 && firstmm) o << '-';
+			if(partition != 0 && firstmm) w.put('-');
 		}
 		if(partition != 0) {
 			// Fields addded as of Crossbow 0.1.4
 			if(!suppress.test((uint32_t)field++)) {
 				if(firstfield) firstfield = false;
-				else o << '\t';
-				o << (int)h.mate;
+				else w.put('\t');
+				w.putInt((int)h.mate);
 			}
 			// Print label, or whole read name if label isn't found
 			if(!suppress.test((uint32_t)field++)) {
 				if(firstfield) firstfield = false;
-				else o << '\t';
+				else w.put('\t');
 				int labelOff = -1;
 				// If LB: field is present, print its value
-				for(int i = 0; i < (int)h.patName.length() - 3; i++) {
-					if(h.patName[i]   == 'L' &&
-					   h.patName[i+1] == 'B' &&
-					   h.patName[i+2] == ':' &&
-					   ((i == 0) || h.patName[i-1] == ';'))
+				for(int i = 0; i < (int)name.length() - 3; i++) {
+					if(name[i]   == 'L' &&
+					   name[i+1] == 'B' &&
+					   name[i+2] == ':' &&
+					   ((i == 0) || name[i-1] == ';'))
 					{
 						labelOff = i+3;
-						for(int j = labelOff; j < (int)h.patName.length(); j++) {
-							if(h.patName[j] != ';') {
-								o << h.patName[j];
+						for(int j = labelOff; j < (int)name.length(); j++) {
+							if(name[j] != ';') {
+								w.put(name[j]);
 							} else {
 								break;
 							}
@@ -269,8 +262,7 @@ void VerboseHitSink::append(
 				}
 				// Otherwise, print the whole read name
 				if(labelOff == -1) {
-					for (size_t i = 0; i < h.patName.length(); i++)
-						o << h.patName[i];
+					w.put(name);
 				}
 			}
 		}
@@ -278,24 +270,24 @@ void VerboseHitSink::append(
 			// Stratum
 			if(!suppress.test((uint32_t)field++)) {
 				if(firstfield) firstfield = false;
-				else o << '\t';
-				o << (int)h.stratum;
+				else w.put('\t');
+				w.putInt((int)h.stratum);
 			}
 			// Cost
 			if(!suppress.test((uint32_t)field++)) {
 				if(firstfield) firstfield = false;
-				else o << '\t';
-				o << (int)h.cost;
+				else w.put('\t');
+				w.putInt((int)h.cost);
 			}
 		}
 		if(showSeed) {
 			// Seed
 			if(!suppress.test((uint32_t)field++)) {
 				if(firstfield) firstfield = false;
-				else o << '\t';
-				o << h.seed;
+				else w.put('\t');
+				w.putInt(h.seed);
 			}
 		}
-		o << '\n';
+		w.put('\n');
 	} while(spill);
 }
@@ -18,11 +18,17 @@
 #include "filebuf.h"
 #include "formats.h"
 #include "hit_set.h"
+#include "out_queue.h"
 #include "pat.h"
 #include "sstring.h"
 #include "threading.h"
 #include "tokenize.h"
 
+#if (__cplusplus >= 201103L)
+#include <atomic>
+#include <thread>
+#endif
+
 /**
  * Classes for dealing with reporting alignments.
  */
@@ -35,7 +41,8 @@ enum output_types {
 	OUTPUT_BINARY,
 	OUTPUT_CHAIN,
 	OUTPUT_SAM,
-	OUTPUT_NONE
+	OUTPUT_NONE,
+	OUTPUT_BAM
 };
 
 /// Names of the various output modes
@@ -48,24 +55,28 @@ static const std::string output_type_names[] = {
 
 typedef pair<TIndexOffU,TIndexOffU> UPair;
 
+/// Edits a Hit holds inline; hits with more keep them in a per-thread pool
+static const size_t HIT_INLINE_EDITS = 4;
+
 /**
  * Encapsulates a hit, including a text-id/text-offset pair, a pattern
  * id, and a boolean indicating whether it matched as its forward or
  * reverse-complement version.
+ *
+ * A Hit refers to the Read that aligned rather than copying its name,
+ * sequence and qualities, and holds its mismatches as a short list of
+ * Edits, so it can be copied without touching the heap.  It must not
+ * outlive the read, i.e. it must be reported before the
+ * PatternSourcePerThread moves on to the next read.
  */
 class Hit {
 public:
-	Hit() : stratum(-1) { }
+	Hit() : rd(NULL), stratum(-1), nedits_(0), spill_(NULL), spillOff_(0) { }
 
 	UPair             h;       /// reference index & offset
 	UPair             mh;      /// reference index & offset for mate
 	uint32_t            patId;   /// read index
-	BTString            patName; /// read name
-	BTDnaString         patSeq;  /// read sequence
-	BTString            quals;   /// read qualities
-	FixedBitset<1024>   mms;     /// nucleotide mismatch mask
-	EList<char>        refcs;   /// reference characters for mms
-	EList<char>        crefcs;  /// reference characters for cmms
+	const Read*         rd;      /// read that aligned
 	uint32_t            oms;     /// # of other possible mappings; 0 -> this is unique
 	bool                fw;      /// orientation of read in alignment
 	bool                mfw;     /// orientation of mate in alignment
@@ -75,7 +86,6 @@ public:
 	uint8_t             mate;    /// matedness; 0 = not a mate
 	                             ///            1 = upstream mate
 	                             ///            2 = downstream mate
-	char                primer;  /// primer base, for csfasta files
 	uint32_t            seed;    /// pseudo-random seed for aligned read
 
 	/**
@@ -84,31 +94,68 @@ public:
 	 */
 	bool repOk() const {
 		assert_geq(cost, (uint32_t)(stratum << 14));
+		assert(rd != NULL);
+		for(size_t i = 0; i < nedits_; i++) {
+			assert_lt(edit(i).pos, length());
+			assert(i == 0 || edit(i-1).pos < edit(i).pos);
+		}
 		return true;
 	}
 
-	size_t length() const { return patSeq.length(); }
-
-	Hit& operator = (const Hit &other) {
-		this->h       = other.h;
-		this->mh      = other.mh;
-		this->patId   = other.patId;
-		this->patName = other.patName;
-		this->patSeq  = other.patSeq;
-		this->quals   = other.quals;
-		this->mms     = other.mms;
-		this->refcs   = other.refcs;
-		this->crefcs  = other.crefcs;
-		this->oms     = other.oms;
-		this->fw      = other.fw;
-		this->mfw     = other.mfw;
-		this->mlen    = other.mlen;
-		this->stratum = other.stratum;
-		this->cost    = other.cost;
-		this->mate    = other.mate;
-		this->seed    = other.seed;
-		return *this;
+	/// Read name
+	const BTString& name() const { return rd->name; }
+
+	/// Read sequence, reverse-complemented if it aligned to the - strand
+	const BTDnaString& seq() const { return fw ? rd->patFw : rd->patRc; }
+
+	/// Read qualities, reversed if it aligned to the - strand
+	const BTString& qual() const { return fw ? rd->qual : rd->qualRev; }
+
+	size_t length() const { return rd->length(); }
+
+	/**
+	 * Make room for 'n' edits, inline if they fit and otherwise at the
+	 * end of 'pool', and return a pointer to the first.  The caller
+	 * fills them in, then calls sortEdits().
+	 */
+	Edit* allocEdits(size_t n, EList<Edit>& pool) {
+		assert_lt(n, 1024);
+		nedits_ = (uint16_t)n;
+		if(n <= HIT_INLINE_EDITS) {
+			spill_ = NULL;
+			return edits_;
+		}
+		spillOff_ = (uint32_t)pool.size();
+		pool.resize(pool.size() + n);
+		spill_ = &pool;
+		return pool.ptr() + spillOff_;
+	}
+
+	/**
+	 * Put the edits in order of their offset from the 5' end.
+	 */
+	void sortEdits() {
+		Edit *e = (spill_ == NULL) ? edits_ : spill_->ptr() + spillOff_;
+		std::sort(e, e + nedits_);
+	}
+
+	/// Number of mismatches
+	size_t numEdits() const { return nedits_; }
+
+	/**
+	 * Return the ith mismatch, in order of offset from the 5' end of
+	 * the read.  Its chr is the reference character there.
+	 */
+	const Edit& edit(size_t i) const {
+		assert_lt(i, nedits_);
+		return (spill_ == NULL) ? edits_[i] : (*spill_)[spillOff_ + i];
 	}
+
+private:
+	uint16_t           nedits_;
+	Edit               edits_[HIT_INLINE_EDITS];
+	EList<Edit>       *spill_;    /// pool holding the edits if they didn't fit
+	uint32_t           spillOff_; /// where in *spill_ they start
 };
 
 /**
@@ -148,7 +195,8 @@ public:
 		EList<string>* refnames,
 		size_t nthreads,
 		size_t perThreadBufSize,
-		bool reorder) :
+		bool reorder,
+		size_t outQueueBytes) :
 		out_(out),
 		_refnames(refnames),
 		mutex_(),
@@ -165,6 +213,13 @@ public:
 		ptNumAligned_(NULL),
 		reorder_(reorder),
 		next_batch_to_flush_(0)
+#if (__cplusplus >= 201103L)
+		,
+		outRing_(NULL),
+		outRingSz_(0),
+		draining_(false),
+		outq_(NULL)
+#endif
 	{
 		size_t nelt = 5 * nthreads_;
 		ptNumAligned_ = new uint64_t[nelt];
@@ -185,7 +240,21 @@ public:
 				reorderInfo_[i].waiting = false;
 				reorderInfo_[i].flushed = true;
 			}
+#if (__cplusplus >= 201103L)
+			// Enough room that a thread rarely has to wait for the
+			// batches before its own to be written
+			outRingSz_ = std::max<size_t>(4 * nthreads_, 16);
+			outRing_ = new OutSlot[outRingSz_];
+			for (size_t i = 0; i < outRingSz_; i++) {
+				outRing_[i].full.store(false, std::memory_order_relaxed);
+			}
+#endif
+		}
+#if (__cplusplus >= 201103L)
+		if (outQueueBytes > 0) {
+			outq_ = new OutQueue(out_, outQueueBytes);
 		}
+#endif
 	}
 
 	/**
@@ -196,6 +265,10 @@ public:
 			delete[] ptNumAligned_;
 			ptNumAligned_ = NULL;
 		}
+#if (__cplusplus >= 201103L)
+		delete outq_;
+		delete[] outRing_;
+#endif
 		closeOuts();
 		destroyDumps();
 	}
@@ -247,17 +320,12 @@ public:
 			const Hit& h = (hptr == NULL) ? (*hsptr)[i] : *hptr;
 			assert(h.repOk());
 			append(o, h, mapq, xms);
-			if(nthreads_ == 1) {
-				out_.writeString(o);
+			if(nthreads_ == 1 && !queued()) {
+				writeOut(o);
 				o.clear();
 			}
 		}
-		ptCounts_[threadId]++;
-		if (reorder_ && reorderInfo_[threadId].flushed) {
-			reorderInfo_[threadId].batchId = p.batch_id();
-			reorderInfo_[threadId].flushed = false;
-		}
-		maybeFlush(threadId);
+		countRead(threadId, p);
 		if(tally) {
 			tallyAlignments(threadId, end - start, paired);
 		}
@@ -270,6 +338,11 @@ public:
 	void finish(bool hadoopOut) {
 		// Flush all per-thread buffers
 		flushAll();
+#if (__cplusplus >= 201103L)
+		if (outq_ != NULL) {
+			outq_->finish();
+		}
+#endif
 
 		// Close all output streams
 		closeOuts();
@@ -507,19 +580,111 @@ public:
 
 protected:
 
+#if (__cplusplus >= 201103L)
+	/**
+	 * Deposit the thread's finished buffer in the output ring, in the
+	 * slot for its batch, then write out whatever is ready.  Threads
+	 * only wait if their batch is a full ring ahead of the next one
+	 * to be written.
+	 */
+	void reorder(size_t threadId, bool force) {
+		assert(!force);
+		const size_t batchId = reorderInfo_[threadId].batchId;
+		assert_geq(batchId, next_batch_to_flush_.load());
+		for (size_t spins = 0;
+		     batchId - next_batch_to_flush_.load(std::memory_order_acquire) >= outRingSz_;
+		     spins++)
+		{
+			if (spins < 64) {
+				std::this_thread::yield();
+			} else {
+				SLEEP(1);
+			}
+		}
+		OutSlot& slot = outRing_[batchId % outRingSz_];
+		assert(!slot.full.load());
+		// Hand over the buffer and take the slot's emptied one back
+		slot.buf.swap(ptBufs_[threadId]);
+		slot.full.store(true);
+		reorderInfo_[threadId].flushed = true;
+		drainOutRing();
+	}
+
+	/**
+	 * Write out batches from the ring for as long as the next one is
+	 * present.  Only one thread writes at a time; a thread that finds
+	 * another already writing leaves its batch for that one.
+	 */
+	void drainOutRing() {
+		while (true) {
+			bool expected = false;
+			if (!draining_.compare_exchange_strong(expected, true)) {
+				return;
+			}
+			size_t next = next_batch_to_flush_.load(std::memory_order_relaxed);
+			while (outRing_[next % outRingSz_].full.load(std::memory_order_acquire)) {
+				OutSlot& slot = outRing_[next % outRingSz_];
+				writeOut(slot.buf);
+				slot.buf.clear();
+				slot.full.store(false, std::memory_order_relaxed);
+				next_batch_to_flush_.store(++next, std::memory_order_release);
+			}
+			draining_.store(false);
+			// Another thread may have filled the next slot after we
+			// checked it but before we stopped draining; if so, it
+			// may have seen us still draining and left it to us
+			if (!outRing_[next % outRingSz_].full.load()) {
+				return;
+			}
+		}
+	}
+
+	/**
+	 * Write out everything left once all threads are done: batches
+	 * still in the ring, then the threads' partial buffers, in batch
+	 * order, skipping over any batch ids that never showed up.
+	 */
+	void flushReordered() {
+		EList<pair<size_t, BTString*> > left;
+		const size_t next = next_batch_to_flush_.load();
+		for (size_t i = 0; i < outRingSz_; i++) {
+			if (outRing_[(next + i) % outRingSz_].full.load()) {
+				left.push_back(make_pair(next + i, &outRing_[(next + i) % outRingSz_].buf));
+			}
+		}
+		for (size_t i = 0; i < nthreads_; i++) {
+			if (!reorderInfo_[i].flushed) {
+				left.push_back(make_pair(reorderInfo_[i].batchId, &ptBufs_[i]));
+			}
+		}
+		left.sort();
+		for (size_t i = 0; i < left.size(); i++) {
+			writeOut(*left[i].second);
+			left[i].second->clear();
+		}
+		for (size_t i = 0; i < outRingSz_; i++) {
+			outRing_[i].full.store(false);
+		}
+		for (size_t i = 0; i < nthreads_; i++) {
+			reorderInfo_[i].flushed = true;
+			ptCounts_[i] = 0;
+			ptBufs_[i].clear();
+		}
+	}
+#else
 	void reorder(size_t threadId, bool force) {
 		COND_LOCK_T<COND_MUTEX_T> l(reorder_mutex_);
 		size_t last_batch_flushed = next_batch_to_flush_;
 		if (next_batch_to_flush_ == reorderInfo_[threadId].batchId || force) {
 			if (!force) {
-				out_.writeString(ptBufs_[threadId]);
+				writeOut(ptBufs_[threadId]);
 				next_batch_to_flush_ += 1;
 				reorderInfo_[threadId].flushed = true;
 			}
 			for (size_t i = 0; i < reorderInfo_.size();) {
 				if (reorderInfo_[i].batchId == next_batch_to_flush_ &&
 				    (reorderInfo_[i].waiting  || force)) {
-					out_.writeString(ptBufs_[i]);
+					writeOut(ptBufs_[i]);
 					reorderInfo_[i].flushed = true;
 					next_batch_to_flush_ += 1;
 					i = 0; // we may have skipped over a flushable batch
@@ -536,15 +701,19 @@ protected:
 			reorderInfo_[threadId].waiting = false;
 		}
 	}
+#endif
+
 	/**
 	 * Flush thread's output buffer and reset both buffer and count.
 	 */
 	void flush(size_t threadId, bool force) {
 		if (reorder_) {
 			reorder(threadId, force);
+		} else if (queued()) {
+			writeOut(ptBufs_[threadId]);
 		} else {
 			ThreadSafe _ts(&mutex_); // flush
-			out_.writeString(ptBufs_[threadId]);
+			writeOut(ptBufs_[threadId]);
 		}
 		ptCounts_[threadId] = 0;
 		ptBufs_[threadId].clear();
@@ -554,11 +723,34 @@ protected:
 	 * Flush all output buffers.
 	 */
 	void flushAll() {
+#if (__cplusplus >= 201103L)
+		if (reorder_) {
+			flushReordered();
+			return;
+		}
+#endif
 		for(size_t i = 0; i < nthreads_; i++) {
 			flush(i, true);
 		}
 	}
 
+	/**
+	 * Count read p toward the thread's output buffer, whether or not
+	 * anything was printed for it, and flush the buffer if it's full.
+	 * With --reorder, the first read counted since the last flush
+	 * sets the batch id the buffer is flushed under.  Every read must
+	 * be counted through here, or a buffer can be flushed under a
+	 * stale batch id.
+	 */
+	void countRead(size_t threadId, PatternSourcePerThread& p) {
+		ptCounts_[threadId]++;
+		if (reorder_ && reorderInfo_[threadId].flushed) {
+			reorderInfo_[threadId].batchId = p.batch_id();
+			reorderInfo_[threadId].flushed = false;
+		}
+		maybeFlush(threadId);
+	}
+
 	/**
 	 * If the thread's output buffer is currently full, flush it and
 	 * reset both buffer and count.
@@ -569,10 +761,42 @@ protected:
 		}
 	}
 
+	/**
+	 * Return true iff output goes through an asynchronous writer.
+	 */
+	bool queued() const {
+#if (__cplusplus >= 201103L)
+		return outq_ != NULL;
+#else
+		return false;
+#endif
+	}
+
+	/**
+	 * Write a finished buffer, or queue it for the writer thread.
+	 * When queued, buf is left holding a recycled empty buffer.
+	 * Everything bound for out_ goes through here, so a sink that
+	 * encodes its output (e.g. BAM) can intercept it.  Without a
+	 * queue, callers take turns (under mutex_, or as the one thread
+	 * draining the reorder ring).  With a queue (--out-queue-mb),
+	 * flush() calls this from many threads at once without mutex_,
+	 * relying on OutQueue::push() being thread-safe; an override
+	 * that isn't must not be given a queue.
+	 */
+	virtual void writeOut(BTString& buf) {
+#if (__cplusplus >= 201103L)
+		if (outq_ != NULL) {
+			outq_->push(buf);
+			return;
+		}
+#endif
+		out_.writeString(buf);
+	}
+
 	/**
 	 * Close (and flush) all OutFileBufs.
 	 */
-	void closeOuts() {
+	virtual void closeOuts() {
 		out_.close();
 	}
 
@@ -592,11 +816,24 @@ protected:
 	EList<size_t> ptCounts_;
 	size_t perThreadBufSize_;
 
-	size_t next_batch_to_flush_;
 	bool reorder_;
 	EList<PtBufInfo> reorderInfo_;
+#if (__cplusplus >= 201103L)
+	struct OutSlot {
+		BTString buf;             // finished output for one batch
+		std::atomic<bool> full;   // buf holds a batch waiting to be written
+	};
+
+	std::atomic<size_t> next_batch_to_flush_;
+	OutSlot *outRing_;            // finished batches, indexed by batch id
+	size_t outRingSz_;
+	std::atomic<bool> draining_;  // a thread is writing from outRing_
+	OutQueue *outq_;              // asynchronous writer, if any
+#else
+	size_t next_batch_to_flush_;
 	COND_MUTEX_T reorder_mutex_;
 	COND_VAR_T output_cond;
+#endif
 
 	// Output filenames for dumping
 	std::string dumpAlBase_;
@@ -718,6 +955,7 @@ public:
 		_numValidHits(0llu),
 		_hits(),
 		_bufferedHits(),
+		_editPool(),
 		hitsForThisRead_(),
 		_max(max),
 		_n(n),
@@ -732,12 +970,15 @@ public:
 	/// Return the vector of retained hits
 	EList<Hit>& retainedHits()   { return _hits; }
 
+	/// Return the pool for edits of buffered hits that don't fit inline
+	EList<Edit>& editPool()      { return _editPool; }
+
 	/// Finalize current read
 	virtual uint32_t finishRead(PatternSourcePerThread& p, bool report, bool dump) {
 		uint32_t ret = finishReadImpl();
 		_bestRemainingStratum = 0;
 		if(!report) {
-			_bufferedHits.clear();
+			clearBuffered();
 			return 0;
 		}
 		bool maxed = (ret > _max);
@@ -754,7 +995,7 @@ public:
 		if(maxed) {
 			// Report that the read maxed-out; useful for chaining output
 			if(dump) _sink.reportMaxed(_bufferedHits, threadId_, p);
-			_bufferedHits.clear();
+			clearBuffered();
 		} else if(unal) {
 			// Report that the read failed to align; useful for chaining output
 			if(dump) _sink.reportUnaligned(threadId_, p);
@@ -775,9 +1016,10 @@ public:
 			                 threadId_, mapq, xms, true, p);
 			_sink.dumpAlign(p);
 			ret = (uint32_t)_bufferedHits.size();
-			_bufferedHits.clear();
+			clearBuffered();
 		}
 		assert_eq(0, _bufferedHits.size());
+		_editPool.clear();
 		return ret;
 	}
 
@@ -888,6 +1130,15 @@ public:
 	}
 
 protected:
+	/**
+	 * Forget the buffered hits along with any edits they kept in the
+	 * pool.  Both lists keep their memory for the next read.
+	 */
+	void clearBuffered() {
+		_bufferedHits.clear();
+		_editPool.clear();
+	}
+
 	HitSink&    _sink; /// Ultimate destination of reported hits
 	/// Least # mismatches in alignments that will be reported in the
 	/// future.  Updated by the search routine.
@@ -898,6 +1149,9 @@ protected:
 	EList<Hit> _hits; /// Repository for retained hits
 	/// Buffered hits, to be reported and flushed at end of read-phase
 	EList<Hit> _bufferedHits;
+	/// Edits of hits that have too many to hold inline; refers to the
+	/// same read as _bufferedHits and is cleared with it
+	EList<Edit> _editPool;
 
 	// Following variables are declared in the parent but maintained in
 	// the concrete subcalsses
@@ -1296,6 +1550,7 @@ public:
 		EList<std::string>* refnames,
 		size_t nthreads,
 		size_t perThreadBufSize,
+		size_t outQueueBytes,
 		int partition = 0) :
 		HitSink(
 			out,
@@ -1307,7 +1562,8 @@ public:
 			refnames,
 			nthreads,
 			perThreadBufSize,
-			false),
+			false,
+			outQueueBytes),
 		partition_(partition),
 		offBase_(offBase),
 		cost_(printCost),
@@ -0,0 +1,119 @@
+/*
+ * hugepage.cpp
+ */
+
+#include <iostream>
+#include <new>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hugepage.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+/// Room at the front of each allocation to remember how it was made.
+/// Keeps the array itself cache-line aligned.
+static const size_t HDR_SZ = 64;
+
+struct HugeHdr {
+	size_t mapLen; // length of the mapping; 0 if malloc()ed
+};
+
+#ifdef __linux__
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+/**
+ * Return true iff transparent huge pages are turned off entirely, in
+ * which case madvise() succeeds but has no effect.
+ */
+static bool thpDisabled() {
+	FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+	if(f == NULL) {
+		return true;
+	}
+	char buf[128];
+	bool ret = fgets(buf, sizeof(buf), f) == NULL || strstr(buf, "[never]") != NULL;
+	fclose(f);
+	return ret;
+}
+
+static inline size_t roundUp(size_t n, size_t to) {
+	return (n + to - 1) & ~(to - 1);
+}
+
+static void report(const char *what, size_t len, const char *how) {
+	cerr << "Huge pages: " << what << " (" << len << " bytes) in " << how << endl;
+}
+
+void *allocHugePages(size_t len, const char *what) {
+	const size_t need = len + HDR_SZ;
+	// Explicit 1 GB pages only pay off for arrays of at least that
+	// size; 2 MB pages for anything
+	const int shifts[] = { 30, 21 };
+	const char *names[] = { "explicit 1 GB pages", "explicit 2 MB pages" };
+	for(int i = 0; i < 2; i++) {
+		const size_t pg = (size_t)1 << shifts[i];
+		if(shifts[i] == 30 && len < pg) {
+			continue;
+		}
+		size_t mapLen = roundUp(need, pg);
+		void *p = mmap(NULL, mapLen, PROT_READ | PROT_WRITE,
+		               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (shifts[i] << MAP_HUGE_SHIFT),
+		               -1, 0);
+		if(p != MAP_FAILED) {
+			((HugeHdr*)p)->mapLen = mapLen;
+			report(what, len, names[i]);
+			return (char*)p + HDR_SZ;
+		}
+	}
+	// No explicit huge pages reserved; ask for transparent ones
+	size_t mapLen = roundUp(need, (size_t)1 << 21);
+	void *p = mmap(NULL, mapLen, PROT_READ | PROT_WRITE,
+	               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(p == MAP_FAILED) {
+		throw std::bad_alloc();
+	}
+	((HugeHdr*)p)->mapLen = mapLen;
+	bool thp = false;
+#ifdef MADV_HUGEPAGE
+	thp = madvise(p, mapLen, MADV_HUGEPAGE) == 0 && !thpDisabled();
+#endif
+	report(what, len, thp ? "transparent huge pages (madvise)" : "normal pages; no huge pages available");
+	return (char*)p + HDR_SZ;
+}
+
+void freeHugePages(void *p) {
+	if(p == NULL) {
+		return;
+	}
+	char *base = (char*)p - HDR_SZ;
+	munmap(base, ((HugeHdr*)base)->mapLen);
+}
+
+#else
+
+void *allocHugePages(size_t len, const char *what) {
+	void *p = malloc(len + HDR_SZ);
+	if(p == NULL) {
+		throw std::bad_alloc();
+	}
+	((HugeHdr*)p)->mapLen = 0;
+	cerr << "Huge pages: " << what << " (" << len << " bytes) in normal pages; not supported on this platform" << endl;
+	return (char*)p + HDR_SZ;
+}
+
+void freeHugePages(void *p) {
+	if(p != NULL) {
+		free((char*)p - HDR_SZ);
+	}
+}
+
+#endif
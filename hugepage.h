@@ -0,0 +1,32 @@
+/*
+ * hugepage.h
+ *
+ * Allocation of large index arrays in huge pages, so that random
+ * accesses into them (e.g. the LF walks over the BWT) miss the TLB
+ * less often.  Explicit huge pages (MAP_HUGETLB) are tried first; if
+ * none are reserved, the memory is mapped normally and the kernel is
+ * asked to back it with transparent huge pages instead.
+ */
+
+#ifndef HUGEPAGE_H_
+#define HUGEPAGE_H_
+
+#include <stddef.h>
+
+/**
+ * Allocate len bytes in the largest pages available and say on stderr
+ * what was obtained for the array called 'what'.  Throws bad_alloc if
+ * the memory can't be had at all.  Free with freeHugePages().
+ */
+extern void *allocHugePages(size_t len, const char *what);
+
+/**
+ * Free memory allocated with allocHugePages().
+ */
+extern void freeHugePages(void *p);
+
+#define ALLOC_HUGE_U(n, what) ((TIndexOffU*)allocHugePages((size_t)(n) * OFF_SIZE, what))
+#define ALLOC_HUGE_U8(n, what) ((uint8_t*)allocHugePages((size_t)(n), what))
+#define FREE_HUGE freeHugePages
+
+#endif /* HUGEPAGE_H_ */
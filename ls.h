@@ -35,18 +35,29 @@
 #ifndef LS_H_
 #define LS_H_
 
+#include <algorithm>
 #include <iostream>
 #include <limits>
 #include <stdint.h>
+#include <string.h>
+#include <vector>
+#if (__cplusplus >= 201103L)
+#include <atomic>
+#include <thread>
+#endif
+
+/* Passes with fewer unsorted elements than this are done on one thread.*/
+#define LS_PAR_CUTOFF (64 * 1024)
 
 template<typename T>
 class LarssonSadakane {
 	T *I, /* group array, ultimately suffix array.*/
 	*V,   /* inverse array, ultimately inverse of I.*/
+	*K,   /* where sort keys are read: V, or a copy of it (see par_pass).*/
 	r,    /* number of symbols aggregated by transform.*/
 	h;    /* length of already-sorted prefixes.*/
 
-	#define LS_KEY(p)          (V[*(p)+(h)])
+	#define LS_KEY(p)          (K[*(p)+(h)])
 	#define LS_SWAP(p, q)      (tmp=*(p), *(p)=*(q), *(q)=tmp)
 	#define LS_SMED3(a, b, c)  (LS_KEY(a)<LS_KEY(b) ?                        \
 			  (LS_KEY(b)<LS_KEY(c) ? (b) : LS_KEY(a)<LS_KEY(c) ? (c) : (a))  \
@@ -276,19 +287,86 @@ class LarssonSadakane {
 	   return j;                    /* return new alphabet size.*/
 	}
 	
+#if (__cplusplus >= 201103L)
+	/* One doubling pass over I on nthreads threads. Unsorted groups only
+	   interact through their keys, but a group's keys may point into a group
+	   another thread is splitting, so keys are read from Vc, a copy of V
+	   taken at the start of the pass, while new group numbers go to V. That
+	   makes the pass plain prefix doubling; the suffix array comes out the
+	   same. Vc has room for n+1 elements.*/
+	void par_pass(T *Vc, T n, int nthreads) {
+	   std::vector<std::pair<T*, T> > groups;
+	   T *pi, *pk;
+	   T s, sl;
+	   size_t work = 0;
+
+	   pi=I;
+	   sl=0;
+	   do {                         /* same scan as suffixsort, sorting later.*/
+		  if ((s=*pi) <= 0 && (s=*pi) != 0) {
+			 pi-=s;
+			 sl+=s;
+		  } else {
+			 if (sl) {
+				*(pi+sl)=sl;
+				sl=0;
+			 }
+			 pk=I+V[s]+1;
+			 groups.push_back(std::make_pair(pi, (T)(pk-pi)));
+			 work+=(size_t)(pk-pi);
+			 pi=pk;
+		  }
+	   } while (pi<=I+n);
+	   if (sl)
+		  *(pi+sl)=sl;
+	   if (work < LS_PAR_CUTOFF) {
+		  for (size_t i=0; i<groups.size(); ++i)
+			 sort_split(groups[i].first, groups[i].second);
+		  return;
+	   }
+	   std::atomic<size_t> next(0);
+	   std::vector<std::thread> threads;
+	   const size_t chunk=((size_t)n+1+nthreads-1)/nthreads;
+	   for (int t=0; t<nthreads; ++t) {
+		  threads.push_back(std::thread([&, t]() {
+			 size_t b=chunk*t, e=std::min(b+chunk, (size_t)n+1);
+			 if (b<e)
+				memcpy(Vc+b, V+b, (e-b)*sizeof(T));
+		  }));
+	   }
+	   for (int t=0; t<nthreads; ++t)
+		  threads[t].join();
+	   threads.clear();
+	   K=Vc;
+	   for (int t=0; t<nthreads; ++t) {
+		  threads.push_back(std::thread([&]() {
+			 size_t i;
+			 while ((i=next++) < groups.size())
+				sort_split(groups[i].first, groups[i].second);
+		  }));
+	   }
+	   for (int t=0; t<nthreads; ++t)
+		  threads[t].join();
+	   K=V;
+	}
+#endif
+
 	public:
 
 	/* Makes suffix array p of x. x becomes inverse of p. p and x are both of size
 	   n+1. Contents of x[0...n-1] are integers in the range l...k-1. Original
 	   contents of x[n] is disregarded, the n-th symbol being regarded as
-	   end-of-string smaller than all other symbols.*/
+	   end-of-string smaller than all other symbols. With nthreads > 1, the
+	   doubling passes are shared among that many threads, using another
+	   n+1 elements of memory.*/
 
-	void suffixsort(T *x, T *p, T n, T k, T l)
+	void suffixsort(T *x, T *p, T n, T k, T l, int nthreads = 1)
 	{
 	   T *pi, *pk;
 	   T i, j, s, sl;
 
 	   V=x;                         /* set global values.*/
+	   K=x;
 	   I=p;
 
 	   if (n>=k-l) {                /* if bucketing possible,*/
@@ -303,6 +381,15 @@ class LarssonSadakane {
 	   }
 	   h=r;                         /* number of symbols aggregated by transform.*/
 
+#if (__cplusplus >= 201103L)
+	   if (nthreads > 1 && n >= LS_PAR_CUTOFF) {
+		  std::vector<T> Vc((size_t)n+1);
+		  while (*I>=-n) {
+			 par_pass(&Vc[0], n, nthreads);
+			 h=2*h;                 /* double sorted-depth.*/
+		  }
+	   }
+#endif
 	   while (*I>=-n) {
 		  pi=I;                     /* pi is first position of group.*/
 		  sl=0;                     /* sl is negated length of sorted groups.*/
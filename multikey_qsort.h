@@ -821,6 +821,8 @@ void qsortSufDcU8(const T1& host1,
 
 #define BUCKET_SORT_CUTOFF (4 * 1024 * 1024)
 #define SELECTION_SORT_CUTOFF 6
+#define RADIX_INSERTION_CUTOFF 64
+#define RADIX_KEY_CHARS 32
 
 /**
  * Straightforwardly obtain a uint8_t-ized version of t[off].  This
@@ -982,8 +984,128 @@ static void selectionSortSufDcU8(
 	}
 }
 
+/**
+ * Return the RADIX_KEY_CHARS characters starting at offset 'off' of
+ * host packed 2 bits apiece into a word, the first character in the
+ * most significant bits, so that keys compare as the prefixes do.
+ * Positions past the end are filled with the largest character, 3;
+ * radixSortSufDcU8 sorts out the suffixes this makes ambiguous.
+ */
+template<typename TStr>
+inline uint64_t suf_key_u8(const TStr& host, size_t hlen, size_t off) {
+	uint64_t key = 0;
+	for(size_t i = 0; i < RADIX_KEY_CHARS; i++) {
+		key <<= 2;
+		key |= (off + i < hlen) ? get_uint8(host, off + i) : 3;
+	}
+	return key;
+}
+
+/**
+ * Pack the 8 characters at p, each 0-3, into 16 bits, the first
+ * character in the most significant bits.  Folds the bytes of a word
+ * together in three shifts rather than one character at a time.
+ */
+static inline uint64_t pack8Chars(const uint8_t* p) {
+	uint64_t w = ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) |
+	             ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+	             ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) |
+	             ((uint64_t)p[6] <<  8) |  (uint64_t)p[7];
+	assert_eq(0, w & 0xfcfcfcfcfcfcfcfcull);
+	w = (w | (w >>  6)) & 0x000f000f000f000full;
+	w = (w | (w >> 12)) & 0x000000ff000000ffull;
+	return (w | (w >> 24)) & 0xffffull;
+}
+
+/**
+ * Specialization for an unpacked host array; packs whole words at a
+ * time except near the end of the text.
+ */
+template<>
+inline uint64_t suf_key_u8<uint8_t*>(uint8_t* const& host, size_t hlen, size_t off) {
+	if(off + RADIX_KEY_CHARS > hlen) {
+		const uint8_t* h = host;
+		return suf_key_u8(h, hlen, off);
+	}
+	const uint8_t* p = host + off;
+	return (pack8Chars(p)      << 48) | (pack8Chars(p +  8) << 32) |
+	       (pack8Chars(p + 16) << 16) |  pack8Chars(p + 24);
+}
+
+/**
+ * Sort the n suffixes in sufs by their keys.  keys2 and sufs2 are
+ * scratch space for n elements each.  An LSD radix sort one byte at a
+ * time; each pass is a counting loop and a scatter over flat arrays,
+ * and passes where every key has the same byte are skipped.
+ */
+static inline void radixSortKeys(uint64_t* keys,
+                                 TIndexOffU* sufs,
+                                 uint64_t* keys2,
+                                 TIndexOffU* sufs2,
+                                 size_t n)
+{
+	if(n < RADIX_INSERTION_CUTOFF) {
+		for(size_t i = 1; i < n; i++) {
+			uint64_t k = keys[i];
+			TIndexOffU sf = sufs[i];
+			size_t j = i;
+			for(; j > 0 && keys[j-1] > k; j--) {
+				keys[j] = keys[j-1];
+				sufs[j] = sufs[j-1];
+			}
+			keys[j] = k;
+			sufs[j] = sf;
+		}
+		return;
+	}
+	size_t cnts[8][256];
+	memset(cnts, 0, sizeof(cnts));
+	for(size_t i = 0; i < n; i++) {
+		uint64_t k = keys[i];
+		for(int d = 0; d < 8; d++) {
+			cnts[d][(k >> (d << 3)) & 0xff]++;
+		}
+	}
+	uint64_t *kin = keys, *kout = keys2;
+	TIndexOffU *sin = sufs, *sout = sufs2;
+	for(int d = 0; d < 8; d++) {
+		const int shift = d << 3;
+		if(cnts[d][(kin[0] >> shift) & 0xff] == n) {
+			continue; // all keys share this byte
+		}
+		size_t sum = 0;
+		for(size_t b = 0; b < 256; b++) {
+			size_t c = cnts[d][b];
+			cnts[d][b] = sum;
+			sum += c;
+		}
+		for(size_t i = 0; i < n; i++) {
+			size_t dst = cnts[d][(kin[i] >> shift) & 0xff]++;
+			kout[dst] = kin[i];
+			sout[dst] = sin[i];
+		}
+		std::swap(kin, kout);
+		std::swap(sin, sout);
+	}
+	if(kin != keys) {
+		memcpy(keys, kin, n * sizeof(uint64_t));
+		memcpy(sufs, sin, n * sizeof(TIndexOffU));
+	}
+}
+
+/**
+ * Sort the suffixes in s[begin..end), which agree on their first
+ * 'depth' characters, by comparing RADIX_KEY_CHARS characters at a
+ * time as packed words.  Suffixes whose keys tie agree on all of those
+ * characters, unless they end inside the key; each such suffix is
+ * greater than the rest of its group (it hits the end where they have
+ * a 3), and a shorter one is greater than a longer one.  So those go
+ * to the top of the group in order of offset, and the rest are sorted
+ * again further along.  keys, keys2 and sufs2 are scratch space for
+ * end-begin elements each.
+ */
 template<typename T1, typename T2>
-static void bucketSortSufDcU8(
+static void radixSortSufDcU8(
 		const T1& host1,
 		const T2& host,
         size_t hlen,
@@ -991,96 +1113,64 @@ static void bucketSortSufDcU8(
         size_t slen,
         const DifferenceCoverSample<T1>& dc,
         uint8_t hi,
-        size_t _begin,
-        size_t _end,
-        size_t _depth,
+        size_t begin,
+        size_t end,
+        size_t depth,
+        uint64_t* keys,
+        uint64_t* keys2,
+        TIndexOffU* sufs2,
         bool sanityCheck = false)
 {
-        // 5 64-element buckets for bucket-sorting A, C, G, T, $
-        TIndexOffU* bkts[4];
-	for(size_t i = 0; i < 4; i++) {
-	        bkts[i] = new TIndexOffU[4 * 1024 * 1024];
+	assert_gt(end, begin+1);
+	assert_eq(hi, 4);
+	if(depth > dc.v()) {
+		// Quicksort the remaining suffixes using difference cover
+		// for constant-time comparisons; this is O(k*log(k)) where
+		// k=(end-begin)
+		qsortSufDcU8<T1,T2>(host1, host, hlen, s, slen, dc, begin, end, sanityCheck);
+		return;
 	}
-	EList<EList<size_t> > block_list;
-	bool first = true;
-	while(true) {
-	        size_t begin = 0, end = 0;
-		if(first) {
-		        begin = _begin;
-			end = _end;
-			first = false;
-		} else {
-		        if(block_list.size() == 0) {
-			        break;
-			}
-			if(block_list.back().size() > 1) {
-			        end = block_list.back().back(); 
-				block_list.back().pop_back();
-				begin = block_list.back().back();
-			} else {
-			        block_list.resize(block_list.size() - 1);
-				if(block_list.size() == 0) {
-				        break;
+	if(end-begin <= SELECTION_SORT_CUTOFF) {
+		selectionSortSufDcU8(host1, host, hlen, s, slen, dc, hi,
+		                     begin, end, depth, sanityCheck);
+		return;
+	}
+	const size_t n = end - begin;
+	for(size_t i = 0; i < n; i++) {
+		keys[i] = suf_key_u8(host, hlen, depth + s[begin + i]);
+	}
+	radixSortKeys(keys, s + begin, keys2, sufs2, n);
+	for(size_t i = 0; i < n;) {
+		size_t j = i + 1;
+		while(j < n && keys[j] == keys[i]) j++;
+		if(j - i > 1) {
+			// Pull out the suffixes that end inside the key
+			TIndexOffU shortSufs[RADIX_KEY_CHARS + 1];
+			size_t nshort = 0, nfull = 0;
+			for(size_t k = begin + i; k < begin + j; k++) {
+				if(s[k] + depth + RADIX_KEY_CHARS > hlen) {
+					assert_lt(nshort, RADIX_KEY_CHARS + 1);
+					// Insert in order of offset
+					size_t m = nshort++;
+					for(; m > 0 && shortSufs[m-1] > s[k]; m--) {
+						shortSufs[m] = shortSufs[m-1];
+					}
+					shortSufs[m] = s[k];
+				} else {
+					s[begin + i + nfull++] = s[k];
 				}
 			}
-		}
-		size_t depth = block_list.size() + _depth;
-		assert_leq(end-begin, BUCKET_SORT_CUTOFF);
-		assert_eq(hi, 4);
-		if(end <= begin + 1) { // 1-element list already sorted
-		        continue;
-		}
-		if(depth > dc.v()) {
-		        // Quicksort the remaining suffixes using difference cover
-		        // for constant-time comparisons; this is O(k*log(k)) where
-		        // k=(end-begin)
-		        qsortSufDcU8<T1,T2>(host1, host, hlen, s, slen, dc, begin, end, sanityCheck);
-			continue;
-		}
-		if(end-begin <= SELECTION_SORT_CUTOFF) {
-		        // Bucket sort remaining items
-		        selectionSortSufDcU8(host1, host, hlen, s, slen, dc, hi,
-					     begin, end, depth, sanityCheck);
-			if(sanityCheck) {
-			        sanityCheckOrderedSufs(host1, hlen, s, slen,
-						       OFF_MASK, begin, end);
+			for(size_t k = 0; k < nshort; k++) {
+				s[begin + i + nfull + k] = shortSufs[k];
 			}
-			continue;
-		}
-		size_t cnts[] = { 0, 0, 0, 0, 0 };
-		for(size_t i = begin; i < end; i++) {
-		        size_t off = depth + s[i];
-			uint8_t c = (off < hlen) ? get_uint8(host, off) : hi;
-			assert_leq(c, 4);
-			if(c == 0) {
-			        s[begin + cnts[0]++] = s[i];
-			} else {
-			        bkts[c-1][cnts[c]++] = s[i];
+			if(nfull > 1) {
+				radixSortSufDcU8(host1, host, hlen, s, slen, dc, hi,
+				                 begin + i, begin + i + nfull,
+				                 depth + RADIX_KEY_CHARS,
+				                 keys + i, keys2 + i, sufs2 + i, sanityCheck);
 			}
 		}
-		assert_eq(cnts[0] + cnts[1] + cnts[2] + cnts[3] + cnts[4], end - begin);
-		size_t cur = begin + cnts[0];
-		if(cnts[1] > 0) { memcpy(&s[cur], bkts[0], cnts[1] << (OFF_SIZE/4 + 1)); cur += cnts[1]; }
-		if(cnts[2] > 0) { memcpy(&s[cur], bkts[1], cnts[2] << (OFF_SIZE/4 + 1)); cur += cnts[2]; }
-		if(cnts[3] > 0) { memcpy(&s[cur], bkts[2], cnts[3] << (OFF_SIZE/4 + 1)); cur += cnts[3]; }
-		if(cnts[4] > 0) { memcpy(&s[cur], bkts[3], cnts[4] << (OFF_SIZE/4 + 1)); }
-		// This frame is now totally finished with bkts[][], so recursive
-		// callees can safely clobber it; we're not done with cnts[], but
-		// that's local to the stack frame.
-		EList<size_t> tmp;
-		block_list.push_back(tmp);
-		block_list.back().clear();
-		block_list.back().push_back(begin);
-		for(size_t i = 0; i < 4; i++) {
-		        if(cnts[i] > 0) {
-			        block_list.back().push_back(block_list.back().back() + cnts[i]);
-			}
-		}
-	}
-	// Done
-	
-	for(size_t i = 0; i < 4; i++) {
-	        delete [] bkts[i];
+		i = j;
 	}
 }
 
@@ -1137,9 +1227,12 @@ void mkeyQSortSufDcU8(const T1& host1,
 		return;
 	}
 	if(n <= BUCKET_SORT_CUTOFF) {
-		// Bucket sort remaining items
-		bucketSortSufDcU8(host1, host, hlen, s, slen, dc,
-		                  (uint8_t)hi, begin, end, depth, sanityCheck);
+		// Radix sort remaining items on packed prefixes
+		AutoArray<uint64_t> keys(n), keys2(n);
+		AutoArray<TIndexOffU> sufs2(n);
+		radixSortSufDcU8(host1, host, hlen, s, slen, dc, (uint8_t)hi,
+		                 begin, end, depth, &keys[0], &keys2[0], &sufs2[0],
+		                 sanityCheck);
 		if(sanityCheck) {
 			sanityCheckOrderedSufs(host1, hlen, s, slen, OFF_MASK, begin, end);
 		}
@@ -0,0 +1,240 @@
+/*
+ * occ_simd.cpp
+ *
+ * Each byte of an Ebwt side packs four 2-bit characters.  With lo being
+ * the low bit of every pair (byte & 0x55) and hi the high bit shifted
+ * down ((byte >> 1) & 0x55), the bits of lo&hi, lo&~hi and ~lo&hi mark
+ * the Ts, Cs and Gs respectively.  As are whatever is left over, so
+ * they're counted as 4*nbytes minus the other three; that also makes
+ * bytes zeroed out by masking harmless.
+ */
+
+#include "occ_simd.h"
+#include "processor_support.h"
+
+#ifdef OCC_SIMD
+#include <immintrin.h>
+// GCC's AVX-512 intrinsics initialize their unused operands from
+// themselves, which trips -Wuninitialized when built via target()
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+int occSimdLevel() {
+#ifdef OCC_SIMD
+	ProcessorSupport ps;
+	if(ps.AVX512enabled()) return OCC_SIMD_AVX512;
+	if(ps.AVX2enabled())   return OCC_SIMD_AVX2;
+#endif
+	return OCC_SIMD_NONE;
+}
+
+const char *occSimdName(int level) {
+	switch(level) {
+		case OCC_SIMD_AVX2:   return "AVX2";
+		case OCC_SIMD_AVX512: return "AVX-512";
+		default:              return "scalar";
+	}
+}
+
+#ifdef OCC_SIMD
+
+/**
+ * Load up to 32 bytes starting at p, zeroing bytes at or past n.  Only
+ * whole dwords that overlap the first n bytes are read.
+ */
+__attribute__((target("avx2")))
+static inline __m256i loadPrefixAvx2(const uint8_t *p, int n) {
+	const __m256i idx = _mm256_setr_epi8(
+		0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+		16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31);
+	if(n >= 32) {
+		return _mm256_loadu_si256((const __m256i*)p);
+	}
+	const __m256i didx = _mm256_setr_epi32(0, 4, 8, 12, 16, 20, 24, 28);
+	__m256i dmask = _mm256_cmpgt_epi32(_mm256_set1_epi32(n), didx);
+	__m256i v = _mm256_maskload_epi32((const int*)p, dmask);
+	__m256i bmask = _mm256_cmpgt_epi8(_mm256_set1_epi8((char)n), idx);
+	return _mm256_and_si256(v, bmask);
+}
+
+/**
+ * Per-byte popcount of a vector in which only even bits may be set.
+ */
+__attribute__((target("avx2")))
+static inline __m256i popcntBytesAvx2(__m256i x) {
+	const __m256i lut = _mm256_setr_epi8(
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i m0f = _mm256_set1_epi8(0x0f);
+	__m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(x, m0f));
+	__m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(x, 4), m0f));
+	return _mm256_add_epi8(lo, hi);
+}
+
+/**
+ * Classify the characters in v and return per-byte counts of Cs, Gs and
+ * Ts packed into the low, middle and high 16 bits... of 64-bit lanes,
+ * courtesy of _mm256_sad_epu8.
+ */
+__attribute__((target("avx2")))
+static inline void classifyAvx2(__m256i v, __m256i& c1, __m256i& c2, __m256i& c3) {
+	const __m256i m55 = _mm256_set1_epi8(0x55);
+	__m256i lo = _mm256_and_si256(v, m55);
+	__m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 1), m55);
+	c1 = popcntBytesAvx2(_mm256_andnot_si256(hi, lo));
+	c2 = popcntBytesAvx2(_mm256_andnot_si256(lo, hi));
+	c3 = popcntBytesAvx2(_mm256_and_si256(lo, hi));
+}
+
+/**
+ * Sum the four 64-bit lanes of x.
+ */
+__attribute__((target("avx2")))
+static inline uint64_t hsumAvx2(__m256i x) {
+	__m128i s = _mm_add_epi64(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+	return (uint64_t)_mm_cvtsi128_si64(s) + (uint64_t)_mm_extract_epi64(s, 1);
+}
+
+__attribute__((target("avx2")))
+void occCountAvx2(const uint8_t *side, int nbytes, TIndexOffU *arrs) {
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i s1 = zero, s2 = zero, s3 = zero;
+	for(int i = 0; i < nbytes; i += 32) {
+		__m256i c1, c2, c3;
+		classifyAvx2(loadPrefixAvx2(side + i, nbytes - i), c1, c2, c3);
+		s1 = _mm256_add_epi64(s1, _mm256_sad_epu8(c1, zero));
+		s2 = _mm256_add_epi64(s2, _mm256_sad_epu8(c2, zero));
+		s3 = _mm256_add_epi64(s3, _mm256_sad_epu8(c3, zero));
+	}
+	TIndexOffU n1 = (TIndexOffU)hsumAvx2(s1);
+	TIndexOffU n2 = (TIndexOffU)hsumAvx2(s2);
+	TIndexOffU n3 = (TIndexOffU)hsumAvx2(s3);
+	arrs[0] += (TIndexOffU)(nbytes << 2) - n1 - n2 - n3;
+	arrs[1] += n1;
+	arrs[2] += n2;
+	arrs[3] += n3;
+}
+
+__attribute__((target("avx2")))
+void occCountAvx2Ex(const uint8_t *side,
+                    int nbytes1, TIndexOffU *arrs1,
+                    int nbytes2, TIndexOffU *arrs2)
+{
+	const __m256i idx = _mm256_setr_epi8(
+		0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+		16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31);
+	const __m256i zero = _mm256_setzero_si256();
+	const int nbytes = nbytes1 > nbytes2 ? nbytes1 : nbytes2;
+	__m256i s11 = zero, s12 = zero, s13 = zero;
+	__m256i s21 = zero, s22 = zero, s23 = zero;
+	for(int i = 0; i < nbytes; i += 32) {
+		__m256i c1, c2, c3;
+		classifyAvx2(loadPrefixAvx2(side + i, nbytes - i), c1, c2, c3);
+		int r1 = nbytes1 - i; if(r1 > 32) r1 = 32; if(r1 < 0) r1 = 0;
+		int r2 = nbytes2 - i; if(r2 > 32) r2 = 32; if(r2 < 0) r2 = 0;
+		__m256i m1 = _mm256_cmpgt_epi8(_mm256_set1_epi8((char)r1), idx);
+		__m256i m2 = _mm256_cmpgt_epi8(_mm256_set1_epi8((char)r2), idx);
+		s11 = _mm256_add_epi64(s11, _mm256_sad_epu8(_mm256_and_si256(c1, m1), zero));
+		s12 = _mm256_add_epi64(s12, _mm256_sad_epu8(_mm256_and_si256(c2, m1), zero));
+		s13 = _mm256_add_epi64(s13, _mm256_sad_epu8(_mm256_and_si256(c3, m1), zero));
+		s21 = _mm256_add_epi64(s21, _mm256_sad_epu8(_mm256_and_si256(c1, m2), zero));
+		s22 = _mm256_add_epi64(s22, _mm256_sad_epu8(_mm256_and_si256(c2, m2), zero));
+		s23 = _mm256_add_epi64(s23, _mm256_sad_epu8(_mm256_and_si256(c3, m2), zero));
+	}
+	TIndexOffU n1 = (TIndexOffU)hsumAvx2(s11);
+	TIndexOffU n2 = (TIndexOffU)hsumAvx2(s12);
+	TIndexOffU n3 = (TIndexOffU)hsumAvx2(s13);
+	arrs1[0] += (TIndexOffU)(nbytes1 << 2) - n1 - n2 - n3;
+	arrs1[1] += n1;
+	arrs1[2] += n2;
+	arrs1[3] += n3;
+	n1 = (TIndexOffU)hsumAvx2(s21);
+	n2 = (TIndexOffU)hsumAvx2(s22);
+	n3 = (TIndexOffU)hsumAvx2(s23);
+	arrs2[0] += (TIndexOffU)(nbytes2 << 2) - n1 - n2 - n3;
+	arrs2[1] += n1;
+	arrs2[2] += n2;
+	arrs2[3] += n3;
+}
+
+/**
+ * Sum the eight 64-bit lanes of x.
+ */
+__attribute__((target("avx512f")))
+static inline uint64_t hsumAvx512(__m512i x) {
+	__m256i s = _mm256_add_epi64(_mm512_castsi512_si256(x), _mm512_extracti64x4_epi64(x, 1));
+	__m128i t = _mm_add_epi64(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1));
+	return (uint64_t)_mm_cvtsi128_si64(t) + (uint64_t)_mm_extract_epi64(t, 1);
+}
+
+/**
+ * Return a mask selecting the first n (at most 64) bytes of a vector.
+ */
+static inline __mmask64 prefixMask512(int n) {
+	return n >= 64 ? ~(__mmask64)0 : (((__mmask64)1 << n) - 1);
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vpopcntdq")))
+void occCountAvx512(const uint8_t *side, int nbytes, TIndexOffU *arrs) {
+	const __m512i m55 = _mm512_set1_epi8(0x55);
+	__m512i s1 = _mm512_setzero_si512(), s2 = s1, s3 = s1;
+	for(int i = 0; i < nbytes; i += 64) {
+		__m512i v = _mm512_maskz_loadu_epi8(prefixMask512(nbytes - i), side + i);
+		__m512i lo = _mm512_and_si512(v, m55);
+		__m512i hi = _mm512_and_si512(_mm512_srli_epi16(v, 1), m55);
+		s1 = _mm512_add_epi64(s1, _mm512_popcnt_epi64(_mm512_andnot_si512(hi, lo)));
+		s2 = _mm512_add_epi64(s2, _mm512_popcnt_epi64(_mm512_andnot_si512(lo, hi)));
+		s3 = _mm512_add_epi64(s3, _mm512_popcnt_epi64(_mm512_and_si512(lo, hi)));
+	}
+	TIndexOffU n1 = (TIndexOffU)hsumAvx512(s1);
+	TIndexOffU n2 = (TIndexOffU)hsumAvx512(s2);
+	TIndexOffU n3 = (TIndexOffU)hsumAvx512(s3);
+	arrs[0] += (TIndexOffU)(nbytes << 2) - n1 - n2 - n3;
+	arrs[1] += n1;
+	arrs[2] += n2;
+	arrs[3] += n3;
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vpopcntdq")))
+void occCountAvx512Ex(const uint8_t *side,
+                      int nbytes1, TIndexOffU *arrs1,
+                      int nbytes2, TIndexOffU *arrs2)
+{
+	const __m512i m55 = _mm512_set1_epi8(0x55);
+	const int nbytes = nbytes1 > nbytes2 ? nbytes1 : nbytes2;
+	__m512i s11 = _mm512_setzero_si512(), s12 = s11, s13 = s11;
+	__m512i s21 = s11, s22 = s11, s23 = s11;
+	for(int i = 0; i < nbytes; i += 64) {
+		__m512i v = _mm512_maskz_loadu_epi8(prefixMask512(nbytes - i), side + i);
+		__m512i lo = _mm512_and_si512(v, m55);
+		__m512i hi = _mm512_and_si512(_mm512_srli_epi16(v, 1), m55);
+		__m512i x1 = _mm512_andnot_si512(hi, lo);
+		__m512i x2 = _mm512_andnot_si512(lo, hi);
+		__m512i x3 = _mm512_and_si512(lo, hi);
+		__mmask64 k1 = prefixMask512(nbytes1 - i > 0 ? nbytes1 - i : 0);
+		__mmask64 k2 = prefixMask512(nbytes2 - i > 0 ? nbytes2 - i : 0);
+		s11 = _mm512_add_epi64(s11, _mm512_popcnt_epi64(_mm512_maskz_mov_epi8(k1, x1)));
+		s12 = _mm512_add_epi64(s12, _mm512_popcnt_epi64(_mm512_maskz_mov_epi8(k1, x2)));
+		s13 = _mm512_add_epi64(s13, _mm512_popcnt_epi64(_mm512_maskz_mov_epi8(k1, x3)));
+		s21 = _mm512_add_epi64(s21, _mm512_popcnt_epi64(_mm512_maskz_mov_epi8(k2, x1)));
+		s22 = _mm512_add_epi64(s22, _mm512_popcnt_epi64(_mm512_maskz_mov_epi8(k2, x2)));
+		s23 = _mm512_add_epi64(s23, _mm512_popcnt_epi64(_mm512_maskz_mov_epi8(k2, x3)));
+	}
+	TIndexOffU n1 = (TIndexOffU)hsumAvx512(s11);
+	TIndexOffU n2 = (TIndexOffU)hsumAvx512(s12);
+	TIndexOffU n3 = (TIndexOffU)hsumAvx512(s13);
+	arrs1[0] += (TIndexOffU)(nbytes1 << 2) - n1 - n2 - n3;
+	arrs1[1] += n1;
+	arrs1[2] += n2;
+	arrs1[3] += n3;
+	n1 = (TIndexOffU)hsumAvx512(s21);
+	n2 = (TIndexOffU)hsumAvx512(s22);
+	n3 = (TIndexOffU)hsumAvx512(s23);
+	arrs2[0] += (TIndexOffU)(nbytes2 << 2) - n1 - n2 - n3;
+	arrs2[1] += n1;
+	arrs2[2] += n2;
+	arrs2[3] += n3;
+}
+
+#endif /* OCC_SIMD */
@@ -0,0 +1,62 @@
+/*
+ * occ_simd.h
+ *
+ * Vector kernels for counting occurrences of all four 2-bit characters
+ * in the leading bytes of an Ebwt side.  The kernels are compiled with
+ * per-function target attributes and picked at runtime according to
+ * what ProcessorSupport reports, so the binary still runs on machines
+ * without AVX2 or AVX-512.
+ */
+
+#ifndef OCC_SIMD_H_
+#define OCC_SIMD_H_
+
+#include <stdint.h>
+#include <string>
+#include "btypes.h"
+
+#if defined(POPCNT_CAPABILITY) && defined(__GNUC__) && defined(__x86_64__)
+#define OCC_SIMD
+#endif
+
+enum {
+	OCC_SIMD_NONE = 0, // scalar countInU64/LUT code in ebwt.h
+	OCC_SIMD_AVX2,     // 32-byte vectors, nibble-LUT popcount
+	OCC_SIMD_AVX512    // 64-byte masked vectors, VPOPCNTQ
+};
+
+/**
+ * Return the best occ-counting kernel supported by this CPU and OS.
+ */
+extern int occSimdLevel();
+
+/**
+ * Return a short name for the given kernel level.
+ */
+extern const char *occSimdName(int level);
+
+#ifdef OCC_SIMD
+
+/**
+ * Add the number of occurrences of A, C, G and T in the first nbytes
+ * bytes of side to arrs[0..3].  Bytes at or past nbytes are never
+ * read.
+ */
+extern void occCountAvx2(const uint8_t *side, int nbytes, TIndexOffU *arrs);
+extern void occCountAvx512(const uint8_t *side, int nbytes, TIndexOffU *arrs);
+
+/**
+ * Like occCount*, but for two prefixes of the same side at once, as
+ * needed when the top and bottom of a range fall in the same side.  The
+ * side is loaded and its characters classified just once.
+ */
+extern void occCountAvx2Ex(const uint8_t *side,
+                           int nbytes1, TIndexOffU *arrs1,
+                           int nbytes2, TIndexOffU *arrs2);
+extern void occCountAvx512Ex(const uint8_t *side,
+                             int nbytes1, TIndexOffU *arrs1,
+                             int nbytes2, TIndexOffU *arrs2);
+
+#endif /* OCC_SIMD */
+
+#endif /* OCC_SIMD_H_ */
@@ -0,0 +1,125 @@
+/*
+ * out_queue.cpp
+ */
+
+#if (__cplusplus >= 201103L)
+
+#include "out_queue.h"
+
+using namespace std;
+
+OutQueue::OutQueue(OutFileBuf& out, size_t maxBytes) :
+	out_(out),
+	maxBytes_(maxBytes),
+	queuedBytes_(0),
+	done_(false),
+	err_(false),
+	thread_(NULL)
+{
+	thread_ = new std::thread(&OutQueue::writerLoop, this);
+}
+
+OutQueue::~OutQueue() {
+	if(thread_ != NULL) {
+		try {
+			finish();
+		} catch(int) { }
+	}
+	while(!queue_.empty()) {
+		delete queue_.front();
+		queue_.pop_front();
+	}
+	for(size_t i = 0; i < free_.size(); i++) {
+		delete free_[i];
+	}
+}
+
+void OutQueue::push(BTString& buf) {
+	const size_t len = buf.length();
+	if(len == 0) {
+		return;
+	}
+	std::unique_lock<std::mutex> lk(mu_);
+	while(!err_ && queuedBytes_ > 0 && queuedBytes_ + len > maxBytes_) {
+		spaceCv_.wait(lk);
+	}
+	if(err_) {
+		throw 1; // writer already printed the error
+	}
+	BTString *b;
+	if(free_.empty()) {
+		b = new BTString();
+	} else {
+		b = free_.back();
+		free_.pop_back();
+	}
+	// Hand over the full buffer and take an emptied one back
+	b->swap(buf);
+	queue_.push_back(b);
+	queuedBytes_ += len;
+	fullCv_.notify_one();
+}
+
+void OutQueue::finish() {
+	if(thread_ == NULL) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lk(mu_);
+		done_ = true;
+	}
+	fullCv_.notify_one();
+	thread_->join();
+	delete thread_;
+	thread_ = NULL;
+	if(err_) {
+		throw 1;
+	}
+}
+
+/**
+ * Body of the writer thread.  Takes everything that has queued up
+ * since the last write and writes it all at once, then recycles the
+ * buffers.
+ */
+void OutQueue::writerLoop() {
+	EList<BTString*> batch;
+	std::unique_lock<std::mutex> lk(mu_);
+	while(true) {
+		while(queue_.empty() && !done_) {
+			fullCv_.wait(lk);
+		}
+		if(queue_.empty()) {
+			break;
+		}
+		batch.clear();
+		size_t bytes = 0;
+		while(!queue_.empty()) {
+			batch.push_back(queue_.front());
+			bytes += queue_.front()->length();
+			queue_.pop_front();
+		}
+		lk.unlock();
+		bool ok = true;
+		try {
+			out_.writeStrings(batch.ptr(), batch.size());
+		} catch(int) {
+			ok = false;
+		}
+		for(size_t i = 0; i < batch.size(); i++) {
+			batch[i]->clear();
+		}
+		lk.lock();
+		for(size_t i = 0; i < batch.size(); i++) {
+			free_.push_back(batch[i]);
+		}
+		queuedBytes_ -= bytes;
+		spaceCv_.notify_all();
+		if(!ok) {
+			err_ = true;
+			break;
+		}
+	}
+}
+
+#endif /* __cplusplus >= 201103L */
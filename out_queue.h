@@ -0,0 +1,73 @@
+/*
+ * out_queue.h
+ *
+ * Asynchronous alignment output.  Search threads hand their finished
+ * output buffers to an OutQueue instead of writing them; a single
+ * writer thread takes whatever has queued up and writes it with one
+ * writev() through the OutFileBuf.  Emptied buffers are kept and
+ * handed back to search threads in exchange for full ones, so after
+ * the first few batches no buffer memory is allocated or freed.  The
+ * bytes waiting to be written are capped; a search thread that would
+ * go over the cap waits for the writer to catch up.
+ */
+
+#ifndef OUT_QUEUE_H_
+#define OUT_QUEUE_H_
+
+#if (__cplusplus >= 201103L)
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include "ds.h"
+#include "filebuf.h"
+#include "sstring.h"
+
+class OutQueue {
+
+public:
+
+	/**
+	 * Start a writer thread for out.  At most maxBytes of output are
+	 * queued at once, though a single buffer larger than that is
+	 * still accepted when the queue is empty.
+	 */
+	OutQueue(OutFileBuf& out, size_t maxBytes);
+
+	~OutQueue();
+
+	/**
+	 * Queue the contents of buf for writing, and leave buf empty (but
+	 * with the capacity of a recycled buffer).  Waits if the queue is
+	 * full.  Safe to call from several threads; buffers are written
+	 * in the order they were pushed.
+	 */
+	void push(BTString& buf);
+
+	/**
+	 * Wait for everything queued to be written, then stop the writer
+	 * thread.  Throws if the writer hit an error.
+	 */
+	void finish();
+
+protected:
+
+	void writerLoop();
+
+	OutFileBuf& out_;
+	size_t maxBytes_;
+	std::deque<BTString*> queue_; // full buffers, oldest first
+	EList<BTString*> free_;       // emptied buffers to hand back
+	size_t queuedBytes_;          // bytes queued or being written
+	bool done_;                   // no more pushes are coming
+	bool err_;                    // the writer thread failed
+	std::mutex mu_;
+	std::condition_variable fullCv_;  // a buffer was queued
+	std::condition_variable spaceCv_; // queued bytes went down
+	std::thread *thread_;
+};
+
+#endif /* __cplusplus >= 201103L */
+
+#endif /* OUT_QUEUE_H_ */
@@ -1,6 +1,7 @@
 #include <cmath>
 #include <inttypes.h>
 #include <iostream>
+#include <limits>
 #include <string>
 #include <stdexcept>
 #include <string.h>
@@ -111,6 +112,10 @@ pair<bool, bool> PatternSourcePerThread::nextReadPair() {
 	if(buf_.rdid() < skip_) {
 		return make_pair(false, this_is_last ? last_batch_ : false);
 	}
+	// Already parsed and finalized by an earlier call to lookahead()?
+	if(buf_.read_a().parsed) {
+		return make_pair(true, this_is_last ? last_batch_ : false);
+	}
 	// Parse read/pair
 	assert(!buf_.read_a().readOrigBuf.empty());
 	assert(buf_.read_a().empty());
@@ -126,6 +131,46 @@ pair<bool, bool> PatternSourcePerThread::nextReadPair() {
 	return make_pair(true, this_is_last ? last_batch_ : false);
 }
 
+/**
+ * Parse and finalize up to n-1 reads following the one under the
+ * cursor, stopping early at the end of the batch, at a pair whose
+ * mates come from separate files, or at a read that can't be parsed.  The cursor is left alone;
+ * nextReadPair() later skips the parsing step for reads handled here.
+ */
+size_t PatternSourcePerThread::lookahead(size_t n) {
+	assert(!buf_.read_a().empty());
+	size_t navail = 1;
+	for(; navail < n; navail++) {
+		size_t i = buf_.cur_buf_ + navail;
+		if(i >= last_batch_size_ || buf_.rdid_ + i < skip_) {
+			break;
+		}
+		Read& ra = buf_.bufa_[i];
+		Read& rb = buf_.bufb_[i];
+		if(ra.parsed) {
+			continue;
+		}
+		assert(!ra.readOrigBuf.empty());
+		if(!rb.readOrigBuf.empty()) {
+			break; // leave paired reads to nextReadPair()
+		}
+		if(!composer_.parse(ra, rb, buf_.rdid_ + i)) {
+			// Undo the partial parse so nextReadPair() sees the same
+			// raw record and fails the same way
+			Read::TBuf orig = ra.readOrigBuf;
+			ra.reset();
+			ra.readOrigBuf = orig;
+			break;
+		}
+		if(rb.parsed) {
+			finalizePair(ra, rb);
+		} else {
+			finalize(ra);
+		}
+	}
+	return navail;
+}
+
 /**
  * The main member function for dispensing pairs of reads or
  * singleton reads.  Returns true iff ra and rb contain a new
@@ -220,6 +265,224 @@ pair<bool, int> DualPatternComposer::nextBatch(PerThreadReadBuf& pt) {
 	return make_pair(true, 0);
 }
 
+#if (__cplusplus >= 201103L)
+/**
+ * Back off while waiting on another thread: yield for a while, then
+ * start sleeping.
+ */
+static inline void stealBackoff(size_t& spins) {
+	if(++spins < 64) {
+		std::this_thread::yield();
+	} else {
+		SLEEP(1);
+	}
+}
+
+StealingPatternComposer::StealingPatternComposer(
+	PatternComposer& composer,
+	size_t max_buf,
+	int nslots) :
+	PatternComposer(),
+	composer_(composer),
+	nslots_(nslots > 0 ? nslots : 1),
+	busy_(NULL),
+	rings_(NULL),
+	started_(false),
+	reader_(NULL)
+{
+	// Enough buffers to fill every ring, plus one for the reader
+	const size_t nbufs = nslots_ * RING_SZ + 1;
+	for(size_t i = 0; i < nbufs; i++) {
+		bufs_.push_back(new PerThreadReadBuf(max_buf));
+	}
+	res_.resize(nbufs);
+	busy_ = new std::atomic<bool>[nbufs];
+	rings_ = new Ring[nslots_];
+}
+
+StealingPatternComposer::~StealingPatternComposer() {
+	stop();
+	for(size_t i = 0; i < bufs_.size(); i++) {
+		delete bufs_[i];
+	}
+	delete[] busy_;
+	delete[] rings_;
+}
+
+/**
+ * Clear the pool and rings and launch the reader thread.
+ */
+void StealingPatternComposer::start() {
+	for(size_t i = 0; i < bufs_.size(); i++) {
+		bufs_[i]->reset();
+		busy_[i].store(false, std::memory_order_relaxed);
+	}
+	for(size_t i = 0; i < nslots_; i++) {
+		rings_[i].head.store(0, std::memory_order_relaxed);
+		rings_[i].tail.store(0, std::memory_order_relaxed);
+	}
+	done_.store(false, std::memory_order_relaxed);
+	stop_.store(false, std::memory_order_relaxed);
+	err_ = std::exception_ptr();
+	endRdid_ = 0;
+	reader_ = new std::thread(&StealingPatternComposer::readerLoop, this);
+}
+
+/**
+ * Tell the reader to quit, if it hasn't already, and wait for it.
+ */
+void StealingPatternComposer::stop() {
+	started_.store(false, std::memory_order_relaxed);
+	if(reader_ == NULL) return;
+	stop_.store(true, std::memory_order_release);
+	reader_->join();
+	delete reader_;
+	reader_ = NULL;
+}
+
+/**
+ * The reader isn't restarted until the next call to nextBatch(); the
+ * wrapped composer can only rewind input it hasn't started to consume
+ * (e.g. stdin).
+ */
+void StealingPatternComposer::reset() {
+	stop();
+	composer_.reset();
+}
+
+/**
+ * Find a buffer that nobody is using and mark it busy.  Returns
+ * bufs_.size() if asked to stop while waiting.
+ */
+size_t StealingPatternComposer::acquireFree() {
+	size_t spins = 0;
+	while(!stop_.load(std::memory_order_acquire)) {
+		for(size_t i = 0; i < bufs_.size(); i++) {
+			if(!busy_[i].load(std::memory_order_acquire)) {
+				busy_[i].store(true, std::memory_order_relaxed);
+				return i;
+			}
+		}
+		stealBackoff(spins);
+	}
+	return bufs_.size();
+}
+
+/**
+ * Append buffer b to the first ring with room, starting with ring
+ * 'slot' and leaving 'slot' pointing at the ring after the one used.
+ * Returns false if asked to stop while waiting.
+ */
+bool StealingPatternComposer::push(size_t b, size_t& slot) {
+	size_t spins = 0;
+	while(!stop_.load(std::memory_order_acquire)) {
+		for(size_t i = 0; i < nslots_; i++) {
+			Ring& r = rings_[slot];
+			slot = (slot + 1) % nslots_;
+			size_t t = r.tail.load(std::memory_order_relaxed);
+			if(t - r.head.load(std::memory_order_acquire) < RING_SZ) {
+				r.ents[t % RING_SZ].store(b, std::memory_order_relaxed);
+				r.tail.store(t + 1, std::memory_order_release);
+				return true;
+			}
+		}
+		stealBackoff(spins);
+	}
+	return false;
+}
+
+/**
+ * Body of the reader thread.  Only this thread calls into the wrapped
+ * composer, so its lock is never contended.
+ */
+void StealingPatternComposer::readerLoop() {
+	size_t slot = 0;
+	try {
+		while(true) {
+			size_t b = acquireFree();
+			if(b == bufs_.size()) break;
+			PerThreadReadBuf& buf = *bufs_[b];
+			// Buffers come back to the pool already reset by
+			// PatternSourcePerThread::nextBatch()
+			pair<bool, int> res = composer_.nextBatch(buf);
+			buf.init();
+			res_[b] = res;
+			if(res.first && res.second == 0) {
+				// Remember where the input ended so that threads told
+				// there's nothing left see the same read id they would
+				// have gotten from the wrapped composer
+				endRdid_ = buf.rdid();
+				buf.reset();
+				busy_[b].store(false, std::memory_order_release);
+				break;
+			}
+			if(!push(b, slot) || res.first) break;
+		}
+	} catch(...) {
+		err_ = std::current_exception();
+	}
+	done_.store(true, std::memory_order_release);
+}
+
+/**
+ * Try to claim the oldest entry in ring r.
+ */
+bool StealingPatternComposer::take(Ring& r, size_t& b) {
+	size_t h = r.head.load(std::memory_order_acquire);
+	while(h != r.tail.load(std::memory_order_acquire)) {
+		b = r.ents[h % RING_SZ].load(std::memory_order_relaxed);
+		if(r.head.compare_exchange_weak(h, h + 1, std::memory_order_acq_rel)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Try to claim a batch from ring 'slot', then from the others.
+ */
+bool StealingPatternComposer::takeAny(size_t slot, size_t& b) {
+	for(size_t i = 0; i < nslots_; i++) {
+		if(take(rings_[(slot + i) % nslots_], b)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+pair<bool, int> StealingPatternComposer::nextBatch(PerThreadReadBuf& pt) {
+	// Each search thread sticks with the ring matching its id
+	const size_t slot = (size_t)pt.tid_ % nslots_;
+	if(!started_.load(std::memory_order_acquire)) {
+		// First call since construction or reset()
+		ThreadSafe ts(&startMutex_);
+		if(!started_.load(std::memory_order_relaxed)) {
+			start();
+			started_.store(true, std::memory_order_release);
+		}
+	}
+	size_t spins = 0;
+	while(true) {
+		// Check 'done' first; once it's set, one last sweep of the
+		// rings is guaranteed to see every batch that was pushed
+		bool done = done_.load(std::memory_order_acquire);
+		size_t b;
+		if(takeAny(slot, b)) {
+			pt.swap(*bufs_[b]);
+			pair<bool, int> res = res_[b];
+			busy_[b].store(false, std::memory_order_release);
+			return res;
+		}
+		if(done) {
+			if(err_) std::rethrow_exception(err_);
+			pt.setReadId(endRdid_);
+			return make_pair(true, 0);
+		}
+		stealBackoff(spins);
+	}
+}
+#endif
+
 /**
  * Fill Read with the sequence, quality and name for the next
  * read in the list of read files.  This function gets called by
@@ -278,6 +541,13 @@ pair<bool, int> CFilePatternSource::nextBatch(
 void CFilePatternSource::open() {
 	if(is_open_) {
 		is_open_ = false;
+#if (__cplusplus >= 201103L)
+		if (inflating_) {
+			inflater_->close();
+			inflating_ = false;
+		}
+		else
+#endif
 		if (compressed_) {
 			gzclose(zfp_);
 			zfp_ = NULL;
@@ -291,23 +561,34 @@ void CFilePatternSource::open() {
 			qfp_ = NULL;
 		}
 	}
+	inCur_ = inEnd_ = NULL;
 	while(filecur_ < infiles_.size()) {
 		// Open read
+		compressed_ = infiles_[filecur_] == "-" ||
+		              is_gzipped_file(infiles_[filecur_]);
+#if (__cplusplus >= 201103L)
+		if (compressed_ && inflateThreads > 0) {
+			// Inflate on helper threads, several at once if it's BGZF
+			const char *fn = infiles_[filecur_].c_str();
+			if (inflater_ == NULL) {
+				inflater_ = new BgzfReader();
+			}
+			inflating_ = inflater_->open(fn, BgzfReader::isBgzf(fn), inflateThreads);
+		}
+		else
+#endif
 		if(infiles_[filecur_] == "-") {
-			compressed_ = true;
 			int fn = dup(fileno(stdin));
 			zfp_ = gzdopen(fn, "rb");
 		}
+		else if (compressed_) {
+			zfp_ = gzopen(infiles_[filecur_].c_str(), "rb");
+		}
 		else {
-			compressed_ = false;
-			if (is_gzipped_file(infiles_[filecur_])) {
-				compressed_ = true;
-				zfp_ = gzopen(infiles_[filecur_].c_str(), "rb");
-			}
-			else {
-				fp_ = fopen(infiles_[filecur_].c_str(), "rb");
-			}
-			if ((compressed_ && zfp_ == NULL) || (!compressed_ && fp_ == NULL)) {
+			fp_ = fopen(infiles_[filecur_].c_str(), "rb");
+		}
+		if(infiles_[filecur_] != "-") {
+			if ((compressed_ && zfp_ == NULL && !inflating_) || (!compressed_ && fp_ == NULL)) {
 				if(!errs_[filecur_]) {
 					cerr << "Warning: Could not open read file \""
 					     << infiles_[filecur_] << "\" for reading; skipping..."
@@ -319,7 +600,7 @@ void CFilePatternSource::open() {
 			}
 		}
 		is_open_ = true;
-		if (compressed_) {
+		if (compressed_ && !inflating_) {
 #if ZLIB_VERNUM < 0x1235
 			cerr << "Warning: gzbuffer added in zlib v1.2.3.5. Unable to change "
 			        "buffer size from default of 8192." << endl;
@@ -327,9 +608,6 @@ void CFilePatternSource::open() {
 			gzbuffer(zfp_, 64*1024);
 #endif
 		}
-		else {
-			setvbuf(fp_, buf_, _IOFBF, 64*1024);
-		}
 		if(!qinfiles_.empty()) {
 			if(qinfiles_[filecur_] == "-") {
 				qfp_ = stdin;
@@ -351,6 +629,33 @@ void CFilePatternSource::open() {
 	throw 1;
 }
 
+bool CFilePatternSource::fill() {
+	if(!is_open_) {
+		return false;
+	}
+#if (__cplusplus >= 201103L)
+	if (inflating_) {
+		// Hand out the inflated block itself
+		if (!inflater_->nextBlock(inCur_, inEnd_)) {
+			inCur_ = inEnd_ = NULL;
+			return false;
+		}
+		return true;
+	}
+#endif
+	size_t n = 0;
+	if (compressed_) {
+		int ret = gzread(zfp_, buf_, sizeof(buf_));
+		n = (ret > 0) ? (size_t)ret : 0;
+	}
+	else {
+		n = fread(buf_, 1, sizeof(buf_), fp_);
+	}
+	inCur_ = buf_;
+	inEnd_ = buf_ + n;
+	return n > 0;
+}
+
 /**
  * Constructor for vector pattern source, used when the user has
  * specified the input strings on the command line using the -c
@@ -553,14 +858,8 @@ pair<bool, int> FastaPatternSource::nextBatchFromFile(
 	// Read until we run out of input or until we've filled the buffer
 	for(; readi < pt.max_buf_ && !done; readi++) {
 		readbuf[readi].readOrigBuf.append('>');
-		while(true) {
-			c = getc_wrapper();
-			if(c < 0 || c == '>') {
-				done = c < 0;
-				break;
-			}
-			readbuf[readi].readOrigBuf.append(c);
-		}
+		c = appendUntil(readbuf[readi].readOrigBuf, '>');
+		done = c < 0;
 	}
 	// Immediate EOF case
 	if(done && readbuf[readi-1].readOrigBuf.length() == 1) {
@@ -820,7 +1119,8 @@ pair<bool, int> FastqPatternSource::nextBatchFromFile(
 		assert(readi == 0 || (*readBuf)[readi].readOrigBuf.length() == 0);
 		int newlines = 4;
 		while(newlines) {
-			c = getc_wrapper();
+			// Copy a whole line at a time
+			c = appendUntil(buf, '\n');
 			done = c < 0;
 			if(c == '\n' || (done && newlines == 1)) {
 				// Saw newline, or EOF that we're
@@ -990,9 +1290,9 @@ pair<bool, int> TabbedPatternSource::nextBatchFromFile(
 	// Read until we run out of input or until we've filled the buffer
 	for(; readi < pt.max_buf_ && c >= 0; readi++) {
 		readbuf[readi].readOrigBuf.clear();
-		while(c >= 0 && c != '\n' && c != '\r') {
+		if(c >= 0 && c != '\n' && c != '\r') {
 			readbuf[readi].readOrigBuf.append(c);
-			c = getc_wrapper();
+			c = appendUntil(readbuf[readi].readOrigBuf, '\n', '\r');
 		}
                 if (c == '\n') {
 			readbuf[readi].readOrigBuf.append(c);
@@ -1142,9 +1442,9 @@ pair<bool, int> RawPatternSource::nextBatchFromFile(
 		while(c >= 0 && (c == '\n' || c == '\r')) {
 			c = getc_wrapper();
 		}
-		while(c >= 0 && (c != '\n' && c != '\r')) {
+		if(c >= 0) {
 			readbuf[readi].readOrigBuf.append(c);
-			c = getc_wrapper();
+			c = appendUntil(readbuf[readi].readOrigBuf, '\n', '\r');
 		}
                 if (c == '\n') {
 			readbuf[readi].readOrigBuf.append(c);
@@ -14,6 +14,7 @@
 
 #include "alphabet.h"
 #include "assert_helpers.h"
+#include "bgzf.h"
 #include "ds.h"
 #include "ds.h"
 #include "filebuf.h"
@@ -26,6 +27,12 @@
 #include "tokenize.h"
 #include "util.h"
 
+#if (__cplusplus >= 201103L)
+#include <atomic>
+#include <exception>
+#include <thread>
+#endif
+
 #ifdef _WIN32
 #define getc_unlocked _fgetc_nolock
 #endif
@@ -91,11 +98,12 @@ struct PatternParams {
  */
 struct PerThreadReadBuf {
 
-	PerThreadReadBuf(size_t max_buf) :
+	PerThreadReadBuf(size_t max_buf, int tid = 0) :
 		max_buf_(max_buf),
 		bufa_(max_buf),
 		bufb_(max_buf),
-		rdid_()
+		rdid_(),
+		tid_(tid)
 	{
 		bufa_.resize(max_buf);
 		bufb_.resize(max_buf);
@@ -160,11 +168,25 @@ struct PerThreadReadBuf {
 		assert_neq(rdid_, std::numeric_limits<TReadId>::max());
 	}
 
+	/**
+	 * Exchange contents with another buffer of the same capacity
+	 * without copying any reads.  Each keeps its own tid_.
+	 */
+	void swap(PerThreadReadBuf& o) {
+		assert_eq(max_buf_, o.max_buf_);
+		EList<Read> tmp;
+		tmp.xfer(bufa_); bufa_.xfer(o.bufa_); o.bufa_.xfer(tmp);
+		tmp.xfer(bufb_); bufb_.xfer(o.bufb_); o.bufb_.xfer(tmp);
+		std::swap(cur_buf_, o.cur_buf_);
+		std::swap(rdid_, o.rdid_);
+	}
+
 	const size_t max_buf_; // max # reads to read into buffer at once
 	EList<Read> bufa_; // Read buffer for mate as
 	EList<Read> bufb_; // Read buffer for mate bs
 	size_t cur_buf_;       // Read buffer currently active
 	TReadId rdid_;         // index of read at offset 0 of bufa_/bufb_
+	const int tid_;        // id of the search thread that owns the buffer
 };
 
 
@@ -324,7 +346,11 @@ public:
 		qfp_(NULL),
 		zfp_(NULL),
 		is_open_(false),
-		first_(true)
+		first_(true),
+		inflater_(NULL),
+		inflating_(false),
+		inCur_(NULL),
+		inEnd_(NULL)
 	{
 		qinfiles_.clear();
 		if(qinfiles != NULL) qinfiles_ = *qinfiles;
@@ -344,6 +370,13 @@ public:
 
 	virtual ~CFilePatternSource() {
 		if(is_open_) {
+#if (__cplusplus >= 201103L)
+			if (inflating_) {
+				inflater_->close();
+				inflating_ = false;
+			}
+			else
+#endif
 			if (compressed_) {
 				gzclose(zfp_);
 				zfp_ = NULL;
@@ -360,6 +393,9 @@ public:
 			assert(fp_ == NULL || fp_ == stdin);
 			assert(qfp_ == NULL || qfp_ == stdin);
 		}
+#if (__cplusplus >= 201103L)
+		delete inflater_;
+#endif
 	}
 
 	/**
@@ -407,12 +443,53 @@ protected:
 	 */
 	void open();
 
+	/**
+	 * Point [inCur_, inEnd_) at the next block of input.  Returns false
+	 * if there's none left.
+	 */
+	bool fill();
+
 	int getc_wrapper() {
-		return compressed_ ? gzgetc(zfp_) : getc_unlocked(fp_);
+		if(inCur_ == inEnd_ && !fill()) return -1;
+		return (unsigned char)*inCur_++;
 	}
 
+	/**
+	 * Push back the character just returned by getc_wrapper().
+	 */
 	int ungetc_wrapper(int c) {
-		return compressed_ ? gzungetc(c, zfp_) : ungetc(c, fp_);
+		if(c < 0) return c;
+		assert(inCur_ != NULL);
+		assert_eq(c, (unsigned char)inCur_[-1]);
+		inCur_--;
+		return c;
+	}
+
+	/**
+	 * Append input to buf up to the next occurrence of delim1 or
+	 * delim2, which is consumed but not appended.  Returns the
+	 * delimiter found, or -1 if the input ran out first.
+	 */
+	int appendUntil(Read::TBuf& buf, int delim1, int delim2) {
+		while(inCur_ != inEnd_ || fill()) {
+			const char *p = (const char *)memchr(inCur_, delim1, inEnd_ - inCur_);
+			if(delim2 != delim1) {
+				const char *q = (const char *)memchr(
+					inCur_, delim2, (p != NULL ? p : inEnd_) - inCur_);
+				if(q != NULL) p = q;
+			}
+			const char *stop = (p != NULL) ? p : inEnd_;
+			buf.append(inCur_, stop - inCur_);
+			inCur_ = stop;
+			if(p != NULL) {
+				return (unsigned char)*inCur_++;
+			}
+		}
+		return -1;
+	}
+
+	int appendUntil(Read::TBuf& buf, int delim) {
+		return appendUntil(buf, delim, delim);
 	}
 
 	bool is_gzipped_file(const std::string& filename) {
@@ -441,9 +518,17 @@ protected:
     gzFile zfp_;
 	bool is_open_; /// whether fp_ is currently open
 	bool first_;
-	char buf_[64*1024]; /// file buffer for sequences
+	char buf_[64*1024]; /// input block for uncompressed or inline-gzipped files
 	char qbuf_[64*1024]; /// file buffer for qualities
     bool compressed_;
+#if (__cplusplus >= 201103L)
+	BgzfReader *inflater_; /// inflates gzipped input on helper threads
+#else
+	void *inflater_;
+#endif
+	bool inflating_; /// whether inflater_ is reading the current file
+	const char *inCur_; /// next unread char of the current input block
+	const char *inEnd_; /// end of the current input block
 
 private:
 
@@ -941,6 +1026,92 @@ protected:
 	EList<PatternSource*> srcb_; /// PatternSources for 2nd mates
 };
 
+#if (__cplusplus >= 201103L)
+/**
+ * Wraps another PatternComposer so that search threads no longer
+ * queue up on its lock.  A dedicated reader thread pulls batches from
+ * the wrapped composer into a fixed pool of buffers and deals them out
+ * round-robin to one small ring per search thread.  A search thread
+ * takes from its own ring and, when that's empty, steals from the
+ * others; either way, the batch is swapped into the caller's
+ * PerThreadReadBuf rather than copied.  Batches keep the read ids the
+ * wrapped composer gave them, so batch_id() and --reorder output are
+ * unaffected.
+ *
+ * Rings are single-producer/multi-consumer: only the reader advances
+ * a ring's tail and consumers claim entries by CAS on its head.
+ */
+class StealingPatternComposer : public PatternComposer {
+
+public:
+
+	StealingPatternComposer(
+		PatternComposer& composer,
+		size_t max_buf,
+		int nslots);
+
+	virtual ~StealingPatternComposer();
+
+	/**
+	 * Stop the reader, reset the wrapped composer and start over.
+	 * Should only be called by the master thread.
+	 */
+	virtual void reset();
+
+	/**
+	 * Hand the caller the next batch, taken from its own ring (ring
+	 * pt.tid_ modulo the number of rings) if possible and stolen from
+	 * another ring if not.  Blocks while all rings are empty and the
+	 * reader isn't finished.
+	 */
+	pair<bool, int> nextBatch(PerThreadReadBuf& pt);
+
+	/**
+	 * Make appropriate call into the format layer to parse individual read.
+	 */
+	virtual bool parse(Read& ra, Read& rb, TReadId rdid) {
+		return composer_.parse(ra, rb, rdid);
+	}
+
+protected:
+
+	/// Number of batches each ring can hold
+	static const size_t RING_SZ = 4;
+
+	/**
+	 * Ring of pool indexes; padded so that rings used by different
+	 * threads don't share cache lines.
+	 */
+	struct Ring {
+		alignas(64) std::atomic<size_t> head; // next entry to take
+		alignas(64) std::atomic<size_t> tail; // next entry to fill
+		std::atomic<size_t> ents[RING_SZ];
+	};
+
+	void start();
+	void stop();
+	void readerLoop();
+	size_t acquireFree();
+	bool push(size_t b, size_t& slot);
+	bool take(Ring& r, size_t& b);
+	bool takeAny(size_t slot, size_t& b);
+
+	PatternComposer& composer_;    // composer doing the actual reading
+	const size_t nslots_;          // # rings
+	EList<PerThreadReadBuf*> bufs_;  // pool of batch buffers
+	EList<pair<bool, int> > res_;  // nextBatch() result for each buffer
+	std::atomic<bool> *busy_;      // whether each buffer is in use
+	Ring *rings_;                  // one per search thread
+	std::atomic<bool> done_;       // reader has pushed its last batch
+	std::atomic<bool> stop_;       // reader should quit early
+	std::atomic<bool> started_;    // reader has been launched
+	MUTEX_T startMutex_;           // serializes launching the reader
+	TReadId endRdid_;              // read id where the input ran out
+	std::exception_ptr err_;       // exception raised in reader, if any
+	std::thread *reader_;          // reader thread
+};
+#endif
+
 /**
  * Encapsulates a single thread's interaction with the PatternSource.
  * Most notably, this class holds the buffers into which the
@@ -956,9 +1127,10 @@ public:
 		PatternComposer& composer,
 		uint32_t max_buf,
 		uint32_t skip,
-		uint32_t seed) :
+		uint32_t seed,
+		int tid = 0) :
 		composer_(composer),
-		buf_(max_buf),
+		buf_(max_buf, tid),
 		last_batch_(false),
 		last_batch_size_(0),
 		skip_(skip),
@@ -983,6 +1155,18 @@ public:
 
 	size_t batch_id() const { return batch_id_; }
 
+	/**
+	 * Parse and finalize up to n-1 reads following the
+	 * cursor without advancing it, so that a caller can work on
+	 * several reads of the current batch at once.  Returns the number
+	 * of reads, starting with the one under the cursor, that are now
+	 * available through bufa(i).  Never crosses a batch boundary.
+	 */
+	size_t lookahead(size_t n);
+
+	/// Return the i'th read following the cursor; see lookahead()
+	Read& bufa(size_t i) { return buf_.bufa_[buf_.cur_buf_ + i]; }
+
 	/**
 	 * Return true iff the read currently in the buffer is a
 	 * paired-end read.
@@ -1049,17 +1233,19 @@ public:
 		PatternComposer& composer,
 		uint32_t max_buf,
 		uint32_t skip,
-		uint32_t seed):
+		uint32_t seed,
+		int tid = 0):
 		composer_(composer),
 		max_buf_(max_buf),
 		skip_(skip),
-		seed_(seed) {}
+		seed_(seed),
+		tid_(tid) {}
 
 	/**
 	 * Create a new heap-allocated PatternSourcePerThreads.
 	 */
 	virtual PatternSourcePerThread* create() const {
-		return new PatternSourcePerThread(composer_, max_buf_, skip_, seed_);
+		return new PatternSourcePerThread(composer_, max_buf_, skip_, seed_, tid_);
 	}
 
 	/**
@@ -1069,7 +1255,7 @@ public:
 	virtual EList<PatternSourcePerThread*>* create(uint32_t n) const {
 		EList<PatternSourcePerThread*>* v = new EList<PatternSourcePerThread*>;
 		for(size_t i = 0; i < n; i++) {
-			v->push_back(new PatternSourcePerThread(composer_, max_buf_, skip_, seed_));
+			v->push_back(new PatternSourcePerThread(composer_, max_buf_, skip_, seed_, tid_));
 			assert(v->back() != NULL);
 		}
 		return v;
@@ -1105,6 +1291,8 @@ private:
 	uint32_t max_buf_;
 	uint32_t skip_;
 	uint32_t seed_;
+	/// Search thread the PatternSourcePerThreads are made for
+	int tid_;
 };
 
 #endif /*PAT_H_*/
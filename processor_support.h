@@ -2,8 +2,9 @@
 #define PROCESSOR_SUPPORT_H_
 
 // Utility class ProcessorSupport provides POPCNTenabled() to determine
-// processor support for POPCNT instruction. It uses CPUID to
-// retrieve the processor capabilities.
+// processor support for POPCNT instruction, and AVX2enabled() and
+// AVX512enabled() for the vector occ-counting kernels in occ_simd.h.
+// It uses CPUID to retrieve the processor capabilities.
 // for Intel ICC compiler __cpuid() is an intrinsic
 // for Microsoft compiler __cpuid() is provided by #include <intrin.h>
 // for GCC compiler __get_cpuid() is provided by #include <cpuid.h>
@@ -60,6 +61,55 @@ public:
     return true;
     }
 
+    // AVX2 needs CPUID.(EAX=07H,ECX=0):EBX.AVX2[bit 5], plus OS support
+    // for saving the YMM state (XCR0 bits 1 and 2)
+    bool AVX2enabled()
+    {
+#if defined(USING_GCC_COMPILER)
+    regs_t regs;
+    if(!OSXSAVEenabled(0x6)) return false;
+    if(__get_cpuid_max(0, 0) < 7) return false;
+    __cpuid_count(7, 0, regs.EAX, regs.EBX, regs.ECX, regs.EDX);
+    return (regs.EBX & BIT(5)) != 0;
+#else
+    return false;
+#endif
+    }
+
+    // The AVX-512 occ kernel needs AVX512F[EBX bit 16], AVX512BW[EBX
+    // bit 30] and AVX512_VPOPCNTDQ[ECX bit 14], plus OS support for
+    // saving the opmask and ZMM state (XCR0 bits 1, 2, 5, 6 and 7)
+    bool AVX512enabled()
+    {
+#if defined(USING_GCC_COMPILER)
+    regs_t regs;
+    if(!OSXSAVEenabled(0xe6)) return false;
+    if(__get_cpuid_max(0, 0) < 7) return false;
+    __cpuid_count(7, 0, regs.EAX, regs.EBX, regs.ECX, regs.EDX);
+    return (regs.EBX & BIT(16)) && (regs.EBX & BIT(30)) && (regs.ECX & BIT(14));
+#else
+    return false;
+#endif
+    }
+
+private:
+
+    // Return true iff the OS has enabled XSAVE (CPUID.01H:ECX.OSXSAVE[bit
+    // 27]) and all of the given XCR0 state-component bits
+    bool OSXSAVEenabled(unsigned int xcr0bits)
+    {
+#if defined(USING_GCC_COMPILER)
+    regs_t regs;
+    if(!__get_cpuid(0x1, &regs.EAX, &regs.EBX, &regs.ECX, &regs.EDX)) return false;
+    if(!(regs.ECX & BIT(27))) return false;
+    unsigned int xcr0lo, xcr0hi;
+    __asm__ ("xgetbv" : "=a" (xcr0lo), "=d" (xcr0hi) : "c" (0));
+    return (xcr0lo & xcr0bits) == xcr0bits;
+#else
+    return false;
+#endif
+    }
+
 #endif // POPCNT_CAPABILITY
 };
 
@@ -1,14 +1,20 @@
 /*
  * range_cache.h
  *
- * Classes that encapsulate the caching of
+ * Classes that encapsulate the caching of reference offsets resolved
+ * for big BW ranges, so that other reads that land in the same range
+ * (or in another range in the same tunnel) needn't walk them again.
+ * One cache per index is shared by all worker threads.
  */
 
 #ifndef RANGE_CACHE_H_
 #define RANGE_CACHE_H_
 
+#if (__cplusplus >= 201103L)
+#include <atomic>
+#endif
 #include <iostream>
-#include <map>
+#include <set>
 #include <stdexcept>
 #include <stdint.h>
 #include <utility>
@@ -16,14 +22,19 @@
 #include "ds.h"
 #include "ebwt.h"
 #include "row_chaser.h"
+#include "threading.h"
 
 #define RANGE_NOT_SET OFF_MASK
 #define RANGE_CACHE_BAD_ALLOC OFF_MASK
 
+#if (__cplusplus >= 201103L)
+
 /**
  * Manages a pool of memory used exclusively for range cache entries.
  * This manager is allocate-only; it exists mainly so that we can avoid
- * lots of new[]s and delete[]s.
+ * lots of new[]s and delete[]s.  It's shared by all worker threads:
+ * allocation is a single atomic add, and words are atomic so that one
+ * thread can fill in an entry another is reading.
  *
  * A given stretch of words may be one of two types: a cache entry, or
  * a cache entry wrapper.  A cache entry has a length and a list of
@@ -34,23 +45,25 @@
  */
 class RangeCacheMemPool {
 public:
-	RangeCacheMemPool(TIndexOffU lim /* max cache size in bytes */) :
-		lim_(lim >> 2 /* convert to words */), occ_(0), buf_(NULL),
-		closed_(false)
+	typedef std::atomic<TIndexOffU> TWord;
+
+	RangeCacheMemPool(size_t lim /* max cache size in bytes */) :
+		lim_(lim / sizeof(TWord)), occ_(0), buf_(NULL), closed_(false)
 	{
 		if(lim_ > 0) {
 			try {
-				buf_ = new TIndexOffU[lim_];
-				if(buf_ == NULL) throw std::bad_alloc();
+				buf_ = new TWord[lim_];
 			} catch(std::bad_alloc& e) {
 				cerr << "Allocation error allocating " << lim
-					 << " words of range-cache memory" << endl;
+					 << " bytes of range-cache memory" << endl;
 				throw 1;
 			}
 			assert(buf_ != NULL);
 			// Fill with 1s to signal that these elements are
 			// uninitialized
-			memset(buf_, 0xff, lim_ << 2 /* convert back to bytes */);
+			for(size_t i = 0; i < lim_; i++) {
+				buf_[i].store(OFF_MASK, std::memory_order_relaxed);
+			}
 		}
 	}
 
@@ -60,132 +73,246 @@ public:
 	}
 
 	/**
-	 * Allocate numElts elements from the word pool.
+	 * Allocate numElts elements from the word pool.  The first is set
+	 * to 0 and the rest to OFF_MASK.
 	 */
 	TIndexOffU alloc(TIndexOffU numElts) {
 		assert_gt(numElts, 0);
-		assert_leq(occ_, lim_);
-		if(occ_ + numElts > lim_ || numElts >= CACHE_WRAPPER_BIT) {
+		if(closed_.load(std::memory_order_relaxed) || numElts >= CACHE_WRAPPER_BIT) {
 			return RANGE_CACHE_BAD_ALLOC;
 		}
+		size_t ret = occ_.fetch_add(numElts, std::memory_order_relaxed);
+		if(ret + numElts > lim_) {
+			closed_.store(true, std::memory_order_relaxed);
+			return RANGE_CACHE_BAD_ALLOC;
+		}
+		if(lim_ - (ret + numElts) < 10) {
+			// No more room - don't try anymore
+			closed_.store(true, std::memory_order_relaxed);
+		}
 		assert_gt(lim_, 0);
-		TIndexOffU ret = occ_;
-		assert(allocs_.find(ret) == allocs_.end());
-		ASSERT_ONLY(allocs_.insert(ret));
-		// Clear the first elt so that we don't think there's already
-		// something there
 #ifndef NDEBUG
+		{
+			ThreadSafe ts(&allocsMutex_);
+			assert(allocs_.find(ret) == allocs_.end());
+			allocs_.insert(ret);
+		}
 		for(TIndexOffU i = 0; i < numElts; i++) {
-			assert_eq(OFF_MASK, buf_[occ_ + i]);
+			assert_eq(OFF_MASK, buf_[ret + i].load());
 		}
 #endif
-		buf_[occ_] = 0;
-		occ_ += numElts;
-		assert_leq(occ_, lim_);
-		if(lim_ - occ_ < 10) {
-			// No more room - don't try anymore
-			closed_ = true;
-		}
-		return ret;
+		// Clear the first elt so that we don't think there's already
+		// something there
+		buf_[ret].store(0, std::memory_order_relaxed);
+		return (TIndexOffU)ret;
 	}
 
 	/**
 	 * Turn a pool-array index into a pointer; check that it doesn't
 	 * fall outside the pool first.
 	 */
-	inline TIndexOffU *get(TIndexOffU off) {
+	inline TWord *get(TIndexOffU off) {
 		assert_gt(lim_, 0);
 		assert_lt(off, lim_);
-		assert(allocs_.find(off) != allocs_.end());
-		TIndexOffU *ret = buf_ + off;
-		assert_neq(CACHE_WRAPPER_BIT, ret[0]);
-		assert_neq(OFF_MASK, ret[0]);
+#ifndef NDEBUG
+		{
+			ThreadSafe ts(&allocsMutex_);
+			assert(allocs_.find(off) != allocs_.end());
+		}
+#endif
+		TWord *ret = buf_ + off;
+		assert_neq(CACHE_WRAPPER_BIT, ret[0].load());
+		assert_neq(OFF_MASK, ret[0].load());
 		return ret;
 	}
 
 	/**
 	 * Return true iff there's no more room in the cache.
 	 */
-	inline bool closed() {
-		return closed_;
+	inline bool closed() const {
+		return closed_.load(std::memory_order_relaxed);
 	}
 
 private:
-	TIndexOffU lim_;  /// limit on number of 32-bit words to dish out in total
-	TIndexOffU occ_;  /// number of occupied words
-	TIndexOffU *buf_; /// buffer of 32-bit words
-	bool closed_;   ///
+	size_t lim_;                 /// limit on number of words to dish out in total
+	std::atomic<size_t> occ_;    /// number of words dished out, or more once full
+	TWord *buf_;                 /// buffer of words
+	std::atomic<bool> closed_;   /// no more room
 #ifndef NDEBUG
 	std::set<TIndexOffU> allocs_; // elements allocated
+	MUTEX_T allocsMutex_;
 #endif
 };
 
+/**
+ * Map from the top row of a cached range to its entry in the pool,
+ * shared by all worker threads.  Open addressing with linear probing
+ * in a fixed-size table; entries are never removed, so an insert
+ * claims an empty slot with a compare-and-swap on its key, then
+ * publishes the value.  Once the table is three-quarters full it
+ * stops taking new keys.
+ */
+class RangeCacheMap {
+public:
+	typedef std::atomic<TIndexOffU> TWord;
+
+	RangeCacheMap(size_t lim /* max size in bytes */) :
+		bits_(0), mask_(0), keys_(NULL), vals_(NULL), size_(0)
+	{
+		size_t slots = 1;
+		while(slots * 4 * sizeof(TWord) <= lim) {
+			slots <<= 1;
+			bits_++;
+		}
+		if(bits_ == 0) {
+			return;
+		}
+		mask_ = slots - 1;
+		try {
+			keys_ = new TWord[slots];
+			vals_ = new TWord[slots];
+		} catch(std::bad_alloc& e) {
+			cerr << "Allocation error allocating " << lim
+				 << " bytes of range-cache memory" << endl;
+			throw 1;
+		}
+		for(size_t i = 0; i < slots; i++) {
+			keys_[i].store(OFF_MASK, std::memory_order_relaxed);
+			vals_[i].store(OFF_MASK, std::memory_order_relaxed);
+		}
+	}
+
+	~RangeCacheMap() {
+		delete[] keys_;
+		delete[] vals_;
+	}
+
+	/**
+	 * Return the value for 'top', or OFF_MASK if there isn't one.
+	 */
+	TIndexOffU find(TIndexOffU top) const {
+		assert_neq(OFF_MASK, top);
+		if(keys_ == NULL) return OFF_MASK;
+		for(size_t i = hash(top), n = 0; n <= mask_; i = (i + 1) & mask_, n++) {
+			TIndexOffU key = keys_[i].load(std::memory_order_acquire);
+			if(key == top) {
+				return value(i);
+			} else if(key == OFF_MASK) {
+				break;
+			}
+		}
+		return OFF_MASK;
+	}
+
+	/**
+	 * Map 'top' to 'val' unless it's already mapped.  Return the value
+	 * 'top' ends up mapped to, or OFF_MASK if the table is full.
+	 */
+	TIndexOffU insert(TIndexOffU top, TIndexOffU val) {
+		assert_neq(OFF_MASK, top);
+		assert_neq(OFF_MASK, val);
+		if(full()) return OFF_MASK;
+		for(size_t i = hash(top), n = 0; n <= mask_; i = (i + 1) & mask_, n++) {
+			TIndexOffU key = keys_[i].load(std::memory_order_acquire);
+			if(key == OFF_MASK) {
+				if(keys_[i].compare_exchange_strong(key, top, std::memory_order_acq_rel)) {
+					vals_[i].store(val, std::memory_order_release);
+					size_.fetch_add(1, std::memory_order_relaxed);
+					return val;
+				}
+				// Lost the slot; 'key' is now what the winner put there
+			}
+			if(key == top) {
+				return value(i);
+			}
+		}
+		return OFF_MASK;
+	}
+
+	/**
+	 * Return true iff the table takes no new keys.
+	 */
+	bool full() const {
+		return keys_ == NULL ||
+		       size_.load(std::memory_order_relaxed) >= (mask_ + 1) / 4 * 3;
+	}
+
+	/// Number of slots, for iterating over them with slot()
+	size_t slots() const { return keys_ == NULL ? 0 : mask_ + 1; }
+
+	/**
+	 * Return the key in slot i and set 'val' to its value; return
+	 * OFF_MASK if the slot is empty or not yet published.
+	 */
+	TIndexOffU slot(size_t i, TIndexOffU& val) const {
+		val = vals_[i].load(std::memory_order_acquire);
+		return val == OFF_MASK ? OFF_MASK : keys_[i].load(std::memory_order_acquire);
+	}
+
+private:
+
+	size_t hash(TIndexOffU top) const {
+		return (size_t)(((uint64_t)top * 0x9E3779B97F4A7C15ull) >> (64 - bits_));
+	}
+
+	/**
+	 * Return the value in slot i, whose key was just seen set.  The
+	 * thread that set the key stores the value next; wait for it.
+	 */
+	TIndexOffU value(size_t i) const {
+		TIndexOffU val;
+		while((val = vals_[i].load(std::memory_order_acquire)) == OFF_MASK) { }
+		return val;
+	}
+
+	int    bits_;          /// log2 of the number of slots
+	size_t mask_;          /// number of slots - 1
+	TWord *keys_;          /// top rows; OFF_MASK if empty
+	TWord *vals_;          /// pool offsets; OFF_MASK until published
+	std::atomic<size_t> size_; /// keys inserted
+};
+
 /**
  * A view to a range of cached reference positions.
  */
 class RangeCacheEntry {
+	typedef RangeCacheMemPool::TWord TWord;
+
 public:
 	/**
 	 *
 	 */
 	RangeCacheEntry(bool sanity = false) :
 		top_(OFF_MASK), jumps_(0), len_(0), ents_(NULL), ebwt_(NULL),
-		sanity_(sanity)
+		verbose_(false), sanity_(sanity)
 	{ }
 
 	/**
-	 * Create a new RangeCacheEntry from the data in the pool at 'ents'.
-	 */
-	RangeCacheEntry(RangeCacheMemPool& pool, TIndexOffU top,
-			TIndexOffU ent, Ebwt* ebwt, bool sanity = false) :
-	    sanity_(sanity)
-	{
-		init(pool, top, ent, ebwt);
-	}
-
-	/**
-	 * Initialize a RangeCacheEntry from the data in the pool at 'ents'.
+	 * Initialize a RangeCacheEntry for the range with top row 'top'
+	 * from the entry or wrapper in the pool at 'ent'.
 	 */
 	void init(RangeCacheMemPool& pool, TIndexOffU top, TIndexOffU ent, Ebwt* ebwt) {
-		assert(ebwt != NULL);
-		top_ = top;
-		ebwt_ = ebwt;
-		TIndexOffU *ents = pool.get(ent);
-		assert_neq(CACHE_WRAPPER_BIT, ents[0]);
+		TIndexOffU jumps = 0;
+		TWord *ents = pool.get(ent);
+		TIndexOffU hdr = ents[0].load(std::memory_order_relaxed);
+		assert_neq(CACHE_WRAPPER_BIT, hdr);
 		// Is hi bit set?
-		if((ents[0] & CACHE_WRAPPER_BIT) != 0) {
+		if((hdr & CACHE_WRAPPER_BIT) != 0) {
 			// If so, the target is a wrapper and the non-hi bits
 			// contain the # jumps
-			jumps_ = (ents[0] & ~CACHE_WRAPPER_BIT);
-			assert_gt(jumps_, 0);
-			assert_leq(jumps_, ebwt_->_eh._len);
+			jumps = (hdr & ~CACHE_WRAPPER_BIT);
+			assert_gt(jumps, 0);
+			assert_leq(jumps, ebwt->_eh._len);
 			// Get the target entry
-			TIndexOffU *dest = pool.get(ents[1]);
-			// Get the length from the target entry
-			len_ = dest[0];
-			assert_leq(top_ + len_, ebwt_->_eh._len);
-			assert_gt(len_, 0);
-			assert_leq(len_, ebwt_->_eh._len);
-			// Get the pointer to the entries themselves
-			ents_ = dest + 1;
-		} else {
-			// Not a wrapper, so there are no jumps
-			jumps_ = 0;
-			// Get the length from the target entry
-			len_  = ents[0];
-			assert_leq(top_ + len_, ebwt_->_eh._len);
-			assert_gt(len_, 0);
-			assert_leq(len_, ebwt_->_eh._len);
-			// Get the pointer to the entries themselves
-			ents_ = ents + 1;
+			ent = ents[1].load(std::memory_order_relaxed);
 		}
-		if (sanity_)
-			assert(sanityCheckEnts());
+		init(pool, top, jumps, ent, ebwt);
 	}
 
 	/**
-	 * Initialize a wrapper with given number of jumps and given target
-	 * entry index.
+	 * Initialize a view of the range with top row 'top' that is
+	 * 'jumps' jumps to the right of the range with the given (non-
+	 * wrapper) entry.
 	 */
 	void init(RangeCacheMemPool& pool, TIndexOffU top, TIndexOffU jumps,
 			TIndexOffU ent, Ebwt* ebwt)
@@ -194,11 +321,10 @@ public:
 		ebwt_ = ebwt;
 		top_ = top;
 		jumps_ = jumps;
-		TIndexOffU *ents = pool.get(ent);
+		TWord *ents = pool.get(ent);
 		// Must not be a wrapper
-		assert_eq(0, ents[0] & CACHE_WRAPPER_BIT);
-		// Get the length from the target entry
-		len_ = ents[0];
+		len_ = ents[0].load(std::memory_order_relaxed);
+		assert_eq(0, len_ & CACHE_WRAPPER_BIT);
 		assert_gt(len_, 0);
 		assert_leq(len_, ebwt_->_eh._len);
 		// Get the pointer to the entries themselves
@@ -241,7 +367,8 @@ public:
 	/**
 	 * Install a result obtained by a client of this cache; be sure to
 	 * adjust for how many jumps down the tunnel the cache entry is
-	 * situated.
+	 * situated.  Other threads may be installing other elements, or
+	 * this one, at the same time; they all agree on its value.
 	 */
 	void install(TIndexOffU elt, TIndexOffU val) {
 		if(ents_ == NULL) {
@@ -257,14 +384,14 @@ public:
 			val -= jumps_;
 			if(verbose_) cout << "Installed reference offset: " << (top_ + elt) << endl;
 			ASSERT_ONLY(TIndexOffU sanity = RowChaser::toFlatRefOff(ebwt_, 1, top_ + elt));
-			assert_eq(sanity, val);
+			assert_eq(sanity, val + jumps_);
 #ifndef NDEBUG
 			for(size_t i = 0; i < len_; i++) {
 				if(i == elt) continue;
-				assert_neq(val, ents_[i]);
+				assert_neq(val, ents_[i].load());
 			}
 #endif
-			ents_[elt] = val;
+			ents_[elt].store(val, std::memory_order_relaxed);
 		} else {
 			// ignore install request
 			if(verbose_) cout << "Fell off end of cache entry for install: " << (top_ + elt) << endl;
@@ -282,9 +409,10 @@ public:
 		assert(ents_ != NULL);
 		assert(ebwt_ != NULL);
 		assert_leq(top_ + len_, ebwt_->_eh._len);
-		if(elt < len_ && ents_[elt] != RANGE_NOT_SET) {
+		TIndexOffU ent = (elt < len_) ? ents_[elt].load(std::memory_order_relaxed) : RANGE_NOT_SET;
+		if(ent != RANGE_NOT_SET) {
 			if(verbose_) cout << "Retrieved result from cache: " << (top_ + elt) << endl;
-			TIndexOffU ret = ents_[elt] + jumps_;
+			TIndexOffU ret = ent + jumps_;
 			ASSERT_ONLY(TIndexOffU sanity = RowChaser::toFlatRefOff(ebwt_, 1, top_ + elt));
 			assert_eq(sanity, ret);
 			return ret;
@@ -297,25 +425,16 @@ public:
 	/**
 	 * Check that len_ and the ents_ array both make sense.
 	 */
-	static bool sanityCheckEnts(TIndexOffU len, TIndexOffU *ents, Ebwt* ebwt) {
+	static bool sanityCheckEnts(TIndexOffU len, const TWord *ents, Ebwt* ebwt) {
 		assert_gt(len, 0);
 		assert_leq(len, ebwt->_eh._len);
-		if(len < 10) {
-			for(size_t i = 0; i < len; i++) {
-				if(ents[i] == OFF_MASK) continue;
-				assert_leq(ents[i], ebwt->_eh._len);
-				for(size_t j = i+1; j < len; j++) {
-					if(ents[j] == OFF_MASK) continue;
-					assert_neq(ents[i], ents[j]);
-				}
-			}
-		} else {
-			std::set<TIndexOffU> seen;
-			for(size_t i = 0; i < len; i++) {
-				if(ents[i] == OFF_MASK) continue;
-				assert(seen.find(ents[i]) == seen.end());
-				seen.insert(ents[i]);
-			}
+		std::set<TIndexOffU> seen;
+		for(size_t i = 0; i < len; i++) {
+			TIndexOffU ent = ents[i].load(std::memory_order_relaxed);
+			if(ent == OFF_MASK) continue;
+			assert_leq(ent, ebwt->_eh._len);
+			assert(seen.find(ent) == seen.end());
+			seen.insert(ent);
 		}
 		return true;
 	}
@@ -332,23 +451,25 @@ private:
 	TIndexOffU top_;   /// top pointer for this range
 	TIndexOffU jumps_; /// how many tunnel-jumps it is away from the requester
 	TIndexOffU len_;   /// # of entries in cache entry
-	TIndexOffU *ents_; /// ptr to entries, which are flat offs within joined ref
+	TWord   *ents_; /// ptr to entries, which are flat offs within joined ref
 	Ebwt    *ebwt_; /// index that alignments are in
 	bool     verbose_; /// be talkative?
 	bool     sanity_;  /// do consistency checks?
 };
 
 /**
- *
+ * Cache of reference offsets for the rows of big ranges in one index,
+ * shared by all worker threads.  Of the 'lim' bytes it's given, a
+ * quarter go to the map from top rows to entries and the rest to the
+ * entries themselves.
  */
 class RangeCache {
 	typedef EList<TIndexOffU> TUVec;
-	typedef std::map<TIndexOffU, TIndexOffU> TMap;
-	typedef std::map<TIndexOffU, TIndexOffU>::iterator TMapItr;
+	typedef RangeCacheMemPool::TWord TWord;
 
 public:
-	RangeCache(TIndexOffU lim, Ebwt* ebwt) :
-		lim_(lim), map_(), pool_(lim), closed_(false), ebwt_(ebwt), sanity_(true) { }
+	RangeCache(size_t lim, Ebwt* ebwt, bool sanity = false) :
+		lim_(lim), map_(lim / 4), pool_(lim - lim / 4), ebwt_(ebwt), sanity_(sanity) { }
 
 	/**
 	 * Given top and bot offsets, retrieve the canonical cache entry
@@ -361,47 +482,49 @@ public:
 		if(ebwt_ == NULL || lim_ == 0) return false;
 		assert_gt(bot, top);
 		ent.reset();
-		TMapItr itr = map_.find(top);
-		if(itr == map_.end()) {
+		TIndexOffU idx = map_.find(top);
+		if(idx == OFF_MASK) {
 			// No cache entry for the given 'top' offset
-			if(closed_) {
+			if(closed()) {
 				return false; // failed to get cache entry
-			} else {
-				if(pool_.closed()) {
-					closed_ = true;
-					return false; // failed to get cache entry
-				}
 			}
 			// Use the tunnel
-			bool ret = tunnel(top, bot, ent);
-			return ret;
+			return tunnel(top, bot, ent);
 		} else {
 			// There is a cache entry for the given 'top' offset
-			TIndexOffU ret = itr->second;
-			ent.init(pool_, top, ret, ebwt_);
+			ent.init(pool_, top, idx, ebwt_);
 			return true; // success
 		}
 	}
 
+	/**
+	 * Return true iff there's no room for new entries.
+	 */
+	bool closed() const {
+		return pool_.closed() || map_.full();
+	}
+
 	/**
 	 * Exhaustively check all entries linked to from map_ to ensure
 	 * they're well-formed.
 	 */
 	bool repOk() {
 #ifndef NDEBUG
-		for(TMapItr itr = map_.begin(); itr != map_.end(); itr++) {
-			TIndexOffU top = itr->first;
-			TIndexOffU idx = itr->second;
+		for(size_t i = 0; i < map_.slots(); i++) {
+			TIndexOffU idx = 0;
+			TIndexOffU top = map_.slot(i, idx);
+			if(top == OFF_MASK) continue;
 			TIndexOffU jumps = 0;
 			assert_leq(top, ebwt_->_eh._len);
-			TIndexOffU *ents = pool_.get(idx);
-			if((ents[0] & CACHE_WRAPPER_BIT) != 0) {
-				jumps = ents[0] & ~CACHE_WRAPPER_BIT;
+			TWord *ents = pool_.get(idx);
+			TIndexOffU hdr = ents[0].load();
+			if((hdr & CACHE_WRAPPER_BIT) != 0) {
+				jumps = hdr & ~CACHE_WRAPPER_BIT;
 				assert_leq(jumps, ebwt_->_eh._len);
-				idx = ents[1];
+				idx = ents[1].load();
 				ents = pool_.get(idx);
 			}
-			TIndexOffU len = ents[0];
+			TIndexOffU len = ents[0].load();
 			assert_leq(top + len, ebwt_->_eh._len);
 			if (sanity_)
 				RangeCacheEntry::sanityCheckEnts(len, ents + 1, ebwt_);
@@ -412,6 +535,23 @@ public:
 
 protected:
 
+	/**
+	 * Make a wrapper saying that the range with top row 'top' is
+	 * 'jumps' jumps to the right of the range with entry 'idx', and
+	 * map 'top' to it, if there's room.
+	 */
+	void addWrapper(TIndexOffU top, TIndexOffU jumps, TIndexOffU idx) {
+		TIndexOffU wrapIdx = pool_.alloc(2);
+		if(wrapIdx != RANGE_CACHE_BAD_ALLOC) {
+			TWord *wrap = pool_.get(wrapIdx);
+			wrap[1].store(idx, std::memory_order_relaxed);
+			wrap[0].store(CACHE_WRAPPER_BIT | jumps, std::memory_order_relaxed);
+			// Another thread may have beaten us to it; either wrapper
+			// will do
+			map_.insert(top, wrapIdx);
+		}
+	}
+
 	/**
 	 * Tunnel through to the first range that 1) includes all the same
 	 * suffixes (though longer) as the given range, and 2) has a cache
@@ -444,34 +584,22 @@ protected:
 			// suffixes as the last range (though longer by 1 char)
 			if((newbot - newtop) == spread) {
 				// Check if newtop is already cached
-				TMapItr itr = map_.find(newtop);
+				TIndexOffU idx = map_.find(newtop);
 				jumps++;
-				if(itr != map_.end()) {
+				if(idx != OFF_MASK) {
 					// This range, which is further to the left in the
 					// same tunnel as the query range, has a cache
 					// entry already, so use that
-					TIndexOffU idx = itr->second;
-					TIndexOffU *ents = pool_.get(idx);
-					if((ents[0] & CACHE_WRAPPER_BIT) != 0) {
+					TIndexOffU hdr = pool_.get(idx)[0].load(std::memory_order_relaxed);
+					if((hdr & CACHE_WRAPPER_BIT) != 0) {
 						// The cache entry we found was a wrapper; make
 						// a new wrapper that points to that wrapper's
 						// target, with the appropriate number of jumps
-						jumps += (ents[0] & ~CACHE_WRAPPER_BIT);
-						idx = ents[1];
-					}
-					// Allocate a new wrapper
-					TIndexOffU newentIdx = pool_.alloc(2);
-					if(newentIdx != RANGE_CACHE_BAD_ALLOC) {
-						// We successfully made a new wrapper entry;
-						// now populate it and install it in map_
-						TIndexOffU *newent = pool_.get(newentIdx); // get ptr to it
-						assert_eq(0, newent[0]);
-						newent[0] = CACHE_WRAPPER_BIT | jumps; // set jumps
-						newent[1] = idx;                // set target
-						assert(map_.find(top) == map_.end());
-						map_[top] = newentIdx;
-						if(sanity_) assert(repOk());
+						jumps += (hdr & ~CACHE_WRAPPER_BIT);
+						idx = pool_.get(idx)[1].load(std::memory_order_relaxed);
 					}
+					addWrapper(top, jumps, idx);
+					if(sanity_) assert(repOk());
 					// Initialize the entry
 					ent.init(pool_, top, jumps, idx, ebwt_);
 					return true;
@@ -491,53 +619,78 @@ protected:
 		// Try to create a new cache entry for the leftmost range in
 		// the tunnel (which might be the query range)
 		TIndexOffU newentIdx = pool_.alloc(spread + 1);
-		if(newentIdx != RANGE_CACHE_BAD_ALLOC) {
-			// Successfully allocated new range cache entry; install it
-			TIndexOffU *newent = pool_.get(newentIdx);
-			assert_eq(0, newent[0]);
-			// Store cache-range length in first word
-			newent[0] = spread;
-			assert_lt(newent[0], CACHE_WRAPPER_BIT);
-			assert_eq(spread, newent[0]);
-			TIndexOffU entTop = top;
-			TIndexOffU jumps = 0;
-			if(tops.size() > 0) {
-				entTop = tops.back();
-				jumps = (TIndexOff)tops.size();
-			}
-			// Cache the entry for the end of the tunnel
-			assert(map_.find(entTop) == map_.end());
-			map_[entTop] = newentIdx;
-			if(sanity_) assert(repOk());
-			ent.init(pool_, entTop, jumps, newentIdx, ebwt_);
-			assert_eq(spread, newent[0]);
-			if(jumps > 0) {
-				assert_neq(entTop, top);
-				// Cache a wrapper entry for the query range (if possible)
-				TIndexOffU wrapentIdx = pool_.alloc(2);
-				if(wrapentIdx != RANGE_CACHE_BAD_ALLOC) {
-					TIndexOffU *wrapent = pool_.get(wrapentIdx);
-					assert_eq(0, wrapent[0]);
-					wrapent[0] = CACHE_WRAPPER_BIT | jumps;
-					wrapent[1] = newentIdx;
-					assert(map_.find(top) == map_.end());
-					map_[top] = wrapentIdx;
-					if(sanity_) assert(repOk());
-				}
-			}
-			return true;
-		} else {
+		if(newentIdx == RANGE_CACHE_BAD_ALLOC) {
 			// Could not allocate new range cache entry
 			return false;
 		}
+		// Store cache-range length in first word
+		pool_.get(newentIdx)[0].store(spread, std::memory_order_relaxed);
+		assert_lt(spread, CACHE_WRAPPER_BIT);
+		TIndexOffU entTop = top;
+		if(tops.size() > 0) {
+			entTop = tops.back();
+		}
+		// Cache the entry for the end of the tunnel.  If another
+		// thread got there first, use its entry instead; ours goes to
+		// waste.
+		TIndexOffU idx = map_.insert(entTop, newentIdx);
+		if(idx == OFF_MASK) {
+			// No room in the map; the entry serves this read only
+			idx = newentIdx;
+		} else if(idx != newentIdx) {
+			TWord *ents = pool_.get(idx);
+			TIndexOffU hdr = ents[0].load(std::memory_order_relaxed);
+			if((hdr & CACHE_WRAPPER_BIT) != 0) {
+				jumps += (hdr & ~CACHE_WRAPPER_BIT);
+				idx = ents[1].load(std::memory_order_relaxed);
+			}
+		}
+		if(sanity_) assert(repOk());
+		if(jumps > 0) {
+			assert_neq(entTop, top);
+			// Cache a wrapper entry for the query range (if possible)
+			addWrapper(top, jumps, idx);
+			if(sanity_) assert(repOk());
+		}
+		ent.init(pool_, top, jumps, idx, ebwt_);
+		return true;
 	}
 
-	TIndexOffU lim_;           /// Total number of key/val bytes to keep in cache
-	TMap map_;               ///
+	size_t lim_;             /// Total number of key/val bytes to keep in cache
+	RangeCacheMap map_;      /// Top rows to entries in pool_
 	RangeCacheMemPool pool_; /// Memory pool
-	bool closed_;            /// Out of space; no new entries
-	Ebwt* ebwt_;            /// Index that alignments are in
+	Ebwt* ebwt_;             /// Index that alignments are in
 	bool sanity_;
 };
 
+#else
+
+/**
+ * Before C++11 there are no atomics to share a cache among threads
+ * with, so no cache is ever made (see createRangeCaches()).  These
+ * stand-ins let the aligners compile against a NULL RangeCache and
+ * an entry that is never valid.
+ */
+class RangeCacheEntry {
+public:
+	RangeCacheEntry(bool sanity = false) { }
+	TIndexOffU len() const { return 0; }
+	TIndexOffU jumps() const { return 0; }
+	void reset() { }
+	bool valid() const { return false; }
+	Ebwt *ebwt() { return NULL; }
+	void install(TIndexOffU elt, TIndexOffU val) { }
+	TIndexOffU get(TIndexOffU elt) const { return RANGE_NOT_SET; }
+};
+
+class RangeCache {
+public:
+	RangeCache(size_t lim, Ebwt* ebwt, bool sanity = false) { }
+	bool lookup(TIndexOffU top, TIndexOffU bot, RangeCacheEntry& ent) { return false; }
+	bool closed() const { return true; }
+	bool repOk() { return true; }
+};
+
+#endif
+
 #endif /* RANGE_CACHE_H_ */
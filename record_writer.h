@@ -0,0 +1,191 @@
+/*
+ * record_writer.h
+ *
+ * Writes one output record (a SAM line, a line of the default
+ * output, a BAM record) straight into a BTString.  The caller reserves an upper
+ * bound on the record's length up front; fields are then written
+ * through a raw pointer, so no character is bounds-checked or can make
+ * the buffer grow.  Integers are converted two digits at a time and
+ * sequences are decoded with a table lookup per base.
+ */
+
+#ifndef RECORD_WRITER_H_
+#define RECORD_WRITER_H_
+
+#include <limits>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include "assert_helpers.h"
+#include "sstring.h"
+
+/// "00" through "99", for converting integers two digits at a time
+static const char RECORD_DIGIT_PAIRS[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+/// Most characters an integer of up to 64 bits takes, with its sign
+static const size_t RECORD_MAX_INT_CHARS = 20;
+
+class RecordWriter {
+
+public:
+
+	/**
+	 * Start a record at the end of 'o', with room for 'maxlen'
+	 * characters.  'o' keeps its extra capacity for later records.
+	 */
+	RecordWriter(BTString& o, size_t maxlen) : o_(o), off_(o.length()) {
+		o_.resize(off_ + maxlen);
+		cur_ = o_.wbuf() + off_;
+#ifndef NDEBUG
+		end_ = cur_ + maxlen;
+#endif
+	}
+
+	/**
+	 * Trim 'o' to the characters actually written.
+	 */
+	~RecordWriter() {
+		o_.resize((size_t)(cur_ - o_.wbuf()));
+	}
+
+	/// Number of characters written so far
+	size_t length() const { return (size_t)(cur_ - (o_.buf() + off_)); }
+
+	void put(char c) {
+		assert_lt(cur_, end_);
+		*cur_++ = c;
+	}
+
+	void put(const char *s, size_t len) {
+		assert_leq(cur_ + len, end_);
+		memcpy(cur_, s, len);
+		cur_ += len;
+	}
+
+	void put(const char *s) {
+		put(s, strlen(s));
+	}
+
+	void put(const BTString& s) {
+		put(s.buf(), s.length());
+	}
+
+	/**
+	 * Write 's' up to but not including its first space or tab if 'ws'
+	 * is true, or all of it otherwise.
+	 */
+	void putUptoWs(const std::string& s, bool ws) {
+		size_t len = ws ? s.find_first_of(" \t") : std::string::npos;
+		put(s.c_str(), len == std::string::npos ? s.length() : len);
+	}
+
+	/**
+	 * Write the nucleotides of 's', or of its reverse if 'rev' is true.
+	 */
+	void putDna(const BTDnaString& s, bool rev = false) {
+		const size_t len = s.length();
+		const char *b = s.buf();
+		assert_leq(cur_ + len, end_);
+		if(rev) {
+			for(size_t i = 0; i < len; i++) {
+				assert_range(0, 4, (int)b[len-i-1]);
+				cur_[i] = "ACGTN"[(int)b[len-i-1]];
+			}
+		} else {
+			for(size_t i = 0; i < len; i++) {
+				assert_range(0, 4, (int)b[i]);
+				cur_[i] = "ACGTN"[(int)b[i]];
+			}
+		}
+		cur_ += len;
+	}
+
+	/**
+	 * Write 'v' in decimal.
+	 */
+	template<typename T>
+	void putInt(T v) {
+		assert_leq(cur_ + RECORD_MAX_INT_CHARS, end_);
+		uint64_t u = (uint64_t)v;
+		if(std::numeric_limits<T>::is_signed && v < (T)0) {
+			*cur_++ = '-';
+			u = 0 - u;
+		}
+		putUint(u, 1);
+	}
+
+	/**
+	 * Write 'u' in decimal, padded with zeros to at least 'width'
+	 * digits.
+	 */
+	void putUint(uint64_t u, size_t width) {
+		assert_leq(width, RECORD_MAX_INT_CHARS);
+		assert_leq(cur_ + RECORD_MAX_INT_CHARS, end_);
+		char tmp[RECORD_MAX_INT_CHARS];
+		char *e = tmp + RECORD_MAX_INT_CHARS, *p = e;
+		while(u >= 100) {
+			const size_t r = (size_t)(u % 100);
+			u /= 100;
+			p -= 2;
+			p[0] = RECORD_DIGIT_PAIRS[2*r];
+			p[1] = RECORD_DIGIT_PAIRS[2*r+1];
+		}
+		if(u >= 10) {
+			p -= 2;
+			p[0] = RECORD_DIGIT_PAIRS[2*u];
+			p[1] = RECORD_DIGIT_PAIRS[2*u+1];
+		} else {
+			*--p = (char)('0' + u);
+		}
+		while((size_t)(e - p) < width) {
+			*--p = '0';
+		}
+		memcpy(cur_, p, (size_t)(e - p));
+		cur_ += (e - p);
+	}
+
+	/**
+	 * Write the low sizeof(T) bytes of 'v', little-endian, as BAM
+	 * stores integers.
+	 */
+	template<typename T>
+	void putLE(T v) {
+		assert_leq(cur_ + sizeof(T), end_);
+		uint64_t u = (uint64_t)v;
+		for(size_t i = 0; i < sizeof(T); i++) {
+			*cur_++ = (char)(u >> (8 * i));
+		}
+	}
+
+	/**
+	 * Overwrite the 4 bytes at offset 'at' in this record with 'v',
+	 * little-endian; for lengths that are only known at the end.
+	 */
+	void patchLE32(size_t at, uint32_t v) {
+		char *p = o_.wbuf() + off_ + at;
+		assert_leq(p + 4, cur_);
+		for(size_t i = 0; i < 4; i++) {
+			p[i] = (char)(v >> (8 * i));
+		}
+	}
+
+private:
+	BTString& o_;
+	size_t    off_;  // where the record starts in o_
+	char     *cur_;  // next character to write
+#ifndef NDEBUG
+	char     *end_;  // end of the space reserved
+#endif
+};
+
+#endif /* RECORD_WRITER_H_ */
@@ -15,6 +15,7 @@
 #include "qual.h"
 #include "range.h"
 #include "reference.h"
+#include "ref_simd.h"
 #include "sstring.h"
 
 // Let the reference-aligner buffer size be 16K by default.  If more
@@ -43,7 +44,8 @@ public:
 	           bool maqPenalty = false) :
 		verbose_(verbose), seedLen_(seedLen),
 		qualMax_(qualMax), maqPenalty_(maqPenalty), refbuf_(buf_),
-		refbufSz_(REF_ALIGNER_BUFSZ), freeRefbuf_(false)
+		refbufSz_(REF_ALIGNER_BUFSZ), freeRefbuf_(false),
+		simd_(refSimdLevel())
 		{ }
 
 	/**
@@ -76,7 +78,8 @@ public:
 			assert_gt(numToFind, 0);
 			assert_gt(end, begin);
 			TIndexOffU spread = end - begin;
-			TIndexOffU spreadPlus = spread + 12;
+			// Leave room for the vector kernel to read past the end
+			TIndexOffU spreadPlus = spread + 12 + (TIndexOffU)REF_SIMD_PAD;
 			// Make sure the buffer is large enough to accommodate the spread
 			if(spreadPlus > this->refbufSz_) {
 				this->newBuf(spreadPlus);
@@ -86,6 +89,12 @@ public:
 			uint8_t *buf = ((uint8_t*)this->refbuf_) + offset;
 			// Look for alignments
 			ASSERT_ONLY(uint32_t irsz = (uint32_t)ranges.size());
+#ifdef REF_SIMD
+			if(simd_ != REF_SIMD_NONE && maxMms() >= 0) {
+				vecFind(numToFind, tidx, buf, qry, quals, begin, end,
+				        ranges, results, pairs, aoff, seedOnLeft);
+			} else
+#endif
 			anchor64Find(numToFind, tidx, buf, qry, quals, begin,
 				     end, ranges, results, pairs, aoff, seedOnLeft);
 #ifndef NDEBUG
@@ -146,6 +155,165 @@ public:
 	}
 
 protected:
+
+	/**
+	 * Return the number of mismatches allowed anywhere in the read if
+	 * this aligner looks for end-to-end alignments with no regard for
+	 * qualities or seeds, and so can use vecFind(); -1 otherwise.
+	 */
+	virtual int maxMms() const { return -1; }
+
+#ifdef REF_SIMD
+	/**
+	 * Find the same alignments as anchor64Find(), in the same order,
+	 * for an aligner that allows maxMms() mismatches end-to-end.
+	 * Candidate offsets are visited outward from the middle of the
+	 * range, alternating sides, as anchor64Find() and naiveFind() do;
+	 * the vector kernel screens them on the first 32 bases 64 offsets
+	 * per side at a time, and the few that pass are checked in full.
+	 * Which end holds the seed doesn't matter end-to-end, so
+	 * seedOnLeft only passes through to the debug-mode cross-check.
+	 */
+	void vecFind(uint32_t numToFind,
+	             size_t tidx,
+	             uint8_t* ref,
+	             const BTDnaString& qry,
+	             const BTString& quals,
+	             TIndexOffU begin,
+	             TIndexOffU end,
+	             TRangeVec& ranges,
+	             EList<TIndexOffU>& results,
+	             TSetPairs* pairs,
+	             TIndexOffU aoff,
+	             bool seedOnLeft) const
+		{
+			assert_gt(numToFind, 0);
+			const int maxmms = maxMms();
+			assert_geq(maxmms, 0);
+			const uint32_t qlen = (uint32_t)qry.length();
+			assert_geq(end - begin, qlen); // caller should have checked this
+			assert_gt(qlen, 0);
+#ifndef NDEBUG
+			// Get the scalar results for comparison; pairs is consulted
+			// and updated as the search goes, so give it a copy
+			TRangeVec r2; EList<TIndexOffU> re2;
+			TSetPairs pairs2;
+			if(pairs != NULL) pairs2 = *pairs;
+			anchor64Find(numToFind, tidx, ref, qry, quals, begin, end, r2,
+			             re2, pairs != NULL ? &pairs2 : NULL, aoff, seedOnLeft);
+			const size_t rangesInitSz = ranges.size();
+			const size_t resultsInitSz = results.size();
+#endif
+			const char *q = qry.buf();
+			const size_t m = min<size_t>(qlen, 32);
+			const TIndexOffU lim = end - qlen - begin;
+			const TIndexOffU half = lim >> 1;
+			// Round k screens the candidates 64k to 64k+63 places from
+			// the middle: offsets half-d on the left, half+1+d on the
+			// right.  Left ones go first on a tie.
+			bool done = false;
+			for(TIndexOffU d0 = 0; !done && (d0 <= half || half + 1 + d0 <= lim); d0 += 64) {
+				uint64_t lo = 0, hi = 0;
+				TIndexOffU loFirst = 0, hiFirst = half + 1 + d0;
+				if(d0 <= half) {
+					TIndexOffU n = min<TIndexOffU>(64, half - d0 + 1);
+					loFirst = half - d0 + 1 - n;
+					lo = refScanAvx2(ref + loFirst, n, q, m, maxmms);
+				}
+				if(hiFirst <= lim) {
+					TIndexOffU n = min<TIndexOffU>(64, lim - hiFirst + 1);
+					hi = refScanAvx2(ref + hiFirst, n, q, m, maxmms);
+				}
+				while((lo | hi) != 0) {
+					TIndexOffU rir;
+					// Distances from the middle of the next candidate on
+					// each side
+					int il = lo != 0 ? 63 - __builtin_clzll(lo) : -1;
+					int ih = hi != 0 ? __builtin_ctzll(hi) : -1;
+					TIndexOffU dl = il >= 0 ? half - (loFirst + il) : OFF_MASK;
+					TIndexOffU dh = ih >= 0 ? d0 + ih : OFF_MASK;
+					if(dl <= dh) {
+						rir = loFirst + il;
+						lo &= ~(1llu << il);
+					} else {
+						rir = hiFirst + ih;
+						hi &= ~(1llu << ih);
+					}
+					// Check the whole read; Ns in the reference rule the
+					// candidate out, as in naiveFind()
+					int mms = 0;
+					TIndexOffU mmOffs[4];
+					int refcs[4];
+					assert_lt(maxmms, 4);
+					bool match = true;
+					for(size_t j = 0; j < qlen; j++) {
+						const int r = (int)ref[rir + j];
+						if(r & 4) {
+							match = false;
+							break;
+						}
+						if((int)q[j] != r) {
+							if(mms == maxmms) {
+								match = false;
+								break;
+							}
+							mmOffs[mms] = (TIndexOffU)j;
+							refcs[mms++] = "ACGT"[r];
+						}
+					}
+					if(!match) continue;
+					const TIndexOffU ri = begin + rir;
+					if(pairs != NULL) {
+						TU64Pair p;
+						if(ri < aoff) {
+							// By convention, the upstream mate's
+							// coordinates go in the 'first' field
+							p.first  = ((uint64_t)tidx << 32) | (uint64_t)ri;
+							p.second = ((uint64_t)tidx << 32) | (uint64_t)aoff;
+						} else {
+							p.first  = ((uint64_t)tidx << 32) | (uint64_t)aoff;
+							p.second = ((uint64_t)tidx << 32) | (uint64_t)ri;
+						}
+						if(pairs->find(p) != pairs->end()) {
+							// We already found this hit!  Continue.
+							continue;
+						}
+						pairs->insert(p);
+					}
+					ranges.resize(ranges.size()+1);
+					Range& range = ranges.back();
+					range.stratum = mms;
+					range.numMms = mms;
+					assert_eq(0, range.mms.size());
+					assert_eq(0, range.refcs.size());
+					for(int i = 0; i < mms; i++) {
+						range.mms.push_back(mmOffs[i]);
+						range.refcs.push_back(refcs[i]);
+					}
+					results.push_back(ri);
+					if(--numToFind == 0) {
+						done = true;
+						break;
+					}
+				}
+			}
+#ifndef NDEBUG
+			assert_eq(re2.size(), results.size() - resultsInitSz);
+			assert_eq(r2.size(), ranges.size() - rangesInitSz);
+			for(size_t i = 0; i < re2.size(); i++) {
+				const Range& a = ranges[rangesInitSz + i];
+				assert_eq(re2[i], results[resultsInitSz + i]);
+				assert_eq(r2[i].numMms, a.numMms);
+				for(size_t j = 0; j < a.mms.size(); j++) {
+					assert_eq(r2[i].mms[j], a.mms[j]);
+					assert_eq(r2[i].refcs[j], a.refcs[j]);
+				}
+			}
+			assert(pairs == NULL || pairs2 == *pairs);
+#endif
+		}
+#endif
+
 	bool      verbose_;   /// be talkative
 	uint32_t  seedLen_;   /// length of seed region for read
 	uint32_t  qualMax_;   /// maximum sum of quality penalties
@@ -154,6 +322,7 @@ protected:
 	uint32_t  refbufSz_;  /// size of current reference buffer
 	uint32_t  buf_[REF_ALIGNER_BUFSZ / 4]; /// built-in reference buffer (may be superseded)
 	bool      freeRefbuf_; /// whether refbuf_ points to something we should delete
+	int       simd_;      /// REF_SIMD_* kernel vecFind() uses, if any
 };
 
 /**
@@ -175,6 +344,8 @@ public:
 	virtual ~ExactRefAligner() { }
 
 protected:
+	virtual int maxMms() const { return 0; }
+
 	/**
 	 * Because we're doing end-to-end exact, we don't care which end of
 	 * 'qry' is the 5' end.
@@ -506,6 +677,8 @@ public:
 	virtual ~OneMMRefAligner() { }
 
 protected:
+	virtual int maxMms() const { return 1; }
+
 	/**
 	 * Because we're doing end-to-end exact, we don't care which end of
 	 * 'qry' is the 5' end.
@@ -907,6 +1080,8 @@ protected:
 		virtual ~TwoMMRefAligner() { }
 
 	protected:
+		virtual int maxMms() const { return 2; }
+
 		/**
 		 * Because we're doing end-to-end exact, we don't care which end of
 		 * 'qry' is the 5' end.
@@ -1382,6 +1557,8 @@ protected:
 			virtual ~ThreeMMRefAligner() { }
 
 		protected:
+			virtual int maxMms() const { return 3; }
+
 			/**
 			 * Because we're doing end-to-end exact, we don't care which end of
 			 * 'qry' is the 5' end.
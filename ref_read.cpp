@@ -1,19 +1,59 @@
+#include <sys/stat.h>
+#if (__cplusplus >= 201103L)
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#endif
 #include "alphabet.h"
 #include "ref_read.h"
 
+/**
+ * Bitpairs packed four to a byte in memory, laid out the way
+ * BitpairOutFileBuf lays them out in the .3.ebwt/.4.ebwt file.  Lets a
+ * worker thread pack its part of the reference ahead of the writer.
+ */
+class BitpairMemBuf {
+public:
+	BitpairMemBuf() : n_(0) { }
+
+	void write(int bp) {
+		assert_lt(bp, 4);
+		assert_geq(bp, 0);
+		if((n_ & 3) == 0) {
+			buf_.push_back(0);
+		}
+		buf_.back() |= (uint8_t)(bp << ((n_ & 3) << 1));
+		n_++;
+	}
+
+	const uint8_t *ptr() const { return buf_.ptr(); }
+	size_t size() const { return n_; }
+
+private:
+	EList<uint8_t> buf_;
+	size_t n_; // bitpairs written
+};
+
 /**
  * Reads past the next ambiguous or unambiguous stretch of sequence
  * from the given FASTA file and returns its length.  Does not do
  * anything with the sequence characters themselves; this is purely for
  * measuring lengths.
  */
-RefRecord fastaRefReadSize(FileBuf& in,
-                           const RefReadInParams& rparms,
-                           bool first,
-                           BitpairOutFileBuf* bpout)
+template<typename TBpOut>
+static RefRecord fastaRefReadSizeT(FileBuf& in,
+                                   const RefReadInParams& rparms,
+                                   bool first,
+                                   TBpOut* bpout)
 {
 	int c;
+#if (__cplusplus >= 201103L)
+	static thread_local int lastc = '>'; // last character seen
+#else
 	static int lastc = '>'; // last character seen
+#endif
 
 	// RefRecord params
 	TIndexOffU len = 0; // 'len' counts toward total length
@@ -140,6 +180,14 @@ RefRecord fastaRefReadSize(FileBuf& in,
 	return RefRecord((TIndexOffU)off, (TIndexOffU)len, first);
 }
 
+RefRecord fastaRefReadSize(FileBuf& in,
+                           const RefReadInParams& rparms,
+                           bool first,
+                           BitpairOutFileBuf* bpout)
+{
+	return fastaRefReadSizeT(in, rparms, first, bpout);
+}
+
 static void
 printRecords(ostream& os, const EList<RefRecord>& l) {
 	for(size_t i = 0; i < l.size(); i++) {
@@ -197,10 +245,319 @@ void reverseRefRecords(const EList<RefRecord>& src,
 #endif
 }
 
+/**
+ * Running totals kept by fastaRefReadSizes as it goes through the
+ * records of all the input files in order.
+ */
+struct RefSizeTally {
+	RefSizeTally() : unambigTot(0), bothTot(0), both(0), unambig(0) { }
+
+	/**
+	 * Account for the next record read and add it to recs unless it's
+	 * empty.
+	 */
+	void add(RefRecord rec,
+	         EList<RefRecord>& recs,
+	         EList<uint32_t>& plens,
+	         TIndexOff& numSeqs)
+	{
+		// Update plens
+		if(rec.first) {
+			if(unambig > 0) {
+				plens.push_back(both);
+			}
+			both = 0;
+			unambig = 0;
+		}
+#ifndef ACCOUNT_FOR_ALL_GAP_REFS
+		if(rec.len == 0) rec.first = false;
+#endif
+		if((unambigTot + rec.len) < unambigTot) {
+#ifdef BOWTIE_64BIT_INDEX
+			cerr << "Error: Reference sequence has more than 2^32-1 characters!  Please divide the" << endl
+			     << "reference into smaller chunks and index each independently." << endl;
+#else
+			cerr << "Error: Reference sequence has more than 2^32-1 characters!  Please try to" << endl
+			     << "build a large index instead using the appropiate options." << endl;
+#endif
+			throw 1;
+		}
+		// Add the length of this record.
+		if(rec.first) numSeqs++;
+		unambigTot += rec.len; unambig += rec.len;
+		bothTot += rec.len;    both += rec.len;
+		bothTot += rec.off;    both += rec.off;
+		if(rec.len == 0 && rec.off == 0 && !rec.first) return;
+		recs.push_back(rec);
+	}
+
+	TIndexOffU unambigTot;
+	size_t bothTot;
+	uint32_t both, unambig;
+};
+
+/**
+ * Rewind an input stream that fastaRefReadSizes has read through.
+ */
+static void resetRefStream(FileBuf *in) {
+	in->reset();
+	assert(!in->eof());
+#ifndef NDEBUG
+	// Check that it's really reset
+	int c = in->get();
+	assert_eq('>', c);
+	in->reset();
+	assert(!in->eof());
+#endif
+}
+
+#if (__cplusplus >= 201103L)
+
+/// Files at least twice this long are split at record boundaries
+/// into pieces of about this size, one per task
+static const uint64_t REF_CHUNK_SZ = 32 * 1024 * 1024;
+
+/**
+ * One piece of the input for a fastaRefReadSizes worker: either a
+ * whole input stream or a byte range of a regular file beginning at
+ * the start of a record.  The worker leaves the piece's records and
+ * packed sequence here for the thread that writes them out.
+ */
+struct RefSizeTask {
+	RefSizeTask() : in(0), fname(0), beg(0), end(0), done(false) { }
+
+	size_t in;          // index of the input stream
+	const char *fname;  // file to open for a byte range, or NULL
+	uint64_t beg, end;  // byte range when fname != NULL
+	EList<RefRecord> recs;
+	BitpairMemBuf bps;
+	bool done;
+	std::exception_ptr err;
+};
+
+/**
+ * Return the offsets at which to split a regular file of fsize bytes
+ * into pieces of about REF_CHUNK_SZ, each starting with the '>' of a
+ * name line.  The first offset is always 0.
+ */
+static void refChunkStarts(const char *fname,
+                           uint64_t fsize,
+                           EList<uint64_t>& starts)
+{
+	starts.clear();
+	starts.push_back(0);
+	FILE *f = fopen(fname, "rb");
+	if(f == NULL) {
+		return;
+	}
+	const size_t nchunks = (size_t)(fsize / REF_CHUNK_SZ);
+	char buf[64 * 1024];
+	uint64_t from = 0;
+	for(size_t k = 1; k < nchunks; k++) {
+		uint64_t target = max<uint64_t>(k * (fsize / nchunks), from);
+		if(target >= fsize) break;
+		// Look for a newline followed by '>' at or after target
+		if(fseeko(f, (off_t)target - 1, SEEK_SET) != 0) break;
+		uint64_t pos = target - 1; // file offset of buf[0]
+		int prev = -1;
+		uint64_t found = fsize;
+		size_t n;
+		while(found == fsize && (n = fread(buf, 1, sizeof(buf), f)) > 0) {
+			if(prev == '\n' && buf[0] == '>') {
+				found = pos;
+				break;
+			}
+			const char *p = buf;
+			while((p = (const char *)memchr(p, '\n', buf + n - p)) != NULL) {
+				if(p + 1 < buf + n && p[1] == '>') {
+					found = pos + (uint64_t)(p + 1 - buf);
+					break;
+				}
+				p++;
+			}
+			prev = buf[n-1];
+			pos += n;
+		}
+		if(found >= fsize) break;
+		if(found > starts.back()) {
+			starts.push_back(found);
+		}
+		from = found + 1;
+	}
+	fclose(f);
+}
+
+/**
+ * Read the sizes of the records in a task's piece of the input and
+ * pack its sequence into memory.
+ */
+static void readRefSizeTask(RefSizeTask& t,
+                            EList<FileBuf*>& in,
+                            const RefReadInParams& rparms,
+                            bool pack)
+{
+	FileBuf *fb = in[t.in];
+	FILE *f = NULL;
+	if(t.fname != NULL) {
+		f = fopen(t.fname, "rb");
+		if(f == NULL || fseeko(f, (off_t)t.beg, SEEK_SET) != 0) {
+			if(f != NULL) fclose(f);
+			cerr << "Error: could not open " << t.fname << endl;
+			throw 1;
+		}
+		fb = new FileBuf(f);
+		fb->limitTo(t.end - t.beg);
+	}
+	try {
+		bool first = true;
+		assert(!fb->eof());
+		while(!fb->eof()) {
+			t.recs.push_back(fastaRefReadSizeT(*fb, rparms, first,
+				pack ? &t.bps : (BitpairMemBuf*)NULL));
+			first = false;
+		}
+	} catch(...) {
+		if(f != NULL) delete fb;
+		throw;
+	}
+	if(f != NULL) {
+		delete fb; // closes f
+	}
+}
+
+/**
+ * Split the input into tasks, read and pack them on nthreads threads,
+ * and account for and write out each task's records in input order as
+ * soon as it's done.  Only a window of tasks is read ahead of the
+ * writer, to bound the memory held by packed sequence.
+ */
+static void fastaRefReadSizesPar(EList<FileBuf*>& in,
+                                 const EList<string>* fnames,
+                                 EList<RefRecord>& recs,
+                                 EList<uint32_t>& plens,
+                                 const RefReadInParams& rparms,
+                                 BitpairOutFileBuf* bpout,
+                                 TIndexOff& numSeqs,
+                                 RefSizeTally& tally,
+                                 int nthreads)
+{
+	EList<RefSizeTask*> tasks;
+	EList<uint64_t> starts;
+	for(size_t i = 0; i < in.size(); i++) {
+		starts.clear();
+		struct stat st;
+		const char *fname = NULL;
+		if(fnames != NULL && i < fnames->size() &&
+		   !FileBuf::isGzippedFile((*fnames)[i].c_str()) &&
+		   stat((*fnames)[i].c_str(), &st) == 0 && S_ISREG(st.st_mode) &&
+		   (uint64_t)st.st_size >= 2 * REF_CHUNK_SZ)
+		{
+			fname = (*fnames)[i].c_str();
+			refChunkStarts(fname, (uint64_t)st.st_size, starts);
+		}
+		if(starts.size() <= 1) {
+			tasks.push_back(new RefSizeTask());
+			tasks.back()->in = i;
+			continue;
+		}
+		for(size_t j = 0; j < starts.size(); j++) {
+			tasks.push_back(new RefSizeTask());
+			RefSizeTask& t = *tasks.back();
+			t.in = i;
+			t.fname = fname;
+			t.beg = starts[j];
+			t.end = (j+1 < starts.size()) ? starts[j+1] : (uint64_t)st.st_size;
+		}
+	}
+	const size_t window = 2 * (size_t)nthreads;
+	std::mutex mu;
+	std::condition_variable doneCv, spaceCv;
+	size_t next = 0, consumed = 0;
+	bool stop = false;
+	auto worker = [&]() {
+		std::unique_lock<std::mutex> lk(mu);
+		while(true) {
+			while(!stop && next < tasks.size() && next >= consumed + window) {
+				spaceCv.wait(lk);
+			}
+			if(stop || next >= tasks.size()) break;
+			RefSizeTask& t = *tasks[next++];
+			lk.unlock();
+			try {
+				readRefSizeTask(t, in, rparms, bpout != NULL);
+			} catch(...) {
+				t.err = std::current_exception();
+			}
+			lk.lock();
+			t.done = true;
+			doneCv.notify_all();
+		}
+	};
+	EList<std::thread*> threads;
+	for(int i = 0; i < nthreads; i++) {
+		threads.push_back(new std::thread(worker));
+	}
+	std::exception_ptr err;
+	for(size_t i = 0; i < tasks.size(); i++) {
+		RefSizeTask& t = *tasks[i];
+		{
+			std::unique_lock<std::mutex> lk(mu);
+			while(!t.done) doneCv.wait(lk);
+		}
+		if(t.err) {
+			err = t.err;
+			break;
+		}
+		try {
+			for(size_t j = 0; j < t.recs.size(); j++) {
+				tally.add(t.recs[j], recs, plens, numSeqs);
+			}
+			if(bpout != NULL) {
+				bpout->writePacked(t.bps.ptr(), t.bps.size());
+			}
+		} catch(...) {
+			err = std::current_exception();
+			break;
+		}
+		// Rewind a whole stream once its last task is consumed
+		if(t.fname == NULL) {
+			resetRefStream(in[t.in]);
+		}
+		delete tasks[i];
+		tasks[i] = NULL;
+		std::lock_guard<std::mutex> lk(mu);
+		consumed++;
+		spaceCv.notify_all();
+	}
+	{
+		std::lock_guard<std::mutex> lk(mu);
+		stop = true;
+	}
+	spaceCv.notify_all();
+	for(size_t i = 0; i < threads.size(); i++) {
+		threads[i]->join();
+		delete threads[i];
+	}
+	for(size_t i = 0; i < tasks.size(); i++) {
+		delete tasks[i];
+	}
+	if(err) {
+		std::rethrow_exception(err);
+	}
+}
+
+#endif /* __cplusplus >= 201103L */
+
 /**
  * Calculate a vector containing the sizes of all of the patterns in
  * all of the given input files, in order.  Returns the total size of
  * all references combined.  Rewinds each istream before returning.
+ *
+ * With nthreads > 1, the inputs are read and their sequence packed on
+ * that many threads: a thread per file, and large regular files named
+ * in fnames are split at record boundaries so their pieces can be
+ * read in parallel too.  Records and packed sequence still come out
+ * in input order, so the result is the same as with one thread.
  */
 std::pair<size_t, size_t>
 fastaRefReadSizes(EList<FileBuf*>& in,
@@ -208,60 +565,34 @@ fastaRefReadSizes(EList<FileBuf*>& in,
                   EList<uint32_t>& plens,
                   const RefReadInParams& rparms,
                   BitpairOutFileBuf* bpout,
-                  TIndexOff& numSeqs)
+                  TIndexOff& numSeqs,
+                  const EList<string>* fnames,
+                  int nthreads)
 {
-	TIndexOffU unambigTot = 0;
-	size_t bothTot = 0;
+	RefSizeTally tally;
 	assert_gt(in.size(), 0);
-	uint32_t both = 0, unambig = 0;
+#if (__cplusplus >= 201103L)
+	if(nthreads > 1) {
+		fastaRefReadSizesPar(in, fnames, recs, plens, rparms, bpout,
+		                     numSeqs, tally, nthreads);
+	} else
+#endif
 	// For each input istream
 	for(size_t i = 0; i < in.size(); i++) {
 		bool first = true;
 		assert(!in[i]->eof());
 		// For each pattern in this istream
 		while(!in[i]->eof()) {
-			RefRecord rec = fastaRefReadSize(*in[i], rparms, first, bpout);
-			// Update plens
-			if(rec.first) {
-				if(unambig > 0) {
-					plens.push_back(both);
-				}
-				both = 0;
-				unambig = 0;
-			}
-#ifndef ACCOUNT_FOR_ALL_GAP_REFS
-			if(rec.len == 0) rec.first = false;
-#endif
-			if((unambigTot + rec.len) < unambigTot) {
-#ifdef BOWTIE_64BIT_INDEX
-				cerr << "Error: Reference sequence has more than 2^32-1 characters!  Please divide the" << endl
-				     << "reference into smaller chunks and index each independently." << endl;
-#else
-				cerr << "Error: Reference sequence has more than 2^32-1 characters!  Please try to" << endl
-				     << "build a large index instead using the appropiate options." << endl;
-#endif
-				throw 1;
-			}
-			// Add the length of this record.
-			if(rec.first) numSeqs++;
-			unambigTot += rec.len; unambig += rec.len;
-			bothTot += rec.len;    both += rec.len;
-			bothTot += rec.off;    both += rec.off;
+			tally.add(fastaRefReadSize(*in[i], rparms, first, bpout),
+			          recs, plens, numSeqs);
 			first = false;
-			if(rec.len == 0 && rec.off == 0 && !rec.first) continue;
-			recs.push_back(rec);
 		}
 		// Reset the input stream
-		in[i]->reset();
-		assert(!in[i]->eof());
-#ifndef NDEBUG
-		// Check that it's really reset
-		int c = in[i]->get();
-		assert_eq('>', c);
-		in[i]->reset();
-		assert(!in[i]->eof());
-#endif
+		resetRefStream(in[i]);
 	}
+	TIndexOffU unambigTot = tally.unambigTot;
+	size_t bothTot = tally.bothTot;
+	uint32_t both = tally.both, unambig = tally.unambig;
 	assert_geq(bothTot, 0);
 	assert_geq(unambigTot, 0);
 	if(unambig > 0) {
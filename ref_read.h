@@ -120,7 +120,9 @@ fastaRefReadSizes(
 	EList<uint32_t>& plens,
 	const RefReadInParams& rparms,
 	BitpairOutFileBuf* bpout,
-	TIndexOff& numSeqs);
+	TIndexOff& numSeqs,
+	const EList<std::string>* fnames = NULL,
+	int nthreads = 1);
 
 extern void
 reverseRefRecords(
@@ -142,7 +144,11 @@ static RefRecord fastaRefReadAppend(FileBuf& in,
                                     string* name = NULL)
 {
 	int c;
+#if (__cplusplus >= 201103L)
+	static thread_local int lastc = '>'; // bowtie-build may read two at once
+#else
 	static int lastc = '>';
+#endif
 	if(first) {
 		c = in.getPastWhitespace();
 		if(c != '>') {
@@ -0,0 +1,63 @@
+/*
+ * ref_simd.cpp
+ *
+ * Byte lane i of the vector loaded from ref+j holds the base that read
+ * position j lines up with when the read starts at offset i, so
+ * comparing it with read character j broadcast to every lane checks
+ * position j for 32 offsets at once.  Matches are tallied per lane; a
+ * lane is out once it has seen more than maxMms mismatches, and a
+ * vector stops early once every lane is out, which for most stretches
+ * of reference happens within the first few read positions.
+ */
+
+#include "ref_simd.h"
+#include "processor_support.h"
+
+#ifdef REF_SIMD
+#include <immintrin.h>
+#endif
+
+int refSimdLevel() {
+#ifdef REF_SIMD
+	ProcessorSupport ps;
+	if(ps.AVX2enabled()) return REF_SIMD_AVX2;
+#endif
+	return REF_SIMD_NONE;
+}
+
+#ifdef REF_SIMD
+
+/// Read positions checked between tests for whether any lane is left
+static const size_t REF_SCAN_STRIDE = 8;
+
+__attribute__((target("avx2")))
+uint64_t refScanAvx2(const uint8_t *ref, size_t n,
+                     const char *qry, size_t m, int maxMms)
+{
+	uint64_t ret = 0;
+	for(size_t v = 0; v < n; v += 32) {
+		const uint8_t *r = ref + v;
+		__m256i matches = _mm256_setzero_si256();
+		uint32_t alive = 0xffffffff;
+		for(size_t j = 0; j < m && alive != 0;) {
+			size_t je = j + REF_SCAN_STRIDE;
+			if(je > m) je = m;
+			for(; j < je; j++) {
+				__m256i eq = _mm256_cmpeq_epi8(
+					_mm256_loadu_si256((const __m256i*)(r + j)),
+					_mm256_set1_epi8(qry[j]));
+				matches = _mm256_sub_epi8(matches, eq); // eq lanes are -1
+			}
+			// A lane is still in if matches > j - maxMms - 1
+			alive = (uint32_t)_mm256_movemask_epi8(_mm256_cmpgt_epi8(
+				matches, _mm256_set1_epi8((char)((int)j - maxMms - 1))));
+		}
+		ret |= (uint64_t)alive << v;
+	}
+	if(n < 64) {
+		ret &= (1llu << n) - 1;
+	}
+	return ret;
+}
+
+#endif /* REF_SIMD */
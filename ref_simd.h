@@ -0,0 +1,52 @@
+/*
+ * ref_simd.h
+ *
+ * Vector kernel for screening many candidate offsets of a read against
+ * a stretch of reference at once, as RefAligner does when looking for
+ * the opposite mate.  The stretch is one byte per base (0-3, or 4 for
+ * N), as BitPairReference::getStretch() leaves it, so each byte lane
+ * of a vector holds the reference base for a different candidate
+ * offset: one compare checks one read position against 32 offsets.
+ * Like the kernels in occ_simd.h, it's compiled with a per-function
+ * target attribute and only used if ProcessorSupport says the CPU can
+ * run it.
+ */
+
+#ifndef REF_SIMD_H_
+#define REF_SIMD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(POPCNT_CAPABILITY) && defined(__GNUC__) && defined(__x86_64__)
+#define REF_SIMD
+#endif
+
+enum {
+	REF_SIMD_NONE = 0, // scalar anchor64Find() in ref_aligner.h
+	REF_SIMD_AVX2      // 32-byte vectors, one offset per byte lane
+};
+
+/// Bytes the kernel may read past the last base of the last candidate
+static const size_t REF_SIMD_PAD = 64;
+
+/**
+ * Return the best screening kernel supported by this CPU and OS.
+ */
+extern int refSimdLevel();
+
+#ifdef REF_SIMD
+
+/**
+ * Set bit i of the result iff the first m characters of qry (m <= 32)
+ * differ from ref[i..i+m) in at most maxMms positions, for i < n
+ * (n <= 64).  An N in the read or the reference counts as a mismatch
+ * unless both are Ns.  Reads up to ref[n+m+31], which must be readable
+ * though it needn't be part of the stretch.
+ */
+extern uint64_t refScanAvx2(const uint8_t *ref, size_t n,
+                            const char *qry, size_t m, int maxMms);
+
+#endif /* REF_SIMD */
+
+#endif /* REF_SIMD_H_ */
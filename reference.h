@@ -9,6 +9,7 @@
 #include "mm.h"
 #include "ref_read.h"
 #include "sequence_io.h"
+#include "hugepage.h"
 #include "shmem.h"
 #include "sstring.h"
 #include "timer.h"
@@ -48,13 +49,15 @@ public:
 	                 bool useShmem,
 	                 bool mmSweep,
 	                 bool verbose,
-	                 bool startVerbose) :
+	                 bool startVerbose,
+	                 bool hugePages = false) :
 	buf_(NULL),
 	sanityBuf_(NULL),
 	loaded_(true),
 	sanity_(sanity),
 	useMm_(useMm),
 	useShmem_(useShmem),
+	hugePages_(hugePages && !useMm && !useShmem),
 	verbose_(verbose)
 	{
 		string s3 = in + ".3." + gEbwt_ext;
@@ -248,7 +251,11 @@ public:
 			if(!useShmem_) {
 				// Allocate a buffer to hold the reference string
 				try {
-					buf_ = new uint8_t[cumsz >> 2];
+					if(hugePages_) {
+						buf_ = ALLOC_HUGE_U8(cumsz >> 2, "reference");
+					} else {
+						buf_ = new uint8_t[cumsz >> 2];
+					}
 					if(buf_ == NULL) throw std::bad_alloc();
 				} catch(std::bad_alloc& e) {
 					cerr << "Error: Ran out of memory allocating space for the bitpacked reference.  Please" << endl
@@ -370,7 +377,8 @@ public:
 	}
 
 	~BitPairReference() {
-		if(buf_ != NULL && !useMm_ && !useShmem_) delete[] buf_;
+		if(buf_ != NULL && hugePages_) FREE_HUGE(buf_);
+		else if(buf_ != NULL && !useMm_ && !useShmem_) delete[] buf_;
 		if(sanityBuf_ != NULL) delete[] sanityBuf_;
 	}
 
@@ -717,6 +725,7 @@ protected:
 	bool     sanity_;   /// do sanity checking
 	bool     useMm_;    /// load the reference as a memory-mapped file
 	bool     useShmem_; /// load the reference into shared memory
+	bool     hugePages_; /// buf_ is in huge pages
 	bool     verbose_;
 };
 
@@ -0,0 +1,270 @@
+/*
+ * sa_checkpoint.h
+ *
+ * Lets a blockwise suffix-array build that was killed pick up where it
+ * left off.  The build keeps its difference-cover sample, its sample
+ * suffixes and every sorted block in a checkpoint directory, and
+ * records each in a manifest once it's completely on disk.  A later
+ * build of the same text with the same parameters reads the manifest,
+ * loads the samples instead of computing them, and sorts only the
+ * blocks that aren't listed.
+ *
+ * Files for an index with checkpoint prefix <base>:
+ *
+ *   <base>.manifest  one line per event: the parameters the build was
+ *                    started with, "samples <nblocks>" once the samples
+ *                    are saved, and "block <i>" for each sorted block
+ *   <base>.samples   difference-cover sample and sample suffixes
+ *   <base>.<i>.sa    sorted block i
+ *   <base>.done      the index itself was written
+ *
+ * Each file is written under a temporary name and renamed into place
+ * before its manifest line is appended, so a listed file is always
+ * whole.  Everything is in this machine's byte order; the manifest's
+ * parameters include the word size and byte order.
+ */
+
+#ifndef SA_CHECKPOINT_H_
+#define SA_CHECKPOINT_H_
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include "ds.h"
+#include "threading.h"
+
+class SACheckpoint {
+
+public:
+
+	SACheckpoint() : _nblocks(0) { }
+
+	/// Prefix of this build's checkpoint files; empty to disable
+	void init(const std::string& base) { _base = base; }
+
+	bool enabled() const { return !_base.empty(); }
+
+	std::string samplesFname() const { return _base + ".samples"; }
+
+	std::string blockFname(size_t i) const {
+		std::ostringstream number; number << i;
+		return _base + "." + number.str() + ".sa";
+	}
+
+	/**
+	 * Open the manifest for a build with parameters 'params'.  If an
+	 * earlier build with the same parameters got as far as saving its
+	 * samples, note which of its blocks were saved and return true.
+	 * Otherwise start a fresh manifest and return false.  Either way
+	 * the manifest is rewritten without any torn last line.
+	 */
+	bool resume(const std::string& params) {
+		_params = params;
+		_nblocks = 0;
+		_saved.clear();
+		std::ifstream in(manifestFname().c_str());
+		std::string line;
+		bool match = false;
+		while(in.good() && std::getline(in, line)) {
+			if(in.eof()) {
+				break; // no newline; torn by a crash
+			}
+			if(line.compare(0, 7, "params ") == 0) {
+				match = (line.substr(7) == params);
+			} else if(!match) {
+				break;
+			} else if(line.compare(0, 8, "samples ") == 0) {
+				std::istringstream is(line.substr(8));
+				is >> _nblocks;
+				_saved.resize(_nblocks);
+				_saved.fill(false);
+			} else if(line.compare(0, 6, "block ") == 0) {
+				std::istringstream is(line.substr(6));
+				size_t i = 0;
+				if(is >> i && i < _saved.size()) {
+					_saved[i] = true;
+				}
+			}
+		}
+		in.close();
+		if(!match || _nblocks == 0) {
+			restart();
+			return false;
+		}
+		std::string tmp = manifestFname() + ".tmp";
+		{
+			std::ofstream out(tmp.c_str());
+			out << "params " << _params << std::endl;
+			out << "samples " << _nblocks << std::endl;
+			for(size_t i = 0; i < _saved.size(); i++) {
+				if(_saved[i]) out << "block " << i << std::endl;
+			}
+			if(!out.good()) {
+				std::cerr << "Could not write checkpoint manifest \"" << tmp << "\"" << std::endl;
+				throw 1;
+			}
+		}
+		commitFile(tmp, manifestFname());
+		openManifest();
+		return true;
+	}
+
+	/**
+	 * Forget any earlier build, deleting its files; start a new
+	 * manifest.
+	 */
+	void restart() {
+		_nblocks = 0;
+		_saved.clear();
+		if(_manifest.is_open()) {
+			_manifest.close();
+		}
+		removeFiles(_base);
+		std::string tmp = manifestFname() + ".tmp";
+		{
+			std::ofstream out(tmp.c_str());
+			out << "params " << _params << std::endl;
+			if(!out.good()) {
+				std::cerr << "Could not write checkpoint manifest \"" << tmp << "\"" << std::endl
+				     << "Please make sure the checkpoint directory exists and is writable." << std::endl;
+				throw 1;
+			}
+		}
+		commitFile(tmp, manifestFname());
+		openManifest();
+	}
+
+	/// Number of blocks the saved samples delimit, or 0
+	size_t nblocks() const { return _nblocks; }
+
+	/// Number of blocks already saved
+	size_t nsaved() const {
+		size_t n = 0;
+		for(size_t i = 0; i < _saved.size(); i++) {
+			if(_saved[i]) n++;
+		}
+		return n;
+	}
+
+	/// True iff block i was saved by this or an earlier build
+	bool saved(size_t i) const {
+		return i < _saved.size() && _saved[i];
+	}
+
+	/**
+	 * Record that the samples, which delimit 'nblocks' blocks, are in
+	 * samplesFname() (written to samplesFname() + ".tmp").
+	 */
+	void commitSamples(size_t nblocks) {
+		commitFile(samplesFname() + ".tmp", samplesFname());
+		_nblocks = nblocks;
+		_saved.resize(nblocks);
+		_saved.fill(false);
+		appendLine("samples", nblocks);
+	}
+
+	/**
+	 * Record that block i is in blockFname(i) (written to
+	 * blockFname(i) + ".tmp").  Can be called from several threads.
+	 */
+	void commitBlock(size_t i) {
+		commitFile(blockFname(i) + ".tmp", blockFname(i));
+		ThreadSafe ts(&_mutex);
+		_saved[i] = true;
+		appendLine("block", i);
+	}
+
+	/**
+	 * Delete the manifest, samples and blocks of the build with
+	 * checkpoint prefix 'base', but not its .done marker.
+	 */
+	static void removeFiles(const std::string& base) {
+		SACheckpoint ckpt;
+		ckpt.init(base);
+		std::ifstream in(ckpt.manifestFname().c_str());
+		std::string line;
+		size_t nblocks = 0;
+		while(std::getline(in, line)) {
+			if(line.compare(0, 8, "samples ") == 0) {
+				std::istringstream is(line.substr(8));
+				is >> nblocks;
+			}
+		}
+		in.close();
+		for(size_t i = 0; i < nblocks; i++) {
+			std::remove(ckpt.blockFname(i).c_str());
+		}
+		std::remove(ckpt.samplesFname().c_str());
+		std::remove(ckpt.manifestFname().c_str());
+	}
+
+	/**
+	 * Note that the index with checkpoint prefix 'base' was written,
+	 * along with a description of the run that wrote it, and delete
+	 * the files its build no longer needs.
+	 */
+	static void markDone(const std::string& base, const std::string& desc) {
+		std::string tmp = base + ".done.tmp";
+		{
+			std::ofstream out(tmp.c_str());
+			out << desc << std::endl;
+			if(!out.good()) {
+				std::cerr << "Could not write checkpoint file \"" << tmp << "\"" << std::endl;
+				throw 1;
+			}
+		}
+		commitFile(tmp, base + ".done");
+		removeFiles(base);
+	}
+
+	/**
+	 * True iff markDone() was called for 'base' with the same 'desc'.
+	 */
+	static bool isDone(const std::string& base, const std::string& desc) {
+		std::ifstream in((base + ".done").c_str());
+		std::string line;
+		return std::getline(in, line) && !in.eof() && line == desc;
+	}
+
+	static void clearDone(const std::string& base) {
+		std::remove((base + ".done").c_str());
+	}
+
+private:
+
+	std::string manifestFname() const { return _base + ".manifest"; }
+
+	void openManifest() {
+		_manifest.open(manifestFname().c_str(), std::ios::app);
+		if(!_manifest.good()) {
+			std::cerr << "Could not open checkpoint manifest \"" << manifestFname() << "\"" << std::endl;
+			throw 1;
+		}
+	}
+
+	void appendLine(const char *what, size_t n) {
+		_manifest << what << " " << n << std::endl; // flushes
+		if(!_manifest.good()) {
+			std::cerr << "Could not write checkpoint manifest \"" << manifestFname() << "\"" << std::endl;
+			throw 1;
+		}
+	}
+
+	static void commitFile(const std::string& tmp, const std::string& fname) {
+		if(std::rename(tmp.c_str(), fname.c_str()) != 0) {
+			std::cerr << "Could not rename checkpoint file \"" << tmp << "\" to \"" << fname << "\"" << std::endl;
+			throw 1;
+		}
+	}
+
+	std::string   _base;     /// prefix of checkpoint files
+	std::string   _params;   /// parameters of this build
+	size_t        _nblocks;  /// blocks, once the samples are saved
+	EList<bool>   _saved;    /// which blocks are saved
+	std::ofstream _manifest; /// open for appending
+	MUTEX_T       _mutex;    /// serializes commitBlock()
+};
+
+#endif /* SA_CHECKPOINT_H_ */
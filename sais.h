@@ -0,0 +1,323 @@
+#ifndef SAIS_H_
+#define SAIS_H_
+
+#if (__cplusplus >= 201103)
+#include <thread>
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+#include "assert_helpers.h"
+#include "ds.h"
+
+/**
+ * \file Linear-time suffix array construction by induced sorting
+ * (SA-IS; Nong, Zhang and Chan, "Two Efficient Algorithms for Linear
+ * Time Suffix Array Construction", IEEE Trans. Computers 2011).
+ *
+ * The text is anything with an operator[] returning a character in
+ * [0, K); its last character must be 0 and must occur nowhere else.
+ * Besides the suffix array itself, the only working memory is one bit
+ * per character for the L/S types plus one bucket array of K counts
+ * per level of recursion; the reduced problem is solved inside the
+ * suffix array.  Comparing and naming the sorted LMS substrings, the
+ * one step whose cost isn't a simple scan, is split across threads.
+ */
+
+/**
+ * Presents a bowtie DNA string of length len as a SA-IS text of length
+ * len+1 over {0, ..., 4}.  Characters are mapped so that A is largest
+ * and T smallest, and the sentinel is the smallest of all; reading the
+ * resulting suffix array backwards gives the order bowtie uses, where
+ * A < C < G < T and a suffix sorts after every suffix it's a proper
+ * prefix of (the '$' is largest).
+ */
+template<typename TStr, typename TIdx>
+class SaisDnaText {
+public:
+	SaisDnaText(const TStr& s) : s_(s), len_((TIdx)s.length()) { }
+
+	TIdx operator[](TIdx i) const {
+		if(i == len_) return 0;
+		assert_lt((int)s_[i], 4);
+		return (TIdx)(4 - (int)s_[i]);
+	}
+
+private:
+	const TStr& s_;
+	TIdx len_;
+};
+
+/**
+ * A reduced text made of LMS-substring names, living in the upper
+ * part of the suffix array being built.
+ */
+template<typename TIdx>
+class SaisNameText {
+public:
+	SaisNameText(const TIdx* p) : p_(p) { }
+	TIdx operator[](TIdx i) const { return p_[i]; }
+private:
+	const TIdx* p_;
+};
+
+/**
+ * SA-IS over a text of length n and alphabet size K, writing the
+ * suffix array into sa[0..n).
+ */
+template<typename TIdx>
+class SaisBuilder {
+public:
+
+	static const TIdx EMPTY = (TIdx)-1;
+
+	/**
+	 * Build the suffix array of t (with its sentinel at n-1) into sa,
+	 * using up to nthreads threads.  Throws bad_alloc if the type bits
+	 * or bucket arrays can't be allocated.
+	 */
+	template<typename TText>
+	static void build(const TText& t, TIdx* sa, TIdx n, TIdx K, int nthreads) {
+		assert_gt(n, 0);
+		if(n == 1) {
+			sa[0] = 0;
+			return;
+		}
+		// Classify each suffix as L (0) or S (1)
+		AutoArray<uint8_t> types((size_t)(n / 8 + 1));
+		uint8_t *ty = &types[0];
+		setType(ty, n-1, true);  // the sentinel
+		setType(ty, n-2, false); // anything's bigger than the sentinel
+		for(TIdx i = n-2; i > 0; i--) {
+			TIdx c0 = t[i-1], c1 = t[i];
+			setType(ty, i-1, c0 < c1 || (c0 == c1 && isS(ty, i)));
+		}
+		// Stage 1: sort the LMS substrings
+		{
+			AutoArray<TIdx> bkt((size_t)K);
+			getBuckets(t, &bkt[0], n, K, true, nthreads);
+			for(TIdx i = 0; i < n; i++) sa[i] = EMPTY;
+			for(TIdx i = 1; i < n; i++) {
+				if(isLMS(ty, i)) sa[--bkt[t[i]]] = i;
+			}
+			induceL(t, ty, sa, &bkt[0], n, K, nthreads);
+			induceS(t, ty, sa, &bkt[0], n, K, nthreads);
+		}
+		// Move the sorted LMS substrings to the front of sa
+		TIdx n1 = 0;
+		for(TIdx i = 0; i < n; i++) {
+			if(isLMS(ty, sa[i])) sa[n1++] = sa[i];
+		}
+		assert_leq(n1, n/2);
+		// Name them; equal substrings get equal names
+		TIdx names = nameLMS(t, ty, sa, n, n1, nthreads);
+		// Gather the names, in text order, into sa[n-n1..n)
+		for(TIdx i = n-1, j = n-1; i >= n1; i--) {
+			if(sa[i] != EMPTY) sa[j--] = sa[i];
+		}
+		// Stage 2: sort the reduced text, recursing if names repeat
+		TIdx *s1 = sa + n - n1, *sa1 = sa;
+		if(names < n1) {
+			build(SaisNameText<TIdx>(s1), sa1, n1, names, nthreads);
+		} else {
+			for(TIdx i = 0; i < n1; i++) sa1[s1[i]] = i;
+		}
+		// Stage 3: induce the full order from the sorted LMS suffixes
+		{
+			AutoArray<TIdx> bkt((size_t)K);
+			getBuckets(t, &bkt[0], n, K, true, nthreads);
+			for(TIdx i = 1, j = 0; i < n; i++) {
+				if(isLMS(ty, i)) s1[j++] = i;
+			}
+			for(TIdx i = 0; i < n1; i++) sa1[i] = s1[sa1[i]];
+			for(TIdx i = n1; i < n; i++) sa[i] = EMPTY;
+			for(TIdx i = n1; i > 0; i--) {
+				TIdx j = sa[i-1];
+				sa[i-1] = EMPTY;
+				sa[--bkt[t[j]]] = j;
+			}
+			induceL(t, ty, sa, &bkt[0], n, K, nthreads);
+			induceS(t, ty, sa, &bkt[0], n, K, nthreads);
+		}
+	}
+
+private:
+
+	static inline bool isS(const uint8_t* ty, TIdx i) {
+		return ((ty[i >> 3] >> (i & 7)) & 1) != 0;
+	}
+
+	static inline void setType(uint8_t* ty, TIdx i, bool s) {
+		if(s) ty[i >> 3] |=  (uint8_t)(1 << (i & 7));
+		else  ty[i >> 3] &= ~(uint8_t)(1 << (i & 7));
+	}
+
+	static inline bool isLMS(const uint8_t* ty, TIdx i) {
+		return i != EMPTY && i > 0 && isS(ty, i) && !isS(ty, i-1);
+	}
+
+	/**
+	 * Set bkt[c] to the start (end == false) or one past the end
+	 * (end == true) of character c's bucket.  For small alphabets the
+	 * counting is split across threads.
+	 */
+	template<typename TText>
+	static void getBuckets(const TText& t, TIdx* bkt, TIdx n, TIdx K,
+	                       bool end, int nthreads)
+	{
+		memset(bkt, 0, sizeof(TIdx) * (size_t)K);
+#if (__cplusplus >= 201103)
+		if(nthreads > 1 && K <= 256 && n >= (TIdx)(1 << 20)) {
+			EList<TIdx> counts;
+			counts.resizeExact((size_t)K * nthreads);
+			counts.fillZero();
+			EList<std::thread*> threads;
+			for(int tid = 0; tid < nthreads; tid++) {
+				threads.push_back(new std::thread([&, tid]() {
+					TIdx *c = counts.ptr() + (size_t)K * tid;
+					TIdx lo = (TIdx)((double)n * tid / nthreads);
+					TIdx hi = (TIdx)((double)n * (tid+1) / nthreads);
+					for(TIdx i = lo; i < hi; i++) c[t[i]]++;
+				}));
+			}
+			for(int tid = 0; tid < nthreads; tid++) {
+				threads[tid]->join();
+				delete threads[tid];
+				for(TIdx c = 0; c < K; c++) bkt[c] += counts[(size_t)K * tid + c];
+			}
+		} else
+#endif
+		{
+			for(TIdx i = 0; i < n; i++) bkt[t[i]]++;
+		}
+		TIdx sum = 0;
+		for(TIdx c = 0; c < K; c++) {
+			sum += bkt[c];
+			bkt[c] = end ? sum : sum - bkt[c];
+		}
+	}
+
+	/**
+	 * Induce the order of the L-type suffixes from the suffixes
+	 * already placed, scanning left to right.
+	 */
+	template<typename TText>
+	static void induceL(const TText& t, const uint8_t* ty, TIdx* sa,
+	                    TIdx* bkt, TIdx n, TIdx K, int nthreads)
+	{
+		getBuckets(t, bkt, n, K, false, nthreads);
+		for(TIdx i = 0; i < n; i++) {
+			TIdx j = sa[i];
+			if(j != EMPTY && j > 0 && !isS(ty, j-1)) {
+				sa[bkt[t[j-1]]++] = j-1;
+			}
+		}
+	}
+
+	/**
+	 * Induce the order of the S-type suffixes from the L-type ones,
+	 * scanning right to left.
+	 */
+	template<typename TText>
+	static void induceS(const TText& t, const uint8_t* ty, TIdx* sa,
+	                    TIdx* bkt, TIdx n, TIdx K, int nthreads)
+	{
+		getBuckets(t, bkt, n, K, true, nthreads);
+		for(TIdx i = n; i > 0; i--) {
+			TIdx j = sa[i-1];
+			if(j != EMPTY && j > 0 && isS(ty, j-1)) {
+				sa[--bkt[t[j-1]]] = j-1;
+			}
+		}
+	}
+
+	/**
+	 * Return true iff the LMS substrings starting at a and b differ.
+	 * The unique sentinel guarantees a difference before either runs
+	 * off the end.
+	 */
+	template<typename TText>
+	static bool lmsDiffer(const TText& t, const uint8_t* ty, TIdx a, TIdx b) {
+		for(TIdx d = 0; ; d++) {
+			if(t[a+d] != t[b+d] || isS(ty, a+d) != isS(ty, b+d)) {
+				return true;
+			}
+			if(d > 0 && (isLMS(ty, a+d) || isLMS(ty, b+d))) {
+				return false;
+			}
+		}
+	}
+
+	/**
+	 * Given the n1 sorted LMS substrings in sa[0..n1), store each one's
+	 * name at sa[n1 + pos/2] (no two LMS positions are adjacent, so
+	 * that's collision-free) and return the number of distinct names.
+	 * Deciding where the names change means comparing each substring
+	 * with its predecessor; those comparisons are independent, so
+	 * they're done in parallel and recorded one bit per substring.
+	 */
+	template<typename TText>
+	static TIdx nameLMS(const TText& t, const uint8_t* ty, TIdx* sa,
+	                    TIdx n, TIdx n1, int nthreads)
+	{
+		for(TIdx i = n1; i < n; i++) sa[i] = EMPTY;
+		AutoArray<uint8_t> diffs((size_t)(n1 / 8 + 1));
+		uint8_t *df = &diffs[0];
+		// Each thread handles a range starting on a byte boundary
+		TIdx nbytes = n1 / 8 + 1;
+		int nt = 1;
+#if (__cplusplus >= 201103)
+		if(nthreads > 1 && n1 >= (TIdx)(1 << 16)) {
+			nt = nthreads;
+		}
+#endif
+		EList<std::pair<TIdx, TIdx> > ranges;
+		for(int tid = 0; tid < nt; tid++) {
+			TIdx lo = (TIdx)((double)nbytes * tid / nt) * 8;
+			TIdx hi = (TIdx)((double)nbytes * (tid+1) / nt) * 8;
+			if(hi > n1) hi = n1;
+			if(lo < hi) ranges.push_back(std::make_pair(lo, hi));
+		}
+#if (__cplusplus >= 201103)
+		EList<std::thread*> threads;
+		for(size_t r = 1; r < ranges.size(); r++) {
+			threads.push_back(new std::thread(markDiffs<TText>, std::cref(t), ty,
+				(const TIdx*)sa, ranges[r].first, ranges[r].second, df));
+		}
+#endif
+		if(!ranges.empty()) {
+			markDiffs<TText>(t, ty, sa, ranges[0].first, ranges[0].second, df);
+		}
+#if (__cplusplus >= 201103)
+		for(size_t i = 0; i < threads.size(); i++) {
+			threads[i]->join();
+			delete threads[i];
+		}
+#endif
+		TIdx name = 0;
+		for(TIdx i = 0; i < n1; i++) {
+			if((df[i >> 3] >> (i & 7)) & 1) name++;
+			TIdx pos = sa[i];
+			sa[n1 + pos / 2] = name - 1;
+		}
+		return name;
+	}
+
+	/**
+	 * Set bit i of df iff sorted LMS substring i differs from i-1, for
+	 * i in [lo, hi).
+	 */
+	template<typename TText>
+	static void markDiffs(const TText& t, const uint8_t* ty, const TIdx* sa,
+	                      TIdx lo, TIdx hi, uint8_t* df)
+	{
+		for(TIdx i = lo; i < hi; i++) {
+			if(i == 0 || lmsDiffer(t, ty, sa[i], sa[i-1])) {
+				df[i >> 3] |= (uint8_t)(1 << (i & 7));
+			}
+		}
+	}
+};
+
+#endif /*SAIS_H_*/
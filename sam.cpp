@@ -7,6 +7,7 @@
 
 #include "hit.h"
 #include "pat.h"
+#include "record_writer.h"
 #include "sam.h"
 #include "search_globals.h"
 #include <iostream>
@@ -15,20 +16,18 @@
 using namespace std;
 
 /**
- * Write the SAM header lines.
+ * Append the text of the SAM header to o.
  */
-void SAMHitSink::appendHeaders(
-	OutFileBuf& os,
+void SAMHitSink::headerText(
+	BTString& o,
 	size_t numRefs,
 	const EList<string>& refnames,
 	bool nosq,
 	const TIndexOffU* plen,
 	bool fullRef,
-	bool noQnameTrunc,
 	const char *cmdline,
 	const char *rgline)
 {
-	BTString o;
 	o << "@HD\tVN:1.0\tSO:unsorted\n";
 	if(!nosq) {
 		for(size_t i = 0; i < numRefs; i++) {
@@ -46,9 +45,50 @@ void SAMHitSink::appendHeaders(
 		o << "@RG\t" << rgline << '\n';
 	}
 	o << "@PG\tID:Bowtie\tVN:" << BOWTIE_VERSION << "\tCL:\"" << cmdline << "\"\n";
+}
+
+/**
+ * Write the SAM header lines, unless nohead is set.
+ */
+void SAMHitSink::appendHeaders(
+	OutFileBuf& os,
+	size_t numRefs,
+	const EList<string>& refnames,
+	bool nohead,
+	bool nosq,
+	const TIndexOffU* plen,
+	bool fullRef,
+	bool noQnameTrunc,
+	const char *cmdline,
+	const char *rgline)
+{
+	if(nohead) {
+		return;
+	}
+	BTString o;
+	headerText(o, numRefs, refnames, nosq, plen, fullRef, cmdline, rgline);
 	os.writeString(o);
 }
 
+/**
+ * Return the length of the QNAME for a read with the given name.
+ */
+size_t SAMHitSink::qnameLen(const BTString& name, bool mate) const {
+	size_t qlen = name.length();
+	if(mate) {
+		// truncate final 2 chars
+		qlen = (qlen >= 2) ? qlen - 2 : 0;
+	}
+	if(!noQnameTrunc_) {
+		for(size_t i = 0; i < qlen; i++) {
+			if(isspace((int)name[i])) {
+				return i;
+			}
+		}
+	}
+	return qlen;
+}
+
 /**
  * Report either an unaligned read or a read that exceeded the -m
  * ceiling.  We output placeholders for most of the fields in this
@@ -64,8 +104,7 @@ void SAMHitSink::reportUnOrMax(
 		HitSink::reportUnaligned(threadId, p);
 		if (noUnal) {
 			if (reorder_) {
-				ptCounts_[threadId]++;
-				maybeFlush(threadId);
+				countRead(threadId, p);
 			}
 			return;
 		}
@@ -80,67 +119,60 @@ void SAMHitSink::reportUnOrMax(
 	size_t hssz = 0;
 	if(hs != NULL) hssz = hs->size();
 	BTString& o = ptBufs_[threadId];
-	for(int i = 0; i < (int)p.bufa().name.length() - (paired ? 2 : 0); i++) {
-		if(!noQnameTrunc_ && isspace((int)p.bufa().name[i])) break;
-		o << p.bufa().name[i];
+	appendUnOrMax(o, p.bufa(), paired,
+		SAM_FLAG_UNMAPPED | (paired ? (SAM_FLAG_PAIRED | SAM_FLAG_FIRST_IN_PAIR | SAM_FLAG_MATE_UNMAPPED) : 0),
+		paired ? (hssz+1)/2 : hssz);
+	if(paired) {
+		appendUnOrMax(o, p.bufb(), paired,
+			SAM_FLAG_UNMAPPED | SAM_FLAG_PAIRED | SAM_FLAG_SECOND_IN_PAIR | SAM_FLAG_MATE_UNMAPPED,
+			(hssz+1)/2);
 	}
-	o << '\t'
-	  << (SAM_FLAG_UNMAPPED | (paired ? (SAM_FLAG_PAIRED | SAM_FLAG_FIRST_IN_PAIR | SAM_FLAG_MATE_UNMAPPED) : 0)) << "\t*"
+	countRead(threadId, p);
+}
+
+/**
+ * Append a SAM record with placeholders for the alignment fields.
+ */
+void SAMHitSink::appendUnOrMax(
+	BTString& o,
+	const Read& rd,
+	bool paired,
+	int flags,
+	size_t xm)
+{
+	o.append(rd.name.buf(), qnameLen(rd.name, paired));
+	o << '\t' << flags << "\t*"
 	  << "\t0\t0\t*\t*\t0\t0\t";
-	for(size_t i = 0; i < p.bufa().patFw.length(); i++) {
-		o << (char)p.bufa().patFw.toChar(i);
+	for(size_t i = 0; i < rd.patFw.length(); i++) {
+		o << (char)rd.patFw.toChar(i);
 	}
 	o << '\t';
-	for(size_t i = 0; i < p.bufa().qual.length(); i++) {
-		o << (char)p.bufa().qual[i];
+	for(size_t i = 0; i < rd.qual.length(); i++) {
+		o << (char)rd.qual[i];
 	}
-	o << "\tXM:i:" << (paired ? (hssz+1)/2 : hssz);
+	o << "\tXM:i:" << xm;
 	o << '\n';
-	if(paired) {
-		// truncate final 2 chars
-		for(int i = 0; i < (int)p.bufb().name.length()-2; i++) {
-			if(!noQnameTrunc_ && isspace((int)p.bufb().name[i])) break;
-			o << p.bufb().name[i];
-		}
-		o << '\t'
-		  << (SAM_FLAG_UNMAPPED | (paired ? (SAM_FLAG_PAIRED | SAM_FLAG_SECOND_IN_PAIR | SAM_FLAG_MATE_UNMAPPED) : 0)) << "\t*"
-		  << "\t0\t0\t*\t*\t0\t0\t";
-		for(size_t i = 0; i < p.bufb().patFw.length(); i++) {
-			o << (char)p.bufb().patFw.toChar(i);
-		}
-		o << '\t';
-		for(size_t i = 0; i < p.bufb().qual.length(); i++) {
-			o << (char)p.bufb().qual[i];
-		}
-		o << "\tXM:i:" << (hssz+1)/2;
-		o << '\n';
-	}
-	ptCounts_[threadId]++;
-	if (reorder_ && reorderInfo_[threadId].flushed) {
-		reorderInfo_[threadId].batchId = p.batch_id();
-		reorderInfo_[threadId].flushed = false;
-	}
-	maybeFlush(threadId);
 }
 
 /**
  * Append a SAM alignment to the given output stream.
  */
 void SAMHitSink::append(BTString& o, const Hit& h, int mapq, int xms) {
-	// QNAME
-	if(h.mate > 0) {
-		// truncate final 2 chars
-		for(int i = 0; i < (int)h.patName.length()-2; i++) {
-			if(!noQnameTrunc_ && isspace((int)h.patName[i])) break;
-			o << h.patName[i];
-		}
-	} else {
-		for(int i = 0; i < (int)h.patName.length(); i++) {
-			if(!noQnameTrunc_ && isspace((int)h.patName[i])) break;
-			o << h.patName[i];
-		}
+	const BTString& name = h.name();
+	const size_t len = h.length();
+	const size_t nm = h.numEdits();
+	const string* refname = NULL;
+	if(_refnames != NULL && h.h.first < _refnames->size()) {
+		refname = &(*_refnames)[h.h.first];
 	}
-	o << '\t';
+	// Name, reference name, SEQ, QUAL, MD (at most a run length and a
+	// character per mismatch, plus the last run) and the fixed fields
+	RecordWriter w(o, name.length() + (refname != NULL ? refname->length() : 0) +
+	                  2 * len + (nm + 1) * (RECORD_MAX_INT_CHARS + 1) +
+	                  12 * RECORD_MAX_INT_CHARS + 64);
+	// QNAME
+	w.put(name.buf(), qnameLen(name, h.mate > 0));
+	w.put('\t');
 	// FLAG
 	int flags = 0;
 	if(h.mate == 1) {
@@ -150,110 +182,88 @@ void SAMHitSink::append(BTString& o, const Hit& h, int mapq, int xms) {
 	}
 	if(!h.fw) flags |= SAM_FLAG_QUERY_STRAND;
 	if(h.mate > 0 && !h.mfw) flags |= SAM_FLAG_MATE_STRAND;
-	o << flags << "\t";
+	w.putInt(flags);
+	w.put('\t');
 	// RNAME
-	if(_refnames != NULL && h.h.first < _refnames->size()) {
-		printUptoWs(o, (*_refnames)[h.h.first], !fullRef_);
+	if(refname != NULL) {
+		w.putUptoWs(*refname, !fullRef_);
 	} else {
-		o << h.h.first;
+		w.putInt(h.h.first);
 	}
 	// POS
-	o << '\t' << (h.h.second + 1);
+	w.put('\t');
+	w.putInt(h.h.second + 1);
 	// MAPQ
-	o << '\t' << mapq;
+	w.put('\t');
+	w.putInt(mapq);
 	// CIGAR
-	o << '\t' << h.length() << 'M';
+	w.put('\t');
+	w.putInt(len);
+	w.put('M');
 	// MRNM
 	if(h.mate > 0) {
-		o << "\t=";
+		w.put("\t=", 2);
 	} else {
-		o << "\t*";
+		w.put("\t*", 2);
 	}
 	// MPOS
 	if(h.mate > 0) {
-		o << '\t' << (h.mh.second + 1);
+		w.put('\t');
+		w.putInt(h.mh.second + 1);
 	} else {
-		o << "\t0";
+		w.put("\t0", 2);
 	}
 	// ISIZE
-	o << '\t';
+	w.put('\t');
 	if(h.mate > 0) {
 		assert_eq(h.h.first, h.mh.first);
 		int64_t inslen = 0;
 		if(h.h.second > h.mh.second) {
-			inslen = (int64_t)h.h.second - (int64_t)h.mh.second + (int64_t)h.length();
+			inslen = (int64_t)h.h.second - (int64_t)h.mh.second + (int64_t)len;
 			inslen = -inslen;
 		} else {
 			inslen = (int64_t)h.mh.second - (int64_t)h.h.second + (int64_t)h.mlen;
 		}
-		o << inslen;
+		w.putInt(inslen);
 	} else {
-		o << '0';
+		w.put('0');
 	}
 	// SEQ
-	o << '\t';
-	for(size_t i = 0; i < h.patSeq.length(); i++) {
-		o << (char)h.patSeq.toChar(i);
-	}
+	w.put('\t');
+	w.putDna(h.seq());
 	// QUAL
-	o << '\t';
-	for(size_t i = 0; i < h.quals.length(); i++) {
-		o << (char)h.quals[i];
-	}
+	w.put('\t');
+	w.put(h.qual());
 	//
 	// Optional fields
 	//
 	// Always output stratum
-	o << "\tXA:i:" << (int)h.stratum;
+	w.put("\tXA:i:", 6);
+	w.putInt((int)h.stratum);
 	// Always output cost
 	//ss << "\tXC:i:" << (int)h.cost;
 	// Look for SNP annotations falling within the alignment
-	// Output MD field
-	size_t len = h.patSeq.length();
-	int nm = 0;
-	int run = 0;
-	o << "\tMD:Z:";
-	const FixedBitset<1024> *mms = &h.mms;
-	ASSERT_ONLY(const BTDnaString* pat = &h.patSeq);
-	const EList<char>* refcs = &h.refcs;
-	if(h.fw) {
-		for (int i = 0; i < (int)len; ++ i) {
-			if(mms->test(i)) {
-				nm++;
-				// There's a mismatch at this position
-				assert_gt((int)refcs->size(), i);
-				char refChar = toupper((*refcs)[i]);
-				ASSERT_ONLY(char qryChar = (h.fw ? (*pat)[i] : (*pat)[len-i-1]));
-				assert_neq(refChar, qryChar);
-				o << run << refChar;
-				run = 0;
-			} else {
-				run++;
-			}
-		}
-	} else {
-		for (int i = (int)len-1; i >= 0; -- i) {
-			if(mms->test(i)) {
-				nm++;
-				// There's a mismatch at this position
-				assert_gt((int)refcs->size(), i);
-				char refChar = toupper((*refcs)[i]);
-				ASSERT_ONLY(char qryChar = (h.fw ? (*pat)[i] : (*pat)[len-i-1]));
-				assert_neq(refChar, qryChar);
-				o << run << refChar;
-				run = 0;
-			} else {
-				run++;
-			}
-		}
+	// Output MD field.  It runs left to right along the reference, so
+	// from the 3' end of a read that aligned to the - strand.
+	size_t last = 0; // offset just past the previous mismatch
+	w.put("\tMD:Z:", 6);
+	for(size_t i = 0; i < nm; i++) {
+		const Edit& e = h.edit(h.fw ? i : nm - i - 1);
+		size_t off = h.fw ? (size_t)e.pos : len - (size_t)e.pos - 1;
+		assert_geq(off, last);
+		w.putInt(off - last);
+		w.put((char)toupper(e.chr));
+		last = off + 1;
 	}
-	o << run;
+	w.putInt(len - last);
 	// Add optional edit distance field
-	o << "\tNM:i:" << nm;
+	w.put("\tNM:i:", 6);
+	w.putInt(nm);
 	if(xms > 0) {
-		o << "\tXM:i:" << xms;
+		w.put("\tXM:i:", 6);
+		w.putInt(xms);
 	}
-	o << '\n';
+	w.put('\n');
 }
 
 /**
@@ -308,5 +318,246 @@ void SAMHitSink::reportMaxed(
 			uint32_t r = rand.nextU32() % num;
 			reportHits(&hs[r], NULL, 0, 1, threadId, 0, (int)hs.size()+1, true, p);
 		}
+	} else if(reorder_) {
+		// Nothing is printed, but the read still counts toward the
+		// batch so that --reorder flushes on batch boundaries
+		countRead(threadId, p);
+	}
+}
+
+#if (__cplusplus >= 201103L)
+
+/// Longest QNAME BAM can hold (l_read_name is a byte, NUL included)
+static const size_t BAM_MAX_QNAME = 254;
+
+/// Bytes in a BAM record from block_size through tlen
+static const size_t BAM_FIXED_LEN = 36;
+
+/// BAM's 4-bit codes for A, C, G, T and N
+static const unsigned char BAM_NT16[] = { 1, 2, 4, 8, 15 };
+
+/**
+ * The bin of the BAI index that [beg, end) falls in, as in the SAM
+ * spec.
+ */
+static inline uint16_t bamReg2bin(int64_t beg, int64_t end) {
+	--end;
+	if(beg >> 14 == end >> 14) return (uint16_t)(((1 << 15) - 1) / 7 + (beg >> 14));
+	if(beg >> 17 == end >> 17) return (uint16_t)(((1 << 12) - 1) / 7 + (beg >> 17));
+	if(beg >> 20 == end >> 20) return (uint16_t)(((1 << 9) - 1) / 7 + (beg >> 20));
+	if(beg >> 23 == end >> 23) return (uint16_t)(((1 << 6) - 1) / 7 + (beg >> 23));
+	if(beg >> 26 == end >> 26) return (uint16_t)(((1 << 3) - 1) / 7 + (beg >> 26));
+	return 0;
+}
+
+/**
+ * Write the fields of a BAM record from block_size through tlen.
+ * block_size is left 0 for bamFinish() to fill in.
+ */
+static inline void bamFixed(
+	RecordWriter& w,
+	int32_t refId,
+	int32_t pos,
+	size_t qlen,
+	int mapq,
+	uint16_t bin,
+	uint16_t ncigar,
+	int flags,
+	size_t len,
+	int32_t mrefId,
+	int32_t mpos,
+	int32_t tlen)
+{
+	w.putLE<int32_t>(0);
+	w.putLE<int32_t>(refId);
+	w.putLE<int32_t>(pos);
+	w.putLE<uint8_t>((uint8_t)(qlen + 1));
+	w.putLE<uint8_t>((uint8_t)mapq);
+	w.putLE<uint16_t>(bin);
+	w.putLE<uint16_t>(ncigar);
+	w.putLE<uint16_t>((uint16_t)flags);
+	w.putLE<int32_t>((int32_t)len);
+	w.putLE<int32_t>(mrefId);
+	w.putLE<int32_t>(mpos);
+	w.putLE<int32_t>(tlen);
+}
+
+/**
+ * Write SEQ two bases to a byte and QUAL as raw Phred scores.
+ */
+static inline void bamSeqQual(RecordWriter& w, const BTDnaString& seq, const BTString& qual) {
+	const size_t len = seq.length();
+	for(size_t i = 0; i < len; i += 2) {
+		unsigned char c = (unsigned char)(BAM_NT16[(int)seq[i]] << 4);
+		if(i + 1 < len) {
+			c |= BAM_NT16[(int)seq[i+1]];
+		}
+		w.put((char)c);
+	}
+	assert_eq(len, qual.length());
+	for(size_t i = 0; i < len; i++) {
+		w.put((char)(qual[i] - 33));
+	}
+}
+
+/**
+ * Write an integer tag with the smallest type that holds v, as
+ * samtools does when it converts SAM's :i: tags.
+ */
+static inline void bamIntTag(RecordWriter& w, const char *tag, int64_t v) {
+	w.put(tag, 2);
+	if(v >= 0) {
+		if(v <= 0xff) {
+			w.put('C'); w.putLE<uint8_t>((uint8_t)v);
+		} else if(v <= 0xffff) {
+			w.put('S'); w.putLE<uint16_t>((uint16_t)v);
+		} else {
+			w.put('I'); w.putLE<uint32_t>((uint32_t)v);
+		}
+	} else {
+		if(v >= -0x80) {
+			w.put('c'); w.putLE<int8_t>((int8_t)v);
+		} else if(v >= -0x8000) {
+			w.put('s'); w.putLE<int16_t>((int16_t)v);
+		} else {
+			w.put('i'); w.putLE<int32_t>((int32_t)v);
+		}
 	}
 }
+
+/**
+ * Fill in block_size now that the record is complete.
+ */
+static inline void bamFinish(RecordWriter& w) {
+	w.patchLE32(0, (uint32_t)(w.length() - 4));
+}
+
+/**
+ * Append a BAM alignment to the given output stream.
+ */
+void BAMHitSink::append(BTString& o, const Hit& h, int mapq, int xms) {
+	const BTString& name = h.name();
+	const size_t len = h.length();
+	const size_t nm = h.numEdits();
+	const size_t qlen = min(qnameLen(name, h.mate > 0), BAM_MAX_QNAME);
+	// Fixed fields, QNAME, CIGAR, SEQ, QUAL, tags (MD at most a run
+	// length and a character per mismatch, plus the last run)
+	RecordWriter w(o, BAM_FIXED_LEN + qlen + 1 + 4 + (len + 1) / 2 + len +
+	                  (nm + 1) * (RECORD_MAX_INT_CHARS + 1) + 64);
+	int flags = 0;
+	if(h.mate == 1) {
+		flags |= SAM_FLAG_PAIRED | SAM_FLAG_FIRST_IN_PAIR | SAM_FLAG_MAPPED_PAIRED;
+	} else if(h.mate == 2) {
+		flags |= SAM_FLAG_PAIRED | SAM_FLAG_SECOND_IN_PAIR | SAM_FLAG_MAPPED_PAIRED;
+	}
+	if(!h.fw) flags |= SAM_FLAG_QUERY_STRAND;
+	if(h.mate > 0 && !h.mfw) flags |= SAM_FLAG_MATE_STRAND;
+	int64_t inslen = 0;
+	if(h.mate > 0) {
+		assert_eq(h.h.first, h.mh.first);
+		if(h.h.second > h.mh.second) {
+			inslen = (int64_t)h.h.second - (int64_t)h.mh.second + (int64_t)len;
+			inslen = -inslen;
+		} else {
+			inslen = (int64_t)h.mh.second - (int64_t)h.h.second + (int64_t)h.mlen;
+		}
+	}
+	bamFixed(w, (int32_t)h.h.first, (int32_t)h.h.second, qlen, mapq,
+	         bamReg2bin(h.h.second, h.h.second + len), 1, flags, len,
+	         h.mate > 0 ? (int32_t)h.mh.first : -1,
+	         h.mate > 0 ? (int32_t)h.mh.second : -1,
+	         (int32_t)inslen);
+	w.put(name.buf(), qlen);
+	w.put('\0');
+	// CIGAR: one M operation
+	w.putLE<uint32_t>((uint32_t)(len << 4));
+	bamSeqQual(w, h.seq(), h.qual());
+	bamIntTag(w, "XA", (int)h.stratum);
+	// MD runs left to right along the reference, as in SAM
+	w.put("MDZ", 3);
+	size_t last = 0;
+	for(size_t i = 0; i < nm; i++) {
+		const Edit& e = h.edit(h.fw ? i : nm - i - 1);
+		size_t off = h.fw ? (size_t)e.pos : len - (size_t)e.pos - 1;
+		assert_geq(off, last);
+		w.putInt(off - last);
+		w.put((char)toupper(e.chr));
+		last = off + 1;
+	}
+	w.putInt(len - last);
+	w.put('\0');
+	bamIntTag(w, "NM", (int64_t)nm);
+	if(xms > 0) {
+		bamIntTag(w, "XM", xms);
+	}
+	bamFinish(w);
+}
+
+/**
+ * Append a BAM record for a read with no alignment reported.
+ */
+void BAMHitSink::appendUnOrMax(
+	BTString& o,
+	const Read& rd,
+	bool paired,
+	int flags,
+	size_t xm)
+{
+	const size_t len = rd.patFw.length();
+	const size_t qlen = min(qnameLen(rd.name, paired), BAM_MAX_QNAME);
+	RecordWriter w(o, BAM_FIXED_LEN + qlen + 1 + (len + 1) / 2 + len + 16);
+	bamFixed(w, -1, -1, qlen, 0, bamReg2bin(-1, 0), 0, flags, len, -1, -1, 0);
+	w.put(rd.name.buf(), qlen);
+	w.put('\0');
+	bamSeqQual(w, rd.patFw, rd.qual);
+	bamIntTag(w, "XM", (int64_t)xm);
+	bamFinish(w);
+}
+
+static inline void appendLE32(BTString& o, uint32_t u) {
+	char b[4] = { (char)u, (char)(u >> 8), (char)(u >> 16), (char)(u >> 24) };
+	o.append(b, 4);
+}
+
+/**
+ * Write the BAM header: the SAM header text, then the name and length
+ * of every reference.
+ */
+void BAMHitSink::appendHeaders(
+	OutFileBuf& os,
+	size_t numRefs,
+	const EList<string>& refnames,
+	bool nohead,
+	bool nosq,
+	const TIndexOffU* plen,
+	bool fullRef,
+	bool noQnameTrunc,
+	const char *cmdline,
+	const char *rgline)
+{
+	BTString text;
+	if(!nohead) {
+		headerText(text, numRefs, refnames, nosq, plen, fullRef, cmdline, rgline);
+	}
+	BTString o;
+	o.append("BAM\1", 4);
+	appendLE32(o, (uint32_t)text.length());
+	o.append(text.buf(), text.length());
+	appendLE32(o, (uint32_t)numRefs);
+	BTString name;
+	for(size_t i = 0; i < numRefs; i++) {
+		name.clear();
+		if(i < refnames.size()) {
+			printUptoWs(name, refnames[i], !fullRef);
+		} else {
+			name << i;
+		}
+		appendLE32(o, (uint32_t)(name.length() + 1));
+		o.append(name.buf(), name.length());
+		o.append('\0');
+		appendLE32(o, (uint32_t)plen[i]);
+	}
+	writeOut(o);
+}
+
+#endif /* __cplusplus >= 201103L */
@@ -8,6 +8,7 @@
 #ifndef SAM_H_
 #define SAM_H_
 
+#include "bgzf.h"
 #include "ds.h"
 #include "hit.h"
 #include "pat.h"
@@ -50,7 +51,8 @@ public:
 		EList<std::string>* refnames,
 		size_t nthreads,
 		int perThreadBufSize,
-		bool reorder) :
+		bool reorder,
+		size_t outQueueBytes) :
 		HitSink(
 			out,
 			dumpAl,
@@ -61,7 +63,8 @@ public:
 			refnames,
 			nthreads,
 			perThreadBufSize,
-			reorder),
+			reorder,
+			outQueueBytes),
 		fullRef_(fullRef),
 		noQnameTrunc_(noQnameTrunc) { }
 
@@ -72,12 +75,13 @@ public:
 	virtual void append(BTString& o, const Hit& h, int mapq, int xms);
 
 	/**
-	 * Write the SAM header lines.
+	 * Write the SAM header lines, unless nohead is set.
 	 */
-	void appendHeaders(
+	virtual void appendHeaders(
 		OutFileBuf& os,
 		size_t numRefs,
 		const EList<string>& refnames,
+		bool nohead,
 		bool nosq,
 		const TIndexOffU* plen,
 		bool fullRef,
@@ -87,6 +91,37 @@ public:
 
 protected:
 
+	/**
+	 * Append the text of the SAM header to o.
+	 */
+	void headerText(
+		BTString& o,
+		size_t numRefs,
+		const EList<string>& refnames,
+		bool nosq,
+		const TIndexOffU* plen,
+		bool fullRef,
+		const char *cmdline,
+		const char *rgline);
+
+	/**
+	 * Return the length of the QNAME for a read with the given name:
+	 * the name less the /1 or /2 of a mate, up to its first
+	 * whitespace unless --sam-no-qname-trunc.
+	 */
+	size_t qnameLen(const BTString& name, bool mate) const;
+
+	/**
+	 * Append a record for a read that is unaligned or exceeded -m,
+	 * with the given flags and XM:i value.
+	 */
+	virtual void appendUnOrMax(
+		BTString& o,
+		const Read& rd,
+		bool paired,
+		int flags,
+		size_t xm);
+
 	/**
 	 * Both
 	 */
@@ -114,9 +149,102 @@ protected:
 		reportUnOrMax(p, NULL, threadId, true);
 	}
 
-private:
 	bool fullRef_;        /// print full reference name, not just up to whitespace
 	bool noQnameTrunc_;   /// true -> don't truncate QNAME at first whitespace
 };
 
+#if (__cplusplus >= 201103L)
+
+/**
+ * Sink that writes BAM: the same records as SAMHitSink, encoded in
+ * binary straight from the Hits and compressed into BGZF blocks by a
+ * pool of threads.  Blocks are written in the order their records
+ * were, so --reorder holds as it does for SAM.
+ */
+class BAMHitSink : public SAMHitSink {
+public:
+	BAMHitSink(
+		OutFileBuf& out,
+		bool fullRef,
+		bool noQnameTrunc,
+		const std::string& dumpAl,
+		const std::string& dumpUnal,
+		const std::string& dumpMax,
+		bool onePairFile,
+		bool sampleMax,
+		EList<std::string>* refnames,
+		size_t nthreads,
+		int perThreadBufSize,
+		bool reorder,
+		int bgzfThreads) :
+		SAMHitSink(
+			out,
+			fullRef,
+			noQnameTrunc,
+			dumpAl,
+			dumpUnal,
+			dumpMax,
+			onePairFile,
+			sampleMax,
+			refnames,
+			nthreads,
+			perThreadBufSize,
+			reorder,
+			0), // the BGZF threads already write asynchronously
+		bgzf_(out, bgzfThreads) { }
+
+	/**
+	 * Append a BAM record for the hit.
+	 */
+	virtual void append(BTString& o, const Hit& h, int mapq, int xms);
+
+	/**
+	 * Write the BAM header.  The reference list is always written in
+	 * full, since records refer to it; nohead and nosq only leave
+	 * lines out of the header text.
+	 */
+	virtual void appendHeaders(
+		OutFileBuf& os,
+		size_t numRefs,
+		const EList<string>& refnames,
+		bool nohead,
+		bool nosq,
+		const TIndexOffU* plen,
+		bool fullRef,
+		bool noQnameTrunc,
+		const char *cmdline,
+		const char *rgline);
+
+protected:
+
+	virtual void appendUnOrMax(
+		BTString& o,
+		const Read& rd,
+		bool paired,
+		int flags,
+		size_t xm);
+
+	/**
+	 * Hand buf to the BGZF compressor rather than writing it.  Not
+	 * thread-safe, which is why this sink is never given an output
+	 * queue and so is only called by one thread at a time.
+	 */
+	virtual void writeOut(BTString& buf) {
+		bgzf_.write(buf.buf(), buf.length());
+	}
+
+	/**
+	 * Write out the last blocks and the end-of-file marker, then
+	 * close the output.
+	 */
+	virtual void closeOuts() {
+		bgzf_.finish();
+		SAMHitSink::closeOuts();
+	}
+
+	BgzfWriter bgzf_;
+};
+
+#endif /* __cplusplus >= 201103L */
+
 #endif /* SAM_H_ */
@@ -0,0 +1,158 @@
+#!/usr/bin/perl -w
+
+##
+# bench_build.pl: Time bowtie-build on synthetic genomes of given sizes
+# and repeat content, using its --profile-json output to break each
+# build down by phase.
+#
+# Each genome is random sequence with a fraction of it replaced by
+# mutated copies of a few repeat families (a short, SINE-like one, a
+# middling one and a long, LINE-like one), so that suffix sorting has
+# long shared prefixes to contend with as real genomes do.  Genomes are
+# kept in the output directory and reused by later runs with the same
+# size, repeat fraction and seed.
+#
+# Writes <out>/<size>_<repeats>.json for each build and appends a row
+# per phase to <out>/summary.tsv, with the bowtie-build arguments, so
+# runs with different --bmax/--dcv/--threads can be compared.
+#
+# Usage: bench_build.pl [options] [-- <bowtie-build args>]
+#
+#   --bowtie-build=<path>  bowtie-build binary (./bowtie-build-s)
+#   --sizes=<list>         genome lengths, comma-separated; k, M and G
+#                          suffixes allowed (1M,10M)
+#   --repeats=<list>       fractions of each genome that is repeats (0,0.5)
+#   --out=<dir>            where genomes, indexes and results go (.build-bench.tmp)
+#   --seed=<int>           seed for the genomes (0)
+#   --keep-index           don't delete each index once it's built
+#
+
+use strict;
+use warnings;
+use Getopt::Long;
+use JSON::PP;
+
+my $bowtie_build = "./bowtie-build-s";
+my $sizes = "1M,10M";
+my $repeats = "0,0.5";
+my $out = ".build-bench.tmp";
+my $seed = 0;
+my $keep_index = 0;
+
+GetOptions(
+	"bowtie-build=s" => \$bowtie_build,
+	"sizes=s"        => \$sizes,
+	"repeats=s"      => \$repeats,
+	"out=s"          => \$out,
+	"seed=i"         => \$seed,
+	"keep-index"     => \$keep_index) || die "Bad option";
+my @build_args = @ARGV;
+
+-x $bowtie_build || die "Can't run $bowtie_build; build it first";
+mkdir($out) unless -d $out;
+-d $out || die "Could not create $out";
+
+##
+# Parse a length like 500k, 10M or 2G.
+#
+sub parseSize($) {
+	my $s = shift;
+	$s =~ /^(\d+(?:\.\d+)?)([kKmMgG]?)$/ || die "Bad size: $s";
+	my ($n, $unit) = ($1, lc $2);
+	$n *= 1000 if $unit eq "k";
+	$n *= 1000000 if $unit eq "m";
+	$n *= 1000000000 if $unit eq "g";
+	return int($n);
+}
+
+my @nucs = ("A", "C", "G", "T");
+
+sub randSeq($) {
+	my $len = shift;
+	return join("", map { $nucs[int(rand(4))] } 1..$len);
+}
+
+##
+# Return a copy of $seq with each character substituted with
+# probability $rate.
+#
+sub mutate($$) {
+	my ($seq, $rate) = @_;
+	my $len = length($seq);
+	my $nmut = int($len * $rate);
+	for(1..$nmut) {
+		substr($seq, int(rand($len)), 1) = $nucs[int(rand(4))];
+	}
+	return $seq;
+}
+
+##
+# Write a genome of $len characters, a fraction $rep of which is
+# repeats, to $fa as a single sequence.
+#
+sub genGenome($$$) {
+	my ($fa, $len, $rep) = @_;
+	srand($seed);
+	my @families = (randSeq(300), randSeq(1500), randSeq(6000));
+	open(my $fh, ">", "$fa.tmp") || die "Could not write $fa.tmp";
+	print $fh ">bench_${len}_$rep\n";
+	my $buf = "";
+	my $left = $len;
+	my $repLeft = int($len * $rep);
+	while($left > 0) {
+		my $chunk;
+		if($repLeft > 0 && rand() < $rep) {
+			# A copy of a family member, diverged by up to 10%
+			my $fam = $families[int(rand(scalar(@families)))];
+			$chunk = mutate($fam, rand(0.1));
+			$repLeft -= length($chunk);
+		} else {
+			$chunk = randSeq(1000);
+		}
+		$chunk = substr($chunk, 0, $left) if length($chunk) > $left;
+		$left -= length($chunk);
+		$buf .= $chunk;
+		while(length($buf) >= 60) {
+			print $fh substr($buf, 0, 60, ""), "\n";
+		}
+	}
+	print $fh "$buf\n" if $buf ne "";
+	close($fh);
+	rename("$fa.tmp", $fa) || die "Could not rename $fa.tmp";
+}
+
+my $summary = "$out/summary.tsv";
+my $newSummary = !-f $summary;
+open(my $sfh, ">>", $summary) || die "Could not write $summary";
+print $sfh join("\t", "size", "repeats", "args", "phase", "calls", "wall_sec",
+                "cpu_sec", "peak_rss_kb", "bytes_read", "bytes_written"), "\n" if $newSummary;
+
+my $args = join(" ", @build_args);
+printf("%12s %8s %10s %10s %12s\n", "size", "repeats", "wall_sec", "cpu_sec", "peak_rss_mb");
+for my $size (map { parseSize($_) } split(/,/, $sizes)) {
+	for my $rep (split(/,/, $repeats)) {
+		($rep >= 0 && $rep <= 1) || die "Bad repeat fraction: $rep";
+		my $name = "${size}_$rep";
+		my $fa = "$out/genome_${name}_$seed.fa";
+		genGenome($fa, $size, $rep) unless -f $fa;
+		my $json = "$out/$name.json";
+		my $idx = "$out/idx_$name";
+		my @cmd = ($bowtie_build, "-q", @build_args, "--profile-json", $json, $fa, $idx);
+		system(@cmd) == 0 || die "Command failed: @cmd";
+		unlink(glob("$idx.*")) unless $keep_index;
+		open(my $jfh, "<", $json) || die "Could not read $json";
+		my $prof = decode_json(join("", <$jfh>));
+		close($jfh);
+		my @rows = ({ %{$prof->{total}}, name => "total", calls => 1 }, @{$prof->{phases}});
+		for my $p (@rows) {
+			print $sfh join("\t", $size, $rep, $args, $p->{name}, $p->{calls},
+			                $p->{wall_sec}, $p->{cpu_sec}, $p->{peak_rss_kb},
+			                $p->{bytes_read}, $p->{bytes_written}), "\n";
+		}
+		my $t = $prof->{total};
+		printf("%12d %8s %10.2f %10.2f %12.1f\n", $size, $rep, $t->{wall_sec},
+		       $t->{cpu_sec}, $t->{peak_rss_kb} / 1024.0);
+	}
+}
+close($sfh);
+print "Per-phase results in $summary\n";
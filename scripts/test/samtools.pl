@@ -70,15 +70,24 @@ sub run($) {
 
 # BTL 4/11/2013: Couldn't get samtools / bcftools to find SNPs from the
 # colorspace invocation of Bowtie.  Not sure why. 
-for my $cmd ("$bowtie_d -S e_coli reads/e_coli_10000snp.fq"
+# The --bam invocation writes BAM itself and should find the same SNPs.
+for my $cmd ("$bowtie_d -S e_coli reads/e_coli_10000snp.fq",
+             "$bowtie_d --bam e_coli reads/e_coli_10000snp.fq"
              #, "$bowtie_d -S -C -f e_coli_c reads/e_coli_10000snp.csfasta"
              )
 {
 	system("rm -f .samtools.pl.*");
-	# Run Bowtie and output SAM
-	run("$cmd .samtools.pl.sam") && die;
-	# Convert to BAM
-	run("$samtools view -bS -o .samtools.pl.bam .samtools.pl.sam") && die;
+	if($cmd =~ /--bam/) {
+		# Run Bowtie and output BAM
+		run("$cmd .samtools.pl.bam") && die;
+		# Check that samtools accepts the header
+		run("$samtools view -H .samtools.pl.bam > /dev/null") && die;
+	} else {
+		# Run Bowtie and output SAM
+		run("$cmd .samtools.pl.sam") && die;
+		# Convert to BAM
+		run("$samtools view -bS -o .samtools.pl.bam .samtools.pl.sam") && die;
+	}
 	# Sort BAM
 	run("$samtools sort .samtools.pl.bam .samtools.pl.sorted") && die;
 	# Run samtools mpileup / bcftools to get SNPs
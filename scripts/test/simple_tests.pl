@@ -10,6 +10,7 @@ use Getopt::Long;
 use FindBin qw($Bin);
 use lib $Bin;
 use List::Util qw(max min);
+use File::Compare;
 use Data::Dumper;
 use DNA;
 use Clone qw(clone);
@@ -39,6 +40,16 @@ if(! -x $bowtie || ! -x $bowtie_build) {
 
 my %prog_pairs = ($bowtie => $bowtie_build, $bowtie." --large-index " => $bowtie_build." --large-index ");
 
+# 1,000 pseudo-random bases, long enough to span many sides of the BWT
+my $longref = "";
+{
+	my $x = 1;
+	for(1..1000) {
+		$x = ($x * 1103515245 + 12345) % 2147483648;
+		$longref .= substr("ACGT", ($x >> 16) & 3, 1);
+	}
+}
+
 my @cases = (
 
 	# File format cases
@@ -886,6 +897,58 @@ my @cases = (
 	  args  => [ "-v 0",
 	             "-n 0" ],
 	  hits  => [ { 2 => 1 } ] },
+
+	# Index layouts and ways of building the index
+
+	{ name       => "Interleaved index",
+	  ref        => [ $longref ],
+	  build_args => "--interleaved",
+	  reads      => [ substr($longref, 0, 20), substr($longref, 333, 20),
+	                  substr($longref, 980, 20) ],
+	  args       => [ "-v 0", "-v 2", "-n 1" ],
+	  hits       => [ { 0 => 1 }, { 333 => 1 }, { 980 => 1 } ] },
+
+	{ name     => "Lockstep exact matching",
+	  ref      => [ $longref ],
+	  reads    => [ map { substr($longref, $_, 20) } (0, 101, 333, 512, 700, 980) ],
+	  args     => [ "-v 0 --lf-batch 2", "-v 0 --lf-batch 16" ],
+	  hits     => [ { 0 => 1 }, { 101 => 1 }, { 333 => 1 }, { 512 => 1 },
+	                { 700 => 1 }, { 980 => 1 } ] },
+
+	{ name      => "Appended index",
+	  ref       => [ substr($longref, 0, 600), substr($longref, 600) ],
+	  build_via => "append",
+	  reads     => [ substr($longref, 100, 20), substr($longref, 700, 20) ],
+	  args      => [ "-v 0", "-v 1" ],
+	  hits      => [ { 100 => 1 }, { 100 => 1 } ] },
+
+	{ name      => "Resumed index build",
+	  ref       => [ $longref ],
+	  build_via => "resume",
+	  reads     => [ substr($longref, 50, 20), substr($longref, 900, 20) ],
+	  args      => [ "-v 0", "-v 1" ],
+	  hits      => [ { 50 => 1 }, { 900 => 1 } ] },
+
+	# Output reordered across several threads, including batches that
+	# print nothing at all
+
+	{ name    => "Reordered output, unaligned reads left out",
+	  ref     => [ $longref ],
+	  reads   => [ map { $_ % 6 == 0 ? substr($longref, $_ * 40, 20) :
+	                     ("A", "C", "G", "T", "AC")[$_ % 6 - 1] x 20 } (0..23) ],
+	  args    => [ "-p 4 --reorder --reads-per-batch 2 --no-unal",
+	               "-p 3 --reorder --no-unal",
+	               "-p 4 --reorder --reads-per-batch 2" ],
+	  ordered => 1,
+	  hits    => [ map { $_ % 6 == 0 ? { $_ * 40 => 1 } : { } } (0..23) ] },
+
+	{ name    => "Reordered output, every read suppressed by -m",
+	  ref     => [ substr($longref, 0, 100) x 3 ],
+	  reads   => [ map { substr($longref, $_ * 3, 20) } (0..23) ],
+	  args    => [ "-m 1 -p 4 --reorder --reads-per-batch 2",
+	               "-m 1 -p 4 --reorder --reads-per-batch 2 --no-unal" ],
+	  ordered => 1,
+	  lines   => 0 },
 );
 
 ##
@@ -952,14 +1015,75 @@ sub writeReads($$$$$$$$$) {
 	close(FQ2);
 }
 
+##
+# Build the index of $fa as .simple_tests.tmp in the roundabout way
+# named by $via, then check that every file of it is identical to an
+# index built from scratch:
+#   "append": index the first sequence, then --append the rest
+#   "resume": make a --checkpoint-dir build fail after the forward
+#             index by blocking the mirror's output, then rerun it
+#
+sub buildVia($$$$$) {
+	my ($via, $build, $build_args, $fa, $ext) = @_;
+	my $run = sub {
+		my $cmd = shift;
+		print "$cmd\n";
+		return system($cmd);
+	};
+	system("rm -f .simple_tests.tmp.* .simple_tests.scratch.*");
+	if($via eq "append") {
+		open(FA, $fa) || die;
+		my @lines = <FA>;
+		close(FA);
+		scalar(@lines) >= 4 || die "Appending needs at least two reference sequences";
+		open(BASE, ">.simple_tests.base.fa") || die;
+		print BASE @lines[0..1];
+		close(BASE);
+		open(REST, ">.simple_tests.rest.fa") || die;
+		print REST @lines[2..$#lines];
+		close(REST);
+		$run->("$build $build_args .simple_tests.base.fa .simple_tests.base") == 0 ||
+			die "Bad exitlevel from bowtie-build: $?";
+		$run->("$build --append .simple_tests.base .simple_tests.rest.fa .simple_tests.tmp") == 0 ||
+			die "Bad exitlevel from bowtie-build --append: $?";
+	} elsif($via eq "resume") {
+		my $ckpt = "--checkpoint-dir .simple_tests.ckpt";
+		system("rm -rf .simple_tests.ckpt");
+		mkdir(".simple_tests.tmp.rev.1.$ext") || die;
+		$run->("$build $ckpt $build_args $fa .simple_tests.tmp 2>/dev/null") != 0 ||
+			die "bowtie-build should have failed writing the mirror index";
+		rmdir(".simple_tests.tmp.rev.1.$ext") || die;
+		my $cmd = "$build $ckpt $build_args $fa .simple_tests.tmp";
+		$cmd =~ s/ --quiet//;
+		print "$cmd\n";
+		my $out = `$cmd`;
+		$? == 0 || die "Bad exitlevel from resumed bowtie-build: $?";
+		$out =~ /Forward index was already built/ ||
+			die "Resumed bowtie-build didn't skip the forward index";
+	} else {
+		die "Bad build_via: $via";
+	}
+	$run->("$build $build_args $fa .simple_tests.scratch") == 0 ||
+		die "Bad exitlevel from bowtie-build: $?";
+	my @files = glob(".simple_tests.scratch.*.$ext");
+	scalar(@files) == 6 || die "Expected 6 index files, found ".scalar(@files);
+	for my $f (@files) {
+		my $g = $f;
+		$g =~ s/scratch/tmp/;
+		compare($f, $g) == 0 || die "$g differs from $f, built from scratch";
+	}
+}
+
 ##
 # Run bowtie with given arguments
 #
-sub runbowtie($$$$$$$$$$$$$$$$$$$$$$$) {
+sub runbowtie($$$$$$$$$$$$$$$$$$$$$$$$$) {
 
 	my (
 		$do_build,
 		$large_idx,
+		$build_args,
+		$build_via,
 		$color,
 		$debug_mode,
 		$args,
@@ -998,12 +1122,17 @@ sub runbowtie($$$$$$$$$$$$$$$$$$$$$$$) {
 		my $info = Sys::Info->new;
 		my $cpu = $info->device('CPU');
 		my $nthreads = int(rand($cpu->count || 1)) + 1;
-		my $build_args = "";
+		$build_args = "" unless defined($build_args);
 		$build_args .= " -C " if $color;
-		my $cmd = "$bowtie_build $idx_type --threads $nthreads --quiet --sanity $build_args $fa .simple_tests.tmp";
-		print "$cmd\n";
-		system($cmd);
-		($? == 0) || die "Bad exitlevel from bowtie-build: $?";
+		my $build = "$bowtie_build $idx_type --threads $nthreads --quiet --sanity";
+		if(defined($build_via)) {
+			buildVia($build_via, $build, $build_args, $fa, $large_idx ? "ebwtl" : "ebwt");
+		} else {
+			my $cmd = "$build $build_args $fa .simple_tests.tmp";
+			print "$cmd\n";
+			system($cmd);
+			($? == 0) || die "Bad exitlevel from bowtie-build: $?";
+		}
 	}
 	my $pe = (defined($mate1s) && $mate1s ne "");
 	$pe = $pe || (defined($mate1_file));
@@ -1149,6 +1278,7 @@ sub matchSamOptionalFlags($$) {
 
 my $tmpfafn = ".simple_tests.pl.fa";
 my $last_ref = undef;
+my $last_build = "";
 foreach my $large_idx (undef,1) {
 	foreach my $debug_mode (1,undef) {
 		for (my $ci = 0; $ci < scalar(@cases); $ci++) {
@@ -1157,7 +1287,10 @@ foreach my $large_idx (undef,1) {
 			# If there's any skipping of cases to be done, do it here prior to the
 			# eq_deeply check
 			my $do_build = 0;
-			unless(defined($last_ref) && eq_deeply($c->{ref}, $last_ref)) {
+			my $build = join("\t", $c->{build_args} || "", $c->{build_via} || "");
+			unless(defined($last_ref) && eq_deeply($c->{ref}, $last_ref) &&
+			       $build eq $last_build)
+			{
 				writeFasta($c->{ref}, $tmpfafn);
 				$do_build = 1;
 			}
@@ -1167,6 +1300,7 @@ foreach my $large_idx (undef,1) {
 			$c->{args} = [$c->{args}] if not ref $c->{args} eq "ARRAY";
 			for my $a (@{$c->{args}}) {
 				$last_ref = $c->{ref};
+				$last_build = $build;
 				# For each set of arguments...
 				my $case_args = $a;
 				$case_args = "" unless defined($a);
@@ -1284,6 +1418,8 @@ foreach my $large_idx (undef,1) {
 					runbowtie(
 						$do_build && $first,
 						$large_idx,
+						$c->{build_args},
+						$c->{build_via},
 						$color,
 						$debug_mode,
 						$args,
@@ -1310,6 +1446,7 @@ foreach my $large_idx (undef,1) {
 					$pe = $pe || defined($mate1_file);
 					$pe = $pe || $c->{paired};
 					my ($lastchr, $lastoff, $lastoff_orig) = ("", -1, -1);
+					my $lastrdi = -1;
 					# Keep temporary copies of hits and pairhits so that we can
 					# restore for the next orientation
 					my $hitstmp = [];
@@ -1403,6 +1540,12 @@ foreach my $large_idx (undef,1) {
 							}
 							$found || die "No specified name matched reported name $readname";
 						}
+						if($c->{ordered}) {
+							# Records must come in the order the reads were input
+							$rdi >= $lastrdi ||
+								die "Read $rdi was reported after read $lastrdi";
+							$lastrdi = $rdi;
+						}
 						# Make simply-named copies of some portions of the test case
 						# 'hits'
 						my %hits = ();
@@ -16,6 +16,7 @@ extern bool showSeed;
 extern bool quiet;
 extern bool gAllowMateContainment;
 extern bool noUnal;
+extern int  inflateThreads;
 
 extern MUTEX_T gLock;
 
@@ -2086,6 +2086,16 @@ public:
 		}
 	}
 
+	/**
+	 * Exchange contents, including allocated buffers, with o.
+	 */
+	void swap(SStringExpandable<T,S,M,I>& o) {
+		std::swap(cs_, o.cs_);
+		std::swap(printcs_, o.printcs_);
+		std::swap(len_, o.len_);
+		std::swap(sz_, o.sz_);
+	}
+
 protected:
 	/**
 	 * Allocate new, bigger buffer and copy old contents into it.  If